@@ -18,11 +18,13 @@
  */
 
 #include <sys/types.h>
+#include <sys/event.h>
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/sysctl.h>
+#include <sys/time.h>
 #include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -36,6 +38,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <imsg.h>
 
@@ -49,14 +52,44 @@
 #define	RTP_PROTO3	0x13
 #define	RTP_MINE	0xff
 
+/*
+ * Our routes in the kernel are audited against the RIB, one table every
+ * KR_AUDIT_INTERVAL seconds. Routes are hashed into KR_AUDIT_SLICES
+ * slices by prefix, only slices with differing digests are repaired.
+ */
+#ifndef KR_AUDIT_INTERVAL
+#define	KR_AUDIT_INTERVAL	60	/* sec between audits, 0 disables */
+#endif
+#ifndef KR_AUDIT_REMOVE
+#define	KR_AUDIT_REMOVE		0	/* unknown routes are only reported */
+#endif
+#define	KR_AUDIT_SLICES		256
+
+/*
+ * The dump is parsed and the RIB walked in slices of KR_AUDIT_BUDGET ms,
+ * a one-shot kqueue timer brings the audit back after other events.
+ */
+#ifndef KR_AUDIT_BUDGET
+#define	KR_AUDIT_BUDGET		10	/* ms of work per event loop pass */
+#endif
+#define	KR_AUDIT_CHECK		64	/* routes between clock checks */
+
+#define	KR_KQ_AUDIT		0	/* kqueue timer starting an audit */
+#define	KR_KQ_AUDIT_STEP	1	/* kqueue timer resuming one */
+
 struct ktable		**krt;
 u_int			  krt_size;
+struct kr_netidx	 *krnetidx;		/* indexed like krt */
 
 struct {
 	uint32_t		rtseq;
 	pid_t			pid;
 	int			fd;
+	int			kq;	/* routing socket and audit timer */
 	uint8_t			fib_prio;
+	uint64_t		suppressed;	/* changes not touching the FIB */
+	struct timespec		reload_start;
+	int			nh_policy;	/* see kr_nexthop_policy() */
 } kr_state;
 
 struct kroute {
@@ -115,6 +148,89 @@ struct kif {
 	uint8_t			 depend_state;	/* for session depend on */
 };
 
+/*
+ * Digests of our routes per slice, one built from a kernel dump and one
+ * from the RIB. Routes of diverged slices are put into a tree and
+ * compared one by one.
+ */
+struct kr_audit_route {
+	RB_ENTRY(kr_audit_route) entry;
+	struct bgpd_addr	 prefix;
+	uint64_t		 hash;
+	uint8_t			 prefixlen;
+};
+
+enum kr_audit_state {
+	KR_AUDIT_IDLE,
+	KR_AUDIT_KERN,		/* parsing the dump */
+	KR_AUDIT_RIB,		/* walking the RIB */
+};
+
+struct kr_audit {
+	uint64_t		 kern[KR_AUDIT_SLICES];
+	uint64_t		 rib[KR_AUDIT_SLICES];
+	uint8_t			 dirty[KR_AUDIT_SLICES];
+	struct kroute		 cur;		/* next RIB route to visit */
+	struct kroute6		 cur6;
+	char			*buf;		/* dump of the audited table */
+	size_t			 len;
+	size_t			 off;		/* next message to parse */
+	enum kr_audit_state	 state;
+	u_int			 rtableid;
+	u_int			 next;		/* next table to audit */
+	u_int			 nslices;
+	uint8_t			 aid;
+	uint8_t			 resume;
+	uint8_t			 collect;	/* second pass */
+	uint8_t			 repair;	/* change is our own */
+	uint64_t		 orepaired;
+	uint64_t		 ounknown;
+	uint64_t		 runs;
+	uint64_t		 slices;	/* diverged slices */
+	uint64_t		 repaired;	/* routes reinstalled */
+	uint64_t		 unknown;	/* routes the RIB does not have */
+} kraudit;
+
+/*
+ * Index over the networks of a table, kt->krn. Reloads look networks up
+ * by their full key, redistribution only visits the networks whose type
+ * and match value fit the kernel route. seq follows the order of kt->krn
+ * so that the first matching network still wins.
+ */
+struct kr_net_node {
+	RB_ENTRY(kr_net_node)	 entry;		/* on kr_netidx.nets */
+	RB_ENTRY(kr_net_node)	 mentry;	/* on kr_netidx.match */
+	struct network		*n;
+	uint64_t		 seq;
+	uint16_t		 value;		/* rtlabel or priority */
+	uint8_t			 aid;
+	uint8_t			 type;
+	uint8_t			 reload;	/* new or changed */
+};
+
+/*
+ * Network rule added, changed or removed by a reload. Only routes the
+ * rule can match are redistributed again by kr_reload().
+ */
+struct kr_net_dirty {
+	SLIST_ENTRY(kr_net_dirty) entry;
+	uint64_t		 rd;
+	uint16_t		 value;		/* rtlabel or priority */
+	uint8_t			 aid;
+	uint8_t			 type;
+	uint8_t			 removed;
+};
+
+RB_HEAD(kr_net_tree, kr_net_node);
+RB_HEAD(kr_net_match_tree, kr_net_node);
+
+struct kr_netidx {
+	struct kr_net_tree	 nets;
+	struct kr_net_match_tree match;
+	SLIST_HEAD(, kr_net_dirty) dirty;
+	uint64_t		 seq;
+};
+
 int	ktable_new(u_int, u_int, char *, int);
 void	ktable_free(u_int);
 void	ktable_destroy(struct ktable *);
@@ -124,6 +240,10 @@ int	kr4_change(struct ktable *, struct kroute_full *);
 int	kr6_change(struct ktable *, struct kroute_full *);
 int	kr_net_match(struct ktable *, struct network_config *, uint16_t, int);
 struct network *kr_net_find(struct ktable *, struct network *);
+void	kr_net_insert(struct ktable *, struct network *);
+void	kr_net_remove(struct ktable *, struct network *);
+void	kr_net_dirty(struct ktable *, struct network *, int);
+size_t	kr_net_reeval(struct ktable *);
 void	kr_net_clear(struct ktable *);
 void	kr_redistribute(int, struct ktable *, struct kroute_full *);
 uint8_t	kr_priority(struct kroute_full *);
@@ -134,6 +254,9 @@ int	kroute6_compare(struct kroute6 *, struct kroute6 *);
 int	knexthop_compare(struct knexthop *, struct knexthop *);
 int	kredist_compare(struct kredist_node *, struct kredist_node *);
 int	kif_compare(struct kif *, struct kif *);
+int	kr_net_compare(struct kr_net_node *, struct kr_net_node *);
+int	kr_net_match_compare(struct kr_net_node *, struct kr_net_node *);
+int	kr_audit_compare(struct kr_audit_route *, struct kr_audit_route *);
 
 struct kroute	*kroute_find(struct ktable *, const struct bgpd_addr *,
 		    uint8_t, uint8_t);
@@ -148,6 +271,10 @@ struct kroute6	*kroute6_matchgw(struct kroute6 *, struct kroute_full *);
 void		 kroute6_clear(struct ktable *);
 
 struct knexthop	*knexthop_find(struct ktable *, struct bgpd_addr *);
+struct knexthop	*knexthop_first(struct ktable *, const struct bgpd_addr *,
+		    uint8_t);
+struct knexthop	*knexthop_next(struct ktable *, struct knexthop *,
+		    const struct bgpd_addr *, uint8_t);
 int		 knexthop_insert(struct ktable *, struct knexthop *);
 void		 knexthop_remove(struct ktable *, struct knexthop *);
 void		 knexthop_clear(struct ktable *);
@@ -181,10 +308,27 @@ void		if_announce(void *);
 int		send_rtmsg(int, struct ktable *, struct kroute_full *);
 int		dispatch_rtmsg(void);
 int		fetchtable(struct ktable *);
+int		fetchtable_dump(struct ktable *, char **, size_t *);
 int		fetchifs(int);
 int		dispatch_rtmsg_addr(struct rt_msghdr *, struct kroute_full *);
 int		kr_fib_delete(struct ktable *, struct kroute_full *, int);
 int		kr_fib_change(struct ktable *, struct kroute_full *, int, int);
+uint64_t	kr_audit_mix(uint64_t, const void *, size_t);
+uint64_t	kr_audit_prefix(const struct bgpd_addr *, uint8_t, u_int *);
+uint64_t	kr_audit_hash(const struct kroute_full *, u_int *);
+void		kr_audit_kernel(struct kroute_full *);
+void		kr_audit_rib(struct ktable *, struct kroute_full *);
+void		kr_audit_dirty(u_int, const struct bgpd_addr *, uint8_t);
+void		kr_audit(void);
+void		kr_audit_start(struct ktable *);
+void		kr_audit_arm(void);
+struct ktable	*kr_audit_table(void);
+void		kr_audit_step(void);
+int		kr_audit_parse(const struct timespec *);
+int		kr_audit_walk(struct ktable *, const struct timespec *);
+void		kr_audit_end(int);
+void		kr_audit_log(void);
+void		kr_stats_log(void);
 
 RB_PROTOTYPE(kroute_tree, kroute, entry, kroute_compare)
 RB_GENERATE(kroute_tree, kroute, entry, kroute_compare)
@@ -202,8 +346,48 @@ RB_HEAD(kif_tree, kif)		kit;
 RB_PROTOTYPE(kif_tree, kif, entry, kif_compare)
 RB_GENERATE(kif_tree, kif, entry, kif_compare)
 
+RB_PROTOTYPE(kr_net_tree, kr_net_node, entry, kr_net_compare)
+RB_GENERATE(kr_net_tree, kr_net_node, entry, kr_net_compare)
+
+RB_PROTOTYPE(kr_net_match_tree, kr_net_node, mentry, kr_net_match_compare)
+RB_GENERATE(kr_net_match_tree, kr_net_node, mentry, kr_net_match_compare)
+
+RB_HEAD(kr_audit_tree, kr_audit_route)	kraudittree;
+RB_PROTOTYPE(kr_audit_tree, kr_audit_route, entry, kr_audit_compare)
+RB_GENERATE(kr_audit_tree, kr_audit_route, entry, kr_audit_compare)
+
 #define KT2KNT(x)	(&(ktable_get((x)->nhtableid)->knt))
 
+/*
+ * Most routes carry no route label. An empty label is always id 0, so
+ * skip the name2id lookups for it altogether.
+ */
+static inline uint16_t
+kr_label_ref(const char *label)
+{
+	if (label[0] == '\0')
+		return (0);
+	return (rtlabel_name2id(label));
+}
+
+static inline void
+kr_label_unref(uint16_t labelid)
+{
+	if (labelid != 0)
+		rtlabel_unref(labelid);
+}
+
+/* take the new reference first, the label may stay the same */
+static inline void
+kr_label_set(uint16_t *labelid, const char *label)
+{
+	uint16_t	id;
+
+	id = kr_label_ref(label);
+	kr_label_unref(*labelid);
+	*labelid = id;
+}
+
 #define LINK_STATE_IS_UP(_s)    \
                 ((_s) == LINK_STATE_UP || (_s) == LINK_STATE_UNKNOWN)
 
@@ -214,7 +398,8 @@ RB_GENERATE(kif_tree, kif, entry, kif_compare)
 int
 kr_init(int *fd, uint8_t fib_prio)
 {
-	int		opt = 0, rcvbuf, default_rcvbuf;
+	struct kevent	ev[2];
+	int		opt = 0, rcvbuf, default_rcvbuf, nev = 0;
 	socklen_t	optlen;
 
 	if ((kr_state.fd = socket(AF_ROUTE,
@@ -244,13 +429,29 @@ kr_init(int *fd, uint8_t fib_prio)
 	kr_state.pid = getpid();
 	kr_state.rtseq = 1;
 	kr_state.fib_prio = fib_prio;
+	kr_state.nh_policy = -1;
 
 	RB_INIT(&kit);
+	RB_INIT(&kraudittree);
+
+	/* the parent polls one fd, the kqueue wraps socket and timer */
+	if ((kr_state.kq = kqueue()) == -1) {
+		log_warn("%s: kqueue", __func__);
+		return (-1);
+	}
+	EV_SET(&ev[nev++], kr_state.fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (KR_AUDIT_INTERVAL > 0)
+		EV_SET(&ev[nev++], KR_KQ_AUDIT, EVFILT_TIMER, EV_ADD, 0,
+		    KR_AUDIT_INTERVAL * 1000, NULL);
+	if (kevent(kr_state.kq, ev, nev, NULL, 0, NULL) == -1) {
+		log_warn("%s: kevent", __func__);
+		return (-1);
+	}
 
 	if (fetchifs(0) == -1)
 		return (-1);
 
-	*fd = kr_state.fd;
+	*fd = kr_state.kq;
 	return (0);
 }
 
@@ -273,6 +474,7 @@ ktable_new(u_int rtableid, u_int rdomid, char *name, int fs)
 {
 	struct ktable	**xkrt;
 	struct ktable	 *kt;
+	struct kr_netidx *xnetidx;
 	size_t		  oldsize;
 
 	/* resize index table if needed */
@@ -287,6 +489,14 @@ ktable_new(u_int rtableid, u_int rdomid, char *name, int fs)
 		krt_size = rtableid + 1;
 		memset((char *)krt + oldsize, 0,
 		    krt_size * sizeof(struct ktable *) - oldsize);
+
+		if ((xnetidx = recallocarray(krnetidx, oldsize /
+		    sizeof(struct ktable *), krt_size,
+		    sizeof(struct kr_netidx))) == NULL) {
+			log_warn("%s", __func__);
+			return (-1);
+		}
+		krnetidx = xnetidx;
 	}
 
 	if (krt[rtableid])
@@ -364,6 +574,7 @@ ktable_destroy(struct ktable *kt)
 	kroute_clear(kt);
 	kroute6_clear(kt);
 	kr_net_clear(kt);
+	memset(&krnetidx[kt->rtableid], 0, sizeof(struct kr_netidx));
 
 	krt[kt->rtableid] = NULL;
 	free(kt);
@@ -472,6 +683,7 @@ int
 kr4_change(struct ktable *kt, struct kroute_full *kf)
 {
 	struct kroute	*kr;
+	int		 changed;
 
 	/* for blackhole and reject routes nexthop needs to be 127.0.0.1 */
 	if (kf->flags & (F_BLACKHOLE|F_REJECT))
@@ -486,9 +698,13 @@ kr4_change(struct ktable *kt, struct kroute_full *kf)
 		if (kroute_insert(kt, kf) == -1)
 			return (-1);
 	} else {
+		/* route labels are not passed to the kernel */
+		changed = !(kr->flags & F_BGPD_INSERTED) ||
+		    kr->nexthop.s_addr != kf->nexthop.v4.s_addr ||
+		    ((kr->flags ^ kf->flags) & (F_BLACKHOLE|F_REJECT));
+
 		kr->nexthop.s_addr = kf->nexthop.v4.s_addr;
-		rtlabel_unref(kr->labelid);
-		kr->labelid = rtlabel_name2id(kf->label);
+		kr_label_set(&kr->labelid, kf->label);
 		if (kf->flags & F_BLACKHOLE)
 			kr->flags |= F_BLACKHOLE;
 		else
@@ -501,9 +717,14 @@ kr4_change(struct ktable *kt, struct kroute_full *kf)
 		if (kr->flags & F_NEXTHOP)
 			knexthop_update(kt, kf);
 
-		/* check if there is already a kernel, higher prio route */
-		if (kroute_find(kt, &kf->prefix, kf->prefixlen, RTP_KERN) ==
-		    NULL)
+		/*
+		 * skip if nothing changed for the kernel or if there is
+		 * already a kernel, higher prio route
+		 */
+		if (!changed)
+			kr_state.suppressed++;
+		else if (kroute_find(kt, &kf->prefix, kf->prefixlen,
+		    RTP_KERN) == NULL)
 			if (send_rtmsg(RTM_CHANGE, kt, kf))
 				kr->flags |= F_BGPD_INSERTED;
 	}
@@ -516,6 +737,7 @@ kr6_change(struct ktable *kt, struct kroute_full *kf)
 {
 	struct kroute6	*kr6;
 	struct in6_addr	 lo6 = IN6ADDR_LOOPBACK_INIT;
+	int		 changed;
 
 	/* for blackhole and reject routes nexthop needs to be ::1 */
 	if (kf->flags & (F_BLACKHOLE|F_REJECT))
@@ -529,10 +751,15 @@ kr6_change(struct ktable *kt, struct kroute_full *kf)
 		if (kroute_insert(kt, kf) == -1)
 			return (-1);
 	} else {
+		changed = !(kr6->flags & F_BGPD_INSERTED) ||
+		    memcmp(&kr6->nexthop, &kf->nexthop.v6,
+		    sizeof(struct in6_addr)) != 0 ||
+		    kr6->nexthop_scope_id != kf->nexthop.scope_id ||
+		    ((kr6->flags ^ kf->flags) & (F_BLACKHOLE|F_REJECT));
+
 		memcpy(&kr6->nexthop, &kf->nexthop.v6, sizeof(struct in6_addr));
 		kr6->nexthop_scope_id = kf->nexthop.scope_id;
-		rtlabel_unref(kr6->labelid);
-		kr6->labelid = rtlabel_name2id(kf->label);
+		kr_label_set(&kr6->labelid, kf->label);
 		if (kf->flags & F_BLACKHOLE)
 			kr6->flags |= F_BLACKHOLE;
 		else
@@ -545,9 +772,14 @@ kr6_change(struct ktable *kt, struct kroute_full *kf)
 		if (kr6->flags & F_NEXTHOP)
 			knexthop_update(kt, kf);
 
-		/* check if there is already a kernel, higher prio route */
-		if (kroute6_find(kt, &kf->prefix, kf->prefixlen, RTP_KERN) ==
-		    NULL)
+		/*
+		 * skip if nothing changed for the kernel or if there is
+		 * already a kernel, higher prio route
+		 */
+		if (!changed)
+			kr_state.suppressed++;
+		else if (kroute6_find(kt, &kf->prefix, kf->prefixlen,
+		    RTP_KERN) == NULL)
 			if (send_rtmsg(RTM_CHANGE, kt, kf))
 				kr6->flags |= F_BGPD_INSERTED;
 	}
@@ -599,10 +831,13 @@ kr_shutdown(void)
 {
 	u_int	i;
 
+	kr_stats_log();
 	for (i = krt_size; i > 0; i--)
 		ktable_free(i - 1);
 	kif_clear();
 	free(krt);
+	free(krnetidx);
+	close(kr_state.kq);
 }
 
 void
@@ -691,7 +926,26 @@ kr_fib_prio_set(uint8_t prio)
 int
 kr_dispatch_msg(void)
 {
-	return (dispatch_rtmsg());
+	struct kevent	ev[2];
+	struct timespec	ts = { 0, 0 };
+	int		i, n;
+
+	if ((n = kevent(kr_state.kq, NULL, 0, ev, 2, &ts)) == -1) {
+		if (errno == EINTR)
+			return (0);
+		log_warn("%s: kevent", __func__);
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		if (ev[i].filter != EVFILT_TIMER) {
+			if (dispatch_rtmsg() == -1)
+				return (-1);
+		} else if (ev[i].ident == KR_KQ_AUDIT_STEP)
+			kr_audit_step();
+		else
+			kr_audit();
+	}
+	return (0);
 }
 
 int
@@ -1003,79 +1257,281 @@ kr_net_redist_del(struct ktable *kt, struct network_config *net, int dynamic)
 		log_warnx("%s: failed to send network removal", __func__);
 }
 
+/* first network of the given type and match value, in kt->krn order */
+static struct kr_net_node *
+kr_net_first(struct ktable *kt, uint8_t aid, uint8_t type, uint16_t value)
+{
+	struct kr_net_node	 key, *xn;
+
+	key.aid = aid;
+	key.type = type;
+	key.value = value;
+	key.seq = 0;
+	xn = RB_NFIND(kr_net_match_tree, &krnetidx[kt->rtableid].match, &key);
+	if (xn == NULL || xn->aid != aid || xn->type != type ||
+	    xn->value != value)
+		return (NULL);
+	return (xn);
+}
+
+static struct kr_net_node *
+kr_net_next(struct ktable *kt, struct kr_net_node *n)
+{
+	struct kr_net_node	*xn;
+
+	xn = RB_NEXT(kr_net_match_tree, &krnetidx[kt->rtableid].match, n);
+	if (xn == NULL || xn->aid != n->aid || xn->type != n->type ||
+	    xn->value != n->value)
+		return (NULL);
+	return (xn);
+}
+
 int
 kr_net_match(struct ktable *kt, struct network_config *net, uint16_t flags,
     int loopback)
 {
-	struct network		*xn;
-
-	TAILQ_FOREACH(xn, &kt->krn, entry) {
-		if (xn->net.prefix.aid != net->prefix.aid)
-			continue;
-		switch (xn->net.type) {
-		case NETWORK_DEFAULT:
-			/* static match already redistributed */
-			continue;
-		case NETWORK_STATIC:
-			/* Skip networks with nexthop on loopback. */
-			if (loopback)
-				continue;
-			if (flags & F_STATIC)
-				break;
-			continue;
-		case NETWORK_CONNECTED:
-			/* Skip networks with nexthop on loopback. */
-			if (loopback)
-				continue;
-			if (flags & F_CONNECTED)
-				break;
-			continue;
-		case NETWORK_RTLABEL:
-			if (net->rtlabel == xn->net.rtlabel)
-				break;
-			continue;
-		case NETWORK_PRIORITY:
-			if (net->priority == xn->net.priority)
-				break;
-			continue;
-		case NETWORK_MRTCLONE:
-		case NETWORK_PREFIXSET:
-			/* must not happen */
-			log_warnx("%s: found a NETWORK_PREFIXSET, "
-			    "please send a bug report", __func__);
-			continue;
-		}
+	struct kr_net_node	*cur[4], *xn;
+	u_int			 i, ncur = 0, best = 0;
+	uint8_t			 aid = net->prefix.aid;
+
+	/* skip static and connected networks with nexthop on loopback */
+	if (!loopback && flags & F_STATIC)
+		cur[ncur++] = kr_net_first(kt, aid, NETWORK_STATIC, 0);
+	if (!loopback && flags & F_CONNECTED)
+		cur[ncur++] = kr_net_first(kt, aid, NETWORK_CONNECTED, 0);
+	cur[ncur++] = kr_net_first(kt, aid, NETWORK_RTLABEL, net->rtlabel);
+	cur[ncur++] = kr_net_first(kt, aid, NETWORK_PRIORITY, net->priority);
+
+	/* merge the candidates back into kt->krn order */
+	for (;;) {
+		xn = NULL;
+		for (i = 0; i < ncur; i++)
+			if (cur[i] != NULL &&
+			    (xn == NULL || cur[i]->seq < xn->seq)) {
+				xn = cur[i];
+				best = i;
+			}
+		if (xn == NULL)
+			break;
+		cur[best] = kr_net_next(kt, xn);
 
-		net->rd = xn->net.rd;
-		if (kr_net_redist_add(kt, net, &xn->net.attrset, 1))
+		net->rd = xn->n->net.rd;
+		if (kr_net_redist_add(kt, net, &xn->n->net.attrset, 1))
 			return (1);
 	}
 	return (0);
 }
 
+static struct kr_net_node *
+kr_net_lookup(struct ktable *kt, struct network *n)
+{
+	struct kr_net_node	 key;
+
+	key.n = n;
+	return (RB_FIND(kr_net_tree, &krnetidx[kt->rtableid].nets, &key));
+}
+
 struct network *
 kr_net_find(struct ktable *kt, struct network *n)
 {
-	struct network		*xn;
+	struct kr_net_node	*xn;
+
+	xn = kr_net_lookup(kt, n);
+	return (xn != NULL ? xn->n : NULL);
+}
+
+/*
+ * Add a network at the end of kt->krn.
+ */
+void
+kr_net_insert(struct ktable *kt, struct network *n)
+{
+	struct kr_netidx	*idx = &krnetidx[kt->rtableid];
+	struct kr_net_node	*xn;
+
+	if ((xn = calloc(1, sizeof(*xn))) == NULL)
+		fatal("%s", __func__);
+	xn->n = n;
+	xn->seq = ++idx->seq;
+	xn->reload = 1;
+	xn->aid = n->net.prefix.aid;
+	xn->type = n->net.type;
+	switch (n->net.type) {
+	case NETWORK_DEFAULT:
+		/* static match already redistributed */
+		break;
+	case NETWORK_RTLABEL:
+		xn->value = n->net.rtlabel;
+		/* FALLTHROUGH */
+	case NETWORK_STATIC:
+	case NETWORK_CONNECTED:
+		RB_INSERT(kr_net_match_tree, &idx->match, xn);
+		break;
+	case NETWORK_PRIORITY:
+		xn->value = n->net.priority;
+		RB_INSERT(kr_net_match_tree, &idx->match, xn);
+		break;
+	case NETWORK_MRTCLONE:
+	case NETWORK_PREFIXSET:
+		/* must not happen */
+		log_warnx("%s: found a NETWORK_PREFIXSET, "
+		    "please send a bug report", __func__);
+		break;
+	}
+	RB_INSERT(kr_net_tree, &idx->nets, xn);
+	TAILQ_INSERT_TAIL(&kt->krn, n, entry);
+	kr_net_dirty(kt, n, 0);
+}
+
+void
+kr_net_remove(struct ktable *kt, struct network *n)
+{
+	struct kr_netidx	*idx = &krnetidx[kt->rtableid];
+	struct kr_net_node	*xn;
+
+	TAILQ_REMOVE(&kt->krn, n, entry);
+	if ((xn = kr_net_lookup(kt, n)) == NULL) {
+		log_warnx("%s: network not indexed", __func__);
+		return;
+	}
+	RB_REMOVE(kr_net_tree, &idx->nets, xn);
+	if (RB_FIND(kr_net_match_tree, &idx->match, xn) == xn)
+		RB_REMOVE(kr_net_match_tree, &idx->match, xn);
+	free(xn);
+}
+
+/*
+ * Remember a dynamic rule the reload added, changed or removed.
+ */
+void
+kr_net_dirty(struct ktable *kt, struct network *n, int removed)
+{
+	struct kr_net_dirty	*d;
+
+	switch (n->net.type) {
+	case NETWORK_STATIC:
+	case NETWORK_CONNECTED:
+	case NETWORK_RTLABEL:
+	case NETWORK_PRIORITY:
+		break;
+	default:
+		return;
+	}
 
-	TAILQ_FOREACH(xn, &kt->krn, entry) {
-		if (n->net.type != xn->net.type ||
-		    n->net.prefixlen != xn->net.prefixlen ||
-		    n->net.rd != xn->net.rd ||
-		    n->net.rtlabel != xn->net.rtlabel ||
-		    n->net.priority != xn->net.priority)
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		fatal("%s", __func__);
+	d->rd = n->net.rd;
+	d->aid = n->net.prefix.aid;
+	d->type = n->net.type;
+	if (n->net.type == NETWORK_RTLABEL)
+		d->value = n->net.rtlabel;
+	else if (n->net.type == NETWORK_PRIORITY)
+		d->value = n->net.priority;
+	d->removed = removed;
+	SLIST_INSERT_HEAD(&krnetidx[kt->rtableid].dirty, d, entry);
+}
+
+static int
+kr_net_dirty_match(struct kr_net_dirty *d, uint8_t aid, uint16_t flags,
+    uint16_t labelid, uint8_t priority)
+{
+	if (d->aid != aid)
+		return (0);
+	switch (d->type) {
+	case NETWORK_STATIC:
+		return ((flags & F_STATIC) != 0);
+	case NETWORK_CONNECTED:
+		return ((flags & F_CONNECTED) != 0);
+	case NETWORK_RTLABEL:
+		return (labelid == d->value);
+	case NETWORK_PRIORITY:
+		return (priority == d->value);
+	}
+	return (0);
+}
+
+/*
+ * Redistribute the kernel routes again that a dirty rule may match.
+ * Announcements of removed rules are withdrawn first, another rule may
+ * still pick the route up. Returns the number of routes evaluated.
+ */
+size_t
+kr_net_reeval(struct ktable *kt)
+{
+	struct kr_netidx	*idx = &krnetidx[kt->rtableid];
+	struct kr_net_dirty	*d;
+	struct kroute		*kr;
+	struct kroute6		*kr6;
+	struct kroute_full	*kf;
+	struct network_config	 net;
+	size_t			 cnt = 0;
+	int			 match;
+
+	if (SLIST_EMPTY(&idx->dirty))
+		return (0);
+
+	RB_FOREACH(kr, kroute_tree, &kt->krt) {
+		if (kr->flags & F_BGPD)
 			continue;
-		if (memcmp(&n->net.prefix, &xn->net.prefix,
-		    sizeof(n->net.prefix)) == 0)
-			return (xn);
+		match = 0;
+		SLIST_FOREACH(d, &idx->dirty, entry) {
+			if (!kr_net_dirty_match(d, AID_INET, kr->flags,
+			    kr->labelid, kr->priority))
+				continue;
+			match = 1;
+			if (d->removed) {
+				memset(&net, 0, sizeof(net));
+				net.prefix.aid = AID_INET;
+				net.prefix.v4 = kr->prefix;
+				net.prefixlen = kr->prefixlen;
+				net.rd = d->rd;
+				kr_net_redist_del(kt, &net, 1);
+			}
+		}
+		if (match) {
+			kf = kr_tofull(kr);
+			kr_redistribute(IMSG_NETWORK_ADD, kt, kf);
+			cnt++;
+		}
 	}
-	return (NULL);
+	RB_FOREACH(kr6, kroute6_tree, &kt->krt6) {
+		if (kr6->flags & F_BGPD)
+			continue;
+		match = 0;
+		SLIST_FOREACH(d, &idx->dirty, entry) {
+			if (!kr_net_dirty_match(d, AID_INET6, kr6->flags,
+			    kr6->labelid, kr6->priority))
+				continue;
+			match = 1;
+			if (d->removed) {
+				memset(&net, 0, sizeof(net));
+				net.prefix.aid = AID_INET6;
+				net.prefix.v6 = kr6->prefix;
+				net.prefix.scope_id = kr6->prefix_scope_id;
+				net.prefixlen = kr6->prefixlen;
+				net.rd = d->rd;
+				kr_net_redist_del(kt, &net, 1);
+			}
+		}
+		if (match) {
+			kf = kr6_tofull(kr6);
+			kr_redistribute(IMSG_NETWORK_ADD, kt, kf);
+			cnt++;
+		}
+	}
+
+	while ((d = SLIST_FIRST(&idx->dirty)) != NULL) {
+		SLIST_REMOVE_HEAD(&idx->dirty, entry);
+		free(d);
+	}
+	return (cnt);
 }
 
 void
 kr_net_reload(u_int rtableid, uint64_t rd, struct network_head *nh)
 {
 	struct network		*n, *xn;
+	struct kr_net_node	*xnn;
 	struct ktable		*kt;
 
 	if ((kt = ktable_get(rtableid)) == NULL)
@@ -1085,28 +1541,39 @@ kr_net_reload(u_int rtableid, uint64_t rd, struct network_head *nh)
 		TAILQ_REMOVE(nh, n, entry);
 		n->net.old = 0;
 		n->net.rd = rd;
-		xn = kr_net_find(kt, n);
-		if (xn) {
+		if ((xnn = kr_net_lookup(kt, n)) != NULL) {
+			xn = xnn->n;
 			xn->net.old = 0;
+			/* announcements only change with the attributes */
+			if (!filterset_equal(&xn->net.attrset,
+			    &n->net.attrset)) {
+				xnn->reload = 1;
+				kr_net_dirty(kt, xn, 0);
+			}
 			filterset_free(&xn->net.attrset);
 			filterset_move(&n->net.attrset, &xn->net.attrset);
 			network_free(n);
 		} else
-			TAILQ_INSERT_TAIL(&kt->krn, n, entry);
+			kr_net_insert(kt, n);
 	}
 }
 
 void
 kr_net_clear(struct ktable *kt)
 {
-	struct network *n, *xn;
+	struct network		*n, *xn;
+	struct kr_net_dirty	*d;
 
 	TAILQ_FOREACH_SAFE(n, &kt->krn, entry, xn) {
-		TAILQ_REMOVE(&kt->krn, n, entry);
+		kr_net_remove(kt, n);
 		if (n->net.type == NETWORK_DEFAULT)
 			kr_net_redist_del(kt, &n->net, 0);
 		network_free(n);
 	}
+	while ((d = SLIST_FIRST(&krnetidx[kt->rtableid].dirty)) != NULL) {
+		SLIST_REMOVE_HEAD(&krnetidx[kt->rtableid].dirty, entry);
+		free(d);
+	}
 }
 
 void
@@ -1119,8 +1586,11 @@ kr_redistribute(int type, struct ktable *kt, struct kroute_full *kf)
 	memset(&net, 0, sizeof(net));
 	net.prefix = kf->prefix;
 	net.prefixlen = kf->prefixlen;
-	net.rtlabel = rtlabel_name2id(kf->label);
-	rtlabel_unref(net.rtlabel); /* drop reference now, which is ok here */
+	if (kf->label[0] != '\0') {
+		net.rtlabel = rtlabel_name2id(kf->label);
+		/* drop reference now, which is ok here */
+		rtlabel_unref(net.rtlabel);
+	}
 	net.priority = kf->priority;
 
 	/* shortcut for removals */
@@ -1191,6 +1661,7 @@ ktable_preload(void)
 	struct network	*n;
 	u_int		 i;
 
+	clock_gettime(CLOCK_MONOTONIC, &kr_state.reload_start);
 	for (i = 0; i < krt_size; i++) {
 		if ((kt = ktable_get(i)) == NULL)
 			continue;
@@ -1221,7 +1692,8 @@ ktable_postload(void)
 		/* cleanup old networks */
 		TAILQ_FOREACH_SAFE(n, &kt->krn, entry, xn) {
 			if (n->net.old) {
-				TAILQ_REMOVE(&kt->krn, n, entry);
+				kr_net_remove(kt, n);
+				kr_net_dirty(kt, n, 1);
 				if (n->net.type == NETWORK_DEFAULT)
 					kr_net_redist_del(kt, &n->net, 0);
 				network_free(n);
@@ -1230,44 +1702,85 @@ ktable_postload(void)
 	}
 }
 
+/*
+ * Nexthop validity only depends on whether routes of the RDE and default
+ * routes may resolve nexthops, see bgpd_oknexthop().
+ */
+static int
+kr_nexthop_policy(void)
+{
+	struct kroute_full	kf;
+	int			policy = 0;
+
+	memset(&kf, 0, sizeof(kf));
+	kf.prefix.aid = AID_INET;
+	if (bgpd_oknexthop(&kf))
+		policy |= 1;
+	kf.prefixlen = 32;
+	kf.flags = F_BGPD;
+	if (bgpd_oknexthop(&kf))
+		policy |= 2;
+	return (policy);
+}
+
+/*
+ * Apply the changes of a reload. Nexthops are only revalidated if the
+ * nexthop policy changed, network rules only announced if they are new
+ * or changed and kernel routes only redistributed again if a new,
+ * changed or removed dynamic rule can match them.
+ */
 int
 kr_reload(void)
 {
-	struct ktable	*kt;
-	struct kroute	*kr;
-	struct kroute6	*kr6;
-	struct knexthop	*nh;
-	struct network	*n;
-	u_int		 rid;
-	int		 hasdyn = 0;
+	struct ktable		*kt;
+	struct knexthop		*nh;
+	struct network		*n;
+	struct kr_net_node	*xn;
+	struct timespec		 start, now, total;
+	size_t			 nroutes = 0;
+	u_int			 rid, nnets = 0;
+	int			 policy, nhreval;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (kr_state.reload_start.tv_sec == 0 &&
+	    kr_state.reload_start.tv_nsec == 0)
+		kr_state.reload_start = start;
+	policy = kr_nexthop_policy();
+	nhreval = policy != kr_state.nh_policy;
+	kr_state.nh_policy = policy;
 
 	for (rid = 0; rid < krt_size; rid++) {
 		if ((kt = ktable_get(rid)) == NULL)
 			continue;
 
 		/* if this is the main nexthop table revalidate nexthops */
-		if (kt->rtableid == kt->nhtableid)
+		if (nhreval && kt->rtableid == kt->nhtableid)
 			RB_FOREACH(nh, knexthop_tree, KT2KNT(kt))
 				knexthop_validate(kt, nh);
 
-		TAILQ_FOREACH(n, &kt->krn, entry)
-			if (n->net.type == NETWORK_DEFAULT) {
+		TAILQ_FOREACH(n, &kt->krn, entry) {
+			if ((xn = kr_net_lookup(kt, n)) == NULL ||
+			    !xn->reload)
+				continue;
+			xn->reload = 0;
+			nnets++;
+			if (n->net.type == NETWORK_DEFAULT)
 				kr_net_redist_add(kt, &n->net,
 				    &n->net.attrset, 0);
-			} else
-				hasdyn = 1;
-
-		if (hasdyn) {
-			/* only evaluate the full tree if we need */
-			RB_FOREACH(kr, kroute_tree, &kt->krt)
-				kr_redistribute(IMSG_NETWORK_ADD, kt,
-				    kr_tofull(kr));
-			RB_FOREACH(kr6, kroute6_tree, &kt->krt6)
-				kr_redistribute(IMSG_NETWORK_ADD, kt,
-				    kr6_tofull(kr6));
 		}
+
+		nroutes += kr_net_reeval(kt);
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &kr_state.reload_start, &total);
+	timespecsub(&now, &start, &now);
+	log_info("kernel reload done in %lld.%03ld sec (kroute %lld.%03ld "
+	    "sec): %u networks changed, %zu routes redistributed%s",
+	    (long long)total.tv_sec, total.tv_nsec / 1000000,
+	    (long long)now.tv_sec, now.tv_nsec / 1000000, nnets, nroutes,
+	    nhreval ? ", nexthops revalidated" : "");
+	memset(&kr_state.reload_start, 0, sizeof(kr_state.reload_start));
 	return (0);
 }
 
@@ -1290,7 +1803,9 @@ kr_tofull(struct kroute *kr)
 	kf.prefix.v4.s_addr = kr->prefix.s_addr;
 	kf.nexthop.aid = AID_INET;
 	kf.nexthop.v4.s_addr = kr->nexthop.s_addr;
-	strlcpy(kf.label, rtlabel_id2name(kr->labelid), sizeof(kf.label));
+	if (kr->labelid != 0)
+		strlcpy(kf.label, rtlabel_id2name(kr->labelid),
+		    sizeof(kf.label));
 	kf.flags = kr->flags;
 	kf.ifindex = kr->ifindex;
 	kf.prefixlen = kr->prefixlen;
@@ -1313,7 +1828,9 @@ kr6_tofull(struct kroute6 *kr6)
 	kf.nexthop.aid = AID_INET6;
 	kf.nexthop.v6 = kr6->nexthop;
 	kf.nexthop.scope_id = kr6->nexthop_scope_id;
-	strlcpy(kf.label, rtlabel_id2name(kr6->labelid), sizeof(kf.label));
+	if (kr6->labelid != 0)
+		strlcpy(kf.label, rtlabel_id2name(kr6->labelid),
+		    sizeof(kf.label));
 	kf.flags = kr6->flags;
 	kf.ifindex = kr6->ifindex;
 	kf.prefixlen = kr6->prefixlen;
@@ -1456,6 +1973,51 @@ kif_compare(struct kif *a, struct kif *b)
 	return (b->ifindex - a->ifindex);
 }
 
+int
+kr_net_compare(struct kr_net_node *a, struct kr_net_node *b)
+{
+	const struct network_config	*na = &a->n->net, *nb = &b->n->net;
+
+	if (na->type != nb->type)
+		return (na->type < nb->type ? -1 : 1);
+	if (na->prefixlen != nb->prefixlen)
+		return (na->prefixlen < nb->prefixlen ? -1 : 1);
+	if (na->rd != nb->rd)
+		return (na->rd < nb->rd ? -1 : 1);
+	if (na->rtlabel != nb->rtlabel)
+		return (na->rtlabel < nb->rtlabel ? -1 : 1);
+	if (na->priority != nb->priority)
+		return (na->priority < nb->priority ? -1 : 1);
+	return (memcmp(&na->prefix, &nb->prefix, sizeof(na->prefix)));
+}
+
+int
+kr_net_match_compare(struct kr_net_node *a, struct kr_net_node *b)
+{
+	if (a->aid != b->aid)
+		return (a->aid < b->aid ? -1 : 1);
+	if (a->type != b->type)
+		return (a->type < b->type ? -1 : 1);
+	if (a->value != b->value)
+		return (a->value < b->value ? -1 : 1);
+	if (a->seq != b->seq)
+		return (a->seq < b->seq ? -1 : 1);
+	return (0);
+}
+
+int
+kr_audit_compare(struct kr_audit_route *a, struct kr_audit_route *b)
+{
+	int	rv;
+
+	if (a->prefix.aid != b->prefix.aid)
+		return (a->prefix.aid - b->prefix.aid);
+	if ((rv = prefix_compare(&a->prefix, &b->prefix,
+	    a->prefix.aid == AID_INET ? 32 : 128)) != 0)
+		return (rv);
+	return (a->prefixlen - b->prefixlen);
+}
+
 
 /*
  * tree management functions
@@ -1553,7 +2115,7 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 
 		kr->ifindex = kf->ifindex;
 		kr->priority = kf->priority;
-		kr->labelid = rtlabel_name2id(kf->label);
+		kr->labelid = kr_label_ref(kf->label);
 
 		if ((krm = RB_INSERT(kroute_tree, &kt->krt, kr)) != NULL) {
 			/* multipath route, add at end of list */
@@ -1593,7 +2155,7 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 
 		kr6->ifindex = kf->ifindex;
 		kr6->priority = kf->priority;
-		kr6->labelid = rtlabel_name2id(kf->label);
+		kr6->labelid = kr_label_ref(kf->label);
 
 		if ((kr6m = RB_INSERT(kroute6_tree, &kt->krt6, kr6)) != NULL) {
 			/* multipath route, add at end of list */
@@ -1613,10 +2175,10 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 	}
 
 	if (bgpd_has_bgpnh() || !(kf->flags & F_BGPD)) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt))
-			if (prefix_compare(&kf->prefix, &n->nexthop,
-			    kf->prefixlen) == 0)
-				knexthop_validate(kt, n);
+		for (n = knexthop_first(kt, &kf->prefix, kf->prefixlen);
+		    n != NULL;
+		    n = knexthop_next(kt, n, &kf->prefix, kf->prefixlen))
+			knexthop_validate(kt, n);
 	}
 
 	if (!(kf->flags & F_BGPD)) {
@@ -1694,7 +2256,7 @@ kroute4_remove(struct ktable *kt, struct kroute_full *kf, int any)
 
 	*kf = *kr_tofull(krm);
 
-	rtlabel_unref(krm->labelid);
+	kr_label_unref(krm->labelid);
 	free(krm);
 	return (multipath);
 }
@@ -1763,7 +2325,7 @@ kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any)
 
 	*kf = *kr6_tofull(krm);
 
-	rtlabel_unref(krm->labelid);
+	kr_label_unref(krm->labelid);
 	free(krm);
 	return (multipath);
 }
@@ -1880,6 +2442,39 @@ knexthop_find(struct ktable *kt, struct bgpd_addr *addr)
 	return (RB_FIND(knexthop_tree, KT2KNT(kt), &s));
 }
 
+/*
+ * The nexthop tree is sorted by address so all nexthops covered by a
+ * prefix are next to each other, starting at the masked prefix.
+ */
+struct knexthop *
+knexthop_first(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
+{
+	struct knexthop	 s;
+	struct knexthop	*kn;
+
+	if (prefix->aid != AID_INET && prefix->aid != AID_INET6)
+		return (NULL);
+
+	memset(&s, 0, sizeof(s));
+	applymask(&s.nexthop, prefix, prefixlen);
+
+	kn = RB_NFIND(knexthop_tree, KT2KNT(kt), &s);
+	if (kn != NULL && prefix_compare(prefix, &kn->nexthop, prefixlen) != 0)
+		return (NULL);
+	return (kn);
+}
+
+struct knexthop *
+knexthop_next(struct ktable *kt, struct knexthop *kn,
+    const struct bgpd_addr *prefix, uint8_t prefixlen)
+{
+	kn = RB_NEXT(knexthop_tree, KT2KNT(kt), kn);
+	if (kn != NULL && prefix_compare(prefix, &kn->nexthop, prefixlen) != 0)
+		return (NULL);
+	return (kn);
+}
+
 int
 knexthop_insert(struct ktable *kt, struct knexthop *kn)
 {
@@ -2157,10 +2752,9 @@ knexthop_update(struct ktable *kt, struct kroute_full *kf)
 {
 	struct knexthop	*kn;
 
-	RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
-		if (prefix_compare(&kf->prefix, &kn->nexthop,
-		    kf->prefixlen) == 0)
-			knexthop_send_update(kn);
+	for (kn = knexthop_first(kt, &kf->prefix, kf->prefixlen); kn != NULL;
+	    kn = knexthop_next(kt, kn, &kf->prefix, kf->prefixlen))
+		knexthop_send_update(kn);
 }
 
 void
@@ -2586,6 +3180,7 @@ send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf)
 
 	if (!kt->fib_sync)
 		return (0);
+	kr_audit_dirty(kt->rtableid, &kf->prefix, kf->prefixlen);
 
 	/* initialize header */
 	memset(&hdr, 0, sizeof(hdr));
@@ -2672,14 +3267,18 @@ retry:
 	return (1);
 }
 
+/*
+ * Dump the routes of a table, *bufp is NULL if there are none.
+ */
 int
-fetchtable(struct ktable *kt)
+fetchtable_dump(struct ktable *kt, char **bufp, size_t *lenp)
 {
 	size_t			 len;
 	int			 mib[7];
-	char			*buf = NULL, *next, *lim;
-	struct rt_msghdr	*rtm;
-	struct kroute_full	 kf;
+	char			*buf = NULL;
+
+	*bufp = NULL;
+	*lenp = 0;
 
 	mib[0] = CTL_NET;
 	mib[1] = PF_ROUTE;
@@ -2708,6 +3307,22 @@ fetchtable(struct ktable *kt)
 		}
 	}
 
+	*bufp = buf;
+	*lenp = len;
+	return (0);
+}
+
+int
+fetchtable(struct ktable *kt)
+{
+	size_t			 len;
+	char			*buf, *next, *lim;
+	struct rt_msghdr	*rtm;
+	struct kroute_full	 kf;
+
+	if (fetchtable_dump(kt, &buf, &len) == -1)
+		return (-1);
+
 	lim = buf + len;
 	for (next = buf; next < lim; next += rtm->rtm_msglen) {
 		rtm = (struct rt_msghdr *)next;
@@ -2717,6 +3332,10 @@ fetchtable(struct ktable *kt)
 		if (dispatch_rtmsg_addr(rtm, &kf) == -1)
 			continue;
 
+		/*
+		 * Routes of ours a previous run left behind are removed,
+		 * they are not taken over like on Linux.
+		 */
 		if (kf.priority == RTP_MINE)
 			send_rtmsg(RTM_DELETE, kt, &kf);
 		else
@@ -2726,6 +3345,450 @@ fetchtable(struct ktable *kt)
 	return (0);
 }
 
+#define	KR_AUDIT_BASIS	0xcbf29ce484222325ULL	/* FNV-1a */
+#define	KR_AUDIT_PRIME	0x100000001b3ULL
+
+uint64_t
+kr_audit_mix(uint64_t h, const void *p, size_t len)
+{
+	const uint8_t	*b = p;
+
+	while (len-- > 0) {
+		h ^= *b++;
+		h *= KR_AUDIT_PRIME;
+	}
+	return (h);
+}
+
+/*
+ * The slice only depends on the prefix, so both sides put a route into
+ * the same one.
+ */
+uint64_t
+kr_audit_prefix(const struct bgpd_addr *prefix, uint8_t prefixlen,
+    u_int *slice)
+{
+	uint64_t	h;
+
+	h = kr_audit_mix(KR_AUDIT_BASIS, &prefix->aid, sizeof(prefix->aid));
+	h = kr_audit_mix(h, &prefixlen, sizeof(prefixlen));
+	if (prefix->aid == AID_INET)
+		h = kr_audit_mix(h, &prefix->v4, sizeof(prefix->v4));
+	else
+		h = kr_audit_mix(h, &prefix->v6, sizeof(prefix->v6));
+	*slice = (h ^ (h >> 32)) % KR_AUDIT_SLICES;
+	return (h);
+}
+
+/*
+ * Hash a route of ours.
+ */
+uint64_t
+kr_audit_hash(const struct kroute_full *kf, u_int *slice)
+{
+	uint64_t	h;
+	uint16_t	flags;
+
+	h = kr_audit_prefix(&kf->prefix, kf->prefixlen, slice);
+	flags = kf->flags & (F_BLACKHOLE|F_REJECT);
+	h = kr_audit_mix(h, &flags, sizeof(flags));
+	/* the gateway of blackhole and reject routes does not matter */
+	if (flags != 0)
+		return (h);
+	switch (kf->nexthop.aid) {
+	case AID_INET:
+		h = kr_audit_mix(h, &kf->nexthop.v4, sizeof(kf->nexthop.v4));
+		break;
+	case AID_INET6:
+		h = kr_audit_mix(h, &kf->nexthop.v6, sizeof(kf->nexthop.v6));
+		break;
+	}
+	return (h);
+}
+
+/*
+ * A route of ours from the kernel dump of the audited table.
+ */
+void
+kr_audit_kernel(struct kroute_full *kf)
+{
+	struct kr_audit_route	*ar;
+	uint64_t		 h;
+	u_int			 slice;
+
+	h = kr_audit_hash(kf, &slice);
+	if (!kraudit.collect) {
+		kraudit.kern[slice] += h;
+		return;
+	}
+	if (kraudit.kern[slice] == kraudit.rib[slice] || kraudit.dirty[slice])
+		return;
+	if ((ar = calloc(1, sizeof(*ar))) == NULL) {
+		log_warn("%s", __func__);
+		return;
+	}
+	ar->prefix = kf->prefix;
+	ar->prefixlen = kf->prefixlen;
+	ar->hash = h;
+	if (RB_INSERT(kr_audit_tree, &kraudittree, ar) != NULL)
+		free(ar);
+}
+
+/*
+ * A route of ours the RIB believes to be in the kernel.
+ */
+void
+kr_audit_rib(struct ktable *kt, struct kroute_full *kf)
+{
+	struct kr_audit_route	*ar, key;
+	uint64_t		 h;
+	u_int			 slice;
+
+	h = kr_audit_hash(kf, &slice);
+	if (!kraudit.collect) {
+		kraudit.rib[slice] += h;
+		return;
+	}
+	if (kraudit.kern[slice] == kraudit.rib[slice] || kraudit.dirty[slice])
+		return;
+
+	key.prefix = kf->prefix;
+	key.prefixlen = kf->prefixlen;
+	if ((ar = RB_FIND(kr_audit_tree, &kraudittree, &key)) != NULL) {
+		RB_REMOVE(kr_audit_tree, &kraudittree, ar);
+		h ^= ar->hash;
+		free(ar);
+		if (h == 0)
+			return;
+	}
+	/* missing or different, install it again */
+	kraudit.repair = 1;
+	if (send_rtmsg(RTM_CHANGE, kt, kf))
+		kraudit.repaired++;
+	kraudit.repair = 0;
+}
+
+/*
+ * A change of the audited table went to the kernel after it was dumped.
+ * Leave its slice alone this time.
+ */
+void
+kr_audit_dirty(u_int rtableid, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
+{
+	u_int	slice;
+
+	if (kraudit.state == KR_AUDIT_IDLE || kraudit.repair ||
+	    rtableid != kraudit.rtableid)
+		return;
+	kr_audit_prefix(prefix, prefixlen, &slice);
+	kraudit.dirty[slice] = 1;
+}
+
+/*
+ * Audit the next coupled table, round robin.
+ */
+void
+kr_audit(void)
+{
+	struct ktable	*kt;
+	u_int		 i, rid;
+
+	if (kraudit.state != KR_AUDIT_IDLE)
+		return;
+
+	for (i = 0; i < krt_size; i++) {
+		rid = (kraudit.next + i) % krt_size;
+		if ((kt = ktable_get(rid)) == NULL || !kt->fib_sync)
+			continue;
+		kraudit.next = rid + 1;
+		kr_audit_start(kt);
+		return;
+	}
+}
+
+/*
+ * Compare the routes of ours in the kernel with the ones the RIB holds
+ * as installed. The first pass over the dump only builds the slice
+ * digests, a second one is needed only if some slices differ. Routes of
+ * those slices are reinstalled if they are missing or different, the
+ * ones the RIB does not know about are reported. Both passes use the
+ * same dump, the slices of routes changed since are skipped.
+ */
+void
+kr_audit_start(struct ktable *kt)
+{
+	if (fetchtable_dump(kt, &kraudit.buf, &kraudit.len) == -1) {
+		log_warnx("audit of rtable %u failed", kt->rtableid);
+		return;
+	}
+
+	memset(kraudit.kern, 0, sizeof(kraudit.kern));
+	memset(kraudit.rib, 0, sizeof(kraudit.rib));
+	memset(kraudit.dirty, 0, sizeof(kraudit.dirty));
+	kraudit.rtableid = kt->rtableid;
+	kraudit.state = KR_AUDIT_KERN;
+	kraudit.off = 0;
+	kraudit.collect = 0;
+	kraudit.nslices = 0;
+	kraudit.orepaired = kraudit.repaired;
+	kraudit.ounknown = kraudit.unknown;
+	kraudit.runs++;
+	kr_audit_arm();
+}
+
+/*
+ * Come back to the audit once other events had their turn.
+ */
+void
+kr_audit_arm(void)
+{
+	struct kevent	ev;
+
+	EV_SET(&ev, KR_KQ_AUDIT_STEP, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0,
+	    0, NULL);
+	if (kevent(kr_state.kq, &ev, 1, NULL, 0, NULL) == -1) {
+		log_warn("%s: kevent", __func__);
+		kr_audit_end(0);
+	}
+}
+
+/*
+ * The audited table if it is still around and coupled, else the audit
+ * is given up.
+ */
+struct ktable *
+kr_audit_table(void)
+{
+	struct ktable	*kt;
+
+	if ((kt = ktable_get(kraudit.rtableid)) == NULL || !kt->fib_sync) {
+		kr_audit_end(0);
+		return (NULL);
+	}
+	return (kt);
+}
+
+/*
+ * Do KR_AUDIT_BUDGET ms worth of the audit.
+ */
+void
+kr_audit_step(void)
+{
+	struct ktable	*kt;
+	struct timespec	 deadline, budget;
+	u_int		 i;
+
+	if (kraudit.state == KR_AUDIT_IDLE || (kt = kr_audit_table()) == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	budget.tv_sec = KR_AUDIT_BUDGET / 1000;
+	budget.tv_nsec = (KR_AUDIT_BUDGET % 1000) * 1000000;
+	timespecadd(&deadline, &budget, &deadline);
+
+	if (kraudit.state == KR_AUDIT_KERN) {
+		if (!kr_audit_parse(&deadline)) {
+			kr_audit_arm();
+			return;
+		}
+		kraudit.state = KR_AUDIT_RIB;
+		kraudit.aid = AID_INET;
+		kraudit.resume = 0;
+	}
+	if (!kr_audit_walk(kt, &deadline)) {
+		kr_audit_arm();
+		return;
+	}
+
+	if (kraudit.collect) {
+		kr_audit_end(1);
+		return;
+	}
+	for (i = 0; i < KR_AUDIT_SLICES; i++)
+		if (kraudit.kern[i] != kraudit.rib[i] && !kraudit.dirty[i])
+			kraudit.nslices++;
+	if (kraudit.nslices == 0) {
+		kr_audit_end(1);
+		return;
+	}
+	kraudit.slices += kraudit.nslices;
+
+	/* go over the dump again, collecting the routes of those slices */
+	kraudit.collect = 1;
+	kraudit.state = KR_AUDIT_KERN;
+	kraudit.off = 0;
+	kr_audit_arm();
+}
+
+/*
+ * Parse the dump until the deadline, returns 1 once it is done.
+ */
+int
+kr_audit_parse(const struct timespec *deadline)
+{
+	struct rt_msghdr	*rtm;
+	struct kroute_full	 kf;
+	struct timespec		 now;
+	u_int			 n = 0;
+
+	while (kraudit.off < kraudit.len) {
+		if (++n % KR_AUDIT_CHECK == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespeccmp(&now, deadline, >=))
+				return (0);
+		}
+		rtm = (struct rt_msghdr *)(kraudit.buf + kraudit.off);
+		if (rtm->rtm_msglen == 0)
+			break;
+		kraudit.off += rtm->rtm_msglen;
+		if (rtm->rtm_version != RTM_VERSION)
+			continue;
+		if (dispatch_rtmsg_addr(rtm, &kf) == -1)
+			continue;
+		if (kf.priority == RTP_MINE)
+			kr_audit_kernel(&kf);
+	}
+	return (1);
+}
+
+/*
+ * Walk the RIB side until the deadline, resuming where the last pass
+ * stopped. Returns 1 once both trees are done.
+ */
+int
+kr_audit_walk(struct ktable *kt, const struct timespec *deadline)
+{
+	struct kroute	*kr, *krn;
+	struct kroute6	*kr6, *kr6n;
+	struct timespec	 now;
+	u_int		 n = 0;
+
+	while (kraudit.aid == AID_INET) {
+		if (++n % KR_AUDIT_CHECK == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespeccmp(&now, deadline, >=))
+				return (0);
+		}
+		if (kraudit.resume)
+			kr = RB_NFIND(kroute_tree, &kt->krt, &kraudit.cur);
+		else
+			kr = RB_MIN(kroute_tree, &kt->krt);
+		if (kr == NULL) {
+			kraudit.aid = AID_INET6;
+			kraudit.resume = 0;
+			break;
+		}
+		if ((krn = RB_NEXT(kroute_tree, &kt->krt, kr)) == NULL)
+			kraudit.aid = AID_INET6;
+		else
+			kraudit.cur = *krn;
+		kraudit.resume = krn != NULL;
+
+		if (kr->priority == RTP_MINE && kr->flags & F_BGPD_INSERTED)
+			kr_audit_rib(kt, kr_tofull(kr));
+	}
+
+	while (kraudit.aid == AID_INET6) {
+		if (++n % KR_AUDIT_CHECK == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespeccmp(&now, deadline, >=))
+				return (0);
+		}
+		if (kraudit.resume)
+			kr6 = RB_NFIND(kroute6_tree, &kt->krt6, &kraudit.cur6);
+		else
+			kr6 = RB_MIN(kroute6_tree, &kt->krt6);
+		if (kr6 == NULL) {
+			kraudit.aid = AID_UNSPEC;
+			break;
+		}
+		if ((kr6n = RB_NEXT(kroute6_tree, &kt->krt6, kr6)) == NULL)
+			kraudit.aid = AID_UNSPEC;
+		else
+			kraudit.cur6 = *kr6n;
+		kraudit.resume = kr6n != NULL;
+
+		if (kr6->priority == RTP_MINE &&
+		    kr6->flags & F_BGPD_INSERTED)
+			kr_audit_rib(kt, kr6_tofull(kr6));
+	}
+	return (1);
+}
+
+/*
+ * Finish the audit. If it went through, the collected routes left over
+ * are the ones the RIB does not have.
+ */
+void
+kr_audit_end(int done)
+{
+	struct kr_audit_route	*ar;
+	struct ktable		*kt;
+	struct kroute_full	 kf;
+	u_int			 slice;
+
+	if (kraudit.state == KR_AUDIT_IDLE)
+		return;
+	kt = ktable_get(kraudit.rtableid);
+
+	while ((ar = RB_MIN(kr_audit_tree, &kraudittree)) != NULL) {
+		RB_REMOVE(kr_audit_tree, &kraudittree, ar);
+		kr_audit_prefix(&ar->prefix, ar->prefixlen, &slice);
+		if (done && kt != NULL && !kraudit.dirty[slice]) {
+			kraudit.unknown++;
+			log_debug("%s: rtable %u: unknown route %s/%u",
+			    __func__, kraudit.rtableid,
+			    log_addr(&ar->prefix), ar->prefixlen);
+			if (KR_AUDIT_REMOVE) {
+				memset(&kf, 0, sizeof(kf));
+				kf.prefix = ar->prefix;
+				kf.prefixlen = ar->prefixlen;
+				kf.flags = F_BGPD;
+				kraudit.repair = 1;
+				send_rtmsg(RTM_DELETE, kt, &kf);
+				kraudit.repair = 0;
+			}
+		}
+		free(ar);
+	}
+	free(kraudit.buf);
+	kraudit.buf = NULL;
+	kraudit.len = 0;
+	kraudit.state = KR_AUDIT_IDLE;
+	kraudit.collect = 0;
+
+	if (done && kraudit.nslices != 0)
+		log_info("audit of rtable %u: %u slices diverged, %llu routes "
+		    "reinstalled, %llu unknown%s", kraudit.rtableid,
+		    kraudit.nslices,
+		    (unsigned long long)(kraudit.repaired - kraudit.orepaired),
+		    (unsigned long long)(kraudit.unknown - kraudit.ounknown),
+		    KR_AUDIT_REMOVE ? " removed" : "");
+}
+
+void
+kr_audit_log(void)
+{
+	log_debug("fib audit: %llu runs, %llu slices diverged, %llu routes "
+	    "reinstalled, %llu unknown", (unsigned long long)kraudit.runs,
+	    (unsigned long long)kraudit.slices,
+	    (unsigned long long)kraudit.repaired,
+	    (unsigned long long)kraudit.unknown);
+}
+
+/*
+ * The counters do not fit into the control replies, they are logged on
+ * shutdown for debugging.
+ */
+void
+kr_stats_log(void)
+{
+	log_debug("fib: %llu no-op changes suppressed",
+	    (unsigned long long)kr_state.suppressed);
+	kr_audit_log();
+}
+
 int
 fetchifs(int ifindex)
 {
@@ -3031,12 +4094,13 @@ kr_fib_change(struct ktable *kt, struct kroute_full *kf, int type, int mpath)
 				if (kr->flags & F_NEXTHOP)
 					flags |= F_NEXTHOP;
 
-				new_labelid = rtlabel_name2id(kf->label);
+				new_labelid = kr_label_ref(kf->label);
 				if (kr->labelid != new_labelid) {
-					rtlabel_unref(kr->labelid);
+					kr_label_unref(kr->labelid);
 					kr->labelid = new_labelid;
 					rtlabel_changed = 1;
-				}
+				} else
+					kr_label_unref(new_labelid);
 
 				oflags = kr->flags;
 				if (flags != oflags)
@@ -3103,12 +4167,13 @@ add4:
 				if (kr6->flags & F_NEXTHOP)
 					flags |= F_NEXTHOP;
 
-				new_labelid = rtlabel_name2id(kf->label);
+				new_labelid = kr_label_ref(kf->label);
 				if (kr6->labelid != new_labelid) {
-					rtlabel_unref(kr6->labelid);
+					kr_label_unref(kr6->labelid);
 					kr6->labelid = new_labelid;
 					rtlabel_changed = 1;
-				}
+				} else
+					kr_label_unref(new_labelid);
 
 				oflags = kr6->flags;
 				if (flags != oflags)
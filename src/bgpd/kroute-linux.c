@@ -21,27 +21,188 @@
 #include <sys/types.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <stddef.h>
 #include <ifaddrs.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "bgpd.h"
 #include "log.h"
 
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
+#include <linux/filter.h>
 #include <linux/if.h>
+#ifdef HAVE_LINUX_NEXTHOP_H
+#include <linux/nexthop.h>
+#endif
 
 #define	RTP_ANY		0x0
 #define	RTP_MINE	0xff
 
+/*
+ * Route messages are packed into one buffer and sent with a single
+ * sendmsg(2). Only the last message of a batch requests an ACK, errors
+ * are reported by the kernel for every failing message anyway.
+ */
+#ifndef KR_BATCH_SIZE
+#define	KR_BATCH_SIZE		(64 * 1024)
+#endif
+#ifndef KR_MAX_INFLIGHT
+#define	KR_MAX_INFLIGHT		8192	/* unacknowledged route messages */
+#endif
+#define	KR_INFLIGHT_TIMEOUT	5000	/* ms to wait for outstanding ACKs */
+#ifndef KR_MAX_MPATH
+#define	KR_MAX_MPATH		16	/* paths per multipath route */
+#endif
+#ifndef KR_FILTER
+#define	KR_FILTER		1	/* 0 disables the socket filter */
+#endif
+#ifndef KR_FILTER_MAXTABLES
+#define	KR_FILTER_MAXTABLES	64	/* tables checked by socket filter */
+#endif
+#ifndef KR_WRITER_RING
+#define	KR_WRITER_RING		16	/* batches handed to the writer */
+#endif
+#define	KR_WRITER_DONE		(KR_MAX_INFLIGHT + 2 * KR_WRITER_RING)
+#ifndef KR_RCVBUF_SIZE
+#define	KR_RCVBUF_SIZE		(32 * 1024 * 1024)
+#endif
+
+/*
+ * Route changes from the RDE are held back for a short time so that a
+ * prefix changing several times only results in one kernel update.
+ * There is no bgpd.conf knob for the limits, they are set at build
+ * time. A delay of 0 sends the changes on the next event loop pass.
+ */
+#ifndef KR_QUEUE_DELAY
+#define	KR_QUEUE_DELAY		50	/* ms before pending changes are sent */
+#endif
+#ifndef KR_QUEUE_MAX
+#define	KR_QUEUE_MAX		10000	/* pending changes forcing a flush */
+#endif
+
+/*
+ * Coupling, decoupling and flushing a table walk all its routes. This is
+ * done in slices of KR_WALK_BUDGET ms so the parent stays responsive.
+ */
+#ifndef KR_WALK_BUDGET
+#define	KR_WALK_BUDGET		10	/* ms of work per event loop pass */
+#endif
+#define	KR_WALK_CHECK		64	/* routes between clock checks */
+
+/*
+ * With KR_ADOPT our routes stay in the kernel on shutdown. Routes left
+ * in the kernel by a previous run are taken over when a table is loaded
+ * and removed if the RDE did not announce them again in time.
+ */
+#ifndef KR_ADOPT
+#define	KR_ADOPT		0
+#endif
+#ifndef KR_STALE_TIME
+#define	KR_STALE_TIME		300	/* sec until stale routes are removed */
+#endif
+
+/*
+ * Optionally routes are only entered into the FIB once the RIB settled
+ * at startup, that is no new route showed up for KR_FIB_HOLD_QUIET
+ * seconds, but at most for KR_FIB_HOLD seconds. 0 disables it.
+ */
+#ifndef KR_FIB_HOLD
+#define	KR_FIB_HOLD		0	/* sec, max hold time */
+#endif
+#ifndef KR_FIB_HOLD_QUIET
+#define	KR_FIB_HOLD_QUIET	5
+#endif
+
+/*
+ * Our routes in the kernel are audited against the RIB, one table every
+ * KR_AUDIT_INTERVAL seconds. Routes are hashed into KR_AUDIT_SLICES
+ * slices by prefix, only slices with differing digests are repaired.
+ * The dump is read and the RIB walked in KR_WALK_BUDGET slices. Routes
+ * of ours the RIB does not know are only reported unless KR_AUDIT_REMOVE
+ * is set.
+ */
+#ifndef KR_AUDIT_INTERVAL
+#define	KR_AUDIT_INTERVAL	60	/* sec between audits, 0 disables */
+#endif
+#ifndef KR_AUDIT_REMOVE
+#define	KR_AUDIT_REMOVE		0
+#endif
+#define	KR_AUDIT_SLICES		256
+
+/*
+ * FIB aggregation keeps routes of ours out of the kernel if the next
+ * shorter prefix covering them forwards the same way. Only sole routes
+ * of a prefix covered by a sole route of ours are considered, so the
+ * kernel lookup falls through to exactly that route.
+ */
+#ifndef KR_FIB_AGGREGATE
+#define	KR_FIB_AGGREGATE	0	/* 1 suppresses redundant routes */
+#endif
+
+/*
+ * Interfaces are looked up by ifindex for every route validated and by
+ * name for every session depend on check. Next to the tree, used for
+ * ordered walks, keep an array indexed by ifindex and a name hash.
+ */
+#ifndef KR_KIF_BUCKETS
+#define	KR_KIF_BUCKETS		1024	/* name hash buckets, power of 2 */
+#endif
+
+/*
+ * Every link bounce makes the RDE withdraw and reannounce all prefixes
+ * using nexthops on that link. Link down is applied at once, link up
+ * only once the link stayed up for a hold down time. It doubles with
+ * every flap up to KR_LINK_HOLD_MAX and halves for every KR_LINK_DECAY
+ * seconds without one. A KR_LINK_HOLD of 0 disables the dampening.
+ * There is no bgpd.conf knob for these, they are set at build time.
+ */
+#ifndef KR_LINK_HOLD
+#define	KR_LINK_HOLD		1	/* sec, hold down after a flap */
+#endif
+#ifndef KR_LINK_HOLD_MAX
+#define	KR_LINK_HOLD_MAX	64
+#endif
+#ifndef KR_LINK_DECAY
+#define	KR_LINK_DECAY		30
+#endif
+
+/* timers, each one is a timerfd on the epoll fd returned by kr_init() */
+enum kr_timer {
+	KR_TIMER_QUEUE,
+	KR_TIMER_WALK,
+	KR_TIMER_STALE,
+	KR_TIMER_HOLD,
+	KR_TIMER_AUDIT,
+	KR_TIMER_NEXTHOP,
+	KR_TIMER_LINK,
+	KR_TIMER_AUDIT_WALK,
+	KR_TIMER_MAX
+};
+#define	KR_EV_NETLINK		KR_TIMER_MAX
+#define	KR_EV_WRITER		(KR_TIMER_MAX + 1)
+#define	KR_EV_AUDIT		(KR_TIMER_MAX + 2)
+
 enum {
 	RTM_ADD=1,
 	RTM_CHANGE,
 	RTM_DELETE,
+	RTM_NH_CHANGE,
+	RTM_NH_DELETE,
 };
 
 enum {
@@ -52,50 +213,398 @@ enum {
 
 struct ktable		**krt;
 u_int			  krt_size;
+struct kr_lpm		 *krlpm;		/* indexed like krt */
+struct kr_netidx	 *krnetidx;		/* indexed like krt */
+
+#ifndef KR_POOL_CHUNK
+#define	KR_POOL_CHUNK		(64 * 1024)	/* bytes per pool chunk */
+#endif
+#define	KR_POOL_ALIGN(x)	(((x) + sizeof(void *) - 1) &	\
+				    ~(sizeof(void *) - 1))
+#define	KR_POOL_HDR		(2 * sizeof(void *))	/* keep alignment */
+
+/*
+ * Fixed size object pool. Objects are carved out of large chunks which
+ * are kept until shutdown, freed objects go on a free list for reuse.
+ */
+struct kr_pool {
+	const char		*name;
+	void			*chunks;
+	void			*freelist;
+	size_t			 size;
+	size_t			 inuse;
+	size_t			 nchunks;
+};
+
+#define	KR_POOL_INITIALIZER(n, t)	\
+	{ (n), NULL, NULL, KR_POOL_ALIGN(sizeof(t)), 0, 0 }
+
+struct kr_inflight {
+	struct bgpd_addr	prefix;
+	u_int			rtableid;
+	uint32_t		seq;
+	uint32_t		nhid;
+	uint8_t			prefixlen;
+	uint8_t			action;
+};
+
+/*
+ * Route messages are written by a thread with its own netlink socket so
+ * the parent never waits for the kernel. Finished batches are passed on
+ * through a single producer, single consumer ring. ACKs and errors come
+ * back the same way, an eventfd in the epoll set wakes up the parent.
+ */
+struct kr_wbatch {
+	char			*buf;
+	size_t			 len;		/* 0 stops the writer */
+	uint32_t		 lastseq;
+};
+
+struct kr_wdone {
+	uint32_t		 seq;
+	int			 error;
+	uint8_t			 batch;		/* failed up to seq */
+	uint8_t			 lost;		/* replies were lost */
+};
+
+struct {
+	struct mnl_socket	*nl;
+	struct kr_wbatch	 ring[KR_WRITER_RING];
+	struct kr_wdone		*done;
+	pthread_t		 thread;
+	atomic_size_t		 head;		/* written by the parent */
+	atomic_size_t		 tail;		/* written by the writer */
+	atomic_size_t		 dhead;		/* written by the writer */
+	size_t			 dtail;
+	uint32_t		 pid;
+	uint32_t		 lastseq;	/* of the last batch retired */
+	int			 wakefd;
+	int			 donefd;
+} krw;
 
 struct {
 	struct mnl_socket	*nl;
+	char			*batch;
+	struct kr_inflight	*inflight;	/* ring ordered by seq */
+	size_t			batchlen;
+	size_t			batchlast;	/* offset of last message */
+	u_int			batchcnt;	/* messages in batch */
+	u_int			inflight_head;
+	u_int			inflight_cnt;
 	uint32_t		pid;
 	uint32_t		nlmsg_seq;
 	uint32_t		query_seq;
+	uint32_t		nhid_next;
+	struct ktable		*shadow;	/* table being resynced */
+	u_int			dump_msgs;
+	u_int			dump_skipped;
 	uint8_t			fib_prio;
+	uint8_t			nhobj;	/* kernel supports nexthop objects */
+	uint8_t			nhdump;	/* see fetchnexthops() */
+	uint8_t			nhwalk;	/* see knexthop_obj_walk() */
+	uint8_t			resync;	/* kernel messages were lost */
+	uint8_t			strict;	/* kernel filters dumps */
+	uint8_t			dump_proto;
+	uint8_t			adopt;	/* take over our routes in dumps */
+	uint8_t			keep;	/* leave our routes on shutdown */
+	uint8_t			fib_hold;	/* initial sync held back */
+	uint64_t		hold_routes;	/* held back so far */
+	uint64_t		hold_seen;	/* at the last hold timer */
+	struct timespec		hold_start;
+	int			epfd;
+	int			timerfd[KR_TIMER_MAX];
+	uint8_t			timer_armed[KR_TIMER_MAX];
+	size_t			queue_len;	/* pending route changes */
+	struct knexthop_obj	*nhdead;	/* released while queued */
+	uint64_t		queue_puts;
+	uint64_t		queue_coalesced;
+	uint64_t		queue_cancelled;
+	uint64_t		fib_writes;
+	uint64_t		fib_suppressed;	/* changes not touching the FIB */
+	uint64_t		nh_updates;
+	uint64_t		nh_coalesced;
+	uint64_t		nh_sent;	/* updates sent to the RDE */
+	size_t			stale_len;	/* routes waiting for the RDE */
+	uint64_t		stale_adopted;
+	uint64_t		stale_refreshed;
+	uint64_t		stale_swept;
+	size_t			agg_len;	/* routes suppressed */
+	uint64_t		agg_suppressed;
+	uint64_t		agg_restored;
+	struct timespec		reload_start;
+	int			nh_policy;	/* see kr_nexthop_policy() */
 } kr_state;
 
+/*
+ * The tree links and the fields used by the tree compare and nexthop
+ * validation come first to share a cache line, rarely used ones last.
+ */
 struct kroute {
 	RB_ENTRY(kroute)	 entry;
-	struct kroute		*next;
 	struct in_addr		 prefix;
-	struct in_addr		 nexthop;
-	uint32_t		 mplslabel;
-	uint16_t		 flags;
-	uint16_t		 labelid;
-	u_short			 ifindex;
 	uint8_t			 prefixlen;
 	uint8_t			 priority;
+	uint16_t		 flags;
+	struct in_addr		 nexthop;
+	u_short			 ifindex;
+	uint16_t		 labelid;
+	struct kroute		*next;
+	LIST_HEAD(, knexthop)	 nexthops;	/* resolving via this route */
+	uint32_t		 nhid;		/* kernel nexthop object */
+	uint32_t		 mplslabel;
 };
 
 struct kroute6 {
 	RB_ENTRY(kroute6)	 entry;
-	struct kroute6		*next;
 	struct in6_addr		 prefix;
-	struct in6_addr		 nexthop;
 	uint32_t		 prefix_scope_id;	/* because ... */
-	uint32_t		 nexthop_scope_id;
-	uint32_t		 mplslabel;
-	uint16_t		 flags;
-	uint16_t		 labelid;
-	u_short			 ifindex;
 	uint8_t			 prefixlen;
 	uint8_t			 priority;
+	uint16_t		 flags;
+	u_short			 ifindex;
+	uint16_t		 labelid;
+	uint32_t		 nhid;		/* kernel nexthop object */
+	struct in6_addr		 nexthop;
+	uint32_t		 nexthop_scope_id;
+	uint32_t		 mplslabel;
+	struct kroute6		*next;
+	LIST_HEAD(, knexthop)	 nexthops;	/* resolving via this route */
 };
 
 struct knexthop {
 	RB_ENTRY(knexthop)	 entry;
+	LIST_ENTRY(knexthop)	 krentry;	/* on kroute->nexthops */
+	LIST_ENTRY(knexthop)	 ifentry;	/* on knexthop_if->nexthops */
+	TAILQ_ENTRY(knexthop)	 upentry;	/* on knupdates */
 	struct bgpd_addr	 nexthop;
 	void			*kroute;
+	struct knexthop_obj	*nhobj;
+	struct knexthop_if	*ifb;
+	u_short			 ifindex;
+	uint8_t			 update;	/* on knupdates */
+};
+
+/* nexthops with an update for the RDE, sent once per event loop pass */
+TAILQ_HEAD(, knexthop)		knupdates = TAILQ_HEAD_INITIALIZER(knupdates);
+
+/*
+ * Nexthops of a nexthop table resolving over an interface, so that
+ * link state changes only revalidate the nexthops actually affected.
+ */
+struct knexthop_if {
+	RB_ENTRY(knexthop_if)	 entry;
+	LIST_HEAD(, knexthop)	 nexthops;
+	u_int			 rtableid;	/* nexthop table */
 	u_short			 ifindex;
 };
 
+/*
+ * Kernel nexthop group used by the routes resolving via a knexthop, with
+ * one member per path of the route the nexthop resolves over. If the
+ * nexthop moves only the group needs to be replaced.
+ */
+struct knexthop_obj {
+	RB_ENTRY(knexthop_obj)	 entry;
+	RB_ENTRY(knexthop_obj)	 aentry;	/* on knhadopt */
+	struct bgpd_addr	 gateway;	/* member only */
+	struct knexthop_obj	*members;	/* group only */
+	struct knexthop_obj	*next;		/* next member of the group */
+	struct knexthop_obj	*dead;		/* on kr_state.nhdead */
+	uint32_t		 id;
+	int			 refcnt;
+	u_short			 ifindex;	/* member only */
+	uint8_t			 installed;
+	uint8_t			 noobj;		/* refused, gateways inline */
+	uint8_t			 adopted;	/* left by a previous run */
+	uint8_t			 lost;		/* see knexthop_obj_walk() */
+	uint8_t			 resend;
+};
+
+/* groups of a previous run, linked up once fetchnexthops() is done */
+struct knexthop_dump {
+	SLIST_ENTRY(knexthop_dump)	 entry;
+	uint32_t			 id;
+	int				 n;
+	uint32_t			 ids[KR_MAX_MPATH];
+};
+
+/*
+ * Incremental walk over the routes of a table. The cursor holds the key
+ * of the next route to visit, routes may come and go in between.
+ */
+enum kr_walk_type {
+	KR_WALK_COUPLE,
+	KR_WALK_DECOUPLE,
+	KR_WALK_FLUSH,
+};
+
+struct kr_walk {
+	TAILQ_ENTRY(kr_walk)	 entry;
+	struct kroute		 cur;
+	struct kroute6		 cur6;
+	size_t			 visited;
+	size_t			 sent;
+	u_int			 rtableid;
+	enum kr_walk_type	 type;
+	uint8_t			 aid;		/* tree being walked */
+	uint8_t			 resume;	/* cursor is valid */
+};
+
+TAILQ_HEAD(, kr_walk)		krwalks = TAILQ_HEAD_INITIALIZER(krwalks);
+
+/*
+ * Route change waiting to be sent to the kernel, last one wins.
+ */
+struct kr_pending {
+	RB_ENTRY(kr_pending)	 entry;
+	struct kroute_full	 kf;
+	u_int			 rtableid;
+	uint32_t		 nhid;		/* reference held */
+	int			 action;
+	uint8_t			 inkernel;	/* route was in the FIB before */
+};
+
+/*
+ * Route of a previous run taken over from the kernel, not yet announced
+ * by the RDE. The kroute itself is in the table like any other one.
+ */
+struct kr_stale {
+	RB_ENTRY(kr_stale)	 entry;
+	struct bgpd_addr	 prefix;
+	u_int			 rtableid;
+	uint8_t			 prefixlen;
+};
+
+/*
+ * Route of ours suppressed by FIB aggregation, it forwards like the route
+ * covering it. The kroute itself is in the table but not inserted.
+ */
+struct kr_agg {
+	RB_ENTRY(kr_agg)	 entry;
+	struct bgpd_addr	 prefix;
+	u_int			 rtableid;
+	uint8_t			 prefixlen;
+};
+
+/*
+ * Digests of our routes per slice, one built from a kernel dump and one
+ * from the RIB. Routes of diverged slices are collected from a second
+ * dump into a tree and compared one by one. The audit runs alongside
+ * the route queue, slices of routes changed meanwhile are left out.
+ */
+struct kr_audit_route {
+	RB_ENTRY(kr_audit_route) entry;
+	struct bgpd_addr	 prefix;
+	uint64_t		 hash;
+	uint8_t			 prefixlen;
+};
+
+enum kr_audit_state {
+	KR_AUDIT_IDLE,
+	KR_AUDIT_DUMP,		/* reading the kernel dump */
+	KR_AUDIT_RIB,		/* walking the RIB */
+};
+
+struct kr_audit {
+	uint64_t		 kern[KR_AUDIT_SLICES];
+	uint64_t		 rib[KR_AUDIT_SLICES];
+	uint8_t			 dirty[KR_AUDIT_SLICES];
+	struct mnl_socket	*nl;		/* dumps are read from here */
+	struct kroute		 cur;		/* RIB cursor, see kr_walk */
+	struct kroute6		 cur6;
+	enum kr_audit_state	 state;
+	u_int			 rtableid;	/* table being audited */
+	u_int			 next;		/* next table to audit */
+	u_int			 nslices;
+	uint32_t		 seq;		/* of the running dump */
+	int			 af;		/* family being dumped */
+	uint8_t			 aid;		/* tree being walked */
+	uint8_t			 resume;	/* cursor is valid */
+	uint8_t			 collect;	/* second dump */
+	uint8_t			 intr;		/* dump was interrupted */
+	uint8_t			 repair;	/* our own changes */
+	uint64_t		 orepaired;
+	uint64_t		 ounknown;
+	uint64_t		 runs;
+	uint64_t		 slices;	/* diverged slices */
+	uint64_t		 repaired;	/* routes reinstalled */
+	uint64_t		 unknown;	/* routes the RIB does not have */
+} kraudit;
+
+/*
+ * Path-compressed binary trie over the prefixes of a table, used for
+ * longest prefix matches. Nodes only record that routes for the prefix
+ * exist, the routes themselves are looked up in the RB trees. Nodes
+ * with a refcnt of 0 are glue nodes where two branches split. The
+ * stride is one bit, a match still costs an RB lookup per covering
+ * prefix but no longer one per possible prefix length.
+ */
+struct kr_lpm_node {
+	struct kr_lpm_node	*child[2];
+	uint8_t			 addr[16];
+	uint32_t		 refcnt;	/* routes with this prefix */
+	uint8_t			 prefixlen;
+};
+
+struct kr_lpm {
+	struct kr_lpm_node	*root4;
+	struct kr_lpm_node	*root6;
+};
+
+/*
+ * Index over the networks of a table, kt->krn. Reloads look networks up
+ * by their full key, redistribution only visits the networks whose type
+ * and match value fit the kernel route. seq follows the order of kt->krn
+ * so that the first matching network still wins.
+ */
+struct kr_net_node {
+	RB_ENTRY(kr_net_node)	 entry;		/* on kr_netidx.nets */
+	RB_ENTRY(kr_net_node)	 mentry;	/* on kr_netidx.match */
+	struct network		*n;
+	uint64_t		 seq;
+	uint16_t		 value;		/* rtlabel or priority */
+	uint8_t			 aid;
+	uint8_t			 type;
+	uint8_t			 reload;	/* new or changed */
+};
+
+/*
+ * Network rule added, changed or removed by a reload. Only routes the
+ * rule can match are redistributed again by kr_reload().
+ */
+struct kr_net_dirty {
+	SLIST_ENTRY(kr_net_dirty) entry;
+	uint64_t		 rd;
+	uint16_t		 value;		/* rtlabel or priority */
+	uint8_t			 aid;
+	uint8_t			 type;
+	uint8_t			 removed;
+};
+
+RB_HEAD(kr_net_tree, kr_net_node);
+RB_HEAD(kr_net_match_tree, kr_net_node);
+
+struct kr_netidx {
+	struct kr_net_tree	 nets;
+	struct kr_net_match_tree match;
+	SLIST_HEAD(, kr_net_dirty) dirty;
+	uint64_t		 seq;
+};
+
+/*
+ * Route from a kernel dump, used to resync a table after lost messages.
+ */
+struct kr_shadow {
+	RB_ENTRY(kr_shadow)	 entry;
+	struct kroute_full	 kf;
+};
+
+#define	KR_SAMEPATH(a, b)						\
+	(kr_addr_compare(&(a)->nexthop, &(b)->nexthop) == 0 &&		\
+	(a)->ifindex == (b)->ifindex &&					\
+	((a)->flags & (F_CONNECTED|F_BLACKHOLE|F_REJECT|F_STATIC)) ==	\
+	((b)->flags & (F_CONNECTED|F_BLACKHOLE|F_REJECT|F_STATIC)))
+
 struct kredist_node {
 	RB_ENTRY(kredist_node)	 entry;
 	struct bgpd_addr	 prefix;
@@ -106,6 +615,7 @@ struct kredist_node {
 
 struct kif {
 	RB_ENTRY(kif)		 entry;
+	LIST_ENTRY(kif)		 nentry;	/* name hash */
 	char			 ifname[IFNAMSIZ];
 	uint64_t		 baudrate;
 	u_int			 rdomain;
@@ -115,21 +625,48 @@ struct kif {
 	uint8_t			 link_state;
 	uint8_t			 nh_reachable;	/* for nexthop verification */
 	uint8_t			 depend_state;	/* for session depend on */
+	uint8_t			 held;		/* link up held down */
+	LIST_ENTRY(kif)		 hentry;
+	time_t			 held_until;
+	time_t			 last_flap;
+	u_int			 hold;		/* sec, current hold down */
+	u_int			 flaps;
 };
 
+struct kr_pool	kroute_pool = KR_POOL_INITIALIZER("kroute", struct kroute);
+struct kr_pool	kroute6_pool = KR_POOL_INITIALIZER("kroute6", struct kroute6);
+struct kr_pool	knexthop_pool = KR_POOL_INITIALIZER("knexthop",
+		    struct knexthop);
+struct kr_pool	kif_pool = KR_POOL_INITIALIZER("kif", struct kif);
+struct kr_pool	kr_lpm_pool = KR_POOL_INITIALIZER("lpm", struct kr_lpm_node);
+struct kr_pool	kr_pending_pool = KR_POOL_INITIALIZER("pending",
+		    struct kr_pending);
+struct kr_pool	kr_stale_pool = KR_POOL_INITIALIZER("stale", struct kr_stale);
+struct kr_pool	kr_agg_pool = KR_POOL_INITIALIZER("aggregate", struct kr_agg);
+
+void	*kr_pool_get(struct kr_pool *);
+void	 kr_pool_put(struct kr_pool *, void *);
+void	 kr_pool_destroy(struct kr_pool *);
+void	 kr_pool_log(struct kr_pool *);
+void	 kr_stats_log(void);
+
 int	ktable_new(u_int, u_int, char *, int);
 void	ktable_free(u_int);
 void	ktable_destroy(struct ktable *);
 struct ktable	*ktable_get(u_int);
 
-int	kr4_change(struct ktable *, struct kroute_full *);
-int	kr6_change(struct ktable *, struct kroute_full *);
+int	kr4_change(struct ktable *, struct kroute_full *, uint32_t);
+int	kr6_change(struct ktable *, struct kroute_full *, uint32_t);
 #ifdef NOTYET
 int	krVPN4_change(struct ktable *, struct kroute_full *);
 int	krVPN6_change(struct ktable *, struct kroute_full *);
 #endif
 int	kr_net_match(struct ktable *, struct network_config *, uint16_t, int);
 struct network *kr_net_find(struct ktable *, struct network *);
+void	kr_net_insert(struct ktable *, struct network *);
+void	kr_net_remove(struct ktable *, struct network *);
+void	kr_net_dirty(struct ktable *, struct network *, int);
+size_t	kr_net_reeval(struct ktable *);
 void	kr_net_clear(struct ktable *);
 void	kr_redistribute(int, struct ktable *, struct kroute_full *);
 uint8_t	kr_priority(struct kroute_full *);
@@ -138,13 +675,25 @@ struct kroute_full *kr6_tofull(struct kroute6 *);
 int	kroute_compare(struct kroute *, struct kroute *);
 int	kroute6_compare(struct kroute6 *, struct kroute6 *);
 int	knexthop_compare(struct knexthop *, struct knexthop *);
+int	knexthop_obj_compare(struct knexthop_obj *, struct knexthop_obj *);
+int	knexthop_obj_adopt_compare(struct knexthop_obj *,
+	    struct knexthop_obj *);
+int	knexthop_if_compare(struct knexthop_if *, struct knexthop_if *);
 int	kredist_compare(struct kredist_node *, struct kredist_node *);
 int	kif_compare(struct kif *, struct kif *);
+int	kr_shadow_compare(struct kr_shadow *, struct kr_shadow *);
+int	kr_pending_compare(struct kr_pending *, struct kr_pending *);
+int	kr_stale_compare(struct kr_stale *, struct kr_stale *);
+int	kr_agg_compare(struct kr_agg *, struct kr_agg *);
+int	kr_net_compare(struct kr_net_node *, struct kr_net_node *);
+int	kr_net_match_compare(struct kr_net_node *, struct kr_net_node *);
+int	kr_audit_compare(struct kr_audit_route *, struct kr_audit_route *);
 
 struct kroute	*kroute_find(struct ktable *, const struct bgpd_addr *,
 		    uint8_t, uint8_t);
 struct kroute	*kroute_matchgw(struct kroute *, struct kroute_full *);
-int		 kroute_insert(struct ktable *, struct kroute_full *);
+int		 kroute_insert(struct ktable *, struct kroute_full *,
+		    uint32_t);
 int		 kroute_remove(struct ktable *, struct kroute_full *, int);
 void		 kroute_clear(struct ktable *);
 
@@ -154,26 +703,65 @@ struct kroute6	*kroute6_matchgw(struct kroute6 *, struct kroute_full *);
 void		 kroute6_clear(struct ktable *);
 
 struct knexthop	*knexthop_find(struct ktable *, struct bgpd_addr *);
+struct knexthop	*knexthop_first(struct ktable *, const struct bgpd_addr *,
+		    uint8_t);
+struct knexthop	*knexthop_next(struct ktable *, struct knexthop *,
+		    const struct bgpd_addr *, uint8_t);
 int		 knexthop_insert(struct ktable *, struct knexthop *);
 void		 knexthop_remove(struct ktable *, struct knexthop *);
 void		 knexthop_clear(struct ktable *);
 
+uint32_t	 knexthop_obj_get(struct knexthop *);
+struct knexthop_obj	*knexthop_obj_alloc(void);
+void		 knexthop_obj_update(struct knexthop *);
+void		 knexthop_obj_install(struct knexthop_obj *);
+void		 knexthop_obj_free(struct knexthop_obj *);
+void		 knexthop_obj_ref(uint32_t);
+void		 knexthop_obj_unref(uint32_t);
+void		 knexthop_obj_flush(u_short);
+void		 knexthop_obj_drop(u_short, uint32_t);
+void		 knexthop_obj_lost(uint32_t);
+void		 knexthop_obj_fallback(struct knexthop_obj *);
+void		 knexthop_obj_walk(void);
+void		 knexthop_obj_adopt_link(void);
+int		 knexthop_obj_adopted(void);
+uint32_t	 knexthop_obj_adopt_paths(struct kroute_full *, int);
+void		 knexthop_obj_claim(struct knexthop *);
+void		 knexthop_obj_adopt_end(void);
+
 struct kif	*kif_find(int);
+struct kif	*kif_find_name(const char *);
+void		 kif_rename(struct kif *, const char *);
 int		 kif_insert(struct kif *);
 int		 kif_remove(struct kif *);
 void		 kif_clear(void);
+void		 kif_link_flap(struct kif *);
+void		 kif_link_hold(struct kif *);
+void		 kif_link_release(void);
+static void	 kif_revalidate(struct kif *);
 
 int		 kroute_validate(struct kroute *);
 int		 kroute6_validate(struct kroute6 *);
-int		 knexthop_true_nexthop(struct ktable *, struct kroute_full *);
+int		 knexthop_true_nexthop(struct ktable *, struct kroute_full *,
+		    uint32_t *);
 void		 knexthop_validate(struct ktable *, struct knexthop *);
 void		 knexthop_track(struct ktable *, u_short);
+void		 knexthop_if_link(struct ktable *, struct knexthop *);
+void		 knexthop_if_unlink(struct knexthop *);
 void		 knexthop_update(struct ktable *, struct kroute_full *);
 void		 knexthop_send_update(struct knexthop *);
+void		 knexthop_update_flush(void);
+static void	 knexthop_report(struct knexthop *);
 struct kroute	*kroute_match(struct ktable *, struct bgpd_addr *, int);
 struct kroute6	*kroute6_match(struct ktable *, struct bgpd_addr *, int);
 void		 kroute_detach_nexthop(struct ktable *, struct knexthop *);
 
+int		 kr_lpm_insert(struct kr_lpm_node **, const void *, uint8_t);
+void		 kr_lpm_remove(struct kr_lpm_node **, const void *, uint8_t);
+int		 kr_lpm_match(struct kr_lpm_node *, const void *, uint8_t,
+		    uint8_t *);
+void		 kr_lpm_clear(struct kr_lpm_node *);
+
 uint8_t		prefixlen_classful(in_addr_t);
 static uint8_t	mask2prefixlen4(struct sockaddr_in *);
 static uint8_t	mask2prefixlen6(struct sockaddr_in6 *);
@@ -184,15 +772,85 @@ void		if_change(u_short, int, struct if_data *);
 #endif
 const char	*get_linkstate(uint8_t, int);
 
-int		send_rtmsg(int, struct ktable *, struct kroute_full *);
+int		send_rtmsg(int, struct ktable *, struct kroute_full *,
+		    uint32_t);
+int		send_rtmsg_now(int, struct ktable *, struct kroute_full *,
+		    uint32_t);
+void		kr_queue_put(int, struct ktable *, struct kroute_full *,
+		    uint32_t);
+struct kr_pending *kr_queue_find(u_int, const struct bgpd_addr *, uint8_t);
+void		kr_queue_flush(void);
+void		kr_queue_log(void);
+void		knexthop_obj_destroy(struct knexthop_obj *);
+struct kr_walk	*kr_walk_find(u_int);
+void		kr_walk_start(struct ktable *, enum kr_walk_type);
+int		kr_walk_run(struct kr_walk *, const struct timespec *);
+void		kr_walk_done(struct kr_walk *);
+void		kr_walk_free(struct kr_walk *);
+void		kr_walk_sync(u_int);
+void		kr_walk_timer(void);
+void		kr_walk_log(void);
+int		kr_stale_adopt(struct ktable *, struct kroute_full *, int,
+		    uint32_t);
+int		kr_stale_drop(u_int, const struct kroute_full *);
+void		kr_stale_sweep(void);
+void		kr_stale_log(void);
+void		kr_fib_hold_start(void);
+void		kr_fib_hold_timer(void);
+void		kr_fib_hold_end(const char *);
+int		kr_agg_find(u_int, const struct kroute_full *);
+void		kr_agg_update(struct ktable *, const struct bgpd_addr *,
+		    uint8_t);
+void		kr_agg_log(void);
+uint64_t	kr_audit_mix(uint64_t, const void *, size_t);
+uint64_t	kr_audit_hash(const struct kroute_full *, uint64_t, u_int *);
+uint64_t	kr_audit_gateway(const struct bgpd_addr *);
+void		kr_audit_kernel(struct kroute_full *, int, uint32_t);
+void		kr_audit_rib(struct ktable *, struct kroute_full *, uint32_t);
+uint64_t	kr_audit_prefix(const struct bgpd_addr *, uint8_t, u_int *);
+void		kr_audit_dirty(u_int, const struct bgpd_addr *, uint8_t);
+void		kr_audit(void);
+void		kr_audit_start(struct ktable *);
+struct ktable	*kr_audit_table(void);
+void		kr_audit_walk(void);
+void		kr_audit_dumped(void);
+void		kr_audit_end(int);
+void		kr_audit_log(void);
+int		kr_audit_request(void);
+void		kr_audit_dispatch(void);
+void		kr_timer_set(enum kr_timer, u_int);
+void		kr_timer_stop(enum kr_timer);
+void		kr_timer_fire(enum kr_timer);
+void		send_nhmsg(int, struct knexthop_obj *);
+int		fetchnexthops(void);
+void		kr_batch_flush(void);
+void		kr_inflight_wait(u_int);
+int		kr_writer_wait(int);
+void		kr_writer_reap(void);
+void		kr_writer_start(void);
+void		kr_writer_stop(void);
+void		kr_writer_done(void);
 int		dispatch_rtmsg(void);
-int		fetchtable(struct ktable *);
+int		fetchtable(struct ktable *, uint8_t);
+int		fetchtable_af(struct ktable *, int, uint8_t);
 int		fetchifs(int);
 int		dispatch_rtmsg_addr(const struct nlmsghdr *,
 		    const struct rtmsg *, const struct nlattr **,
 		    struct kroute_full *);
+int		dispatch_rtmsg_mpath(const struct rtmsg *,
+		    const struct nlattr *, const struct kroute_full *,
+		    struct kroute_full *);
 int		kr_fib_delete(struct ktable *, struct kroute_full *, int);
 int		kr_fib_change(struct ktable *, struct kroute_full *, int, int);
+int		kr_fib_mpath(struct ktable *, struct kroute_full *, int, int);
+int		kr_fib_haspath(struct ktable *, struct kroute_full *);
+
+void		kr_filter_update(void);
+void		kr_resync(void);
+int		kr_resync_table(struct ktable *);
+int		kr_resync_samepaths(struct ktable *, struct kroute_full *, int);
+void		kr_shadow_update(int, struct kroute_full *, int);
+void		kr_shadow_clear(void);
 
 RB_PROTOTYPE(kroute_tree, kroute, entry, kroute_compare)
 RB_GENERATE(kroute_tree, kroute, entry, kroute_compare)
@@ -206,12 +864,89 @@ RB_GENERATE(knexthop_tree, knexthop, entry, knexthop_compare)
 RB_PROTOTYPE(kredist_tree, kredist_node, entry, kredist_compare)
 RB_GENERATE(kredist_tree, kredist_node, entry, kredist_compare)
 
+RB_HEAD(knexthop_obj_tree, knexthop_obj)	knhot;
+RB_PROTOTYPE(knexthop_obj_tree, knexthop_obj, entry, knexthop_obj_compare)
+RB_GENERATE(knexthop_obj_tree, knexthop_obj, entry, knexthop_obj_compare)
+SLIST_HEAD(, knexthop_dump)	knhdump;
+
+/* adopted groups by their members, see knexthop_obj_claim() */
+RB_HEAD(knexthop_adopt_tree, knexthop_obj)	knhadopt;
+RB_PROTOTYPE(knexthop_adopt_tree, knexthop_obj, aentry,
+    knexthop_obj_adopt_compare)
+RB_GENERATE(knexthop_adopt_tree, knexthop_obj, aentry,
+    knexthop_obj_adopt_compare)
+
+RB_HEAD(knexthop_if_tree, knexthop_if)	knift;
+RB_PROTOTYPE(knexthop_if_tree, knexthop_if, entry, knexthop_if_compare)
+RB_GENERATE(knexthop_if_tree, knexthop_if, entry, knexthop_if_compare)
+
 RB_HEAD(kif_tree, kif)		kit;
 RB_PROTOTYPE(kif_tree, kif, entry, kif_compare)
 RB_GENERATE(kif_tree, kif, entry, kif_compare)
 
+struct kif		**kifidx;	/* indexed by ifindex */
+u_int			  kifidx_size;
+LIST_HEAD(kif_head, kif) kifnames[KR_KIF_BUCKETS];
+struct kif_head		  kifheld;	/* link up held down */
+
+RB_HEAD(kr_shadow_tree, kr_shadow)	krshadow;
+RB_PROTOTYPE(kr_shadow_tree, kr_shadow, entry, kr_shadow_compare)
+RB_GENERATE(kr_shadow_tree, kr_shadow, entry, kr_shadow_compare)
+
+RB_HEAD(kr_pending_tree, kr_pending)	krpending;
+RB_PROTOTYPE(kr_pending_tree, kr_pending, entry, kr_pending_compare)
+RB_GENERATE(kr_pending_tree, kr_pending, entry, kr_pending_compare)
+
+RB_HEAD(kr_audit_tree, kr_audit_route)	kraudittree;
+RB_PROTOTYPE(kr_audit_tree, kr_audit_route, entry, kr_audit_compare)
+RB_GENERATE(kr_audit_tree, kr_audit_route, entry, kr_audit_compare)
+
+RB_HEAD(kr_stale_tree, kr_stale)	krstale;
+RB_PROTOTYPE(kr_stale_tree, kr_stale, entry, kr_stale_compare)
+RB_GENERATE(kr_stale_tree, kr_stale, entry, kr_stale_compare)
+
+RB_PROTOTYPE(kr_net_tree, kr_net_node, entry, kr_net_compare)
+RB_GENERATE(kr_net_tree, kr_net_node, entry, kr_net_compare)
+
+RB_PROTOTYPE(kr_net_match_tree, kr_net_node, mentry, kr_net_match_compare)
+RB_GENERATE(kr_net_match_tree, kr_net_node, mentry, kr_net_match_compare)
+
+RB_HEAD(kr_agg_tree, kr_agg)		kragg;
+RB_PROTOTYPE(kr_agg_tree, kr_agg, entry, kr_agg_compare)
+RB_GENERATE(kr_agg_tree, kr_agg, entry, kr_agg_compare)
+
 #define KT2KNT(x)	(&(ktable_get((x)->nhtableid)->knt))
 
+/*
+ * Most routes carry no route label. An empty label is always id 0, so
+ * skip the name2id lookups for it altogether.
+ */
+static inline uint16_t
+kr_label_ref(const char *label)
+{
+	if (label[0] == '\0')
+		return (0);
+	return (rtlabel_name2id(label));
+}
+
+static inline void
+kr_label_unref(uint16_t labelid)
+{
+	if (labelid != 0)
+		rtlabel_unref(labelid);
+}
+
+/* take the new reference first, the label may stay the same */
+static inline void
+kr_label_set(uint16_t *labelid, const char *label)
+{
+	uint16_t	id;
+
+	id = kr_label_ref(label);
+	kr_label_unref(*labelid);
+	*labelid = id;
+}
+
 /* seq num 0 is special, so skip it */
 static uint32_t
 kr_next_seq(void)
@@ -228,25 +963,146 @@ kr_next_seq(void)
 int
 kr_init(int *fd, uint8_t fib_prio)
 {
+	struct epoll_event	ev;
+	int			rcvbuf = KR_RCVBUF_SIZE, default_rcvbuf, opt;
+	int			i;
+	socklen_t		optlen;
+
 	kr_state.nl = mnl_socket_open2(NETLINK_ROUTE,
 	    SOCK_CLOEXEC | SOCK_NONBLOCK);
 	if (kr_state.nl == NULL)
 		fatal("mnl_socket_open");
 
+	/*
+	 * Grow receive buffer, a table flush by someone else easily
+	 * overruns the default. SO_RCVBUFFORCE ignores rmem_max but needs
+	 * CAP_NET_ADMIN, else fall back to what SO_RCVBUF allows.
+	 */
+	optlen = sizeof(default_rcvbuf);
+	if (getsockopt(mnl_socket_get_fd(kr_state.nl), SOL_SOCKET, SO_RCVBUF,
+	    &default_rcvbuf, &optlen) == -1)
+		log_warn("%s: getsockopt SOL_SOCKET SO_RCVBUF", __func__);
+	else if (rcvbuf > default_rcvbuf &&
+	    setsockopt(mnl_socket_get_fd(kr_state.nl), SOL_SOCKET,
+	    SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1 &&
+	    setsockopt(mnl_socket_get_fd(kr_state.nl), SOL_SOCKET,
+	    SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1)
+		log_warn("%s: setsockopt SOL_SOCKET SO_RCVBUF", __func__);
+
 	if (mnl_socket_bind(kr_state.nl, RTMGRP_LINK | RTMGRP_IPV4_ROUTE |
 	    RTMGRP_IPV6_ROUTE, MNL_SOCKET_AUTOPID) < 0)
 		fatal("mnl_socket_bind");
+#ifdef HAVE_LINUX_NEXTHOP_H
+	/* notice nexthop objects removed by others, see knexthop_obj_lost() */
+	opt = RTNLGRP_NEXTHOP;
+	if (mnl_socket_setsockopt(kr_state.nl, NETLINK_ADD_MEMBERSHIP,
+	    &opt, sizeof(opt)) < 0)
+		log_warn("%s: setsockopt NETLINK_ADD_MEMBERSHIP", __func__);
+#endif
+
+#ifdef NETLINK_GET_STRICT_CHK
+	/* let the kernel filter route dumps by table, family and protocol */
+	opt = 1;
+	if (setsockopt(mnl_socket_get_fd(kr_state.nl), SOL_NETLINK,
+	    NETLINK_GET_STRICT_CHK, &opt, sizeof(opt)) == 0)
+		kr_state.strict = 1;
+	else
+		log_info("kernel does not filter route dumps");
+#endif
 
 	kr_state.pid = mnl_socket_get_portid(kr_state.nl);
 	kr_state.nlmsg_seq = 1;
+
+	/* audit dumps are read a bit at a time, see kr_audit_dispatch() */
+	kraudit.nl = mnl_socket_open2(NETLINK_ROUTE,
+	    SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (kraudit.nl == NULL)
+		fatal("mnl_socket_open");
+	if (mnl_socket_bind(kraudit.nl, 0, MNL_SOCKET_AUTOPID) < 0)
+		fatal("mnl_socket_bind");
+#ifdef NETLINK_GET_STRICT_CHK
+	opt = 1;
+	if (kr_state.strict && setsockopt(mnl_socket_get_fd(kraudit.nl),
+	    SOL_NETLINK, NETLINK_GET_STRICT_CHK, &opt, sizeof(opt)) == -1)
+		log_warn("%s: setsockopt NETLINK_GET_STRICT_CHK", __func__);
+#endif
 	kr_state.fib_prio = fib_prio;
+	kr_state.nh_policy = -1;
+
+	if ((kr_state.batch = malloc(KR_BATCH_SIZE +
+	    MNL_SOCKET_BUFFER_SIZE)) == NULL)
+		fatal("%s", __func__);
+	if ((kr_state.inflight = calloc(KR_MAX_INFLIGHT,
+	    sizeof(*kr_state.inflight))) == NULL)
+		fatal("%s", __func__);
+	kr_writer_start();
 
 	RB_INIT(&kit);
+	for (i = 0; i < KR_KIF_BUCKETS; i++)
+		LIST_INIT(&kifnames[i]);
+	LIST_INIT(&kifheld);
+	RB_INIT(&knhot);
+	SLIST_INIT(&knhdump);
+	RB_INIT(&knhadopt);
+	RB_INIT(&knift);
+	RB_INIT(&krshadow);
+	RB_INIT(&krpending);
+	RB_INIT(&krstale);
+	RB_INIT(&kragg);
+	RB_INIT(&kraudittree);
+
+	/*
+	 * The parent only polls a single fd, so the netlink socket and
+	 * the timers are hidden behind an epoll fd.
+	 */
+	if ((kr_state.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		fatal("epoll_create1");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = KR_EV_NETLINK;
+	if (epoll_ctl(kr_state.epfd, EPOLL_CTL_ADD,
+	    mnl_socket_get_fd(kr_state.nl), &ev) == -1)
+		fatal("epoll_ctl");
+	ev.data.u32 = KR_EV_WRITER;
+	if (epoll_ctl(kr_state.epfd, EPOLL_CTL_ADD, krw.donefd, &ev) == -1)
+		fatal("epoll_ctl");
+	ev.data.u32 = KR_EV_AUDIT;
+	if (epoll_ctl(kr_state.epfd, EPOLL_CTL_ADD,
+	    mnl_socket_get_fd(kraudit.nl), &ev) == -1)
+		fatal("epoll_ctl");
+	for (i = 0; i < KR_TIMER_MAX; i++) {
+		if ((kr_state.timerfd[i] = timerfd_create(CLOCK_MONOTONIC,
+		    TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			fatal("timerfd_create");
+		ev.data.u32 = i;
+		if (epoll_ctl(kr_state.epfd, EPOLL_CTL_ADD,
+		    kr_state.timerfd[i], &ev) == -1)
+			fatal("epoll_ctl");
+	}
+
+	/* new routes stay out of the FIB until the RDE converged */
+	if (KR_FIB_HOLD > 0)
+		kr_fib_hold_start();
+
+	if (KR_AUDIT_INTERVAL > 0)
+		kr_timer_set(KR_TIMER_AUDIT, KR_AUDIT_INTERVAL * 1000);
 
 	if (fetchifs(0) == -1)
 		return (-1);
 
-	*fd = mnl_socket_get_fd(kr_state.nl);
+	/* routes point to nexthop objects if the kernel supports them */
+	kr_state.nhid_next = 1;
+	if (fetchnexthops() == 0)
+		kr_state.nhobj = 1;
+	else
+		log_info("kernel nexthop objects not supported, "
+		    "using inline gateways");
+
+	/* groups of a previous run go once adopted routes are refreshed */
+	if (knexthop_obj_adopted())
+		kr_timer_set(KR_TIMER_STALE, KR_STALE_TIME * 1000);
+
+	*fd = kr_state.epfd;
 	return (0);
 }
 
@@ -264,12 +1120,95 @@ kr_check_prio(long long prio)
 	return 1;
 }
 
+void *
+kr_pool_get(struct kr_pool *pool)
+{
+	char	*chunk, *obj;
+	size_t	 i, n;
+
+	if (pool->freelist == NULL) {
+		if ((chunk = malloc(KR_POOL_CHUNK)) == NULL)
+			return (NULL);
+		*(void **)chunk = pool->chunks;
+		pool->chunks = chunk;
+		pool->nchunks++;
+
+		n = (KR_POOL_CHUNK - KR_POOL_HDR) / pool->size;
+		for (i = n; i > 0; i--) {
+			obj = chunk + KR_POOL_HDR + (i - 1) * pool->size;
+			*(void **)obj = pool->freelist;
+			pool->freelist = obj;
+		}
+	}
+
+	obj = pool->freelist;
+	pool->freelist = *(void **)obj;
+	pool->inuse++;
+	memset(obj, 0, pool->size);
+	return (obj);
+}
+
+void
+kr_pool_put(struct kr_pool *pool, void *obj)
+{
+	if (obj == NULL)
+		return;
+	*(void **)obj = pool->freelist;
+	pool->freelist = obj;
+	pool->inuse--;
+}
+
+void
+kr_pool_destroy(struct kr_pool *pool)
+{
+	void	*chunk;
+
+	while ((chunk = pool->chunks) != NULL) {
+		pool->chunks = *(void **)chunk;
+		free(chunk);
+	}
+	pool->freelist = NULL;
+	pool->inuse = 0;
+	pool->nchunks = 0;
+}
+
+void
+kr_pool_log(struct kr_pool *pool)
+{
+	log_debug("pool %s: %zu in use, %zu bytes each, %zu kB allocated",
+	    pool->name, pool->inuse, pool->size,
+	    pool->nchunks * KR_POOL_CHUNK / 1024);
+}
+
+/*
+ * The counters do not fit into the control replies, they are logged on
+ * shutdown for debugging.
+ */
+void
+kr_stats_log(void)
+{
+	kr_pool_log(&kroute_pool);
+	kr_pool_log(&kroute6_pool);
+	kr_pool_log(&knexthop_pool);
+	kr_pool_log(&kr_lpm_pool);
+	kr_pool_log(&kif_pool);
+	kr_queue_log();
+	kr_walk_log();
+	kr_stale_log();
+	kr_agg_log();
+	kr_audit_log();
+}
+
 int
 ktable_new(u_int rtableid, u_int rdomid, char *name, int fs)
 {
 	struct ktable	**xkrt;
 	struct ktable	 *kt;
+	struct kr_lpm	 *xlpm;
+	struct kr_netidx *xnetidx;
 	size_t		  oldsize;
+	uint64_t	  oadopted;
+	int		  rv;
 
 	/* resize index table if needed */
 	if (rtableid >= krt_size) {
@@ -283,6 +1222,22 @@ ktable_new(u_int rtableid, u_int rdomid, char *name, int fs)
 		krt_size = rtableid + 1;
 		memset((char *)krt + oldsize, 0,
 		    krt_size * sizeof(struct ktable *) - oldsize);
+
+		if ((xlpm = recallocarray(krlpm, oldsize /
+		    sizeof(struct ktable *), krt_size,
+		    sizeof(struct kr_lpm))) == NULL) {
+			log_warn("%s", __func__);
+			return (-1);
+		}
+		krlpm = xlpm;
+
+		if ((xnetidx = recallocarray(krnetidx, oldsize /
+		    sizeof(struct ktable *), krt_size,
+		    sizeof(struct kr_netidx))) == NULL) {
+			log_warn("%s", __func__);
+			return (-1);
+		}
+		krnetidx = xnetidx;
 	}
 
 	if (krt[rtableid])
@@ -307,9 +1262,22 @@ ktable_new(u_int rtableid, u_int rdomid, char *name, int fs)
 	/* bump refcount of rdomain table for the nexthop lookups */
 	ktable_get(kt->nhtableid)->nhrefcnt++;
 
-	/* ... and load it */
-	if (fetchtable(kt) == -1)
+	/* start listening for events of the new table */
+	kr_filter_update();
+
+	/* ... and load it, taking over what a previous run left behind */
+	oadopted = kr_state.stale_adopted;
+	kr_state.adopt = fs && KR_ADOPT;
+	rv = fetchtable(kt, 0);
+	kr_state.adopt = 0;
+	if (rv == -1)
 		return (-1);
+	if (kr_state.stale_adopted != oadopted) {
+		log_info("rtable %u: %llu routes of a previous run adopted",
+		    rtableid, (unsigned long long)
+		    (kr_state.stale_adopted - oadopted));
+		kr_timer_set(KR_TIMER_STALE, KR_STALE_TIME * 1000);
+	}
 
 	/* everything is up and running */
 	kt->state = RECONF_REINIT;
@@ -328,6 +1296,7 @@ ktable_free(u_int rtableid)
 
 	/* decouple from kernel, no new routes will be entered from here */
 	kr_fib_decouple(kt->rtableid);
+	kr_walk_sync(kt->rtableid);
 
 	/* first unhook from the nexthop table */
 	nkt = ktable_get(kt->nhtableid);
@@ -351,6 +1320,7 @@ ktable_destroy(struct ktable *kt)
 {
 	/* decouple just to be sure, does not hurt */
 	kr_fib_decouple(kt->rtableid);
+	kr_walk_sync(kt->rtableid);
 
 	log_debug("%s: freeing ktable %s rtableid %u", __func__, kt->descr,
 	    kt->rtableid);
@@ -361,9 +1331,14 @@ ktable_destroy(struct ktable *kt)
 	kroute6_clear(kt);
 	knexthop_clear(kt);
 	kr_net_clear(kt);
+	memset(&krnetidx[kt->rtableid], 0, sizeof(struct kr_netidx));
+	kr_lpm_clear(krlpm[kt->rtableid].root4);
+	kr_lpm_clear(krlpm[kt->rtableid].root6);
+	memset(&krlpm[kt->rtableid], 0, sizeof(struct kr_lpm));
 
 	krt[kt->rtableid] = NULL;
 	free(kt);
+	kr_filter_update();
 }
 
 struct ktable *
@@ -438,19 +1413,20 @@ int
 kr_change(u_int rtableid, struct kroute_full *kf)
 {
 	struct ktable		*kt;
+	uint32_t		 nhid = 0;
 
 	if ((kt = ktable_get(rtableid)) == NULL)
 		/* too noisy during reloads, just ignore */
 		return (0);
 	kf->flags |= F_BGPD;
 	kf->priority = RTP_MINE;
-	if (!knexthop_true_nexthop(kt, kf))
+	if (!knexthop_true_nexthop(kt, kf, &nhid))
 		return kroute_remove(kt, kf, 1);
 	switch (kf->prefix.aid) {
 	case AID_INET:
-		return (kr4_change(kt, kf));
+		return (kr4_change(kt, kf, nhid));
 	case AID_INET6:
-		return (kr6_change(kt, kf));
+		return (kr6_change(kt, kf, nhid));
 #ifdef NOTYET
 	case AID_VPN_IPv4:
 		return (krVPN4_change(kt, kf));
@@ -463,26 +1439,42 @@ kr_change(u_int rtableid, struct kroute_full *kf)
 }
 
 int
-kr4_change(struct ktable *kt, struct kroute_full *kf)
+kr4_change(struct ktable *kt, struct kroute_full *kf, uint32_t nhid)
 {
 	struct kroute	*kr;
+	uint32_t	 oldnhid;
+	int		 changed;
 
 	/* for blackhole and reject routes nexthop needs to be 127.0.0.1 */
-	if (kf->flags & (F_BLACKHOLE|F_REJECT))
+	if (kf->flags & (F_BLACKHOLE|F_REJECT)) {
 		kf->nexthop.v4.s_addr = htonl(INADDR_LOOPBACK);
+		nhid = 0;
 	/* nexthop within 127/8 -> ignore silently */
-	else if ((kf->nexthop.v4.s_addr & htonl(IN_CLASSA_NET)) ==
+	} else if ((kf->nexthop.v4.s_addr & htonl(IN_CLASSA_NET)) ==
 	    htonl(INADDR_LOOPBACK & IN_CLASSA_NET))
 		return (0);
 
 	if ((kr = kroute_find(kt, &kf->prefix, kf->prefixlen,
 	    kf->priority)) == NULL) {
-		if (kroute_insert(kt, kf) == -1)
+		if (kroute_insert(kt, kf, nhid) == -1)
 			return (-1);
 	} else {
+		if (kr_stale_drop(kt->rtableid, kf))
+			kr_state.stale_refreshed++;
+		/* route labels are not passed to the kernel */
+		/* with a group the kernel only sees that, not the nexthop */
+		changed = (!(kr->flags & F_BGPD_INSERTED) &&
+		    !kr_agg_find(kt->rtableid, kf)) ||
+		    (nhid == 0 &&
+		    kr->nexthop.s_addr != kf->nexthop.v4.s_addr) ||
+		    kr->nhid != nhid ||
+		    ((kr->flags ^ kf->flags) & (F_BLACKHOLE|F_REJECT));
+
 		kr->nexthop.s_addr = kf->nexthop.v4.s_addr;
-		rtlabel_unref(kr->labelid);
-		kr->labelid = rtlabel_name2id(kf->label);
+		oldnhid = kr->nhid;
+		knexthop_obj_ref(nhid);
+		kr->nhid = nhid;
+		kr_label_set(&kr->labelid, kf->label);
 		if (kf->flags & F_BLACKHOLE)
 			kr->flags |= F_BLACKHOLE;
 		else
@@ -495,35 +1487,58 @@ kr4_change(struct ktable *kt, struct kroute_full *kf)
 		if (kr->flags & F_NEXTHOP)
 			knexthop_update(kt, kf);
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
-			kr->flags |= F_BGPD_INSERTED;
+		if (!changed)
+			kr_state.fib_suppressed++;
+		else {
+			if (send_rtmsg(kr->flags & F_BGPD_INSERTED ?
+			    RTM_CHANGE : RTM_ADD, kt, kf, kr->nhid))
+				kr->flags |= F_BGPD_INSERTED;
+			kr_agg_update(kt, &kf->prefix, kf->prefixlen);
+		}
+		/* the old object may only go once the route moved away */
+		knexthop_obj_unref(oldnhid);
 	}
 
 	return (0);
 }
 
 int
-kr6_change(struct ktable *kt, struct kroute_full *kf)
+kr6_change(struct ktable *kt, struct kroute_full *kf, uint32_t nhid)
 {
 	struct kroute6	*kr6;
 	struct in6_addr	 lo6 = IN6ADDR_LOOPBACK_INIT;
+	uint32_t	 oldnhid;
+	int		 changed;
 
 	/* for blackhole and reject routes nexthop needs to be ::1 */
-	if (kf->flags & (F_BLACKHOLE|F_REJECT))
+	if (kf->flags & (F_BLACKHOLE|F_REJECT)) {
 		memcpy(&kf->nexthop.v6, &lo6, sizeof(kf->nexthop.v6));
+		nhid = 0;
 	/* nexthop to loopback -> ignore silently */
-	else if (IN6_IS_ADDR_LOOPBACK(&kf->nexthop.v6))
+	} else if (IN6_IS_ADDR_LOOPBACK(&kf->nexthop.v6))
 		return (0);
 
 	if ((kr6 = kroute6_find(kt, &kf->prefix, kf->prefixlen,
 	    kf->priority)) == NULL) {
-		if (kroute_insert(kt, kf) == -1)
+		if (kroute_insert(kt, kf, nhid) == -1)
 			return (-1);
 	} else {
+		if (kr_stale_drop(kt->rtableid, kf))
+			kr_state.stale_refreshed++;
+		changed = (!(kr6->flags & F_BGPD_INSERTED) &&
+		    !kr_agg_find(kt->rtableid, kf)) ||
+		    (nhid == 0 && (memcmp(&kr6->nexthop, &kf->nexthop.v6,
+		    sizeof(struct in6_addr)) != 0 ||
+		    kr6->nexthop_scope_id != kf->nexthop.scope_id)) ||
+		    kr6->nhid != nhid ||
+		    ((kr6->flags ^ kf->flags) & (F_BLACKHOLE|F_REJECT));
+
 		memcpy(&kr6->nexthop, &kf->nexthop.v6, sizeof(struct in6_addr));
 		kr6->nexthop_scope_id = kf->nexthop.scope_id;
-		rtlabel_unref(kr6->labelid);
-		kr6->labelid = rtlabel_name2id(kf->label);
+		oldnhid = kr6->nhid;
+		knexthop_obj_ref(nhid);
+		kr6->nhid = nhid;
+		kr_label_set(&kr6->labelid, kf->label);
 		if (kf->flags & F_BLACKHOLE)
 			kr6->flags |= F_BLACKHOLE;
 		else
@@ -536,8 +1551,15 @@ kr6_change(struct ktable *kt, struct kroute_full *kf)
 		if (kr6->flags & F_NEXTHOP)
 			knexthop_update(kt, kf);
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
-			kr6->flags |= F_BGPD_INSERTED;
+		if (!changed)
+			kr_state.fib_suppressed++;
+		else {
+			if (send_rtmsg(kr6->flags & F_BGPD_INSERTED ?
+			    RTM_CHANGE : RTM_ADD, kt, kf, kr6->nhid))
+				kr6->flags |= F_BGPD_INSERTED;
+			kr_agg_update(kt, &kf->prefix, kf->prefixlen);
+		}
+		knexthop_obj_unref(oldnhid);
 	}
 
 	return (0);
@@ -572,14 +1594,13 @@ krVPN4_change(struct ktable *kt, struct kroute_full *kf)
 
 	if ((kr = kroute_find(kt, &kf->prefix, kf->prefixlen,
 	    kf->priority)) == NULL) {
-		if (kroute_insert(kt, kf) == -1)
+		if (kroute_insert(kt, kf, 0) == -1)
 			return (-1);
 	} else {
 		kr->mplslabel = mplslabel;
 		kr->ifindex = kf->ifindex;
 		kr->nexthop.s_addr = kf->nexthop.v4.s_addr;
-		rtlabel_unref(kr->labelid);
-		kr->labelid = rtlabel_name2id(kf->label);
+		kr_label_set(&kr->labelid, kf->label);
 		if (kf->flags & F_BLACKHOLE)
 			kr->flags |= F_BLACKHOLE;
 		else
@@ -589,7 +1610,7 @@ krVPN4_change(struct ktable *kt, struct kroute_full *kf)
 		else
 			kr->flags &= ~F_REJECT;
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
+		if (send_rtmsg(RTM_CHANGE, kt, kf, 0))
 			kr->flags |= F_BGPD_INSERTED;
 	}
 
@@ -624,15 +1645,14 @@ krVPN6_change(struct ktable *kt, struct kroute_full *kf)
 
 	if ((kr6 = kroute6_find(kt, &kf->prefix, kf->prefixlen,
 	    kf->priority)) == NULL) {
-		if (kroute_insert(kt, kf) == -1)
+		if (kroute_insert(kt, kf, 0) == -1)
 			return (-1);
 	} else {
 		kr6->mplslabel = mplslabel;
 		kr6->ifindex = kf->ifindex;
 		memcpy(&kr6->nexthop, &kf->nexthop.v6, sizeof(struct in6_addr));
 		kr6->nexthop_scope_id = kf->nexthop.scope_id;
-		rtlabel_unref(kr6->labelid);
-		kr6->labelid = rtlabel_name2id(kf->label);
+		kr_label_set(&kr6->labelid, kf->label);
 		if (kf->flags & F_BLACKHOLE)
 			kr6->flags |= F_BLACKHOLE;
 		else
@@ -642,7 +1662,7 @@ krVPN6_change(struct ktable *kt, struct kroute_full *kf)
 		else
 			kr6->flags &= ~F_REJECT;
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
+		if (send_rtmsg(RTM_CHANGE, kt, kf, 0))
 			kr6->flags |= F_BGPD_INSERTED;
 	}
 
@@ -667,67 +1687,86 @@ int
 kr_flush(u_int rtableid)
 {
 	struct ktable	*kt;
-	struct kroute	*kr, *next;
-	struct kroute6	*kr6, *next6;
+	struct kr_walk	*w;
 
 	if ((kt = ktable_get(rtableid)) == NULL)
 		/* too noisy during reloads, just ignore */
 		return (0);
 
-	RB_FOREACH_SAFE(kr, kroute_tree, &kt->krt, next)
-		if ((kr->flags & F_BGPD_INSERTED)) {
-			if (kroute_remove(kt, kr_tofull(kr), 1) == -1)
-				return (-1);
-		}
-	RB_FOREACH_SAFE(kr6, kroute6_tree, &kt->krt6, next6)
-		if ((kr6->flags & F_BGPD_INSERTED)) {
-			if (kroute_remove(kt, kr6_tofull(kr6), 1) == -1)
-				return (-1);
-		}
-
-	kt->fib_sync = 0;
+	if ((w = kr_walk_find(rtableid)) != NULL) {
+		if (w->type == KR_WALK_FLUSH)
+			return (0);
+		kr_walk_free(w);
+	}
+	kr_walk_start(kt, KR_WALK_FLUSH);
 	return (0);
 }
 
 void
 kr_shutdown(void)
 {
-	u_int	i;
+	struct ktable	*kt;
+	u_int		 i;
 
+	kr_stats_log();
+
+	/* our routes and their nexthops stay for the next run to adopt */
+	if (KR_ADOPT) {
+		kr_state.keep = 1;
+		for (i = 0; i < krt_size; i++)
+			if ((kt = ktable_get(i)) != NULL)
+				kt->fib_sync = 0;
+	}
 	for (i = krt_size; i > 0; i--)
 		ktable_free(i - 1);
 	kif_clear();
+	free(kifidx);
 	free(krt);
+	free(krlpm);
+	free(krnetidx);
+	knexthop_obj_adopt_end();
+
+	/* push out the remaining deletes before closing the socket */
+	kr_queue_flush();
+	kr_inflight_wait(0);
+	kr_writer_stop();
+	free(kr_state.batch);
+	free(kr_state.inflight);
+	kr_audit_end(0);
+	mnl_socket_close(kraudit.nl);
 	mnl_socket_close(kr_state.nl);
+
+	kr_pool_destroy(&kroute_pool);
+	kr_pool_destroy(&kroute6_pool);
+	kr_pool_destroy(&knexthop_pool);
+	kr_pool_destroy(&kif_pool);
+	kr_pool_destroy(&kr_lpm_pool);
+	kr_pool_destroy(&kr_pending_pool);
+	kr_pool_destroy(&kr_stale_pool);
+	kr_pool_destroy(&kr_agg_pool);
+	for (i = 0; i < KR_TIMER_MAX; i++)
+		close(kr_state.timerfd[i]);
+	close(kr_state.epfd);
 }
 
 void
 kr_fib_couple(u_int rtableid)
 {
 	struct ktable	*kt;
-	struct kroute	*kr;
-	struct kroute6	*kr6;
+	struct kr_walk	*w;
 
 	if ((kt = ktable_get(rtableid)) == NULL)  /* table does not exist */
 		return;
 
-	if (kt->fib_sync)	/* already coupled */
+	w = kr_walk_find(rtableid);
+	/* already coupled or on the way there */
+	if (kt->fib_sync && (w == NULL || w->type == KR_WALK_COUPLE))
 		return;
+	if (w != NULL)
+		kr_walk_free(w);
 
 	kt->fib_sync = 1;
-
-	RB_FOREACH(kr, kroute_tree, &kt->krt)
-		if (kr->flags & F_BGPD) {
-			if (send_rtmsg(RTM_ADD, kt, kr_tofull(kr)))
-				kr->flags |= F_BGPD_INSERTED;
-		}
-	RB_FOREACH(kr6, kroute6_tree, &kt->krt6)
-		if (kr6->flags & F_BGPD) {
-			if (send_rtmsg(RTM_ADD, kt, kr6_tofull(kr6)))
-				kr6->flags |= F_BGPD_INSERTED;
-		}
-	log_info("kernel routing table %u (%s) coupled", kt->rtableid,
-	    kt->descr);
+	kr_walk_start(kt, KR_WALK_COUPLE);
 }
 
 void
@@ -743,8 +1782,7 @@ void
 kr_fib_decouple(u_int rtableid)
 {
 	struct ktable	*kt;
-	struct kroute	*kr;
-	struct kroute6	*kr6;
+	struct kr_walk	*w;
 
 	if ((kt = ktable_get(rtableid)) == NULL)  /* table does not exist */
 		return;
@@ -752,2004 +1790,5906 @@ kr_fib_decouple(u_int rtableid)
 	if (!kt->fib_sync)	/* already decoupled */
 		return;
 
-	RB_FOREACH(kr, kroute_tree, &kt->krt)
-		if ((kr->flags & F_BGPD_INSERTED)) {
-			if (send_rtmsg(RTM_DELETE, kt, kr_tofull(kr)))
-				kr->flags &= ~F_BGPD_INSERTED;
-		}
-	RB_FOREACH(kr6, kroute6_tree, &kt->krt6)
-		if ((kr6->flags & F_BGPD_INSERTED)) {
-			if (send_rtmsg(RTM_DELETE, kt, kr6_tofull(kr6)))
-				kr6->flags &= ~F_BGPD_INSERTED;
-		}
+	if ((w = kr_walk_find(rtableid)) != NULL) {
+		/* already on the way out */
+		if (w->type != KR_WALK_COUPLE)
+			return;
+		kr_walk_free(w);
+	}
+	kr_walk_start(kt, KR_WALK_DECOUPLE);
+}
 
-	kt->fib_sync = 0;
+struct kr_walk *
+kr_walk_find(u_int rtableid)
+{
+	struct kr_walk	*w;
 
-	log_info("kernel routing table %u (%s) decoupled", kt->rtableid,
-	    kt->descr);
+	TAILQ_FOREACH(w, &krwalks, entry)
+		if (w->rtableid == rtableid)
+			return (w);
+	return (NULL);
 }
 
 void
-kr_fib_decouple_all(void)
+kr_walk_start(struct ktable *kt, enum kr_walk_type type)
 {
-	u_int	 i;
+	struct kr_walk	*w;
 
-	for (i = krt_size; i > 0; i--)
-		kr_fib_decouple(i - 1);
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		fatal("%s", __func__);
+	w->rtableid = kt->rtableid;
+	w->type = type;
+	w->aid = AID_INET;
+	TAILQ_INSERT_TAIL(&krwalks, w, entry);
+
+	if (!kr_state.timer_armed[KR_TIMER_WALK])
+		kr_timer_set(KR_TIMER_WALK, 0);
 }
 
 void
-kr_fib_prio_set(uint8_t prio)
+kr_walk_free(struct kr_walk *w)
 {
-	kr_state.fib_prio = prio;
+	TAILQ_REMOVE(&krwalks, w, entry);
+	free(w);
 }
 
+/*
+ * Visit routes until the walk is done, returns 1, or the deadline is
+ * hit, returns 0. Without deadline the walk runs to the end.
+ */
 int
-kr_dispatch_msg(void)
+kr_walk_run(struct kr_walk *w, const struct timespec *deadline)
 {
-	return (dispatch_rtmsg());
+	struct ktable	*kt;
+	struct kroute	*kr, *krn;
+	struct kroute6	*kr6, *kr6n;
+	struct timespec	 now;
+	u_int		 n = 0;
+
+	if ((kt = ktable_get(w->rtableid)) == NULL)
+		return (1);
+
+	while (w->aid == AID_INET) {
+		if (deadline != NULL && ++n % KR_WALK_CHECK == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespeccmp(&now, deadline, >=))
+				return (0);
+		}
+		if (w->resume)
+			kr = RB_NFIND(kroute_tree, &kt->krt, &w->cur);
+		else
+			kr = RB_MIN(kroute_tree, &kt->krt);
+		if (kr == NULL) {
+			w->aid = AID_INET6;
+			w->resume = 0;
+			break;
+		}
+		/* remember the next route, this one may go away */
+		if ((krn = RB_NEXT(kroute_tree, &kt->krt, kr)) == NULL)
+			w->aid = AID_INET6;
+		else
+			w->cur = *krn;
+		w->resume = krn != NULL;
+		w->visited++;
+
+		switch (w->type) {
+		case KR_WALK_COUPLE:
+			if (!(kr->flags & F_BGPD) ||
+			    kr->flags & F_BGPD_INSERTED ||
+			    kr_agg_find(kt->rtableid, kr_tofull(kr)))
+				continue;
+			if (send_rtmsg(RTM_ADD, kt, kr_tofull(kr), kr->nhid))
+				kr->flags |= F_BGPD_INSERTED;
+			break;
+		case KR_WALK_DECOUPLE:
+			if (!(kr->flags & F_BGPD_INSERTED))
+				continue;
+			if (send_rtmsg(RTM_DELETE, kt, kr_tofull(kr), 0))
+				kr->flags &= ~F_BGPD_INSERTED;
+			break;
+		case KR_WALK_FLUSH:
+			if (!(kr->flags & F_BGPD_INSERTED) &&
+			    !kr_agg_find(kt->rtableid, kr_tofull(kr)))
+				continue;
+			kroute_remove(kt, kr_tofull(kr), 1);
+			break;
+		}
+		w->sent++;
+	}
+
+	while (w->aid == AID_INET6) {
+		if (deadline != NULL && ++n % KR_WALK_CHECK == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespeccmp(&now, deadline, >=))
+				return (0);
+		}
+		if (w->resume)
+			kr6 = RB_NFIND(kroute6_tree, &kt->krt6, &w->cur6);
+		else
+			kr6 = RB_MIN(kroute6_tree, &kt->krt6);
+		if (kr6 == NULL) {
+			w->aid = AID_UNSPEC;
+			break;
+		}
+		if ((kr6n = RB_NEXT(kroute6_tree, &kt->krt6, kr6)) == NULL)
+			w->aid = AID_UNSPEC;
+		else
+			w->cur6 = *kr6n;
+		w->resume = kr6n != NULL;
+		w->visited++;
+
+		switch (w->type) {
+		case KR_WALK_COUPLE:
+			if (!(kr6->flags & F_BGPD) ||
+			    kr6->flags & F_BGPD_INSERTED ||
+			    kr_agg_find(kt->rtableid, kr6_tofull(kr6)))
+				continue;
+			if (send_rtmsg(RTM_ADD, kt, kr6_tofull(kr6),
+			    kr6->nhid))
+				kr6->flags |= F_BGPD_INSERTED;
+			break;
+		case KR_WALK_DECOUPLE:
+			if (!(kr6->flags & F_BGPD_INSERTED))
+				continue;
+			if (send_rtmsg(RTM_DELETE, kt, kr6_tofull(kr6), 0))
+				kr6->flags &= ~F_BGPD_INSERTED;
+			break;
+		case KR_WALK_FLUSH:
+			if (!(kr6->flags & F_BGPD_INSERTED) &&
+			    !kr_agg_find(kt->rtableid, kr6_tofull(kr6)))
+				continue;
+			kroute_remove(kt, kr6_tofull(kr6), 1);
+			break;
+		}
+		w->sent++;
+	}
+
+	return (1);
 }
 
-int
-kr_nexthop_add(u_int rtableid, struct bgpd_addr *addr)
+void
+kr_walk_done(struct kr_walk *w)
 {
 	struct ktable	*kt;
-	struct knexthop	*h;
 
-	if ((kt = ktable_get(rtableid)) == NULL) {
-		log_warnx("%s: non-existent rtableid %d", __func__, rtableid);
-		return (0);
+	if ((kt = ktable_get(w->rtableid)) == NULL) {
+		kr_walk_free(w);
+		return;
 	}
-	if ((h = knexthop_find(kt, addr)) != NULL) {
-		/* should not happen... this is actually an error path */
-		knexthop_send_update(h);
-	} else {
-		if ((h = calloc(1, sizeof(*h))) == NULL) {
-			log_warn("%s", __func__);
-			return (-1);
-		}
-		memcpy(&h->nexthop, addr, sizeof(h->nexthop));
 
-		if (knexthop_insert(kt, h) == -1)
-			return (-1);
+	kr_queue_flush();
+	switch (w->type) {
+	case KR_WALK_COUPLE:
+		log_info("kernel routing table %u (%s) coupled", kt->rtableid,
+		    kt->descr);
+		break;
+	case KR_WALK_DECOUPLE:
+		kt->fib_sync = 0;
+		log_info("kernel routing table %u (%s) decoupled",
+		    kt->rtableid, kt->descr);
+		break;
+	case KR_WALK_FLUSH:
+		kt->fib_sync = 0;
+		break;
 	}
+	log_debug("%s: table %u, %zu routes visited, %zu changed", __func__,
+	    w->rtableid, w->visited, w->sent);
+	kr_walk_free(w);
+}
 
-	return (0);
+/*
+ * Finish a pending walk of the table right away, e.g. before the table
+ * goes away.
+ */
+void
+kr_walk_sync(u_int rtableid)
+{
+	struct kr_walk	*w;
+
+	if ((w = kr_walk_find(rtableid)) == NULL)
+		return;
+	kr_walk_run(w, NULL);
+	kr_walk_done(w);
 }
 
 void
-kr_nexthop_delete(u_int rtableid, struct bgpd_addr *addr)
+kr_walk_timer(void)
 {
-	struct ktable	*kt;
-	struct knexthop	*kn;
+	struct kr_walk	*w;
+	struct timespec	 deadline, budget;
 
-	if ((kt = ktable_get(rtableid)) == NULL) {
-		log_warnx("%s: non-existent rtableid %d", __func__,
-		    rtableid);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	budget.tv_sec = KR_WALK_BUDGET / 1000;
+	budget.tv_nsec = (KR_WALK_BUDGET % 1000) * 1000000;
+	timespecadd(&deadline, &budget, &deadline);
+
+	while ((w = TAILQ_FIRST(&krwalks)) != NULL) {
+		if (!kr_walk_run(w, &deadline))
+			break;
+		kr_walk_done(w);
+	}
+
+	/* more to do, come back after the other events got a chance */
+	if (!TAILQ_EMPTY(&krwalks))
+		kr_timer_set(KR_TIMER_WALK, 0);
+}
+
+void
+kr_walk_log(void)
+{
+	struct kr_walk	*w;
+	static const char *names[] = { "couple", "decouple", "flush" };
+
+	TAILQ_FOREACH(w, &krwalks, entry)
+		log_debug("fib %s of table %u in progress, %zu routes done",
+		    names[w->type], w->rtableid, w->visited);
+	if (kr_state.fib_hold)
+		log_debug("initial fib sync held back");
+}
+
+void
+kr_fib_hold_start(void)
+{
+	kr_state.fib_hold = 1;
+	clock_gettime(CLOCK_MONOTONIC, &kr_state.hold_start);
+	kr_fib_hold_timer();
+}
+
+/*
+ * Check every KR_FIB_HOLD_QUIET seconds whether new routes still show
+ * up, until the hold time is over.
+ */
+void
+kr_fib_hold_timer(void)
+{
+	struct timespec	now;
+	u_int		msec, left;
+
+	if (!kr_state.fib_hold)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &kr_state.hold_start, &now);
+	msec = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	if (msec >= KR_FIB_HOLD * 1000) {
+		kr_fib_hold_end("timeout");
 		return;
 	}
-	if ((kn = knexthop_find(kt, addr)) == NULL)
+	if (kr_state.hold_routes > 0 &&
+	    kr_state.hold_routes == kr_state.hold_seen) {
+		kr_fib_hold_end("no new routes");
 		return;
+	}
+	kr_state.hold_seen = kr_state.hold_routes;
+	left = KR_FIB_HOLD * 1000 - msec;
+	kr_timer_set(KR_TIMER_HOLD, left < KR_FIB_HOLD_QUIET * 1000 ?
+	    left : KR_FIB_HOLD_QUIET * 1000);
+}
 
-	knexthop_remove(kt, kn);
+/*
+ * End the hold of the initial FIB sync, all tables are coupled in one
+ * pass.
+ */
+void
+kr_fib_hold_end(const char *why)
+{
+	struct ktable	*kt;
+	struct timespec	 now;
+	u_int		 i;
+
+	kr_state.fib_hold = 0;
+	kr_timer_stop(KR_TIMER_HOLD);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &kr_state.hold_start, &now);
+	log_info("initial fib sync released after %lld.%03ld sec, %s, "
+	    "%llu routes held", (long long)now.tv_sec,
+	    now.tv_nsec / 1000000, why,
+	    (unsigned long long)kr_state.hold_routes);
+
+	for (i = 0; i < krt_size; i++) {
+		if ((kt = ktable_get(i)) == NULL || !kt->fib_sync)
+			continue;
+		/* decoupling or already on the way */
+		if (kr_walk_find(i) != NULL)
+			continue;
+		kr_walk_start(kt, KR_WALK_COUPLE);
+	}
 }
 
-static struct ctl_show_interface *
-kr_show_interface(struct kif *kif)
+/*
+ * Take over a route a previous run left in the kernel. It is entered as
+ * if the RDE had installed it and stays stale until the RDE announces the
+ * prefix again, unchanged routes are then not touched in the kernel.
+ * Its paths are taken over as a nexthop group, the adopted one it uses
+ * in the kernel if any. The nexthop of the RDE takes it over later.
+ */
+int
+kr_stale_adopt(struct ktable *kt, struct kroute_full *paths, int npaths,
+    uint32_t nhid)
 {
-	static struct ctl_show_interface iface;
-#ifdef NOTYET
-	uint64_t ifms_type;
-#endif
+	struct kroute_full	*kf = &paths[0];
+	struct knexthop_obj	 s, *nho;
+	struct kr_stale		*ks;
 
-	memset(&iface, 0, sizeof(iface));
-	strlcpy(iface.ifname, kif->ifname, sizeof(iface.ifname));
+	kf->flags = (kf->flags & (F_BLACKHOLE|F_REJECT)) |
+	    F_BGPD | F_BGPD_INSERTED;
+	kf->priority = RTP_MINE;
+	if (kroute_find(kt, &kf->prefix, kf->prefixlen, RTP_MINE) != NULL)
+		return (0);
 
-	snprintf(iface.linkstate, sizeof(iface.linkstate),
-	    "%s", get_linkstate(kif->if_type, kif->link_state));
+	if ((ks = kr_pool_get(&kr_stale_pool)) == NULL) {
+		log_warn("%s", __func__);
+		return (-1);
+	}
+	ks->prefix = kf->prefix;
+	ks->prefixlen = kf->prefixlen;
+	ks->rtableid = kt->rtableid;
 
-#ifdef NOTYET
-	if ((ifms_type = ift2ifm(kif->if_type)) != 0)
-		snprintf(iface.media, sizeof(iface.media),
-		    "%s", get_media_descr(ifms_type));
-#endif
+	if (kf->flags & (F_BLACKHOLE|F_REJECT))
+		nhid = 0;
+	else {
+		s.id = nhid;
+		if (nhid == 0 || (nho = RB_FIND(knexthop_obj_tree, &knhot,
+		    &s)) == NULL || nho->members == NULL)
+			nhid = knexthop_obj_adopt_paths(paths, npaths);
+	}
+	if (kroute_insert(kt, kf, nhid) == -1) {
+		kr_pool_put(&kr_stale_pool, ks);
+		return (-1);
+	}
+	RB_INSERT(kr_stale_tree, &krstale, ks);
+	kr_state.stale_len++;
+	kr_state.stale_adopted++;
+	return (0);
+}
 
-	iface.baudrate = kif->baudrate;
-	iface.rdomain = kif->rdomain;
-	iface.nh_reachable = kif->nh_reachable;
-	iface.is_up = (kif->flags & IFF_UP) == IFF_UP;
+/*
+ * The route is refreshed or gone, returns 1 if it was stale.
+ */
+int
+kr_stale_drop(u_int rtableid, const struct kroute_full *kf)
+{
+	struct kr_stale	*ks, key;
 
-	return &iface;
+	if (RB_EMPTY(&krstale))
+		return (0);
+
+	key.prefix = kf->prefix;
+	key.prefixlen = kf->prefixlen;
+	key.rtableid = rtableid;
+	if ((ks = RB_FIND(kr_stale_tree, &krstale, &key)) == NULL)
+		return (0);
+	RB_REMOVE(kr_stale_tree, &krstale, ks);
+	kr_pool_put(&kr_stale_pool, ks);
+
+	/* everything got announced again, nothing left to sweep */
+	if (--kr_state.stale_len == 0) {
+		kr_timer_stop(KR_TIMER_STALE);
+		log_info("all adopted routes refreshed");
+		knexthop_obj_adopt_end();
+	}
+	return (1);
 }
 
+/*
+ * Remove the adopted routes the RDE did not announce again.
+ */
 void
-kr_show_route(struct imsg *imsg)
+kr_stale_sweep(void)
 {
+	struct kr_stale		*ks;
 	struct ktable		*kt;
-	struct kroute		*kr, *kn;
-	struct kroute6		*kr6, *kn6;
-	struct kroute_full	*kf;
-	struct bgpd_addr	 addr;
-	struct ctl_kroute_req	 req;
-	struct ctl_show_nexthop	 snh;
-	struct knexthop		*h;
-	struct kif		*kif;
-	uint32_t		 tableid;
-	pid_t			 pid;
-	u_int			 i;
-	u_short			 ifindex = 0;
-
-	tableid = imsg_get_id(imsg);
-	pid = imsg_get_pid(imsg);
-	switch (imsg_get_type(imsg)) {
-	case IMSG_CTL_KROUTE:
-		if (imsg_get_data(imsg, &req, sizeof(req)) == -1) {
-			log_warnx("%s: wrong imsg len", __func__);
-			break;
-		}
-		kt = ktable_get(tableid);
-		if (kt == NULL) {
-			log_warnx("%s: table %u does not exist", __func__,
-			    tableid);
-			break;
+	struct kroute_full	 kf;
+	size_t			 n = 0;
+
+	kr_timer_stop(KR_TIMER_STALE);
+	while ((ks = RB_MIN(kr_stale_tree, &krstale)) != NULL) {
+		RB_REMOVE(kr_stale_tree, &krstale, ks);
+		kr_state.stale_len--;
+
+		if ((kt = ktable_get(ks->rtableid)) != NULL) {
+			memset(&kf, 0, sizeof(kf));
+			kf.prefix = ks->prefix;
+			kf.prefixlen = ks->prefixlen;
+			kf.flags = F_BGPD;
+			kf.priority = RTP_MINE;
+			if (kroute_remove(kt, &kf, 1) == 0)
+				n++;
 		}
-		if (!req.af || req.af == AF_INET)
-			RB_FOREACH(kr, kroute_tree, &kt->krt) {
-				if (req.flags && (kr->flags & req.flags) == 0)
-					continue;
-				kn = kr;
-				do {
-					kf = kr_tofull(kn);
-					kf->priority = kr_priority(kf);
-					send_imsg_session(IMSG_CTL_KROUTE,
-					    pid, kf, sizeof(*kf));
-				} while ((kn = kn->next) != NULL);
-			}
-		if (!req.af || req.af == AF_INET6)
-			RB_FOREACH(kr6, kroute6_tree, &kt->krt6) {
-				if (req.flags && (kr6->flags & req.flags) == 0)
-					continue;
-				kn6 = kr6;
-				do {
-					kf = kr6_tofull(kn6);
-					kf->priority = kr_priority(kf);
-					send_imsg_session(IMSG_CTL_KROUTE,
-					    pid, kf, sizeof(*kf));
-				} while ((kn6 = kn6->next) != NULL);
-			}
-		break;
-	case IMSG_CTL_KROUTE_ADDR:
-		if (imsg_get_data(imsg, &addr, sizeof(addr)) == -1) {
-			log_warnx("%s: wrong imsg len", __func__);
-			break;
-		}
-		kt = ktable_get(tableid);
-		if (kt == NULL) {
-			log_warnx("%s: table %u does not exist", __func__,
-			    tableid);
-			break;
-		}
-		kr = NULL;
-		switch (addr.aid) {
-		case AID_INET:
-			kr = kroute_match(kt, &addr, 1);
-			if (kr != NULL) {
-				kf = kr_tofull(kr);
-				kf->priority = kr_priority(kf);
-				send_imsg_session(IMSG_CTL_KROUTE,
-				    pid, kf, sizeof(*kf));
-			}
-			break;
-		case AID_INET6:
-			kr6 = kroute6_match(kt, &addr, 1);
-			if (kr6 != NULL) {
-				kf = kr6_tofull(kr6);
-				kf->priority = kr_priority(kf);
-				send_imsg_session(IMSG_CTL_KROUTE,
-				    pid, kf, sizeof(*kf));
-			}
-			break;
-		}
-		break;
-	case IMSG_CTL_SHOW_NEXTHOP:
-		kt = ktable_get(tableid);
-		if (kt == NULL) {
-			log_warnx("%s: table %u does not exist", __func__,
-			    tableid);
-			break;
-		}
-		RB_FOREACH(h, knexthop_tree, KT2KNT(kt)) {
-			memset(&snh, 0, sizeof(snh));
-			memcpy(&snh.addr, &h->nexthop, sizeof(snh.addr));
-			if (h->kroute != NULL) {
-				switch (h->nexthop.aid) {
-				case AID_INET:
-					kr = h->kroute;
-					snh.valid = kroute_validate(kr);
-					snh.krvalid = 1;
-					snh.kr = *kr_tofull(kr);
-					ifindex = kr->ifindex;
-					break;
-				case AID_INET6:
-					kr6 = h->kroute;
-					snh.valid = kroute6_validate(kr6);
-					snh.krvalid = 1;
-					snh.kr = *kr6_tofull(kr6);
-					ifindex = kr6->ifindex;
-					break;
-				}
-				snh.kr.priority = kr_priority(&snh.kr);
-				if ((kif = kif_find(ifindex)) != NULL)
-					memcpy(&snh.iface,
-					    kr_show_interface(kif),
-					    sizeof(snh.iface));
-			}
-			send_imsg_session(IMSG_CTL_SHOW_NEXTHOP, pid,
-			    &snh, sizeof(snh));
-		}
-		break;
-	case IMSG_CTL_SHOW_INTERFACE:
-		RB_FOREACH(kif, kif_tree, &kit)
-			send_imsg_session(IMSG_CTL_SHOW_INTERFACE,
-			    pid, kr_show_interface(kif),
-			    sizeof(struct ctl_show_interface));
-		break;
-	case IMSG_CTL_SHOW_FIB_TABLES:
-		for (i = 0; i < krt_size; i++) {
-			struct ktable	ktab;
+		kr_pool_put(&kr_stale_pool, ks);
+	}
+	kr_state.stale_swept += n;
+	if (n > 0)
+		log_info("%zu stale routes of a previous run removed", n);
+	knexthop_obj_adopt_end();
+}
 
-			if ((kt = ktable_get(i)) == NULL)
-				continue;
+void
+kr_stale_log(void)
+{
+	log_debug("fib adoption: %zu stale, %llu adopted, %llu refreshed, "
+	    "%llu swept", kr_state.stale_len,
+	    (unsigned long long)kr_state.stale_adopted,
+	    (unsigned long long)kr_state.stale_refreshed,
+	    (unsigned long long)kr_state.stale_swept);
+}
 
-			ktab = *kt;
-			/* do not leak internal information */
-			RB_INIT(&ktab.krt);
-			RB_INIT(&ktab.krt6);
-			RB_INIT(&ktab.knt);
-			TAILQ_INIT(&ktab.krn);
+/*
+ * Returns 1 if the route is kept out of the kernel by FIB aggregation.
+ */
+int
+kr_agg_find(u_int rtableid, const struct kroute_full *kf)
+{
+	struct kr_agg	key;
 
-			send_imsg_session(IMSG_CTL_SHOW_FIB_TABLES,
-			    pid, &ktab, sizeof(ktab));
-		}
-		break;
-	default:	/* nada */
-		break;
-	}
+	if (RB_EMPTY(&kragg))
+		return (0);
 
-	send_imsg_session(IMSG_CTL_END, pid, NULL, 0);
+	key.prefix = kf->prefix;
+	key.prefixlen = kf->prefixlen;
+	key.rtableid = rtableid;
+	return (RB_FIND(kr_agg_tree, &kragg, &key) != NULL);
 }
 
-static void
-kr_send_dependon(struct kif *kif)
+/* our route, if it is the only one of the prefix */
+static struct kroute *
+kr_agg_sole4(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	struct session_dependon sdon = { {0} };
+	struct kroute	*kr;
 
-	strlcpy(sdon.ifname, kif->ifname, sizeof(sdon.ifname));
-	sdon.depend_state = kif->depend_state;
-	send_imsg_session(IMSG_SESSION_DEPENDON, 0, &sdon, sizeof(sdon));
+	/* RTP_MINE sorts last, anything else would be found first */
+	kr = kroute_find(kt, prefix, prefixlen, RTP_ANY);
+	if (kr == NULL || kr->priority != RTP_MINE ||
+	    !(kr->flags & F_BGPD) || kr->next != NULL)
+		return (NULL);
+	return (kr);
 }
 
-void
-kr_ifinfo(char *ifname)
+static struct kroute6 *
+kr_agg_sole6(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	struct kif	*kif;
+	struct kroute6	*kr6;
 
-	RB_FOREACH(kif, kif_tree, &kit)
-		if (!strcmp(ifname, kif->ifname)) {
-			kr_send_dependon(kif);
-			return;
-		}
+	kr6 = kroute6_find(kt, prefix, prefixlen, RTP_ANY);
+	if (kr6 == NULL || kr6->priority != RTP_MINE ||
+	    !(kr6->flags & F_BGPD) || kr6->next != NULL)
+		return (NULL);
+	return (kr6);
 }
 
+/*
+ * The route is redundant if the next shorter prefix covering it is a
+ * sole route of ours forwarding the same way.
+ */
 static int
-kr_net_redist_add(struct ktable *kt, struct network_config *net,
-    struct filter_set_head *attr, int dynamic)
+kr_agg_redundant4(struct ktable *kt, const struct kroute_full *kf,
+    struct kroute *kr)
 {
-	struct kredist_node *r, *xr;
+	struct kroute		*cover;
+	struct bgpd_addr	 masked;
+	uint8_t			 plens[32 + 1];
+	int			 i;
 
-	if ((r = calloc(1, sizeof(*r))) == NULL)
-		fatal("%s", __func__);
-	r->prefix = net->prefix;
-	r->prefixlen = net->prefixlen;
-	r->rd = net->rd;
-	r->dynamic = dynamic;
+	if (kr->prefixlen == 0)
+		return (0);
+	i = kr_lpm_match(krlpm[kt->rtableid].root4, &kr->prefix,
+	    kr->prefixlen - 1, plens);
+	if (i == 0)
+		return (0);
+	applymask(&masked, &kf->prefix, plens[i - 1]);
+	if ((cover = kr_agg_sole4(kt, &masked, plens[i - 1])) == NULL)
+		return (0);
 
-	xr = RB_INSERT(kredist_tree, &kt->kredist, r);
-	if (xr != NULL) {
-		free(r);
+	return (cover->nexthop.s_addr == kr->nexthop.s_addr &&
+	    cover->ifindex == kr->ifindex && cover->nhid == kr->nhid &&
+	    ((cover->flags ^ kr->flags) &
+	    (F_BLACKHOLE|F_REJECT|F_MPLS)) == 0 &&
+	    (!(kr->flags & F_MPLS) || cover->mplslabel == kr->mplslabel));
+}
 
-		if (dynamic != xr->dynamic && dynamic) {
-			/*
-			 * ignore update a non-dynamic announcement is
-			 * already present which has preference.
-			 */
-			return 0;
-		}
-		/*
-		 * only equal or non-dynamic announcement ends up here.
-		 * In both cases reset the dynamic flag (nop for equal) and
-		 * redistribute.
-		 */
-		xr->dynamic = dynamic;
-	}
+static int
+kr_agg_redundant6(struct ktable *kt, const struct kroute_full *kf,
+    struct kroute6 *kr6)
+{
+	struct kroute6		*cover;
+	struct bgpd_addr	 masked;
+	uint8_t			 plens[128 + 1];
+	int			 i;
 
-	if (send_network(IMSG_NETWORK_ADD, net, attr) == -1)
-		log_warnx("%s: failed to send network update", __func__);
-	return 1;
+	if (kr6->prefixlen == 0)
+		return (0);
+	i = kr_lpm_match(krlpm[kt->rtableid].root6, &kr6->prefix,
+	    kr6->prefixlen - 1, plens);
+	if (i == 0)
+		return (0);
+	applymask(&masked, &kf->prefix, plens[i - 1]);
+	if ((cover = kr_agg_sole6(kt, &masked, plens[i - 1])) == NULL)
+		return (0);
+
+	return (memcmp(&cover->nexthop, &kr6->nexthop,
+	    sizeof(struct in6_addr)) == 0 &&
+	    cover->nexthop_scope_id == kr6->nexthop_scope_id &&
+	    cover->ifindex == kr6->ifindex && cover->nhid == kr6->nhid &&
+	    ((cover->flags ^ kr6->flags) &
+	    (F_BLACKHOLE|F_REJECT|F_MPLS)) == 0 &&
+	    (!(kr6->flags & F_MPLS) || cover->mplslabel == kr6->mplslabel));
 }
 
+/*
+ * Take our route of the prefix out of the kernel if it became redundant
+ * or put it back if it no longer is.
+ */
 static void
-kr_net_redist_del(struct ktable *kt, struct network_config *net, int dynamic)
+kr_agg_check(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	struct kredist_node *r, node;
-
-	memset(&node, 0, sizeof(node));
-	node.prefix = net->prefix;
-	node.prefixlen = net->prefixlen;
-	node.rd = net->rd;
-
-	r = RB_FIND(kredist_tree, &kt->kredist, &node);
-	if (r == NULL || dynamic != r->dynamic)
-		return;
+	struct kr_agg		*ka, key;
+	struct kroute		*kr;
+	struct kroute6		*kr6;
+	struct kroute_full	*kf = NULL;
+	uint16_t		*flags = NULL;
+	uint32_t		 nhid = 0;
+	int			 redundant = 0;
 
-	if (RB_REMOVE(kredist_tree, &kt->kredist, r) == NULL) {
-		log_warnx("%s: failed to remove network %s/%u", __func__,
-		    log_addr(&node.prefix), node.prefixlen);
+	switch (prefix->aid) {
+	case AID_INET:
+		kr = kroute_find(kt, prefix, prefixlen, RTP_MINE);
+		if (kr == NULL || !(kr->flags & F_BGPD))
+			break;
+		kf = kr_tofull(kr);
+		flags = &kr->flags;
+		nhid = kr->nhid;
+		redundant = kr_agg_sole4(kt, prefix, prefixlen) == kr &&
+		    kr_agg_redundant4(kt, kf, kr);
+		break;
+	case AID_INET6:
+		kr6 = kroute6_find(kt, prefix, prefixlen, RTP_MINE);
+		if (kr6 == NULL || !(kr6->flags & F_BGPD))
+			break;
+		kf = kr6_tofull(kr6);
+		flags = &kr6->flags;
+		nhid = kr6->nhid;
+		redundant = kr_agg_sole6(kt, prefix, prefixlen) == kr6 &&
+		    kr_agg_redundant6(kt, kf, kr6);
+		break;
+	default:
 		return;
 	}
-	free(r);
 
-	if (send_network(IMSG_NETWORK_REMOVE, net, NULL) == -1)
-		log_warnx("%s: failed to send network removal", __func__);
+	memset(&key, 0, sizeof(key));
+	applymask(&key.prefix, prefix, prefixlen);
+	key.prefixlen = prefixlen;
+	key.rtableid = kt->rtableid;
+	ka = RB_FIND(kr_agg_tree, &kragg, &key);
+
+	if (redundant) {
+		if (ka == NULL) {
+			if ((ka = kr_pool_get(&kr_agg_pool)) == NULL) {
+				log_warn("%s", __func__);
+				return;
+			}
+			ka->prefix = key.prefix;
+			ka->prefixlen = key.prefixlen;
+			ka->rtableid = key.rtableid;
+			RB_INSERT(kr_agg_tree, &kragg, ka);
+			kr_state.agg_len++;
+			kr_state.agg_suppressed++;
+		}
+		if (*flags & F_BGPD_INSERTED &&
+		    send_rtmsg(RTM_DELETE, kt, kf, 0))
+			*flags &= ~F_BGPD_INSERTED;
+	} else if (ka != NULL) {
+		RB_REMOVE(kr_agg_tree, &kragg, ka);
+		kr_pool_put(&kr_agg_pool, ka);
+		kr_state.agg_len--;
+		/* gone altogether or needed in the kernel again */
+		if (flags != NULL) {
+			kr_state.agg_restored++;
+			if (!(*flags & F_BGPD_INSERTED) &&
+			    send_rtmsg(RTM_ADD, kt, kf, nhid))
+				*flags |= F_BGPD_INSERTED;
+		}
+	}
 }
 
-int
-kr_net_match(struct ktable *kt, struct network_config *net, uint16_t flags,
-    int loopback)
+/*
+ * Recheck the routes directly below the prefix, the ones it covers with
+ * no other prefix in between. Deeper ones are skipped, their covering
+ * route did not change.
+ */
+static void
+kr_agg_children4(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	struct network		*xn;
+	struct kroute		 s, *kr;
+	struct bgpd_addr	 addr;
+	uint32_t		 end;
 
-	TAILQ_FOREACH(xn, &kt->krn, entry) {
-		if (xn->net.prefix.aid != net->prefix.aid)
-			continue;
-		switch (xn->net.type) {
-		case NETWORK_DEFAULT:
-			/* static match already redistributed */
-			continue;
-		case NETWORK_STATIC:
-			/* Skip networks with nexthop on loopback. */
-			if (loopback)
-				continue;
-			if (flags & F_STATIC)
-				break;
-			continue;
-		case NETWORK_CONNECTED:
-			/* Skip networks with nexthop on loopback. */
-			if (loopback)
-				continue;
-			if (flags & F_CONNECTED)
-				break;
-			continue;
-		case NETWORK_RTLABEL:
-			if (net->rtlabel == xn->net.rtlabel)
-				break;
-			continue;
-		case NETWORK_PRIORITY:
-			if (net->priority == xn->net.priority)
-				break;
-			continue;
-		case NETWORK_MRTCLONE:
-		case NETWORK_PREFIXSET:
-			/* must not happen */
-			log_warnx("%s: found a NETWORK_PREFIXSET, "
-			    "please send a bug report", __func__);
-			continue;
-		}
+	if (prefixlen >= 32)
+		return;
 
-		net->rd = xn->net.rd;
-		if (kr_net_redist_add(kt, net, &xn->net.attrset, 1))
-			return (1);
+	memset(&s, 0, sizeof(s));
+	s.prefix = prefix->v4;
+	s.prefixlen = prefixlen + 1;
+	memset(&addr, 0, sizeof(addr));
+	addr.aid = AID_INET;
+
+	kr = RB_NFIND(kroute_tree, &kt->krt, &s);
+	while (kr != NULL) {
+		addr.v4 = kr->prefix;
+		if (prefix_compare(&addr, prefix, prefixlen) != 0)
+			break;
+		kr_agg_check(kt, &addr, kr->prefixlen);
+
+		/* continue after the last address covered by kr */
+		end = ntohl(kr->prefix.s_addr) |
+		    (0xffffffffU >> kr->prefixlen);
+		if (end == 0xffffffffU)
+			break;
+		s.prefix.s_addr = htonl(end + 1);
+		s.prefixlen = 0;
+		kr = RB_NFIND(kroute_tree, &kt->krt, &s);
 	}
-	return (0);
 }
 
-struct network *
-kr_net_find(struct ktable *kt, struct network *n)
+static void
+kr_agg_children6(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	struct network		*xn;
+	struct kroute6		 s, *kr6;
+	struct bgpd_addr	 addr;
+	int			 i;
 
-	TAILQ_FOREACH(xn, &kt->krn, entry) {
-		if (n->net.type != xn->net.type ||
-		    n->net.prefixlen != xn->net.prefixlen ||
-		    n->net.rd != xn->net.rd ||
-		    n->net.rtlabel != xn->net.rtlabel ||
-		    n->net.priority != xn->net.priority)
-			continue;
-		if (memcmp(&n->net.prefix, &xn->net.prefix,
-		    sizeof(n->net.prefix)) == 0)
-			return (xn);
+	if (prefixlen >= 128)
+		return;
+
+	memset(&s, 0, sizeof(s));
+	s.prefix = prefix->v6;
+	s.prefixlen = prefixlen + 1;
+	memset(&addr, 0, sizeof(addr));
+	addr.aid = AID_INET6;
+
+	kr6 = RB_NFIND(kroute6_tree, &kt->krt6, &s);
+	while (kr6 != NULL) {
+		addr.v6 = kr6->prefix;
+		if (prefix_compare(&addr, prefix, prefixlen) != 0)
+			break;
+		kr_agg_check(kt, &addr, kr6->prefixlen);
+
+		/* continue after the last address covered by kr6 */
+		s.prefix = kr6->prefix;
+		for (i = kr6->prefixlen; i < 128; i++)
+			s.prefix.s6_addr[i / 8] |= 0x80 >> (i % 8);
+		for (i = 15; i >= 0; i--)
+			if (++s.prefix.s6_addr[i] != 0)
+				break;
+		if (i < 0)
+			break;
+		s.prefixlen = 0;
+		kr6 = RB_NFIND(kroute6_tree, &kt->krt6, &s);
 	}
-	return (NULL);
 }
 
+/*
+ * A route of the prefix came, went or changed its forwarding. The routes
+ * it covers directly may depend on it, so they are rechecked as well.
+ */
 void
-kr_net_reload(u_int rtableid, uint64_t rd, struct network_head *nh)
+kr_agg_update(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	struct network		*n, *xn;
-	struct ktable		*kt;
+	struct bgpd_addr	masked;
 
-	if ((kt = ktable_get(rtableid)) == NULL)
-		fatalx("%s: non-existent rtableid %d", __func__, rtableid);
+	if (!KR_FIB_AGGREGATE)
+		return;
 
-	while ((n = TAILQ_FIRST(nh)) != NULL) {
-		TAILQ_REMOVE(nh, n, entry);
-		n->net.old = 0;
-		n->net.rd = rd;
-		xn = kr_net_find(kt, n);
-		if (xn) {
-			xn->net.old = 0;
-			filterset_free(&xn->net.attrset);
-			filterset_move(&n->net.attrset, &xn->net.attrset);
-			network_free(n);
-		} else
-			TAILQ_INSERT_TAIL(&kt->krn, n, entry);
+	/* prefix may point into the buffer of kr_tofull() */
+	applymask(&masked, prefix, prefixlen);
+	kr_agg_check(kt, &masked, prefixlen);
+	switch (masked.aid) {
+	case AID_INET:
+		kr_agg_children4(kt, &masked, prefixlen);
+		break;
+	case AID_INET6:
+		kr_agg_children6(kt, &masked, prefixlen);
+		break;
 	}
 }
 
 void
-kr_net_clear(struct ktable *kt)
+kr_agg_log(void)
 {
-	struct network *n, *xn;
-
-	TAILQ_FOREACH_SAFE(n, &kt->krn, entry, xn) {
-		TAILQ_REMOVE(&kt->krn, n, entry);
-		if (n->net.type == NETWORK_DEFAULT)
-			kr_net_redist_del(kt, &n->net, 0);
-		network_free(n);
-	}
+	if (!KR_FIB_AGGREGATE)
+		return;
+	log_debug("fib aggregation: %zu routes suppressed, %llu suppressed, "
+	    "%llu restored", kr_state.agg_len,
+	    (unsigned long long)kr_state.agg_suppressed,
+	    (unsigned long long)kr_state.agg_restored);
 }
 
 void
-kr_redistribute(int type, struct ktable *kt, struct kroute_full *kf)
+kr_fib_decouple_all(void)
 {
-	struct network_config	 net;
-	uint32_t		 a;
-	int			 loflag = 0;
-
-	memset(&net, 0, sizeof(net));
-	net.prefix = kf->prefix;
-	net.prefixlen = kf->prefixlen;
-	net.rtlabel = rtlabel_name2id(kf->label);
-	rtlabel_unref(net.rtlabel); /* drop reference now, which is ok here */
-	net.priority = kf->priority;
-
-	/* shortcut for removals */
-	if (type == IMSG_NETWORK_REMOVE) {
-		kr_net_redist_del(kt, &net, 1);
-		return;
-	}
-
-	if (kf->flags & F_BGPD)
-		return;
+	u_int	 i;
 
-	switch (kf->prefix.aid) {
-	case AID_INET:
-		/*
-		 * We consider the loopback net and multicast addresses
-		 * as not redistributable.
-		 */
-		a = ntohl(kf->prefix.v4.s_addr);
-		if (IN_MULTICAST(a) ||
-		    (a >> IN_CLASSA_NSHIFT) == IN_LOOPBACKNET)
-			return;
+	for (i = krt_size; i > 0; i--)
+		kr_fib_decouple(i - 1);
+}
 
-		/* Check if the nexthop is the loopback addr. */
-		if (kf->nexthop.v4.s_addr == htonl(INADDR_LOOPBACK))
-			loflag = 1;
-		break;
+void
+kr_fib_prio_set(uint8_t prio)
+{
+	kr_state.fib_prio = prio;
+}
 
-	case AID_INET6:
-		/*
-		 * We consider unspecified, loopback, multicast,
-		 * link- and site-local, IPv4 mapped and IPv4 compatible
-		 * addresses as not redistributable.
-		 */
-		if (IN6_IS_ADDR_UNSPECIFIED(&kf->prefix.v6) ||
-		    IN6_IS_ADDR_LOOPBACK(&kf->prefix.v6) ||
-		    IN6_IS_ADDR_MULTICAST(&kf->prefix.v6) ||
-		    IN6_IS_ADDR_LINKLOCAL(&kf->prefix.v6) ||
-		    IN6_IS_ADDR_SITELOCAL(&kf->prefix.v6) ||
-		    IN6_IS_ADDR_V4MAPPED(&kf->prefix.v6) ||
-		    IN6_IS_ADDR_V4COMPAT(&kf->prefix.v6))
-			return;
+int
+kr_dispatch_msg(void)
+{
+	struct epoll_event	ev[KR_TIMER_MAX + 3];
+	int			i, n, rv = 0;
 
-		/* Check if the nexthop is the loopback addr. */
-		if (IN6_IS_ADDR_LOOPBACK(&kf->nexthop.v6))
-			loflag = 1;
-		break;
-	default:
-		/* unhandled AID cannot be redistributed */
-		return;
+	if ((n = epoll_wait(kr_state.epfd, ev, KR_TIMER_MAX + 3, 0)) == -1) {
+		if (errno == EINTR)
+			return (0);
+		log_warn("%s: epoll_wait", __func__);
+		return (-1);
 	}
-
-	/*
-	 * never allow 0/0 or ::/0 the default route can only be redistributed
-	 * with announce default.
-	 */
-	if (kf->prefixlen == 0)
-		return;
-
-	if (kr_net_match(kt, &net, kf->flags, loflag) == 0)
-		/* no longer matches, if still present remove it */
-		kr_net_redist_del(kt, &net, 1);
+	for (i = 0; i < n; i++) {
+		if (ev[i].data.u32 == KR_EV_NETLINK) {
+			if (dispatch_rtmsg() == -1)
+				rv = -1;
+		} else if (ev[i].data.u32 == KR_EV_WRITER)
+			kr_writer_done();
+		else if (ev[i].data.u32 == KR_EV_AUDIT)
+			kr_audit_dispatch();
+		else
+			kr_timer_fire(ev[i].data.u32);
+	}
+	if (kr_state.nhwalk)
+		knexthop_obj_walk();
+	if (kr_state.resync)
+		kr_resync();
+	return (rv);
 }
 
 void
-ktable_preload(void)
+kr_timer_set(enum kr_timer t, u_int msec)
 {
-	struct ktable	*kt;
-	struct network	*n;
-	u_int		 i;
+	struct itimerspec	its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = msec / 1000;
+	its.it_value.tv_nsec = (msec % 1000) * 1000000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;	/* 0 would disarm */
+	if (timerfd_settime(kr_state.timerfd[t], 0, &its, NULL) == -1)
+		fatal("timerfd_settime");
+	kr_state.timer_armed[t] = 1;
+}
 
-	for (i = 0; i < krt_size; i++) {
-		if ((kt = ktable_get(i)) == NULL)
-			continue;
-		kt->state = RECONF_DELETE;
+void
+kr_timer_stop(enum kr_timer t)
+{
+	struct itimerspec	its;
+	uint64_t		exp;
 
-		/* mark all networks as old */
-		TAILQ_FOREACH(n, &kt->krn, entry)
-			n->net.old = 1;
-	}
+	if (!kr_state.timer_armed[t])
+		return;
+	memset(&its, 0, sizeof(its));
+	if (timerfd_settime(kr_state.timerfd[t], 0, &its, NULL) == -1)
+		fatal("timerfd_settime");
+	/* drop an expiry that already happened */
+	(void)read(kr_state.timerfd[t], &exp, sizeof(exp));
+	kr_state.timer_armed[t] = 0;
 }
 
 void
-ktable_postload(void)
+kr_timer_fire(enum kr_timer t)
 {
-	struct ktable	*kt;
-	struct network	*n, *xn;
-	u_int		 i;
+	uint64_t	exp;
 
-	for (i = krt_size; i > 0; i--) {
-		if ((kt = ktable_get(i - 1)) == NULL)
-			continue;
-		if (kt->state == RECONF_DELETE) {
-			ktable_free(i - 1);
-			continue;
-		} else if (kt->state == RECONF_REINIT)
-			kt->fib_sync = kt->fib_conf;
+	if (read(kr_state.timerfd[t], &exp, sizeof(exp)) == -1) {
+		if (errno != EAGAIN)
+			log_warn("%s: read", __func__);
+		return;
+	}
+	kr_state.timer_armed[t] = 0;
 
-		/* cleanup old networks */
-		TAILQ_FOREACH_SAFE(n, &kt->krn, entry, xn) {
-			if (n->net.old) {
-				TAILQ_REMOVE(&kt->krn, n, entry);
-				if (n->net.type == NETWORK_DEFAULT)
-					kr_net_redist_del(kt, &n->net, 0);
-				network_free(n);
-			}
-		}
+	switch (t) {
+	case KR_TIMER_QUEUE:
+		kr_queue_flush();
+		break;
+	case KR_TIMER_WALK:
+		kr_walk_timer();
+		break;
+	case KR_TIMER_STALE:
+		kr_stale_sweep();
+		break;
+	case KR_TIMER_HOLD:
+		kr_fib_hold_timer();
+		break;
+	case KR_TIMER_AUDIT:
+		kr_audit();
+		kr_timer_set(KR_TIMER_AUDIT, KR_AUDIT_INTERVAL * 1000);
+		break;
+	case KR_TIMER_NEXTHOP:
+		knexthop_update_flush();
+		break;
+	case KR_TIMER_LINK:
+		kif_link_release();
+		break;
+	case KR_TIMER_AUDIT_WALK:
+		kr_audit_walk();
+		break;
+	default:
+		break;
 	}
 }
 
 int
-kr_reload(void)
+kr_nexthop_add(u_int rtableid, struct bgpd_addr *addr)
 {
 	struct ktable	*kt;
-	struct kroute	*kr;
-	struct kroute6	*kr6;
-	struct knexthop	*nh;
-	struct network	*n;
-	u_int		 rid;
-	int		 hasdyn = 0;
-
-	for (rid = 0; rid < krt_size; rid++) {
-		if ((kt = ktable_get(rid)) == NULL)
-			continue;
-
-		/* if this is the main nexthop table revalidate nexthops */
-		if (kt->rtableid == kt->nhtableid)
-			RB_FOREACH(nh, knexthop_tree, KT2KNT(kt))
-				knexthop_validate(kt, nh);
-
-		TAILQ_FOREACH(n, &kt->krn, entry)
-			if (n->net.type == NETWORK_DEFAULT) {
-				kr_net_redist_add(kt, &n->net,
-				    &n->net.attrset, 0);
-			} else
-				hasdyn = 1;
+	struct knexthop	*h;
 
-		if (hasdyn) {
-			/* only evaluate the full tree if we need */
-			RB_FOREACH(kr, kroute_tree, &kt->krt)
-				kr_redistribute(IMSG_NETWORK_ADD, kt,
-				    kr_tofull(kr));
-			RB_FOREACH(kr6, kroute6_tree, &kt->krt6)
-				kr_redistribute(IMSG_NETWORK_ADD, kt,
-				    kr6_tofull(kr6));
+	if ((kt = ktable_get(rtableid)) == NULL) {
+		log_warnx("%s: non-existent rtableid %d", __func__, rtableid);
+		return (0);
+	}
+	if ((h = knexthop_find(kt, addr)) != NULL) {
+		/* should not happen... this is actually an error path */
+		knexthop_send_update(h);
+	} else {
+		if ((h = kr_pool_get(&knexthop_pool)) == NULL) {
+			log_warn("%s", __func__);
+			return (-1);
 		}
+		memcpy(&h->nexthop, addr, sizeof(h->nexthop));
+
+		if (knexthop_insert(kt, h) == -1)
+			return (-1);
 	}
 
 	return (0);
 }
 
-uint8_t
-kr_priority(struct kroute_full *kf)
-{
-	if (kf->priority == RTP_MINE)
-		return kr_state.fib_prio;
-	return kf->priority;
-}
-
-struct kroute_full *
-kr_tofull(struct kroute *kr)
+void
+kr_nexthop_delete(u_int rtableid, struct bgpd_addr *addr)
 {
-	static struct kroute_full	kf;
-
-	memset(&kf, 0, sizeof(kf));
+	struct ktable	*kt;
+	struct knexthop	*kn;
 
-	kf.prefix.aid = AID_INET;
-	kf.prefix.v4.s_addr = kr->prefix.s_addr;
-	kf.nexthop.aid = AID_INET;
-	kf.nexthop.v4.s_addr = kr->nexthop.s_addr;
-	strlcpy(kf.label, rtlabel_id2name(kr->labelid), sizeof(kf.label));
-	kf.flags = kr->flags;
-	kf.ifindex = kr->ifindex;
-	kf.prefixlen = kr->prefixlen;
-	kf.priority = kr->priority;
-	kf.mplslabel = kr->mplslabel;
+	if ((kt = ktable_get(rtableid)) == NULL) {
+		log_warnx("%s: non-existent rtableid %d", __func__,
+		    rtableid);
+		return;
+	}
+	if ((kn = knexthop_find(kt, addr)) == NULL)
+		return;
 
-	return (&kf);
+	knexthop_remove(kt, kn);
 }
 
-struct kroute_full *
-kr6_tofull(struct kroute6 *kr6)
+static struct ctl_show_interface *
+kr_show_interface(struct kif *kif)
 {
-	static struct kroute_full	kf;
+	static struct ctl_show_interface iface;
+#ifdef NOTYET
+	uint64_t ifms_type;
+#endif
 
-	memset(&kf, 0, sizeof(kf));
+	memset(&iface, 0, sizeof(iface));
+	strlcpy(iface.ifname, kif->ifname, sizeof(iface.ifname));
 
-	kf.prefix.aid = AID_INET6;
-	kf.prefix.v6 = kr6->prefix;
-	kf.prefix.scope_id = kr6->prefix_scope_id;
-	kf.nexthop.aid = AID_INET6;
-	kf.nexthop.v6 = kr6->nexthop;
-	kf.nexthop.scope_id = kr6->nexthop_scope_id;
-	strlcpy(kf.label, rtlabel_id2name(kr6->labelid), sizeof(kf.label));
-	kf.flags = kr6->flags;
-	kf.ifindex = kr6->ifindex;
-	kf.prefixlen = kr6->prefixlen;
-	kf.priority = kr6->priority;
-	kf.mplslabel = kr6->mplslabel;
+	snprintf(iface.linkstate, sizeof(iface.linkstate),
+	    "%s", get_linkstate(kif->if_type, kif->link_state));
 
-	return (&kf);
-}
+#ifdef NOTYET
+	if ((ifms_type = ift2ifm(kif->if_type)) != 0)
+		snprintf(iface.media, sizeof(iface.media),
+		    "%s", get_media_descr(ifms_type));
+#endif
 
-/*
- * RB-tree compare functions
- */
+	iface.baudrate = kif->baudrate;
+	iface.rdomain = kif->rdomain;
+	iface.nh_reachable = kif->nh_reachable;
+	iface.is_up = (kif->flags & IFF_UP) == IFF_UP;
 
-int
+	return &iface;
+}
+
+void
+kr_show_route(struct imsg *imsg)
+{
+	struct ktable		*kt;
+	struct kroute		*kr, *kn;
+	struct kroute6		*kr6, *kn6;
+	struct kroute_full	*kf;
+	struct bgpd_addr	 addr;
+	struct ctl_kroute_req	 req;
+	struct ctl_show_nexthop	 snh;
+	struct knexthop		*h;
+	struct kif		*kif;
+	uint32_t		 tableid;
+	pid_t			 pid;
+	u_int			 i;
+	u_short			 ifindex = 0;
+
+	tableid = imsg_get_id(imsg);
+	pid = imsg_get_pid(imsg);
+	switch (imsg_get_type(imsg)) {
+	case IMSG_CTL_KROUTE:
+		if (imsg_get_data(imsg, &req, sizeof(req)) == -1) {
+			log_warnx("%s: wrong imsg len", __func__);
+			break;
+		}
+		kt = ktable_get(tableid);
+		if (kt == NULL) {
+			log_warnx("%s: table %u does not exist", __func__,
+			    tableid);
+			break;
+		}
+		if (!req.af || req.af == AF_INET)
+			RB_FOREACH(kr, kroute_tree, &kt->krt) {
+				if (req.flags && (kr->flags & req.flags) == 0)
+					continue;
+				kn = kr;
+				do {
+					kf = kr_tofull(kn);
+					kf->priority = kr_priority(kf);
+					send_imsg_session(IMSG_CTL_KROUTE,
+					    pid, kf, sizeof(*kf));
+				} while ((kn = kn->next) != NULL);
+			}
+		if (!req.af || req.af == AF_INET6)
+			RB_FOREACH(kr6, kroute6_tree, &kt->krt6) {
+				if (req.flags && (kr6->flags & req.flags) == 0)
+					continue;
+				kn6 = kr6;
+				do {
+					kf = kr6_tofull(kn6);
+					kf->priority = kr_priority(kf);
+					send_imsg_session(IMSG_CTL_KROUTE,
+					    pid, kf, sizeof(*kf));
+				} while ((kn6 = kn6->next) != NULL);
+			}
+		break;
+	case IMSG_CTL_KROUTE_ADDR:
+		if (imsg_get_data(imsg, &addr, sizeof(addr)) == -1) {
+			log_warnx("%s: wrong imsg len", __func__);
+			break;
+		}
+		kt = ktable_get(tableid);
+		if (kt == NULL) {
+			log_warnx("%s: table %u does not exist", __func__,
+			    tableid);
+			break;
+		}
+		kr = NULL;
+		switch (addr.aid) {
+		case AID_INET:
+			kr = kroute_match(kt, &addr, 1);
+			if (kr != NULL) {
+				kf = kr_tofull(kr);
+				kf->priority = kr_priority(kf);
+				send_imsg_session(IMSG_CTL_KROUTE,
+				    pid, kf, sizeof(*kf));
+			}
+			break;
+		case AID_INET6:
+			kr6 = kroute6_match(kt, &addr, 1);
+			if (kr6 != NULL) {
+				kf = kr6_tofull(kr6);
+				kf->priority = kr_priority(kf);
+				send_imsg_session(IMSG_CTL_KROUTE,
+				    pid, kf, sizeof(*kf));
+			}
+			break;
+		}
+		break;
+	case IMSG_CTL_SHOW_NEXTHOP:
+		kt = ktable_get(tableid);
+		if (kt == NULL) {
+			log_warnx("%s: table %u does not exist", __func__,
+			    tableid);
+			break;
+		}
+		RB_FOREACH(h, knexthop_tree, KT2KNT(kt)) {
+			memset(&snh, 0, sizeof(snh));
+			memcpy(&snh.addr, &h->nexthop, sizeof(snh.addr));
+			if (h->kroute != NULL) {
+				switch (h->nexthop.aid) {
+				case AID_INET:
+					kr = h->kroute;
+					snh.valid = kroute_validate(kr);
+					snh.krvalid = 1;
+					snh.kr = *kr_tofull(kr);
+					ifindex = kr->ifindex;
+					break;
+				case AID_INET6:
+					kr6 = h->kroute;
+					snh.valid = kroute6_validate(kr6);
+					snh.krvalid = 1;
+					snh.kr = *kr6_tofull(kr6);
+					ifindex = kr6->ifindex;
+					break;
+				}
+				snh.kr.priority = kr_priority(&snh.kr);
+				if ((kif = kif_find(ifindex)) != NULL)
+					memcpy(&snh.iface,
+					    kr_show_interface(kif),
+					    sizeof(snh.iface));
+			}
+			send_imsg_session(IMSG_CTL_SHOW_NEXTHOP, pid,
+			    &snh, sizeof(snh));
+		}
+		break;
+	case IMSG_CTL_SHOW_INTERFACE:
+		RB_FOREACH(kif, kif_tree, &kit)
+			send_imsg_session(IMSG_CTL_SHOW_INTERFACE,
+			    pid, kr_show_interface(kif),
+			    sizeof(struct ctl_show_interface));
+		break;
+	case IMSG_CTL_SHOW_FIB_TABLES:
+		for (i = 0; i < krt_size; i++) {
+			struct ktable	ktab;
+
+			if ((kt = ktable_get(i)) == NULL)
+				continue;
+
+			ktab = *kt;
+			/* do not leak internal information */
+			RB_INIT(&ktab.krt);
+			RB_INIT(&ktab.krt6);
+			RB_INIT(&ktab.knt);
+			TAILQ_INIT(&ktab.krn);
+
+			send_imsg_session(IMSG_CTL_SHOW_FIB_TABLES,
+			    pid, &ktab, sizeof(ktab));
+		}
+		break;
+	default:	/* nada */
+		break;
+	}
+
+	send_imsg_session(IMSG_CTL_END, pid, NULL, 0);
+}
+
+static void
+kr_send_dependon(struct kif *kif)
+{
+	struct session_dependon sdon = { {0} };
+
+	strlcpy(sdon.ifname, kif->ifname, sizeof(sdon.ifname));
+	sdon.depend_state = kif->depend_state;
+	send_imsg_session(IMSG_SESSION_DEPENDON, 0, &sdon, sizeof(sdon));
+}
+
+void
+kr_ifinfo(char *ifname)
+{
+	struct kif	*kif;
+
+	if ((kif = kif_find_name(ifname)) != NULL)
+		kr_send_dependon(kif);
+}
+
+static int
+kr_net_redist_add(struct ktable *kt, struct network_config *net,
+    struct filter_set_head *attr, int dynamic)
+{
+	struct kredist_node *r, *xr;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		fatal("%s", __func__);
+	r->prefix = net->prefix;
+	r->prefixlen = net->prefixlen;
+	r->rd = net->rd;
+	r->dynamic = dynamic;
+
+	xr = RB_INSERT(kredist_tree, &kt->kredist, r);
+	if (xr != NULL) {
+		free(r);
+
+		if (dynamic != xr->dynamic && dynamic) {
+			/*
+			 * ignore update a non-dynamic announcement is
+			 * already present which has preference.
+			 */
+			return 0;
+		}
+		/*
+		 * only equal or non-dynamic announcement ends up here.
+		 * In both cases reset the dynamic flag (nop for equal) and
+		 * redistribute.
+		 */
+		xr->dynamic = dynamic;
+	}
+
+	if (send_network(IMSG_NETWORK_ADD, net, attr) == -1)
+		log_warnx("%s: failed to send network update", __func__);
+	return 1;
+}
+
+static void
+kr_net_redist_del(struct ktable *kt, struct network_config *net, int dynamic)
+{
+	struct kredist_node *r, node;
+
+	memset(&node, 0, sizeof(node));
+	node.prefix = net->prefix;
+	node.prefixlen = net->prefixlen;
+	node.rd = net->rd;
+
+	r = RB_FIND(kredist_tree, &kt->kredist, &node);
+	if (r == NULL || dynamic != r->dynamic)
+		return;
+
+	if (RB_REMOVE(kredist_tree, &kt->kredist, r) == NULL) {
+		log_warnx("%s: failed to remove network %s/%u", __func__,
+		    log_addr(&node.prefix), node.prefixlen);
+		return;
+	}
+	free(r);
+
+	if (send_network(IMSG_NETWORK_REMOVE, net, NULL) == -1)
+		log_warnx("%s: failed to send network removal", __func__);
+}
+
+/* first network of the given type and match value, in kt->krn order */
+static struct kr_net_node *
+kr_net_first(struct ktable *kt, uint8_t aid, uint8_t type, uint16_t value)
+{
+	struct kr_net_node	 key, *xn;
+
+	key.aid = aid;
+	key.type = type;
+	key.value = value;
+	key.seq = 0;
+	xn = RB_NFIND(kr_net_match_tree, &krnetidx[kt->rtableid].match, &key);
+	if (xn == NULL || xn->aid != aid || xn->type != type ||
+	    xn->value != value)
+		return (NULL);
+	return (xn);
+}
+
+static struct kr_net_node *
+kr_net_next(struct ktable *kt, struct kr_net_node *n)
+{
+	struct kr_net_node	*xn;
+
+	xn = RB_NEXT(kr_net_match_tree, &krnetidx[kt->rtableid].match, n);
+	if (xn == NULL || xn->aid != n->aid || xn->type != n->type ||
+	    xn->value != n->value)
+		return (NULL);
+	return (xn);
+}
+
+int
+kr_net_match(struct ktable *kt, struct network_config *net, uint16_t flags,
+    int loopback)
+{
+	struct kr_net_node	*cur[4], *xn;
+	u_int			 i, ncur = 0, best = 0;
+	uint8_t			 aid = net->prefix.aid;
+
+	/* skip static and connected networks with nexthop on loopback */
+	if (!loopback && flags & F_STATIC)
+		cur[ncur++] = kr_net_first(kt, aid, NETWORK_STATIC, 0);
+	if (!loopback && flags & F_CONNECTED)
+		cur[ncur++] = kr_net_first(kt, aid, NETWORK_CONNECTED, 0);
+	cur[ncur++] = kr_net_first(kt, aid, NETWORK_RTLABEL, net->rtlabel);
+	cur[ncur++] = kr_net_first(kt, aid, NETWORK_PRIORITY, net->priority);
+
+	/* merge the candidates back into kt->krn order */
+	for (;;) {
+		xn = NULL;
+		for (i = 0; i < ncur; i++)
+			if (cur[i] != NULL &&
+			    (xn == NULL || cur[i]->seq < xn->seq)) {
+				xn = cur[i];
+				best = i;
+			}
+		if (xn == NULL)
+			break;
+		cur[best] = kr_net_next(kt, xn);
+
+		net->rd = xn->n->net.rd;
+		if (kr_net_redist_add(kt, net, &xn->n->net.attrset, 1))
+			return (1);
+	}
+	return (0);
+}
+
+static struct kr_net_node *
+kr_net_lookup(struct ktable *kt, struct network *n)
+{
+	struct kr_net_node	 key;
+
+	key.n = n;
+	return (RB_FIND(kr_net_tree, &krnetidx[kt->rtableid].nets, &key));
+}
+
+struct network *
+kr_net_find(struct ktable *kt, struct network *n)
+{
+	struct kr_net_node	*xn;
+
+	xn = kr_net_lookup(kt, n);
+	return (xn != NULL ? xn->n : NULL);
+}
+
+/*
+ * Add a network at the end of kt->krn.
+ */
+void
+kr_net_insert(struct ktable *kt, struct network *n)
+{
+	struct kr_netidx	*idx = &krnetidx[kt->rtableid];
+	struct kr_net_node	*xn;
+
+	if ((xn = calloc(1, sizeof(*xn))) == NULL)
+		fatal("%s", __func__);
+	xn->n = n;
+	xn->seq = ++idx->seq;
+	xn->reload = 1;
+	xn->aid = n->net.prefix.aid;
+	xn->type = n->net.type;
+	switch (n->net.type) {
+	case NETWORK_DEFAULT:
+		/* static match already redistributed */
+		break;
+	case NETWORK_RTLABEL:
+		xn->value = n->net.rtlabel;
+		/* FALLTHROUGH */
+	case NETWORK_STATIC:
+	case NETWORK_CONNECTED:
+		RB_INSERT(kr_net_match_tree, &idx->match, xn);
+		break;
+	case NETWORK_PRIORITY:
+		xn->value = n->net.priority;
+		RB_INSERT(kr_net_match_tree, &idx->match, xn);
+		break;
+	case NETWORK_MRTCLONE:
+	case NETWORK_PREFIXSET:
+		/* must not happen */
+		log_warnx("%s: found a NETWORK_PREFIXSET, "
+		    "please send a bug report", __func__);
+		break;
+	}
+	RB_INSERT(kr_net_tree, &idx->nets, xn);
+	TAILQ_INSERT_TAIL(&kt->krn, n, entry);
+	kr_net_dirty(kt, n, 0);
+}
+
+void
+kr_net_remove(struct ktable *kt, struct network *n)
+{
+	struct kr_netidx	*idx = &krnetidx[kt->rtableid];
+	struct kr_net_node	*xn;
+
+	TAILQ_REMOVE(&kt->krn, n, entry);
+	if ((xn = kr_net_lookup(kt, n)) == NULL) {
+		log_warnx("%s: network not indexed", __func__);
+		return;
+	}
+	RB_REMOVE(kr_net_tree, &idx->nets, xn);
+	if (RB_FIND(kr_net_match_tree, &idx->match, xn) == xn)
+		RB_REMOVE(kr_net_match_tree, &idx->match, xn);
+	free(xn);
+}
+
+/*
+ * Remember a dynamic rule the reload added, changed or removed.
+ */
+void
+kr_net_dirty(struct ktable *kt, struct network *n, int removed)
+{
+	struct kr_net_dirty	*d;
+
+	switch (n->net.type) {
+	case NETWORK_STATIC:
+	case NETWORK_CONNECTED:
+	case NETWORK_RTLABEL:
+	case NETWORK_PRIORITY:
+		break;
+	default:
+		return;
+	}
+
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		fatal("%s", __func__);
+	d->rd = n->net.rd;
+	d->aid = n->net.prefix.aid;
+	d->type = n->net.type;
+	if (n->net.type == NETWORK_RTLABEL)
+		d->value = n->net.rtlabel;
+	else if (n->net.type == NETWORK_PRIORITY)
+		d->value = n->net.priority;
+	d->removed = removed;
+	SLIST_INSERT_HEAD(&krnetidx[kt->rtableid].dirty, d, entry);
+}
+
+static int
+kr_net_dirty_match(struct kr_net_dirty *d, uint8_t aid, uint16_t flags,
+    uint16_t labelid, uint8_t priority)
+{
+	if (d->aid != aid)
+		return (0);
+	switch (d->type) {
+	case NETWORK_STATIC:
+		return ((flags & F_STATIC) != 0);
+	case NETWORK_CONNECTED:
+		return ((flags & F_CONNECTED) != 0);
+	case NETWORK_RTLABEL:
+		return (labelid == d->value);
+	case NETWORK_PRIORITY:
+		return (priority == d->value);
+	}
+	return (0);
+}
+
+/*
+ * Redistribute the kernel routes again that a dirty rule may match.
+ * Announcements of removed rules are withdrawn first, another rule may
+ * still pick the route up. Returns the number of routes evaluated.
+ */
+size_t
+kr_net_reeval(struct ktable *kt)
+{
+	struct kr_netidx	*idx = &krnetidx[kt->rtableid];
+	struct kr_net_dirty	*d;
+	struct kroute		*kr;
+	struct kroute6		*kr6;
+	struct kroute_full	*kf;
+	struct network_config	 net;
+	size_t			 cnt = 0;
+	int			 match;
+
+	if (SLIST_EMPTY(&idx->dirty))
+		return (0);
+
+	RB_FOREACH(kr, kroute_tree, &kt->krt) {
+		if (kr->flags & F_BGPD)
+			continue;
+		match = 0;
+		SLIST_FOREACH(d, &idx->dirty, entry) {
+			if (!kr_net_dirty_match(d, AID_INET, kr->flags,
+			    kr->labelid, kr->priority))
+				continue;
+			match = 1;
+			if (d->removed) {
+				memset(&net, 0, sizeof(net));
+				net.prefix.aid = AID_INET;
+				net.prefix.v4 = kr->prefix;
+				net.prefixlen = kr->prefixlen;
+				net.rd = d->rd;
+				kr_net_redist_del(kt, &net, 1);
+			}
+		}
+		if (match) {
+			kf = kr_tofull(kr);
+			kr_redistribute(IMSG_NETWORK_ADD, kt, kf);
+			cnt++;
+		}
+	}
+	RB_FOREACH(kr6, kroute6_tree, &kt->krt6) {
+		if (kr6->flags & F_BGPD)
+			continue;
+		match = 0;
+		SLIST_FOREACH(d, &idx->dirty, entry) {
+			if (!kr_net_dirty_match(d, AID_INET6, kr6->flags,
+			    kr6->labelid, kr6->priority))
+				continue;
+			match = 1;
+			if (d->removed) {
+				memset(&net, 0, sizeof(net));
+				net.prefix.aid = AID_INET6;
+				net.prefix.v6 = kr6->prefix;
+				net.prefix.scope_id = kr6->prefix_scope_id;
+				net.prefixlen = kr6->prefixlen;
+				net.rd = d->rd;
+				kr_net_redist_del(kt, &net, 1);
+			}
+		}
+		if (match) {
+			kf = kr6_tofull(kr6);
+			kr_redistribute(IMSG_NETWORK_ADD, kt, kf);
+			cnt++;
+		}
+	}
+
+	while ((d = SLIST_FIRST(&idx->dirty)) != NULL) {
+		SLIST_REMOVE_HEAD(&idx->dirty, entry);
+		free(d);
+	}
+	return (cnt);
+}
+
+void
+kr_net_reload(u_int rtableid, uint64_t rd, struct network_head *nh)
+{
+	struct network		*n, *xn;
+	struct kr_net_node	*xnn;
+	struct ktable		*kt;
+
+	if ((kt = ktable_get(rtableid)) == NULL)
+		fatalx("%s: non-existent rtableid %d", __func__, rtableid);
+
+	while ((n = TAILQ_FIRST(nh)) != NULL) {
+		TAILQ_REMOVE(nh, n, entry);
+		n->net.old = 0;
+		n->net.rd = rd;
+		if ((xnn = kr_net_lookup(kt, n)) != NULL) {
+			xn = xnn->n;
+			xn->net.old = 0;
+			/* announcements only change with the attributes */
+			if (!filterset_equal(&xn->net.attrset,
+			    &n->net.attrset)) {
+				xnn->reload = 1;
+				kr_net_dirty(kt, xn, 0);
+			}
+			filterset_free(&xn->net.attrset);
+			filterset_move(&n->net.attrset, &xn->net.attrset);
+			network_free(n);
+		} else
+			kr_net_insert(kt, n);
+	}
+}
+
+void
+kr_net_clear(struct ktable *kt)
+{
+	struct network		*n, *xn;
+	struct kr_net_dirty	*d;
+
+	TAILQ_FOREACH_SAFE(n, &kt->krn, entry, xn) {
+		kr_net_remove(kt, n);
+		if (n->net.type == NETWORK_DEFAULT)
+			kr_net_redist_del(kt, &n->net, 0);
+		network_free(n);
+	}
+	while ((d = SLIST_FIRST(&krnetidx[kt->rtableid].dirty)) != NULL) {
+		SLIST_REMOVE_HEAD(&krnetidx[kt->rtableid].dirty, entry);
+		free(d);
+	}
+}
+
+void
+kr_redistribute(int type, struct ktable *kt, struct kroute_full *kf)
+{
+	struct network_config	 net;
+	uint32_t		 a;
+	int			 loflag = 0;
+
+	memset(&net, 0, sizeof(net));
+	net.prefix = kf->prefix;
+	net.prefixlen = kf->prefixlen;
+	if (kf->label[0] != '\0') {
+		net.rtlabel = rtlabel_name2id(kf->label);
+		/* drop reference now, which is ok here */
+		rtlabel_unref(net.rtlabel);
+	}
+	net.priority = kf->priority;
+
+	/* shortcut for removals */
+	if (type == IMSG_NETWORK_REMOVE) {
+		kr_net_redist_del(kt, &net, 1);
+		return;
+	}
+
+	if (kf->flags & F_BGPD)
+		return;
+
+	switch (kf->prefix.aid) {
+	case AID_INET:
+		/*
+		 * We consider the loopback net and multicast addresses
+		 * as not redistributable.
+		 */
+		a = ntohl(kf->prefix.v4.s_addr);
+		if (IN_MULTICAST(a) ||
+		    (a >> IN_CLASSA_NSHIFT) == IN_LOOPBACKNET)
+			return;
+
+		/* Check if the nexthop is the loopback addr. */
+		if (kf->nexthop.v4.s_addr == htonl(INADDR_LOOPBACK))
+			loflag = 1;
+		break;
+
+	case AID_INET6:
+		/*
+		 * We consider unspecified, loopback, multicast,
+		 * link- and site-local, IPv4 mapped and IPv4 compatible
+		 * addresses as not redistributable.
+		 */
+		if (IN6_IS_ADDR_UNSPECIFIED(&kf->prefix.v6) ||
+		    IN6_IS_ADDR_LOOPBACK(&kf->prefix.v6) ||
+		    IN6_IS_ADDR_MULTICAST(&kf->prefix.v6) ||
+		    IN6_IS_ADDR_LINKLOCAL(&kf->prefix.v6) ||
+		    IN6_IS_ADDR_SITELOCAL(&kf->prefix.v6) ||
+		    IN6_IS_ADDR_V4MAPPED(&kf->prefix.v6) ||
+		    IN6_IS_ADDR_V4COMPAT(&kf->prefix.v6))
+			return;
+
+		/* Check if the nexthop is the loopback addr. */
+		if (IN6_IS_ADDR_LOOPBACK(&kf->nexthop.v6))
+			loflag = 1;
+		break;
+	default:
+		/* unhandled AID cannot be redistributed */
+		return;
+	}
+
+	/*
+	 * never allow 0/0 or ::/0 the default route can only be redistributed
+	 * with announce default.
+	 */
+	if (kf->prefixlen == 0)
+		return;
+
+	if (kr_net_match(kt, &net, kf->flags, loflag) == 0)
+		/* no longer matches, if still present remove it */
+		kr_net_redist_del(kt, &net, 1);
+}
+
+void
+ktable_preload(void)
+{
+	struct ktable	*kt;
+	struct network	*n;
+	u_int		 i;
+
+	clock_gettime(CLOCK_MONOTONIC, &kr_state.reload_start);
+	for (i = 0; i < krt_size; i++) {
+		if ((kt = ktable_get(i)) == NULL)
+			continue;
+		kt->state = RECONF_DELETE;
+
+		/* mark all networks as old */
+		TAILQ_FOREACH(n, &kt->krn, entry)
+			n->net.old = 1;
+	}
+}
+
+void
+ktable_postload(void)
+{
+	struct ktable	*kt;
+	struct network	*n, *xn;
+	u_int		 i;
+
+	for (i = krt_size; i > 0; i--) {
+		if ((kt = ktable_get(i - 1)) == NULL)
+			continue;
+		if (kt->state == RECONF_DELETE) {
+			ktable_free(i - 1);
+			continue;
+		} else if (kt->state == RECONF_REINIT)
+			kt->fib_sync = kt->fib_conf;
+
+		/* cleanup old networks */
+		TAILQ_FOREACH_SAFE(n, &kt->krn, entry, xn) {
+			if (n->net.old) {
+				kr_net_remove(kt, n);
+				kr_net_dirty(kt, n, 1);
+				if (n->net.type == NETWORK_DEFAULT)
+					kr_net_redist_del(kt, &n->net, 0);
+				network_free(n);
+			}
+		}
+	}
+}
+
+/*
+ * Nexthop validity only depends on whether routes of the RDE and default
+ * routes may resolve nexthops, see bgpd_oknexthop().
+ */
+static int
+kr_nexthop_policy(void)
+{
+	struct kroute_full	kf;
+	int			policy = 0;
+
+	memset(&kf, 0, sizeof(kf));
+	kf.prefix.aid = AID_INET;
+	if (bgpd_oknexthop(&kf))
+		policy |= 1;
+	kf.prefixlen = 32;
+	kf.flags = F_BGPD;
+	if (bgpd_oknexthop(&kf))
+		policy |= 2;
+	return (policy);
+}
+
+/*
+ * Apply the changes of a reload. Nexthops are only revalidated if the
+ * nexthop policy changed, network rules only announced if they are new
+ * or changed and kernel routes only redistributed again if a new,
+ * changed or removed dynamic rule can match them.
+ */
+int
+kr_reload(void)
+{
+	struct ktable		*kt;
+	struct knexthop		*nh;
+	struct network		*n;
+	struct kr_net_node	*xn;
+	struct timespec		 start, now, total;
+	size_t			 nroutes = 0;
+	u_int			 rid, nnets = 0;
+	int			 policy, nhreval;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (kr_state.reload_start.tv_sec == 0 &&
+	    kr_state.reload_start.tv_nsec == 0)
+		kr_state.reload_start = start;
+	policy = kr_nexthop_policy();
+	nhreval = policy != kr_state.nh_policy;
+	kr_state.nh_policy = policy;
+
+	for (rid = 0; rid < krt_size; rid++) {
+		if ((kt = ktable_get(rid)) == NULL)
+			continue;
+
+		/* if this is the main nexthop table revalidate nexthops */
+		if (nhreval && kt->rtableid == kt->nhtableid)
+			RB_FOREACH(nh, knexthop_tree, KT2KNT(kt))
+				knexthop_validate(kt, nh);
+
+		TAILQ_FOREACH(n, &kt->krn, entry) {
+			if ((xn = kr_net_lookup(kt, n)) == NULL ||
+			    !xn->reload)
+				continue;
+			xn->reload = 0;
+			nnets++;
+			if (n->net.type == NETWORK_DEFAULT)
+				kr_net_redist_add(kt, &n->net,
+				    &n->net.attrset, 0);
+		}
+
+		nroutes += kr_net_reeval(kt);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &kr_state.reload_start, &total);
+	timespecsub(&now, &start, &now);
+	log_info("kernel reload done in %lld.%03ld sec (kroute %lld.%03ld "
+	    "sec): %u networks changed, %zu routes redistributed%s",
+	    (long long)total.tv_sec, total.tv_nsec / 1000000,
+	    (long long)now.tv_sec, now.tv_nsec / 1000000, nnets, nroutes,
+	    nhreval ? ", nexthops revalidated" : "");
+	memset(&kr_state.reload_start, 0, sizeof(kr_state.reload_start));
+	return (0);
+}
+
+uint8_t
+kr_priority(struct kroute_full *kf)
+{
+	if (kf->priority == RTP_MINE)
+		return kr_state.fib_prio;
+	return kf->priority;
+}
+
+struct kroute_full *
+kr_tofull(struct kroute *kr)
+{
+	static struct kroute_full	kf;
+
+	memset(&kf, 0, sizeof(kf));
+
+	kf.prefix.aid = AID_INET;
+	kf.prefix.v4.s_addr = kr->prefix.s_addr;
+	kf.nexthop.aid = AID_INET;
+	kf.nexthop.v4.s_addr = kr->nexthop.s_addr;
+	if (kr->labelid != 0)
+		strlcpy(kf.label, rtlabel_id2name(kr->labelid),
+		    sizeof(kf.label));
+	kf.flags = kr->flags;
+	kf.ifindex = kr->ifindex;
+	kf.prefixlen = kr->prefixlen;
+	kf.priority = kr->priority;
+	kf.mplslabel = kr->mplslabel;
+
+	return (&kf);
+}
+
+struct kroute_full *
+kr6_tofull(struct kroute6 *kr6)
+{
+	static struct kroute_full	kf;
+
+	memset(&kf, 0, sizeof(kf));
+
+	kf.prefix.aid = AID_INET6;
+	kf.prefix.v6 = kr6->prefix;
+	kf.prefix.scope_id = kr6->prefix_scope_id;
+	kf.nexthop.aid = AID_INET6;
+	kf.nexthop.v6 = kr6->nexthop;
+	kf.nexthop.scope_id = kr6->nexthop_scope_id;
+	if (kr6->labelid != 0)
+		strlcpy(kf.label, rtlabel_id2name(kr6->labelid),
+		    sizeof(kf.label));
+	kf.flags = kr6->flags;
+	kf.ifindex = kr6->ifindex;
+	kf.prefixlen = kr6->prefixlen;
+	kf.priority = kr6->priority;
+	kf.mplslabel = kr6->mplslabel;
+
+	return (&kf);
+}
+
+/*
+ * RB-tree compare functions
+ */
+
+int
 kroute_compare(struct kroute *a, struct kroute *b)
 {
-	if (ntohl(a->prefix.s_addr) < ntohl(b->prefix.s_addr))
-		return (-1);
-	if (ntohl(a->prefix.s_addr) > ntohl(b->prefix.s_addr))
-		return (1);
-	if (a->prefixlen < b->prefixlen)
+	if (ntohl(a->prefix.s_addr) < ntohl(b->prefix.s_addr))
+		return (-1);
+	if (ntohl(a->prefix.s_addr) > ntohl(b->prefix.s_addr))
+		return (1);
+	if (a->prefixlen < b->prefixlen)
+		return (-1);
+	if (a->prefixlen > b->prefixlen)
+		return (1);
+
+	/* if the priority is RTP_ANY finish on the first address hit */
+	if (a->priority == RTP_ANY || b->priority == RTP_ANY)
+		return (0);
+	if (a->priority < b->priority)
+		return (-1);
+	if (a->priority > b->priority)
+		return (1);
+	return (0);
+}
+
+int
+kroute6_compare(struct kroute6 *a, struct kroute6 *b)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if (a->prefix.s6_addr[i] < b->prefix.s6_addr[i])
+			return (-1);
+		if (a->prefix.s6_addr[i] > b->prefix.s6_addr[i])
+			return (1);
+	}
+	if (a->prefix_scope_id < b->prefix_scope_id)
+		return (-1);
+	if (a->prefix_scope_id > b->prefix_scope_id)
+		return (1);
+
+	if (a->prefixlen < b->prefixlen)
+		return (-1);
+	if (a->prefixlen > b->prefixlen)
+		return (1);
+
+	/* if the priority is RTP_ANY finish on the first address hit */
+	if (a->priority == RTP_ANY || b->priority == RTP_ANY)
+		return (0);
+	if (a->priority < b->priority)
+		return (-1);
+	if (a->priority > b->priority)
+		return (1);
+	return (0);
+}
+
+int
+knexthop_compare(struct knexthop *a, struct knexthop *b)
+{
+	int	i;
+
+	if (a->nexthop.aid != b->nexthop.aid)
+		return (b->nexthop.aid - a->nexthop.aid);
+
+	switch (a->nexthop.aid) {
+	case AID_INET:
+		if (ntohl(a->nexthop.v4.s_addr) < ntohl(b->nexthop.v4.s_addr))
+			return (-1);
+		if (ntohl(a->nexthop.v4.s_addr) > ntohl(b->nexthop.v4.s_addr))
+			return (1);
+		break;
+	case AID_INET6:
+		for (i = 0; i < 16; i++) {
+			if (a->nexthop.v6.s6_addr[i] < b->nexthop.v6.s6_addr[i])
+				return (-1);
+			if (a->nexthop.v6.s6_addr[i] > b->nexthop.v6.s6_addr[i])
+				return (1);
+		}
+		break;
+	default:
+		fatalx("%s: unknown AF", __func__);
+	}
+
+	return (0);
+}
+
+int
+knexthop_obj_compare(struct knexthop_obj *a, struct knexthop_obj *b)
+{
+	if (a->id < b->id)
+		return (-1);
+	if (a->id > b->id)
+		return (1);
+	return (0);
+}
+
+/* by members first, groups forwarding the same way are next to another */
+int
+knexthop_obj_adopt_compare(struct knexthop_obj *a, struct knexthop_obj *b)
+{
+	struct knexthop_obj	*ma, *mb;
+	int			 rv;
+
+	for (ma = a->members, mb = b->members; ma != NULL && mb != NULL;
+	    ma = ma->next, mb = mb->next) {
+		if (ma->ifindex != mb->ifindex)
+			return (ma->ifindex < mb->ifindex ? -1 : 1);
+		if ((rv = memcmp(&ma->gateway, &mb->gateway,
+		    sizeof(ma->gateway))) != 0)
+			return (rv < 0 ? -1 : 1);
+	}
+	if (ma != mb)
+		return (ma == NULL ? -1 : 1);
+	return (knexthop_obj_compare(a, b));
+}
+
+int
+knexthop_if_compare(struct knexthop_if *a, struct knexthop_if *b)
+{
+	if (a->rtableid < b->rtableid)
+		return (-1);
+	if (a->rtableid > b->rtableid)
+		return (1);
+	return (a->ifindex - b->ifindex);
+}
+
+int
+kredist_compare(struct kredist_node *a, struct kredist_node *b)
+{
+	int	i;
+
+	if (a->prefix.aid != b->prefix.aid)
+		return (b->prefix.aid - a->prefix.aid);
+
+	if (a->prefixlen < b->prefixlen)
+		return (-1);
+	if (a->prefixlen > b->prefixlen)
+		return (1);
+
+	switch (a->prefix.aid) {
+	case AID_INET:
+		if (ntohl(a->prefix.v4.s_addr) < ntohl(b->prefix.v4.s_addr))
+			return (-1);
+		if (ntohl(a->prefix.v4.s_addr) > ntohl(b->prefix.v4.s_addr))
+			return (1);
+		break;
+	case AID_INET6:
+		for (i = 0; i < 16; i++) {
+			if (a->prefix.v6.s6_addr[i] < b->prefix.v6.s6_addr[i])
+				return (-1);
+			if (a->prefix.v6.s6_addr[i] > b->prefix.v6.s6_addr[i])
+				return (1);
+		}
+		break;
+	default:
+		fatalx("%s: unknown AF", __func__);
+	}
+
+	if (a->rd < b->rd)
+		return (-1);
+	if (a->rd > b->rd)
+		return (1);
+
+	return (0);
+}
+
+int
+kif_compare(struct kif *a, struct kif *b)
+{
+	return (b->ifindex - a->ifindex);
+}
+
+static int
+kr_addr_compare(const struct bgpd_addr *a, const struct bgpd_addr *b)
+{
+	if (a->aid != b->aid)
+		return (a->aid - b->aid);
+	if (a->aid == AID_UNSPEC)
+		return (0);
+	return (prefix_compare(a, b, a->aid == AID_INET ? 32 : 128));
+}
+
+int
+kr_shadow_compare(struct kr_shadow *a, struct kr_shadow *b)
+{
+	int	rv;
+
+	if ((rv = kr_addr_compare(&a->kf.prefix, &b->kf.prefix)) != 0)
+		return (rv);
+	if (a->kf.prefixlen != b->kf.prefixlen)
+		return (a->kf.prefixlen - b->kf.prefixlen);
+	if (a->kf.priority != b->kf.priority)
+		return (a->kf.priority - b->kf.priority);
+	if ((rv = kr_addr_compare(&a->kf.nexthop, &b->kf.nexthop)) != 0)
+		return (rv);
+	return (a->kf.ifindex - b->kf.ifindex);
+}
+
+int
+kr_pending_compare(struct kr_pending *a, struct kr_pending *b)
+{
+	int	rv;
+
+	if (a->rtableid < b->rtableid)
+		return (-1);
+	if (a->rtableid > b->rtableid)
+		return (1);
+	if ((rv = kr_addr_compare(&a->kf.prefix, &b->kf.prefix)) != 0)
+		return (rv);
+	return (a->kf.prefixlen - b->kf.prefixlen);
+}
+
+int
+kr_stale_compare(struct kr_stale *a, struct kr_stale *b)
+{
+	int	rv;
+
+	if (a->rtableid < b->rtableid)
+		return (-1);
+	if (a->rtableid > b->rtableid)
+		return (1);
+	if ((rv = kr_addr_compare(&a->prefix, &b->prefix)) != 0)
+		return (rv);
+	return (a->prefixlen - b->prefixlen);
+}
+
+int
+kr_agg_compare(struct kr_agg *a, struct kr_agg *b)
+{
+	int	rv;
+
+	if (a->rtableid < b->rtableid)
+		return (-1);
+	if (a->rtableid > b->rtableid)
+		return (1);
+	if ((rv = kr_addr_compare(&a->prefix, &b->prefix)) != 0)
+		return (rv);
+	return (a->prefixlen - b->prefixlen);
+}
+
+int
+kr_net_compare(struct kr_net_node *a, struct kr_net_node *b)
+{
+	const struct network_config	*na = &a->n->net, *nb = &b->n->net;
+
+	if (na->type != nb->type)
+		return (na->type < nb->type ? -1 : 1);
+	if (na->prefixlen != nb->prefixlen)
+		return (na->prefixlen < nb->prefixlen ? -1 : 1);
+	if (na->rd != nb->rd)
+		return (na->rd < nb->rd ? -1 : 1);
+	if (na->rtlabel != nb->rtlabel)
+		return (na->rtlabel < nb->rtlabel ? -1 : 1);
+	if (na->priority != nb->priority)
+		return (na->priority < nb->priority ? -1 : 1);
+	return (memcmp(&na->prefix, &nb->prefix, sizeof(na->prefix)));
+}
+
+int
+kr_net_match_compare(struct kr_net_node *a, struct kr_net_node *b)
+{
+	if (a->aid != b->aid)
+		return (a->aid < b->aid ? -1 : 1);
+	if (a->type != b->type)
+		return (a->type < b->type ? -1 : 1);
+	if (a->value != b->value)
+		return (a->value < b->value ? -1 : 1);
+	if (a->seq != b->seq)
+		return (a->seq < b->seq ? -1 : 1);
+	return (0);
+}
+
+int
+kr_audit_compare(struct kr_audit_route *a, struct kr_audit_route *b)
+{
+	int	rv;
+
+	if ((rv = kr_addr_compare(&a->prefix, &b->prefix)) != 0)
+		return (rv);
+	return (a->prefixlen - b->prefixlen);
+}
+
+
+/*
+ * tree management functions
+ */
+
+struct kroute *
+kroute_find(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen, uint8_t prio)
+{
+	struct kroute	 s;
+	struct kroute	*kn, *tmp;
+
+	s.prefix = prefix->v4;
+	s.prefixlen = prefixlen;
+	s.priority = prio;
+
+	kn = RB_FIND(kroute_tree, &kt->krt, &s);
+	if (kn && prio == RTP_ANY) {
+		tmp = RB_PREV(kroute_tree, &kt->krt, kn);
+		while (tmp) {
+			if (kroute_compare(&s, tmp) == 0)
+				kn = tmp;
+			else
+				break;
+			tmp = RB_PREV(kroute_tree, &kt->krt, kn);
+		}
+	}
+	return (kn);
+}
+
+struct kroute *
+kroute_matchgw(struct kroute *kr, struct kroute_full *kf)
+{
+	in_addr_t	nexthop;
+
+	if (kf->flags & F_CONNECTED) {
+		do {
+			if (kr->ifindex == kf->ifindex)
+				return (kr);
+			kr = kr->next;
+		} while (kr);
+		return (NULL);
+	}
+
+	nexthop = kf->nexthop.v4.s_addr;
+	do {
+		if (kr->nexthop.s_addr == nexthop)
+			return (kr);
+		kr = kr->next;
+	} while (kr);
+
+	return (NULL);
+}
+
+int
+kroute_insert(struct ktable *kt, struct kroute_full *kf, uint32_t nhid)
+{
+	struct kroute	*kr, *krm;
+	struct kroute6	*kr6, *kr6m;
+	struct knexthop	*n;
+	uint32_t	 mplslabel = 0;
+	int		 multipath = 0;
+
+	if (kf->prefix.aid == AID_VPN_IPv4 ||
+	    kf->prefix.aid == AID_VPN_IPv6) {
+		/* only a single MPLS label is supported for now */
+		if (kf->prefix.labellen != 3) {
+			log_warnx("%s/%u does not have a single label",
+			    log_addr(&kf->prefix), kf->prefixlen);
+			return -1;
+		}
+		mplslabel = (kf->prefix.labelstack[0] << 24) |
+		    (kf->prefix.labelstack[1] << 16) |
+		    (kf->prefix.labelstack[2] << 8);
+	}
+
+	switch (kf->prefix.aid) {
+	case AID_INET:
+	case AID_VPN_IPv4:
+		if ((kr = kr_pool_get(&kroute_pool)) == NULL) {
+			log_warn("%s", __func__);
+			return (-1);
+		}
+		kr->flags = kf->flags;
+		kr->prefix = kf->prefix.v4;
+		kr->prefixlen = kf->prefixlen;
+		if (kf->nexthop.aid == AID_INET)
+			kr->nexthop = kf->nexthop.v4;
+
+		if (kf->prefix.aid == AID_VPN_IPv4) {
+			kr->flags |= F_MPLS;
+			kr->mplslabel = htonl(mplslabel);
+		}
+
+		kr->ifindex = kf->ifindex;
+		kr->priority = kf->priority;
+		kr->labelid = kr_label_ref(kf->label);
+		if (kr_lpm_insert(&krlpm[kt->rtableid].root4, &kr->prefix,
+		    kr->prefixlen) == -1) {
+			kr_label_unref(kr->labelid);
+			kr_pool_put(&kroute_pool, kr);
+			return (-1);
+		}
+		knexthop_obj_ref(nhid);
+		kr->nhid = nhid;
+
+		if ((krm = RB_INSERT(kroute_tree, &kt->krt, kr)) != NULL) {
+			/* multipath route, add at end of list */
+			while (krm->next != NULL)
+				krm = krm->next;
+			krm->next = kr;
+			multipath = 1;
+		}
+
+		/* adopted routes are in the kernel already */
+		if ((kf->flags & (F_BGPD|F_BGPD_INSERTED)) == F_BGPD)
+			if (send_rtmsg(RTM_ADD, kt, kf, kr->nhid))
+				kr->flags |= F_BGPD_INSERTED;
+		break;
+	case AID_INET6:
+	case AID_VPN_IPv6:
+		if ((kr6 = kr_pool_get(&kroute6_pool)) == NULL) {
+			log_warn("%s", __func__);
+			return (-1);
+		}
+		kr6->flags = kf->flags;
+		kr6->prefix = kf->prefix.v6;
+		kr6->prefix_scope_id = kf->prefix.scope_id;
+		kr6->prefixlen = kf->prefixlen;
+		if (kf->nexthop.aid == AID_INET6) {
+			kr6->nexthop = kf->nexthop.v6;
+			kr6->nexthop_scope_id = kf->nexthop.scope_id;
+		} else
+			kr6->nexthop = in6addr_any;
+
+		if (kf->prefix.aid == AID_VPN_IPv6) {
+			kr6->flags |= F_MPLS;
+			kr6->mplslabel = htonl(mplslabel);
+		}
+
+		kr6->ifindex = kf->ifindex;
+		kr6->priority = kf->priority;
+		kr6->labelid = kr_label_ref(kf->label);
+		if (kr_lpm_insert(&krlpm[kt->rtableid].root6, &kr6->prefix,
+		    kr6->prefixlen) == -1) {
+			kr_label_unref(kr6->labelid);
+			kr_pool_put(&kroute6_pool, kr6);
+			return (-1);
+		}
+		knexthop_obj_ref(nhid);
+		kr6->nhid = nhid;
+
+		if ((kr6m = RB_INSERT(kroute6_tree, &kt->krt6, kr6)) != NULL) {
+			/* multipath route, add at end of list */
+			while (kr6m->next != NULL)
+				kr6m = kr6m->next;
+			kr6m->next = kr6;
+			multipath = 1;
+		}
+
+		if ((kf->flags & (F_BGPD|F_BGPD_INSERTED)) == F_BGPD)
+			if (send_rtmsg(RTM_ADD, kt, kf, kr6->nhid))
+				kr6->flags |= F_BGPD_INSERTED;
+		break;
+	}
+
+	if (bgpd_has_bgpnh() || !(kf->flags & F_BGPD)) {
+		for (n = knexthop_first(kt, &kf->prefix, kf->prefixlen);
+		    n != NULL;
+		    n = knexthop_next(kt, n, &kf->prefix, kf->prefixlen))
+			knexthop_validate(kt, n);
+	}
+
+	if (!(kf->flags & F_BGPD)) {
+		/* redistribute multipath routes only once */
+		if (!multipath)
+			kr_redistribute(IMSG_NETWORK_ADD, kt, kf);
+	}
+
+	kr_agg_update(kt, &kf->prefix, kf->prefixlen);
+	return (0);
+}
+
+
+static int
+kroute4_remove(struct ktable *kt, struct kroute_full *kf, int any,
+    uint32_t *nhid)
+{
+	struct kroute	*kr, *krm, *krh;
+	struct knexthop	*n;
+	int multipath = 1;
+
+	if ((kr = kroute_find(kt, &kf->prefix, kf->prefixlen,
+	    kf->priority)) == NULL)
+		return (-1);
+	krh = kr;
+
+	if ((kr->flags & F_BGPD) != (kf->flags & F_BGPD)) {
+		log_warnx("%s: wrong type for %s/%u", __func__,
+		    log_addr(&kf->prefix), kf->prefixlen);
+		if (!(kf->flags & F_BGPD))
+			kr->flags &= ~F_BGPD_INSERTED;
+		return (-1);
+	}
+
+	/* get the correct route to remove */
+	krm = kr;
+	if (!any) {
+		if ((krm = kroute_matchgw(kr, kf)) == NULL) {
+			log_warnx("delete %s/%u: route not found",
+			    log_addr(&kf->prefix), kf->prefixlen);
+			return (-2);
+		}
+	}
+
+	if (krm == kr) {
+		/* head element */
+		RB_REMOVE(kroute_tree, &kt->krt, krm);
+		if (krm->next != NULL) {
+			kr = krm->next;
+			if (RB_INSERT(kroute_tree, &kt->krt, kr) != NULL) {
+				log_warnx("%s: failed to add %s/%u",
+				    __func__, inet_ntoa(kr->prefix),
+				    kr->prefixlen);
+				return (-2);
+			}
+		} else {
+			multipath = 0;
+		}
+	} else {
+		/* somewhere in the list */
+		while (kr->next != krm && kr->next != NULL)
+			kr = kr->next;
+		if (kr->next == NULL) {
+			log_warnx("%s: multipath list corrupted for %s/%u",
+			    __func__, inet_ntoa(kr->prefix), kr->prefixlen);
+			return (-2);
+		}
+		kr->next = krm->next;
+	}
+
+	/* check whether a nexthop depends on this kroute */
+	if (krm->flags & F_NEXTHOP) {
+		/* revalidation moves the nexthop off the list */
+		while ((n = LIST_FIRST(&krm->nexthops)) != NULL)
+			knexthop_validate(kt, n);
+	} else if (krm != krh && krh->flags & F_NEXTHOP) {
+		/* nexthops over the remaining paths lose one of them */
+		LIST_FOREACH(n, &krh->nexthops, krentry)
+			knexthop_obj_update(n);
+	}
+
+	kr_lpm_remove(&krlpm[kt->rtableid].root4, &krm->prefix, krm->prefixlen);
+	*kf = *kr_tofull(krm);
+	*nhid = krm->nhid;
+
+	kr_label_unref(krm->labelid);
+	kr_pool_put(&kroute_pool, krm);
+	return (multipath);
+}
+
+static int
+kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any,
+    uint32_t *nhid)
+{
+	struct kroute6	*kr, *krm, *krh;
+	struct knexthop	*n;
+	int multipath = 1;
+
+	if ((kr = kroute6_find(kt, &kf->prefix, kf->prefixlen,
+	    kf->priority)) == NULL)
+		return (-1);
+	krh = kr;
+
+	if ((kr->flags & F_BGPD) != (kf->flags & F_BGPD)) {
+		log_warnx("%s: wrong type for %s/%u", __func__,
+		    log_addr(&kf->prefix), kf->prefixlen);
+		if (!(kf->flags & F_BGPD))
+			kr->flags &= ~F_BGPD_INSERTED;
+		return (-1);
+	}
+
+	/* get the correct route to remove */
+	krm = kr;
+	if (!any) {
+		if ((krm = kroute6_matchgw(kr, kf)) == NULL) {
+			log_warnx("delete %s/%u: route not found",
+			    log_addr(&kf->prefix), kf->prefixlen);
+			return (-2);
+		}
+	}
+
+	if (krm == kr) {
+		/* head element */
+		RB_REMOVE(kroute6_tree, &kt->krt6, krm);
+		if (krm->next != NULL) {
+			kr = krm->next;
+			if (RB_INSERT(kroute6_tree, &kt->krt6, kr) != NULL) {
+				log_warnx("%s: failed to add %s/%u", __func__,
+				    log_in6addr(&kr->prefix), kr->prefixlen);
+				return (-2);
+			}
+		} else {
+			multipath = 0;
+		}
+	} else {
+		/* somewhere in the list */
+		while (kr->next != krm && kr->next != NULL)
+			kr = kr->next;
+		if (kr->next == NULL) {
+			log_warnx("%s: multipath list corrupted for %s/%u",
+			    __func__, log_in6addr(&kr->prefix), kr->prefixlen);
+			return (-2);
+		}
+		kr->next = krm->next;
+	}
+
+	/* check whether a nexthop depends on this kroute */
+	if (krm->flags & F_NEXTHOP) {
+		/* revalidation moves the nexthop off the list */
+		while ((n = LIST_FIRST(&krm->nexthops)) != NULL)
+			knexthop_validate(kt, n);
+	} else if (krm != krh && krh->flags & F_NEXTHOP) {
+		/* nexthops over the remaining paths lose one of them */
+		LIST_FOREACH(n, &krh->nexthops, krentry)
+			knexthop_obj_update(n);
+	}
+
+	kr_lpm_remove(&krlpm[kt->rtableid].root6, &krm->prefix, krm->prefixlen);
+	*kf = *kr6_tofull(krm);
+	*nhid = krm->nhid;
+
+	kr_label_unref(krm->labelid);
+	kr_pool_put(&kroute6_pool, krm);
+	return (multipath);
+}
+
+
+int
+kroute_remove(struct ktable *kt, struct kroute_full *kf, int any)
+{
+	uint32_t nhid = 0;
+	int multipath;
+
+	switch (kf->prefix.aid) {
+	case AID_INET:
+		multipath = kroute4_remove(kt, kf, any, &nhid);
+		break;
+	case AID_INET6:
+		multipath = kroute6_remove(kt, kf, any, &nhid);
+		break;
+	default:
+		log_warnx("%s: not handled AID", __func__);
+		return (-1);
+	}
+
+	if (multipath < 0)
+		return (multipath + 1);
+
+	if (kf->flags & F_BGPD_INSERTED)
+		send_rtmsg(RTM_DELETE, kt, kf, 0);
+	if (kf->flags & F_BGPD)
+		kr_stale_drop(kt->rtableid, kf);
+	/* drop the nexthop object only after the route is gone */
+	knexthop_obj_unref(nhid);
+	kr_agg_update(kt, &kf->prefix, kf->prefixlen);
+
+	/* remove only once all multipath routes are gone */
+	if (!(kf->flags & F_BGPD) && !multipath)
+		kr_redistribute(IMSG_NETWORK_REMOVE, kt, kf);
+
+	return (0);
+}
+
+void
+kroute_clear(struct ktable *kt)
+{
+	struct kroute	*kr;
+
+	while ((kr = RB_MIN(kroute_tree, &kt->krt)) != NULL)
+		kroute_remove(kt, kr_tofull(kr), 1);
+}
+
+struct kroute6 *
+kroute6_find(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen, uint8_t prio)
+{
+	struct kroute6	s;
+	struct kroute6	*kn6, *tmp;
+
+	s.prefix = prefix->v6;
+	s.prefix_scope_id = prefix->scope_id;
+	s.prefixlen = prefixlen;
+	s.priority = prio;
+
+	kn6 = RB_FIND(kroute6_tree, &kt->krt6, &s);
+	if (kn6 && prio == RTP_ANY) {
+		tmp = RB_PREV(kroute6_tree, &kt->krt6, kn6);
+		while (tmp) {
+			if (kroute6_compare(&s, tmp) == 0)
+				kn6 = tmp;
+			else
+				break;
+			tmp = RB_PREV(kroute6_tree, &kt->krt6, kn6);
+		}
+	}
+	return (kn6);
+}
+
+struct kroute6 *
+kroute6_matchgw(struct kroute6 *kr, struct kroute_full *kf)
+{
+	struct in6_addr	nexthop;
+
+	if (kf->flags & F_CONNECTED) {
+		do {
+			if (kr->ifindex == kf->ifindex)
+				return (kr);
+			kr = kr->next;
+		} while (kr);
+		return (NULL);
+	}
+
+	nexthop = kf->nexthop.v6;
+	do {
+		if (memcmp(&kr->nexthop, &nexthop, sizeof(nexthop)) == 0 &&
+		    kr->nexthop_scope_id == kf->nexthop.scope_id)
+			return (kr);
+		kr = kr->next;
+	} while (kr);
+
+	return (NULL);
+}
+
+void
+kroute6_clear(struct ktable *kt)
+{
+	struct kroute6	*kr;
+
+	while ((kr = RB_MIN(kroute6_tree, &kt->krt6)) != NULL)
+		kroute_remove(kt, kr6_tofull(kr), 1);
+}
+
+struct knexthop *
+knexthop_find(struct ktable *kt, struct bgpd_addr *addr)
+{
+	struct knexthop	s;
+
+	memset(&s, 0, sizeof(s));
+	memcpy(&s.nexthop, addr, sizeof(s.nexthop));
+
+	return (RB_FIND(knexthop_tree, KT2KNT(kt), &s));
+}
+
+/*
+ * The nexthop tree is sorted by address so all nexthops covered by a
+ * prefix are next to each other, starting at the masked prefix.
+ */
+struct knexthop *
+knexthop_first(struct ktable *kt, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
+{
+	struct knexthop	 s;
+	struct knexthop	*kn;
+
+	if (prefix->aid != AID_INET && prefix->aid != AID_INET6)
+		return (NULL);
+
+	memset(&s, 0, sizeof(s));
+	applymask(&s.nexthop, prefix, prefixlen);
+
+	kn = RB_NFIND(knexthop_tree, KT2KNT(kt), &s);
+	if (kn != NULL && prefix_compare(prefix, &kn->nexthop, prefixlen) != 0)
+		return (NULL);
+	return (kn);
+}
+
+struct knexthop *
+knexthop_next(struct ktable *kt, struct knexthop *kn,
+    const struct bgpd_addr *prefix, uint8_t prefixlen)
+{
+	kn = RB_NEXT(knexthop_tree, KT2KNT(kt), kn);
+	if (kn != NULL && prefix_compare(prefix, &kn->nexthop, prefixlen) != 0)
+		return (NULL);
+	return (kn);
+}
+
+int
+knexthop_insert(struct ktable *kt, struct knexthop *kn)
+{
+	if (RB_INSERT(knexthop_tree, KT2KNT(kt), kn) != NULL) {
+		log_warnx("%s: failed for %s", __func__,
+		    log_addr(&kn->nexthop));
+		kr_pool_put(&knexthop_pool, kn);
+		return (-1);
+	}
+
+	knexthop_validate(kt, kn);
+
+	return (0);
+}
+
+void
+knexthop_remove(struct ktable *kt, struct knexthop *kn)
+{
+	if (kn->nhobj != NULL)
+		knexthop_obj_unref(kn->nhobj->id);
+	/* the RDE is no longer interested */
+	if (kn->update)
+		TAILQ_REMOVE(&knupdates, kn, upentry);
+	kroute_detach_nexthop(kt, kn);
+	RB_REMOVE(knexthop_tree, KT2KNT(kt), kn);
+	kr_pool_put(&knexthop_pool, kn);
+}
+
+void
+knexthop_clear(struct ktable *kt)
+{
+	struct knexthop	*kn;
+
+	if (kt == NULL)
+		return;
+
+	while ((kn = RB_MIN(knexthop_tree, KT2KNT(kt))) != NULL)
+		knexthop_remove(kt, kn);
+}
+
+struct kif *
+kif_find(int ifindex)
+{
+	u_short	idx = ifindex;	/* truncated like kif->ifindex */
+
+	if (idx >= kifidx_size)
+		return (NULL);
+	return (kifidx[idx]);
+}
+
+static struct kif_head *
+kif_name_bucket(const char *name)
+{
+	uint32_t	h = 2166136261U;	/* FNV-1a */
+
+	while (*name != '\0') {
+		h ^= (uint8_t)*name++;
+		h *= 16777619U;
+	}
+	return (&kifnames[h & (KR_KIF_BUCKETS - 1)]);
+}
+
+struct kif *
+kif_find_name(const char *name)
+{
+	struct kif	*kif;
+
+	LIST_FOREACH(kif, kif_name_bucket(name), nentry)
+		if (strcmp(name, kif->ifname) == 0)
+			return (kif);
+	return (NULL);
+}
+
+/* interfaces may be renamed, keep the name hash in sync */
+void
+kif_rename(struct kif *kif, const char *name)
+{
+	if (strcmp(name, kif->ifname) == 0)
+		return;
+	LIST_REMOVE(kif, nentry);
+	strlcpy(kif->ifname, name, sizeof(kif->ifname));
+	LIST_INSERT_HEAD(kif_name_bucket(kif->ifname), kif, nentry);
+}
+
+int
+kif_insert(struct kif *kif)
+{
+	struct kif	**xidx;
+	u_int		  newsize;
+
+	if (kif->ifindex >= kifidx_size) {
+		newsize = kifidx_size ? kifidx_size : 64;
+		while (newsize <= kif->ifindex)
+			newsize *= 2;
+		if ((xidx = recallocarray(kifidx, kifidx_size, newsize,
+		    sizeof(struct kif *))) == NULL) {
+			log_warn("%s", __func__);
+			kr_pool_put(&kif_pool, kif);
+			return (-1);
+		}
+		kifidx = xidx;
+		kifidx_size = newsize;
+	}
+
+	if (RB_INSERT(kif_tree, &kit, kif) != NULL) {
+		log_warnx("RB_INSERT(kif_tree, &kit, kif)");
+		kr_pool_put(&kif_pool, kif);
+		return (-1);
+	}
+	kifidx[kif->ifindex] = kif;
+	LIST_INSERT_HEAD(kif_name_bucket(kif->ifname), kif, nentry);
+
+	return (0);
+}
+
+int
+kif_remove(struct kif *kif)
+{
+	struct ktable	*kt;
+
+	kif->flags &= ~IFF_UP;
+
+	/*
+	 * TODO, remove all kroutes using this interface,
+	 * the kernel does this for us but better to do it
+	 * here as well.
+	 */
+
+	if ((kt = ktable_get(kif->rdomain)) != NULL)
+		knexthop_track(kt, kif->ifindex);
+
+	if (kif->held)
+		LIST_REMOVE(kif, hentry);
+	RB_REMOVE(kif_tree, &kit, kif);
+	kifidx[kif->ifindex] = NULL;
+	LIST_REMOVE(kif, nentry);
+	kr_pool_put(&kif_pool, kif);
+	return (0);
+}
+
+void
+kif_clear(void)
+{
+	struct kif	*kif;
+
+	while ((kif = RB_MIN(kif_tree, &kit)) != NULL)
+		kif_remove(kif);
+	kr_timer_stop(KR_TIMER_LINK);
+}
+
+static time_t
+kif_link_time(void)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec);
+}
+
+/*
+ * Called when the link went down. Decay the hold down for the time
+ * the link was stable, then double it for this flap.
+ */
+void
+kif_link_flap(struct kif *kif)
+{
+	time_t	now, quiet;
+
+	now = kif_link_time();
+	kif->flaps++;
+	if (kif->held) {
+		LIST_REMOVE(kif, hentry);
+		kif->held = 0;
+	}
+
+	quiet = (now - kif->last_flap) / KR_LINK_DECAY;
+	if (quiet >= 32)
+		kif->hold = 0;
+	else
+		kif->hold >>= quiet;
+	if (kif->hold == 0)
+		kif->hold = KR_LINK_HOLD;
+	else if ((kif->hold *= 2) > KR_LINK_HOLD_MAX)
+		kif->hold = KR_LINK_HOLD_MAX;
+	kif->last_flap = now;
+	log_debug("%s: %s: %u flaps, hold down %u sec", __func__,
+	    kif->ifname, kif->flaps, kif->hold);
+}
+
+/* called when the link came back up after a flap */
+void
+kif_link_hold(struct kif *kif)
+{
+	struct kif	*xkif;
+	time_t		 now;
+
+	if (kif->hold == 0 || kif->held)
+		return;
+	now = kif_link_time();
+	kif->held = 1;
+	kif->held_until = now + kif->hold;
+	LIST_INSERT_HEAD(&kifheld, kif, hentry);
+
+	/* the timer is set to the first hold down to expire */
+	LIST_FOREACH(xkif, &kifheld, hentry)
+		if (xkif->held_until < kif->held_until)
+			return;
+	kr_timer_set(KR_TIMER_LINK, kif->hold * 1000);
+}
+
+void
+kif_link_release(void)
+{
+	struct kif	*kif, *nkif;
+	time_t		 now, next = 0;
+
+	now = kif_link_time();
+	LIST_FOREACH_SAFE(kif, &kifheld, hentry, nkif) {
+		if (kif->held_until > now) {
+			if (next == 0 || kif->held_until - now < next)
+				next = kif->held_until - now;
+			continue;
+		}
+		LIST_REMOVE(kif, hentry);
+		kif->held = 0;
+		kif_revalidate(kif);
+	}
+	if (next != 0)
+		kr_timer_set(KR_TIMER_LINK, next * 1000);
+}
+
+/*
+ * nexthop validation
+ */
+
+static int
+kif_validate(struct kif *kif)
+{
+	if (!(kif->flags & IFF_UP))
+		return (0);
+
+	/* link came back up but is still held down */
+	if (kif->held)
+		return (0);
+
+	/*
+	 * we treat link_state == LINK_STATE_UNKNOWN as valid,
+	 * not all interfaces have a concept of "link state" and/or
+	 * do not report up
+	 */
+
+	if (kif->link_state == LINK_STATE_DOWN)
+		return (0);
+
+	return (1);
+}
+
+static void
+kif_revalidate(struct kif *kif)
+{
+	struct ktable	*kt;
+	uint8_t		 reachable;
+
+	if ((reachable = kif_validate(kif)) == kif->nh_reachable)
+		return;	/* nothing changed wrt nexthop validity */
+
+	kif->nh_reachable = reachable;
+
+	kt = ktable_get(kif->rdomain);
+	if (kt == NULL)
+		return;
+
+	knexthop_track(kt, kif->ifindex);
+}
+
+#ifdef NOTYET
+/*
+ * return 1 when the interface is up and the link state is up or unknwown
+ * except when this is a carp interface, then return 1 only when link state
+ * is up
+ */
+static int
+kif_depend_state(struct kif *kif)
+{
+	if (!(kif->flags & IFF_UP))
+		return (0);
+
+	if (kif->if_type == IFT_CARP &&
+	    kif->link_state == LINK_STATE_UNKNOWN)
+		return (0);
+	return LINK_STATE_IS_UP(kif->link_state);
+}
+#endif
+
+int
+kroute_validate(struct kroute *kr)
+{
+	struct kif	*kif;
+
+	if (kr->flags & (F_REJECT | F_BLACKHOLE))
+		return (0);
+
+	if ((kif = kif_find(kr->ifindex)) == NULL) {
+		if (kr->ifindex)
+			log_warnx("%s: interface with index %d not found, "
+			    "referenced from route for %s/%u", __func__,
+			    kr->ifindex, inet_ntoa(kr->prefix),
+			    kr->prefixlen);
+		return (1);
+	}
+
+	return (kif->nh_reachable);
+}
+
+int
+kroute6_validate(struct kroute6 *kr)
+{
+	struct kif	*kif;
+
+	if (kr->flags & (F_REJECT | F_BLACKHOLE))
+		return (0);
+
+	if ((kif = kif_find(kr->ifindex)) == NULL) {
+		if (kr->ifindex)
+			log_warnx("%s: interface with index %d not found, "
+			    "referenced from route for %s/%u", __func__,
+			    kr->ifindex, log_in6addr(&kr->prefix),
+			    kr->prefixlen);
+		return (1);
+	}
+
+	return (kif->nh_reachable);
+}
+
+int
+knexthop_true_nexthop(struct ktable *kt, struct kroute_full *kf,
+    uint32_t *nhid)
+{
+	struct bgpd_addr gateway = { 0 };
+	struct knexthop *kn;
+	struct kroute	*kr;
+	struct kroute6	*kr6;
+
+	/*
+	 * Ignore the nexthop for VPN routes. The gateway is forced
+	 * to an mpe(4) interface route using an MPLS label.
+	 */
+	switch (kf->prefix.aid) {
+	case AID_VPN_IPv4:
+	case AID_VPN_IPv6:
+		return 1;
+	}
+
+	kn = knexthop_find(kt, &kf->nexthop);
+	if (kn == NULL) {
+		log_warnx("%s: nexthop %s not found", __func__,
+		    log_addr(&kf->nexthop));
+		return 0;
+	}
+	if (kn->kroute == NULL)
+		return 0;
+
+	*nhid = knexthop_obj_get(kn);
+
+	switch (kn->nexthop.aid) {
+	case AID_INET:
+		kr = kn->kroute;
+		if (kr->flags & F_CONNECTED)
+			return 1;
+		gateway.aid = AID_INET;
+		gateway.v4.s_addr = kr->nexthop.s_addr;
+		break;
+	case AID_INET6:
+		kr6 = kn->kroute;
+		if (kr6->flags & F_CONNECTED)
+			return 1;
+		gateway.aid = AID_INET6;
+		gateway.v6 = kr6->nexthop;
+		gateway.scope_id = kr6->nexthop_scope_id;
+		break;
+	}
+
+	kf->nexthop = gateway;
+	return 1;
+}
+
+void
+knexthop_validate(struct ktable *kt, struct knexthop *kn)
+{
+	void		*oldk;
+	struct kroute	*kr;
+	struct kroute6	*kr6;
+
+	oldk = kn->kroute;
+	kroute_detach_nexthop(kt, kn);
+
+	if ((kt = ktable_get(kt->nhtableid)) == NULL)
+		fatalx("%s: lost nexthop routing table", __func__);
+
+	switch (kn->nexthop.aid) {
+	case AID_INET:
+		kr = kroute_match(kt, &kn->nexthop, 0);
+
+		if (kr != NULL) {
+			kn->kroute = kr;
+			kn->ifindex = kr->ifindex;
+			knexthop_if_link(kt, kn);
+			LIST_INSERT_HEAD(&kr->nexthops, kn, krentry);
+			kr->flags |= F_NEXTHOP;
+		}
+
+		/*
+		 * Send update if nexthop route changed under us if
+		 * the route remains the same then the NH state has not
+		 * changed.
+		 */
+		if (kr != oldk)
+			knexthop_send_update(kn);
+		else	/* the paths of a multipath route may have changed */
+			knexthop_obj_update(kn);
+		break;
+	case AID_INET6:
+		kr6 = kroute6_match(kt, &kn->nexthop, 0);
+
+		if (kr6 != NULL) {
+			kn->kroute = kr6;
+			kn->ifindex = kr6->ifindex;
+			knexthop_if_link(kt, kn);
+			LIST_INSERT_HEAD(&kr6->nexthops, kn, krentry);
+			kr6->flags |= F_NEXTHOP;
+		}
+
+		if (kr6 != oldk)
+			knexthop_send_update(kn);
+		else
+			knexthop_obj_update(kn);
+		break;
+	}
+}
+
+/*
+ * Called on interface state change.
+ */
+void
+knexthop_track(struct ktable *kt, u_short ifindex)
+{
+	struct knexthop_if	 s, *ifb;
+	struct knexthop		*kn, *nkn;
+
+	memset(&s, 0, sizeof(s));
+	s.rtableid = kt->nhtableid;
+	s.ifindex = ifindex;
+	if ((ifb = RB_FIND(knexthop_if_tree, &knift, &s)) == NULL)
+		return;
+
+	/*
+	 * Revalidation takes each nexthop off the list and, if it stays
+	 * on this interface, puts it back at the head where the walk
+	 * does not see it again. The bucket is only freed once empty.
+	 */
+	LIST_FOREACH_SAFE(kn, &ifb->nexthops, ifentry, nkn)
+		knexthop_validate(kt, kn);
+}
+
+void
+knexthop_if_link(struct ktable *kt, struct knexthop *kn)
+{
+	struct knexthop_if	 s, *ifb;
+
+	memset(&s, 0, sizeof(s));
+	s.rtableid = kt->nhtableid;
+	s.ifindex = kn->ifindex;
+	if ((ifb = RB_FIND(knexthop_if_tree, &knift, &s)) == NULL) {
+		if ((ifb = calloc(1, sizeof(*ifb))) == NULL)
+			fatal("%s", __func__);
+		ifb->rtableid = s.rtableid;
+		ifb->ifindex = s.ifindex;
+		LIST_INIT(&ifb->nexthops);
+		RB_INSERT(knexthop_if_tree, &knift, ifb);
+	}
+	LIST_INSERT_HEAD(&ifb->nexthops, kn, ifentry);
+	kn->ifb = ifb;
+}
+
+void
+knexthop_if_unlink(struct knexthop *kn)
+{
+	struct knexthop_if	*ifb;
+
+	if ((ifb = kn->ifb) == NULL)
+		return;
+	LIST_REMOVE(kn, ifentry);
+	kn->ifb = NULL;
+	if (LIST_EMPTY(&ifb->nexthops)) {
+		RB_REMOVE(knexthop_if_tree, &knift, ifb);
+		free(ifb);
+	}
+}
+
+/*
+ * Called on route change.
+ */
+void
+knexthop_update(struct ktable *kt, struct kroute_full *kf)
+{
+	struct knexthop	*kn;
+
+	for (kn = knexthop_first(kt, &kf->prefix, kf->prefixlen); kn != NULL;
+	    kn = knexthop_next(kt, kn, &kf->prefix, kf->prefixlen))
+		knexthop_send_update(kn);
+}
+
+/*
+ * The kernel nexthop group follows right away, the RDE is told once per
+ * event loop pass. A nexthop changing several times in between, e.g.
+ * while routes over a failed link are withdrawn one by one, is reported
+ * once with its final state.
+ */
+void
+knexthop_send_update(struct knexthop *kn)
+{
+	knexthop_obj_update(kn);
+
+	kr_state.nh_updates++;
+	if (kn->update) {
+		kr_state.nh_coalesced++;
+		return;
+	}
+	kn->update = 1;
+	TAILQ_INSERT_TAIL(&knupdates, kn, upentry);
+	if (!kr_state.timer_armed[KR_TIMER_NEXTHOP])
+		kr_timer_set(KR_TIMER_NEXTHOP, 0);
+}
+
+/*
+ * Send the queued nexthop updates back to back, they end up in as few
+ * writes to the RDE as the imsg buffer allows.
+ */
+void
+knexthop_update_flush(void)
+{
+	struct knexthop	*kn;
+
+	kr_timer_stop(KR_TIMER_NEXTHOP);
+	while ((kn = TAILQ_FIRST(&knupdates)) != NULL) {
+		TAILQ_REMOVE(&knupdates, kn, upentry);
+		kn->update = 0;
+		knexthop_report(kn);
+		kr_state.nh_sent++;
+	}
+}
+
+static void
+knexthop_report(struct knexthop *kn)
+{
+	struct kroute_nexthop	 n;
+	struct kroute		*kr;
+	struct kroute6		*kr6;
+
+	memset(&n, 0, sizeof(n));
+	n.nexthop = kn->nexthop;
+
+	if (kn->kroute == NULL) {
+		n.valid = 0;	/* NH is not valid */
+		send_nexthop_update(&n);
+		return;
+	}
+
+	switch (kn->nexthop.aid) {
+	case AID_INET:
+		kr = kn->kroute;
+		n.valid = kroute_validate(kr);
+		n.connected = kr->flags & F_CONNECTED;
+		if (!n.connected) {
+			n.gateway.aid = AID_INET;
+			n.gateway.v4.s_addr = kr->nexthop.s_addr;
+		} else {
+			n.gateway = n.nexthop;
+			n.net.aid = AID_INET;
+			n.net.v4.s_addr = kr->prefix.s_addr;
+			n.netlen = kr->prefixlen;
+		}
+		break;
+	case AID_INET6:
+		kr6 = kn->kroute;
+		n.valid = kroute6_validate(kr6);
+		n.connected = kr6->flags & F_CONNECTED;
+		if (!n.connected) {
+			n.gateway.aid = AID_INET6;
+			n.gateway.v6 = kr6->nexthop;
+			n.gateway.scope_id = kr6->nexthop_scope_id;
+		} else {
+			n.gateway = n.nexthop;
+			n.net.aid = AID_INET6;
+			n.net.v6 = kr6->prefix;
+			n.net.scope_id = kr6->prefix_scope_id;
+			n.netlen = kr6->prefixlen;
+		}
+		break;
+	}
+	send_nexthop_update(&n);
+}
+
+/*
+ * Return the id of the kernel nexthop group for kn, allocating one if
+ * needed. Objects are only sent to the kernel once a route uses them.
+ * Returns 0 if the route needs to carry its gateway inline.
+ */
+uint32_t
+knexthop_obj_get(struct knexthop *kn)
+{
+	struct knexthop_obj	*nho;
+
+	if (kn->kroute == NULL)
+		return (0);
+
+	if (kn->nhobj == NULL) {
+		if ((nho = knexthop_obj_alloc()) == NULL)
+			return (0);
+		nho->refcnt = 1;	/* reference held by the knexthop */
+		kn->nhobj = nho;
+		knexthop_obj_update(kn);
+		knexthop_obj_claim(kn);
+	}
+
+	/* without an interface the kernel can't resolve the nexthop */
+	if (kn->nhobj->members == NULL)
+		return (0);
+	return (kn->nhobj->id);
+}
+
+struct knexthop_obj *
+knexthop_obj_alloc(void)
+{
+	struct knexthop_obj	*nho;
+
+	if ((nho = calloc(1, sizeof(*nho))) == NULL) {
+		log_warn("%s", __func__);
+		return (NULL);
+	}
+	do {
+		nho->id = kr_state.nhid_next++;
+		if (kr_state.nhid_next == 0)
+			kr_state.nhid_next = 1;
+	} while (RB_INSERT(knexthop_obj_tree, &knhot, nho) != NULL);
+
+	return (nho);
+}
+
+/*
+ * Sync the group with the paths of the route the nexthop resolves over.
+ * A single replace of the group moves all routes using it.
+ */
+void
+knexthop_obj_update(struct knexthop *kn)
+{
+	struct knexthop_obj	*nho = kn->nhobj;
+	struct knexthop_obj	*m, **pm, *old, *members = NULL;
+	struct knexthop_obj	**tail = &members;
+	struct bgpd_addr	 gw[KR_MAX_MPATH];
+	u_short			 ifindex[KR_MAX_MPATH];
+	struct kroute		*kr;
+	struct kroute6		*kr6;
+	int			 i, n = 0;
+
+	if (nho == NULL || kn->kroute == NULL)
+		return;
+
+	memset(gw, 0, sizeof(gw));
+	switch (kn->nexthop.aid) {
+	case AID_INET:
+		for (kr = kn->kroute; kr != NULL && n < KR_MAX_MPATH;
+		    kr = kr->next) {
+			if (kr->ifindex == 0 || !kroute_validate(kr))
+				continue;
+			ifindex[n] = kr->ifindex;
+			if (kr->flags & F_CONNECTED)
+				gw[n] = kn->nexthop;
+			else {
+				gw[n].aid = AID_INET;
+				gw[n].v4.s_addr = kr->nexthop.s_addr;
+			}
+			n++;
+		}
+		break;
+	case AID_INET6:
+		for (kr6 = kn->kroute; kr6 != NULL && n < KR_MAX_MPATH;
+		    kr6 = kr6->next) {
+			if (kr6->ifindex == 0 || !kroute6_validate(kr6))
+				continue;
+			ifindex[n] = kr6->ifindex;
+			if (kr6->flags & F_CONNECTED)
+				gw[n] = kn->nexthop;
+			else {
+				gw[n].aid = AID_INET6;
+				gw[n].v6 = kr6->nexthop;
+				gw[n].scope_id = kr6->nexthop_scope_id;
+			}
+			n++;
+		}
+		break;
+	default:
+		return;
+	}
+
+	/* keep the old forwarding until the nexthop is resolvable again */
+	if (n == 0)
+		return;
+
+	for (i = 0, m = nho->members; i < n && m != NULL; i++, m = m->next)
+		if (m->ifindex != ifindex[i] ||
+		    memcmp(&m->gateway, &gw[i], sizeof(gw[i])) != 0)
+			break;
+	if (i == n && m == NULL)
+		return;
+
+	/* reuse the members that stay, they are in the kernel already */
+	old = nho->members;
+	for (i = 0; i < n; i++) {
+		for (pm = &old; *pm != NULL; pm = &(*pm)->next)
+			if ((*pm)->ifindex == ifindex[i] &&
+			    memcmp(&(*pm)->gateway, &gw[i], sizeof(gw[i])) == 0)
+				break;
+		if ((m = *pm) != NULL)
+			*pm = m->next;
+		else {
+			if ((m = knexthop_obj_alloc()) == NULL)
+				break;
+			m->gateway = gw[i];
+			m->ifindex = ifindex[i];
+		}
+		m->next = NULL;
+		*tail = m;
+		tail = &m->next;
+	}
+	if (members == NULL) {
+		nho->members = old;
+		return;
+	}
+	nho->members = members;
+
+	if (nho->installed && !nho->noobj)
+		knexthop_obj_install(nho);
+	knexthop_obj_free(old);
+}
+
+/*
+ * Send the members and then the group, the kernel only accepts groups
+ * of existing nexthops.
+ */
+void
+knexthop_obj_install(struct knexthop_obj *nho)
+{
+	struct knexthop_obj	*m;
+
+	for (m = nho->members; m != NULL; m = m->next)
+		if (!m->installed)
+			send_nhmsg(RTM_NH_CHANGE, m);
+	send_nhmsg(RTM_NH_CHANGE, nho);
+}
+
+/*
+ * Free a list of group members, removing them from the kernel.
+ */
+void
+knexthop_obj_free(struct knexthop_obj *m)
+{
+	struct knexthop_obj	*next;
+
+	for (; m != NULL; m = next) {
+		next = m->next;
+		if (m->installed && !kr_state.keep)
+			send_nhmsg(RTM_NH_DELETE, m);
+		RB_REMOVE(knexthop_obj_tree, &knhot, m);
+		free(m);
+	}
+}
+
+void
+knexthop_obj_ref(uint32_t id)
+{
+	struct knexthop_obj	s, *nho;
+
+	if (id == 0)
+		return;
+	s.id = id;
+	if ((nho = RB_FIND(knexthop_obj_tree, &knhot, &s)) == NULL)
+		fatalx("%s: unknown nexthop object %u", __func__, id);
+	nho->refcnt++;
+}
+
+void
+knexthop_obj_unref(uint32_t id)
+{
+	struct knexthop_obj	s, *nho;
+
+	if (id == 0)
+		return;
+	s.id = id;
+	if ((nho = RB_FIND(knexthop_obj_tree, &knhot, &s)) == NULL)
+		fatalx("%s: unknown nexthop object %u", __func__, id);
+	if (--nho->refcnt > 0)
+		return;
+	if (nho->adopted) {
+		RB_REMOVE(knexthop_adopt_tree, &knhadopt, nho);
+		nho->adopted = 0;
+	}
+
+	/* queued route changes may still point the kernel to this group */
+	if (kr_state.queue_len > 0) {
+		RB_REMOVE(knexthop_obj_tree, &knhot, nho);
+		nho->dead = kr_state.nhdead;
+		kr_state.nhdead = nho;
+		return;
+	}
+	RB_REMOVE(knexthop_obj_tree, &knhot, nho);
+	knexthop_obj_destroy(nho);
+}
+
+void
+knexthop_obj_destroy(struct knexthop_obj *nho)
+{
+	/* the group goes first, its members are still in use until then */
+	if (nho->installed && !kr_state.keep)
+		send_nhmsg(RTM_NH_DELETE, nho);
+	knexthop_obj_free(nho->members);
+	free(nho);
+}
+
+/*
+ * The kernel drops all nexthop objects of an interface that goes down
+ * or loses its carrier, without telling us. They are sent again on next
+ * use.
+ */
+void
+knexthop_obj_flush(u_short ifindex)
+{
+	knexthop_obj_drop(ifindex, 0);
+}
+
+/*
+ * Members dropped by the kernel, either all of an interface or the one
+ * with the given id, are taken out of their groups. An emptied group is
+ * removed together with the routes using it.
+ */
+void
+knexthop_obj_drop(u_short ifindex, uint32_t id)
+{
+	struct knexthop_obj	*nho, *m;
+	int			 hit, left;
+
+	RB_FOREACH(nho, knexthop_obj_tree, &knhot) {
+		if (nho->members == NULL)
+			continue;
+		hit = left = 0;
+		for (m = nho->members; m != NULL; m = m->next) {
+			if (!m->installed)
+				continue;
+			if (id != 0 ? m->id == id : m->ifindex == ifindex) {
+				m->installed = 0;
+				hit = 1;
+			} else
+				left = 1;
+		}
+		if (!hit)
+			continue;
+		/* routes with inline gateways do not depend on the group */
+		if (!left && !nho->noobj) {
+			nho->lost = 1;
+			kr_state.nhwalk = 1;
+		}
+		nho->installed = 0;
+	}
+}
+
+/*
+ * Somebody else removed one of our nexthop objects.
+ */
+void
+knexthop_obj_lost(uint32_t id)
+{
+	struct knexthop_obj	 s, *nho;
+
+	s.id = id;
+	if ((nho = RB_FIND(knexthop_obj_tree, &knhot, &s)) == NULL ||
+	    !nho->installed)
+		return;
+	log_warnx("nexthop object %u removed from the kernel", id);
+	if (nho->members == NULL) {
+		knexthop_obj_drop(0, id);
+		nho->installed = 0;
+		return;
+	}
+	if (!nho->noobj) {
+		nho->lost = 1;
+		kr_state.nhwalk = 1;
+	}
+	nho->installed = 0;
+}
+
+/*
+ * The kernel refused a nexthop object. Only its group falls back to
+ * inline gateways, the routes already sent with it are sent again.
+ */
+void
+knexthop_obj_fallback(struct knexthop_obj *nho)
+{
+	struct knexthop_obj	*g, *m = NULL;
+
+	nho->installed = 0;
+	if (nho->members != NULL)
+		g = nho;
+	else
+		RB_FOREACH(g, knexthop_obj_tree, &knhot) {
+			for (m = g->members; m != NULL; m = m->next)
+				if (m == nho)
+					break;
+			if (m != NULL)
+				break;
+		}
+	if (g == NULL || g->noobj)
+		return;
+
+	log_warnx("nexthop group %u uses inline gateways", g->id);
+	g->noobj = 1;
+	g->resend = 1;
+	kr_state.nhwalk = 1;
+}
+
+static struct knexthop_obj *
+knexthop_obj_marked(uint32_t nhid, uint16_t flags)
+{
+	struct knexthop_obj	 s, *nho;
+
+	if (nhid == 0 || !(flags & F_BGPD_INSERTED))
+		return (NULL);
+	s.id = nhid;
+	if ((nho = RB_FIND(knexthop_obj_tree, &knhot, &s)) == NULL ||
+	    (!nho->lost && !nho->resend))
+		return (NULL);
+	return (nho);
+}
+
+/*
+ * Routes using a group the kernel removed are gone as well, unless a
+ * queued change puts them back. Those using a group that fell back to
+ * inline gateways are sent again.
+ */
+void
+knexthop_obj_walk(void)
+{
+	struct ktable		*kt;
+	struct kroute		*kr, *krm;
+	struct kroute6		*kr6, *kr6m;
+	struct kroute_full	*kf;
+	struct knexthop_obj	*nho;
+	u_int			 i;
+
+	kr_state.nhwalk = 0;
+	for (i = 0; i < krt_size; i++) {
+		if ((kt = ktable_get(i)) == NULL)
+			continue;
+		RB_FOREACH(kr, kroute_tree, &kt->krt)
+			for (krm = kr; krm != NULL; krm = krm->next) {
+				if ((nho = knexthop_obj_marked(krm->nhid,
+				    krm->flags)) == NULL)
+					continue;
+				kf = kr_tofull(krm);
+				if (nho->resend)
+					send_rtmsg(RTM_CHANGE, kt, kf,
+					    krm->nhid);
+				else if (kr_queue_find(kt->rtableid,
+				    &kf->prefix, kf->prefixlen) == NULL)
+					krm->flags &= ~F_BGPD_INSERTED;
+			}
+		RB_FOREACH(kr6, kroute6_tree, &kt->krt6)
+			for (kr6m = kr6; kr6m != NULL; kr6m = kr6m->next) {
+				if ((nho = knexthop_obj_marked(kr6m->nhid,
+				    kr6m->flags)) == NULL)
+					continue;
+				kf = kr6_tofull(kr6m);
+				if (nho->resend)
+					send_rtmsg(RTM_CHANGE, kt, kf,
+					    kr6m->nhid);
+				else if (kr_queue_find(kt->rtableid,
+				    &kf->prefix, kf->prefixlen) == NULL)
+					kr6m->flags &= ~F_BGPD_INSERTED;
+			}
+	}
+
+	RB_FOREACH(nho, knexthop_obj_tree, &knhot)
+		nho->lost = nho->resend = 0;
+}
+
+#ifdef HAVE_LINUX_NEXTHOP_H
+/*
+ * Nexthop object of ours left by a previous run, seen while dumping them
+ * at startup. Groups are linked to their members once the dump is done.
+ */
+static int
+knexthop_obj_adopt(const struct nhmsg *nhm, const struct nlattr **tb)
+{
+	struct knexthop_obj	*nho;
+	struct knexthop_dump	*d = NULL;
+	const struct nexthop_grp *grp;
+	int			 i, n;
+
+	if (tb[NHA_GROUP] != NULL) {
+		grp = mnl_attr_get_payload(tb[NHA_GROUP]);
+		n = mnl_attr_get_payload_len(tb[NHA_GROUP]) / sizeof(*grp);
+		if (n == 0 || n > KR_MAX_MPATH)
+			n = 0;
+		if ((d = calloc(1, sizeof(*d))) == NULL) {
+			log_warn("%s", __func__);
+			return (-1);
+		}
+		d->id = mnl_attr_get_u32(tb[NHA_ID]);
+		d->n = n;
+		for (i = 0; i < n; i++)
+			d->ids[i] = grp[i].id;
+	} else if (tb[NHA_GATEWAY] == NULL || tb[NHA_OIF] == NULL)
+		return (0);
+
+	if ((nho = calloc(1, sizeof(*nho))) == NULL) {
+		log_warn("%s", __func__);
+		free(d);
 		return (-1);
-	if (a->prefixlen > b->prefixlen)
-		return (1);
+	}
+	nho->id = mnl_attr_get_u32(tb[NHA_ID]);
+	nho->installed = 1;
+	nho->adopted = 1;
+	if (d == NULL) {
+		nho->ifindex = mnl_attr_get_u32(tb[NHA_OIF]);
+		switch (nhm->nh_family) {
+		case AF_INET:
+			nho->gateway.aid = AID_INET;
+			memcpy(&nho->gateway.v4,
+			    mnl_attr_get_payload(tb[NHA_GATEWAY]),
+			    sizeof(nho->gateway.v4));
+			break;
+		case AF_INET6:
+			nho->gateway.aid = AID_INET6;
+			memcpy(&nho->gateway.v6,
+			    mnl_attr_get_payload(tb[NHA_GATEWAY]),
+			    sizeof(nho->gateway.v6));
+			break;
+		default:
+			free(nho);
+			return (0);
+		}
+	}
+	if (RB_INSERT(knexthop_obj_tree, &knhot, nho) != NULL) {
+		free(nho);
+		free(d);
+		return (0);
+	}
+	if (d != NULL)
+		SLIST_INSERT_HEAD(&knhdump, d, entry);
+	return (0);
+}
+#endif
+
+/*
+ * Link the adopted groups to their members once the dump is done. What
+ * is not part of a complete group is removed from the kernel right away,
+ * the groups stay until the adopted routes are refreshed.
+ */
+void
+knexthop_obj_adopt_link(void)
+{
+	struct knexthop_dump	*d;
+	struct knexthop_obj	 s, *nho, *xnho, *m[KR_MAX_MPATH];
+	int			 i;
+
+	while ((d = SLIST_FIRST(&knhdump)) != NULL) {
+		SLIST_REMOVE_HEAD(&knhdump, entry);
+		s.id = d->id;
+		if ((nho = RB_FIND(knexthop_obj_tree, &knhot, &s)) == NULL) {
+			free(d);
+			continue;
+		}
+		for (i = 0; i < d->n; i++) {
+			s.id = d->ids[i];
+			m[i] = RB_FIND(knexthop_obj_tree, &knhot, &s);
+			/* only unlinked members, they belong to one group */
+			if (m[i] == NULL || !m[i]->adopted ||
+			    m[i]->gateway.aid == AID_UNSPEC)
+				break;
+		}
+		if (i < d->n || d->n == 0) {
+			RB_REMOVE(knexthop_obj_tree, &knhot, nho);
+			send_nhmsg(RTM_NH_DELETE, nho);
+			free(nho);
+		} else {
+			for (i = d->n - 1; i >= 0; i--) {
+				m[i]->adopted = 0;
+				m[i]->next = nho->members;
+				nho->members = m[i];
+			}
+			RB_INSERT(knexthop_adopt_tree, &knhadopt, nho);
+		}
+		free(d);
+	}
+
+	RB_FOREACH_SAFE(nho, knexthop_obj_tree, &knhot, xnho) {
+		if (!nho->adopted || nho->members != NULL)
+			continue;
+		RB_REMOVE(knexthop_obj_tree, &knhot, nho);
+		send_nhmsg(RTM_NH_DELETE, nho);
+		free(nho);
+	}
+}
+
+int
+knexthop_obj_adopted(void)
+{
+	struct knexthop_obj	*nho;
+
+	RB_FOREACH(nho, knexthop_obj_tree, &knhot)
+		if (nho->adopted)
+			return (1);
+	return (0);
+}
+
+/*
+ * Group for an adopted route the kernel showed without a group of a
+ * previous run, made up from its paths. It is not installed, the route
+ * keeps its inline gateways until it changes.
+ */
+uint32_t
+knexthop_obj_adopt_paths(struct kroute_full *paths, int npaths)
+{
+	struct knexthop_obj	 key, m[KR_MAX_MPATH], *nho, *xm, **tail;
+	int			 i;
+
+	memset(&key, 0, sizeof(key));
+	memset(m, 0, sizeof(m));
+	for (i = 0; i < npaths; i++) {
+		if (paths[i].ifindex == 0 ||
+		    (paths[i].nexthop.aid != AID_INET &&
+		    paths[i].nexthop.aid != AID_INET6))
+			return (0);
+		m[i].ifindex = paths[i].ifindex;
+		m[i].gateway.aid = paths[i].nexthop.aid;
+		if (paths[i].nexthop.aid == AID_INET)
+			m[i].gateway.v4 = paths[i].nexthop.v4;
+		else {
+			m[i].gateway.v6 = paths[i].nexthop.v6;
+			m[i].gateway.scope_id = paths[i].nexthop.scope_id;
+		}
+		m[i].next = i + 1 < npaths ? &m[i + 1] : NULL;
+	}
+	key.members = &m[0];
+
+	/* with id 0 NFIND lands on the lowest id with these members */
+	if ((nho = RB_NFIND(knexthop_adopt_tree, &knhadopt, &key)) != NULL) {
+		key.id = nho->id;
+		if (knexthop_obj_adopt_compare(nho, &key) == 0)
+			return (nho->id);
+	}
+
+	if ((nho = knexthop_obj_alloc()) == NULL)
+		return (0);
+	tail = &nho->members;
+	for (i = 0; i < npaths; i++) {
+		if ((xm = knexthop_obj_alloc()) == NULL) {
+			knexthop_obj_free(nho->members);
+			RB_REMOVE(knexthop_obj_tree, &knhot, nho);
+			free(nho);
+			return (0);
+		}
+		xm->gateway = m[i].gateway;
+		xm->ifindex = m[i].ifindex;
+		*tail = xm;
+		tail = &xm->next;
+	}
+	nho->adopted = 1;
+	RB_INSERT(knexthop_adopt_tree, &knhadopt, nho);
+	return (nho->id);
+}
+
+/*
+ * A nexthop got its group, take over an adopted one forwarding the same
+ * way instead. The adopted routes using it then stay untouched.
+ */
+void
+knexthop_obj_claim(struct knexthop *kn)
+{
+	struct knexthop_obj	 key, *nho = kn->nhobj, *a;
+
+	if (nho->members == NULL || RB_EMPTY(&knhadopt))
+		return;
+	memset(&key, 0, sizeof(key));
+	key.members = nho->members;
+	if ((a = RB_NFIND(knexthop_adopt_tree, &knhadopt, &key)) == NULL)
+		return;
+	key.id = a->id;
+	if (knexthop_obj_adopt_compare(a, &key) != 0)
+		return;
+
+	RB_REMOVE(knexthop_adopt_tree, &knhadopt, a);
+	a->adopted = 0;
+	a->refcnt++;
+	kn->nhobj = a;
+
+	/* the fresh group never made it to the kernel */
+	RB_REMOVE(knexthop_obj_tree, &knhot, nho);
+	knexthop_obj_free(nho->members);
+	free(nho);
+}
+
+/*
+ * Adopted routes are refreshed or gone, remove the groups of a previous
+ * run no route uses. The others go with their last route.
+ */
+void
+knexthop_obj_adopt_end(void)
+{
+	struct knexthop_obj	*nho, *xnho, *dead = NULL;
+
+	RB_FOREACH_SAFE(nho, knexthop_obj_tree, &knhot, xnho) {
+		if (!nho->adopted || nho->refcnt > 0)
+			continue;
+		RB_REMOVE(knexthop_adopt_tree, &knhadopt, nho);
+		RB_REMOVE(knexthop_obj_tree, &knhot, nho);
+		nho->dead = dead;
+		dead = nho;
+	}
+	/* destroying removes the members from the tree */
+	while ((nho = dead) != NULL) {
+		dead = nho->dead;
+		knexthop_obj_destroy(nho);
+	}
+}
+
+static inline int
+kr_lpm_bit(const uint8_t *addr, uint8_t bit)
+{
+	return ((addr[bit / 8] >> (7 - bit % 8)) & 1);
+}
+
+/* number of leading bits a and b have in common, at most len */
+static uint8_t
+kr_lpm_common(const uint8_t *a, const uint8_t *b, uint8_t len)
+{
+	u_int	i;
+	uint8_t	x;
+
+	for (i = 0; i < len; i += 8) {
+		if ((x = a[i / 8] ^ b[i / 8]) == 0)
+			continue;
+		i += __builtin_clz(x) - (sizeof(u_int) - 1) * 8;
+		break;
+	}
+	return (i < len ? i : len);
+}
+
+static struct kr_lpm_node *
+kr_lpm_alloc(const uint8_t *addr, uint8_t prefixlen, uint32_t refcnt)
+{
+	struct kr_lpm_node	*n;
+
+	if ((n = kr_pool_get(&kr_lpm_pool)) == NULL) {
+		log_warn("%s", __func__);
+		return (NULL);
+	}
+	memcpy(n->addr, addr, (prefixlen + 7) / 8);
+	if (prefixlen % 8)
+		n->addr[prefixlen / 8] &= 0xff << (8 - prefixlen % 8);
+	n->prefixlen = prefixlen;
+	n->refcnt = refcnt;
+	return (n);
+}
 
-	/* if the priority is RTP_ANY finish on the first address hit */
-	if (a->priority == RTP_ANY || b->priority == RTP_ANY)
-		return (0);
-	if (a->priority < b->priority)
+int
+kr_lpm_insert(struct kr_lpm_node **np, const void *key, uint8_t prefixlen)
+{
+	const uint8_t		*addr = key;
+	struct kr_lpm_node	*n, *new, *glue;
+	uint8_t			 common;
+
+	while ((n = *np) != NULL) {
+		common = kr_lpm_common(n->addr, addr,
+		    n->prefixlen < prefixlen ? n->prefixlen : prefixlen);
+		if (common < n->prefixlen) {
+			/* split the path in front of n */
+			if ((new = kr_lpm_alloc(addr, prefixlen, 1)) == NULL)
+				return (-1);
+			if (common == prefixlen) {
+				new->child[kr_lpm_bit(n->addr, common)] = n;
+				*np = new;
+				return (0);
+			}
+			if ((glue = kr_lpm_alloc(addr, common, 0)) == NULL) {
+				kr_pool_put(&kr_lpm_pool, new);
+				return (-1);
+			}
+			glue->child[kr_lpm_bit(n->addr, common)] = n;
+			glue->child[kr_lpm_bit(addr, common)] = new;
+			*np = glue;
+			return (0);
+		}
+		if (n->prefixlen == prefixlen) {
+			n->refcnt++;
+			return (0);
+		}
+		np = &n->child[kr_lpm_bit(addr, n->prefixlen)];
+	}
+
+	if ((*np = kr_lpm_alloc(addr, prefixlen, 1)) == NULL)
 		return (-1);
-	if (a->priority > b->priority)
-		return (1);
 	return (0);
 }
 
-int
-kroute6_compare(struct kroute6 *a, struct kroute6 *b)
+void
+kr_lpm_remove(struct kr_lpm_node **np, const void *key, uint8_t prefixlen)
 {
-	int i;
+	const uint8_t		*addr = key;
+	struct kr_lpm_node	*n, **pp = NULL;
 
-	for (i = 0; i < 16; i++) {
-		if (a->prefix.s6_addr[i] < b->prefix.s6_addr[i])
-			return (-1);
-		if (a->prefix.s6_addr[i] > b->prefix.s6_addr[i])
-			return (1);
+	while ((n = *np) != NULL && n->prefixlen < prefixlen) {
+		pp = np;
+		np = &n->child[kr_lpm_bit(addr, n->prefixlen)];
 	}
-	if (a->prefix_scope_id < b->prefix_scope_id)
-		return (-1);
-	if (a->prefix_scope_id > b->prefix_scope_id)
-		return (1);
+	if (n == NULL || n->prefixlen != prefixlen || n->refcnt == 0 ||
+	    kr_lpm_common(n->addr, addr, prefixlen) != prefixlen) {
+		log_warnx("%s: prefix not in lookup table", __func__);
+		return;
+	}
+	if (--n->refcnt > 0)
+		return;
 
-	if (a->prefixlen < b->prefixlen)
-		return (-1);
-	if (a->prefixlen > b->prefixlen)
-		return (1);
+	/* keep it as glue node if both branches are in use */
+	if (n->child[0] != NULL && n->child[1] != NULL)
+		return;
+	*np = n->child[0] != NULL ? n->child[0] : n->child[1];
+	kr_pool_put(&kr_lpm_pool, n);
 
-	/* if the priority is RTP_ANY finish on the first address hit */
-	if (a->priority == RTP_ANY || b->priority == RTP_ANY)
-		return (0);
-	if (a->priority < b->priority)
-		return (-1);
-	if (a->priority > b->priority)
-		return (1);
-	return (0);
+	/* a glue node left with a single branch is no longer needed */
+	if (*np == NULL && pp != NULL && (n = *pp)->refcnt == 0) {
+		*pp = n->child[0] != NULL ? n->child[0] : n->child[1];
+		kr_pool_put(&kr_lpm_pool, n);
+	}
 }
 
+/*
+ * Collect the prefix lengths of all prefixes covering key, shortest first.
+ * Returns the number of entries stored in prefixlens.
+ */
 int
-knexthop_compare(struct knexthop *a, struct knexthop *b)
+kr_lpm_match(struct kr_lpm_node *n, const void *key, uint8_t maxlen,
+    uint8_t *prefixlens)
 {
-	int	i;
+	const uint8_t	*addr = key;
+	int		 cnt = 0;
 
-	if (a->nexthop.aid != b->nexthop.aid)
-		return (b->nexthop.aid - a->nexthop.aid);
+	while (n != NULL && n->prefixlen <= maxlen) {
+		if (kr_lpm_common(n->addr, addr, n->prefixlen) < n->prefixlen)
+			break;
+		if (n->refcnt > 0)
+			prefixlens[cnt++] = n->prefixlen;
+		if (n->prefixlen == maxlen)
+			break;
+		n = n->child[kr_lpm_bit(addr, n->prefixlen)];
+	}
+	return (cnt);
+}
 
-	switch (a->nexthop.aid) {
-	case AID_INET:
-		if (ntohl(a->nexthop.v4.s_addr) < ntohl(b->nexthop.v4.s_addr))
-			return (-1);
-		if (ntohl(a->nexthop.v4.s_addr) > ntohl(b->nexthop.v4.s_addr))
-			return (1);
-		break;
-	case AID_INET6:
-		for (i = 0; i < 16; i++) {
-			if (a->nexthop.v6.s6_addr[i] < b->nexthop.v6.s6_addr[i])
-				return (-1);
-			if (a->nexthop.v6.s6_addr[i] > b->nexthop.v6.s6_addr[i])
-				return (1);
-		}
-		break;
-	default:
-		fatalx("%s: unknown AF", __func__);
+void
+kr_lpm_clear(struct kr_lpm_node *n)
+{
+	if (n == NULL)
+		return;
+	kr_lpm_clear(n->child[0]);
+	kr_lpm_clear(n->child[1]);
+	kr_pool_put(&kr_lpm_pool, n);
+}
+
+struct kroute *
+kroute_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
+{
+	int			 i;
+	struct kroute		*kr;
+	struct bgpd_addr	 masked;
+	uint8_t			 plens[32 + 1];
+
+	i = kr_lpm_match(krlpm[kt->rtableid].root4, &key->v4, 32, plens);
+	while (i-- > 0) {
+		applymask(&masked, key, plens[i]);
+		if ((kr = kroute_find(kt, &masked, plens[i], RTP_ANY)) != NULL)
+			if (matchany || bgpd_oknexthop(kr_tofull(kr)))
+				return (kr);
 	}
 
-	return (0);
+	return (NULL);
 }
 
-int
-kredist_compare(struct kredist_node *a, struct kredist_node *b)
+struct kroute6 *
+kroute6_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
 {
-	int	i;
+	int			 i;
+	struct kroute6		*kr6;
+	struct bgpd_addr	 masked;
+	uint8_t			 plens[128 + 1];
 
-	if (a->prefix.aid != b->prefix.aid)
-		return (b->prefix.aid - a->prefix.aid);
+	i = kr_lpm_match(krlpm[kt->rtableid].root6, &key->v6, 128, plens);
+	while (i-- > 0) {
+		applymask(&masked, key, plens[i]);
+		if ((kr6 = kroute6_find(kt, &masked, plens[i],
+		    RTP_ANY)) != NULL)
+			if (matchany || bgpd_oknexthop(kr6_tofull(kr6)))
+				return (kr6);
+	}
 
-	if (a->prefixlen < b->prefixlen)
-		return (-1);
-	if (a->prefixlen > b->prefixlen)
-		return (1);
+	return (NULL);
+}
 
-	switch (a->prefix.aid) {
+void
+kroute_detach_nexthop(struct ktable *kt, struct knexthop *kn)
+{
+	struct kroute	*k;
+	struct kroute6	*k6;
+
+	if (kn->kroute == NULL)
+		return;
+
+	/*
+	 * remove from the list of nexthops depending on this kroute
+	 * and clear the flag if it was the last one
+	 */
+	LIST_REMOVE(kn, krentry);
+	switch (kn->nexthop.aid) {
 	case AID_INET:
-		if (ntohl(a->prefix.v4.s_addr) < ntohl(b->prefix.v4.s_addr))
-			return (-1);
-		if (ntohl(a->prefix.v4.s_addr) > ntohl(b->prefix.v4.s_addr))
-			return (1);
+		k = kn->kroute;
+		if (LIST_EMPTY(&k->nexthops))
+			k->flags &= ~F_NEXTHOP;
 		break;
 	case AID_INET6:
-		for (i = 0; i < 16; i++) {
-			if (a->prefix.v6.s6_addr[i] < b->prefix.v6.s6_addr[i])
-				return (-1);
-			if (a->prefix.v6.s6_addr[i] > b->prefix.v6.s6_addr[i])
-				return (1);
-		}
+		k6 = kn->kroute;
+		if (LIST_EMPTY(&k6->nexthops))
+			k6->flags &= ~F_NEXTHOP;
 		break;
-	default:
-		fatalx("%s: unknown AF", __func__);
 	}
 
-	if (a->rd < b->rd)
-		return (-1);
-	if (a->rd > b->rd)
-		return (1);
-
-	return (0);
+	knexthop_if_unlink(kn);
+	kn->kroute = NULL;
+	kn->ifindex = 0;
 }
 
-int
-kif_compare(struct kif *a, struct kif *b)
+/*
+ * misc helpers
+ */
+
+uint8_t
+prefixlen_classful(in_addr_t ina)
 {
-	return (b->ifindex - a->ifindex);
+	/* it hurt to write this. */
+
+	if (ina >= 0xf0000000U)		/* class E */
+		return (32);
+	else if (ina >= 0xe0000000U)	/* class D */
+		return (4);
+	else if (ina >= 0xc0000000U)	/* class C */
+		return (24);
+	else if (ina >= 0x80000000U)	/* class B */
+		return (16);
+	else				/* class A */
+		return (8);
 }
 
+static uint8_t
+mask2prefixlen4(struct sockaddr_in *sa_in)
+{
+	in_addr_t ina;
 
-/*
- * tree management functions
- */
+	ina = sa_in->sin_addr.s_addr;
+	if (ina == 0)
+		return (0);
+	else
+		return (33 - ffs(ntohl(ina)));
+}
 
-struct kroute *
-kroute_find(struct ktable *kt, const struct bgpd_addr *prefix,
-    uint8_t prefixlen, uint8_t prio)
+static uint8_t
+mask2prefixlen6(struct sockaddr_in6 *sa_in6)
 {
-	struct kroute	 s;
-	struct kroute	*kn, *tmp;
-
-	s.prefix = prefix->v4;
-	s.prefixlen = prefixlen;
-	s.priority = prio;
+	uint8_t	*ap, *ep;
+	u_int	 l = 0;
 
-	kn = RB_FIND(kroute_tree, &kt->krt, &s);
-	if (kn && prio == RTP_ANY) {
-		tmp = RB_PREV(kroute_tree, &kt->krt, kn);
-		while (tmp) {
-			if (kroute_compare(&s, tmp) == 0)
-				kn = tmp;
-			else
-				break;
-			tmp = RB_PREV(kroute_tree, &kt->krt, kn);
+	/*
+	 * sin6_len is the size of the sockaddr so substract the offset of
+	 * the possibly truncated sin6_addr struct.
+	 */
+	ap = (uint8_t *)&sa_in6->sin6_addr;
+	ep = (uint8_t *)sa_in6 + sizeof(struct in6_addr);
+	for (; ap < ep; ap++) {
+		/* this "beauty" is adopted from sbin/route/show.c ... */
+		switch (*ap) {
+		case 0xff:
+			l += 8;
+			break;
+		case 0xfe:
+			l += 7;
+			goto done;
+		case 0xfc:
+			l += 6;
+			goto done;
+		case 0xf8:
+			l += 5;
+			goto done;
+		case 0xf0:
+			l += 4;
+			goto done;
+		case 0xe0:
+			l += 3;
+			goto done;
+		case 0xc0:
+			l += 2;
+			goto done;
+		case 0x80:
+			l += 1;
+			goto done;
+		case 0x00:
+			goto done;
+		default:
+			fatalx("non contiguous inet6 netmask");
 		}
 	}
-	return (kn);
+
+ done:
+	if (l > sizeof(struct in6_addr) * 8)
+		fatalx("%s: prefixlen %d out of bound", __func__, l);
+	return (l);
+}
+
+uint8_t
+mask2prefixlen(sa_family_t af, struct sockaddr *mask)
+{
+	switch (af) {
+	case AF_INET:
+		return mask2prefixlen4((struct sockaddr_in *)mask);
+	case AF_INET6:
+		return mask2prefixlen6((struct sockaddr_in6 *)mask);
+	default:
+		fatalx("%s: unsupported af", __func__);
+	}
 }
 
-struct kroute *
-kroute_matchgw(struct kroute *kr, struct kroute_full *kf)
-{
-	in_addr_t	nexthop;
+#ifdef NOTYET
+const struct if_status_description
+		if_status_descriptions[] = LINK_STATE_DESCRIPTIONS;
+const struct ifmedia_description
+		ifm_type_descriptions[] = IFM_TYPE_DESCRIPTIONS;
 
-	if (kf->flags & F_CONNECTED) {
-		do {
-			if (kr->ifindex == kf->ifindex)
-				return (kr);
-			kr = kr->next;
-		} while (kr);
-		return (NULL);
+uint64_t
+ift2ifm(uint8_t if_type)
+{
+	switch (if_type) {
+	case IFT_ETHER:
+		return (IFM_ETHER);
+	case IFT_FDDI:
+		return (IFM_FDDI);
+	case IFT_CARP:
+		return (IFM_CARP);
+	case IFT_IEEE80211:
+		return (IFM_IEEE80211);
+	default:
+		return (0);
 	}
-
-	nexthop = kf->nexthop.v4.s_addr;
-	do {
-		if (kr->nexthop.s_addr == nexthop)
-			return (kr);
-		kr = kr->next;
-	} while (kr);
-
-	return (NULL);
 }
 
-int
-kroute_insert(struct ktable *kt, struct kroute_full *kf)
+const char *
+get_media_descr(uint64_t media_type)
 {
-	struct kroute	*kr, *krm;
-	struct kroute6	*kr6, *kr6m;
-	struct knexthop	*n;
-	uint32_t	 mplslabel = 0;
-	int		 multipath = 0;
+	const struct ifmedia_description	*p;
 
-	if (kf->prefix.aid == AID_VPN_IPv4 ||
-	    kf->prefix.aid == AID_VPN_IPv6) {
-		/* only a single MPLS label is supported for now */
-		if (kf->prefix.labellen != 3) {
-			log_warnx("%s/%u does not have a single label",
-			    log_addr(&kf->prefix), kf->prefixlen);
-			return -1;
-		}
-		mplslabel = (kf->prefix.labelstack[0] << 24) |
-		    (kf->prefix.labelstack[1] << 16) |
-		    (kf->prefix.labelstack[2] << 8);
-	}
+	for (p = ifm_type_descriptions; p->ifmt_string != NULL; p++)
+		if (media_type == p->ifmt_word)
+			return (p->ifmt_string);
 
-	switch (kf->prefix.aid) {
-	case AID_INET:
-	case AID_VPN_IPv4:
-		if ((kr = calloc(1, sizeof(*kr))) == NULL) {
-			log_warn("%s", __func__);
-			return (-1);
-		}
-		kr->flags = kf->flags;
-		kr->prefix = kf->prefix.v4;
-		kr->prefixlen = kf->prefixlen;
-		if (kf->nexthop.aid == AID_INET)
-			kr->nexthop = kf->nexthop.v4;
+	return ("unknown media");
+}
+#endif
 
-		if (kf->prefix.aid == AID_VPN_IPv4) {
-			kr->flags |= F_MPLS;
-			kr->mplslabel = htonl(mplslabel);
-		}
+const char *
+get_linkstate(uint8_t if_type, int link_state)
+{
+	static char buf[8];
 
-		kr->ifindex = kf->ifindex;
-		kr->priority = kf->priority;
-		kr->labelid = rtlabel_name2id(kf->label);
+	switch (link_state) {
+	case LINK_STATE_UP:
+		return "active";
+	case LINK_STATE_DOWN:
+		return "down";
+	case LINK_STATE_UNKNOWN:
+		return "unknown";
+	default:
+		snprintf(buf, sizeof(buf), "[#%d]", link_state);
+		return (buf);
+	}
+}
 
-		if ((krm = RB_INSERT(kroute_tree, &kt->krt, kr)) != NULL) {
-			/* multipath route, add at end of list */
-			while (krm->next != NULL)
-				krm = krm->next;
-			krm->next = kr;
-			multipath = 1;
-		}
+#ifdef NOTYET
+void
+if_change(u_short ifindex, int flags, struct if_data *ifd)
+{
+	struct ktable		*kt;
+	struct kif		*kif;
+	uint8_t			 reachable;
 
-		if (kf->flags & F_BGPD)
-			if (send_rtmsg(RTM_ADD, kt, kf))
-				kr->flags |= F_BGPD_INSERTED;
-		break;
-	case AID_INET6:
-	case AID_VPN_IPv6:
-		if ((kr6 = calloc(1, sizeof(*kr6))) == NULL) {
-			log_warn("%s", __func__);
-			return (-1);
-		}
-		kr6->flags = kf->flags;
-		kr6->prefix = kf->prefix.v6;
-		kr6->prefix_scope_id = kf->prefix.scope_id;
-		kr6->prefixlen = kf->prefixlen;
-		if (kf->nexthop.aid == AID_INET6) {
-			kr6->nexthop = kf->nexthop.v6;
-			kr6->nexthop_scope_id = kf->nexthop.scope_id;
-		} else
-			kr6->nexthop = in6addr_any;
+	if ((kif = kif_find(ifindex)) == NULL) {
+		log_warnx("%s: interface with index %u not found",
+		    __func__, ifindex);
+		return;
+	}
 
-		if (kf->prefix.aid == AID_VPN_IPv6) {
-			kr6->flags |= F_MPLS;
-			kr6->mplslabel = htonl(mplslabel);
-		}
+	log_info("%s: %s: rdomain %u %s, %s, %s, %s",
+	    __func__, kif->ifname, ifd->ifi_rdomain,
+	    flags & IFF_UP ? "UP" : "DOWN",
+	    get_media_descr(ift2ifm(ifd->ifi_type)),
+	    get_linkstate(ifd->ifi_type, ifd->ifi_link_state),
+	    get_baudrate(ifd->ifi_baudrate, "bps"));
 
-		kr6->ifindex = kf->ifindex;
-		kr6->priority = kf->priority;
-		kr6->labelid = rtlabel_name2id(kf->label);
+	kif->flags = flags;
+	kif->link_state = ifd->ifi_link_state;
+	kif->if_type = ifd->ifi_type;
+	kif->rdomain = ifd->ifi_rdomain;
+	kif->baudrate = ifd->ifi_baudrate;
+	kif->depend_state = kif_depend_state(kif);
 
-		if ((kr6m = RB_INSERT(kroute6_tree, &kt->krt6, kr6)) != NULL) {
-			/* multipath route, add at end of list */
-			while (kr6m->next != NULL)
-				kr6m = kr6m->next;
-			kr6m->next = kr6;
-			multipath = 1;
-		}
+	kr_send_dependon(kif);
 
-		if (kf->flags & F_BGPD)
-			if (send_rtmsg(RTM_ADD, kt, kf))
-				kr6->flags |= F_BGPD_INSERTED;
-		break;
-	}
+	if ((reachable = kif_validate(kif)) == kif->nh_reachable)
+		return;		/* nothing changed wrt nexthop validity */
 
-	if (bgpd_has_bgpnh() || !(kf->flags & F_BGPD)) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt))
-			if (prefix_compare(&kf->prefix, &n->nexthop,
-			    kf->prefixlen) == 0)
-				knexthop_validate(kt, n);
-	}
+	kif->nh_reachable = reachable;
 
-	if (!(kf->flags & F_BGPD)) {
-		/* redistribute multipath routes only once */
-		if (!multipath)
-			kr_redistribute(IMSG_NETWORK_ADD, kt, kf);
-	}
+	kt = ktable_get(kif->rdomain);
+	if (kt == NULL)
+		return;
 
-	return (0);
+	knexthop_track(kt, ifindex);
 }
+#endif
 
-
-static int
-kroute4_remove(struct ktable *kt, struct kroute_full *kf, int any)
+static void
+if_announce(const struct nlmsghdr *nlh, const char *name)
 {
-	struct kroute	*kr, *krm;
-	struct knexthop	*n;
-	int multipath = 1;
-
-	if ((kr = kroute_find(kt, &kf->prefix, kf->prefixlen,
-	    kf->priority)) == NULL)
-		return (-1);
 
-	if ((kr->flags & F_BGPD) != (kf->flags & F_BGPD)) {
-		log_warnx("%s: wrong type for %s/%u", __func__,
-		    log_addr(&kf->prefix), kf->prefixlen);
-		if (!(kf->flags & F_BGPD))
-			kr->flags &= ~F_BGPD_INSERTED;
-		return (-1);
-	}
+	struct ifinfomsg *ifi;
+	struct kif *kif;
+	uint8_t	olink;
 
-	/* get the correct route to remove */
-	krm = kr;
-	if (!any) {
-		if ((krm = kroute_matchgw(kr, kf)) == NULL) {
-			log_warnx("delete %s/%u: route not found",
-			    log_addr(&kf->prefix), kf->prefixlen);
-			return (-2);
-		}
-	}
+	ifi = mnl_nlmsg_get_payload(nlh);
 
-	if (krm == kr) {
-		/* head element */
-		RB_REMOVE(kroute_tree, &kt->krt, krm);
-		if (krm->next != NULL) {
-			kr = krm->next;
-			if (RB_INSERT(kroute_tree, &kt->krt, kr) != NULL) {
-				log_warnx("%s: failed to add %s/%u",
-				    __func__, inet_ntoa(kr->prefix),
-				    kr->prefixlen);
-				return (-2);
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWLINK:
+		kif = kif_find(ifi->ifi_index);
+		if (kif == NULL) {
+			if ((kif = kr_pool_get(&kif_pool)) == NULL) {
+				log_warn("%s", __func__);
+				return;
 			}
-		} else {
-			multipath = 0;
-		}
-	} else {
-		/* somewhere in the list */
-		while (kr->next != krm && kr->next != NULL)
-			kr = kr->next;
-		if (kr->next == NULL) {
-			log_warnx("%s: multipath list corrupted for %s/%u",
-			    __func__, inet_ntoa(kr->prefix), kr->prefixlen);
-			return (-2);
+			kif->ifindex = ifi->ifi_index;
+			if (kif_insert(kif) == -1)
+				return;
 		}
-		kr->next = krm->next;
-	}
 
-	/* check whether a nexthop depends on this kroute */
-	if (krm->flags & F_NEXTHOP) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt)) {
-			if (n->kroute == krm)
-				knexthop_validate(kt, n);
-		}
-	}
+		if (name)
+			kif_rename(kif, name);
+		kif->flags = ifi->ifi_flags;
+		kif->if_type = ifi->ifi_type;
 
-	*kf = *kr_tofull(krm);
+		olink = kif->link_state;
+		if (ifi->ifi_flags & IFF_LOWER_UP)
+			kif->link_state = LINK_STATE_UP;
+		else
+			kif->link_state = LINK_STATE_DOWN;
+
+		if (olink == LINK_STATE_UP &&
+		    kif->link_state == LINK_STATE_DOWN)
+			kif_link_flap(kif);
+		else if (olink == LINK_STATE_DOWN &&
+		    kif->link_state == LINK_STATE_UP)
+			kif_link_hold(kif);
+
+		/* the kernel flushes nexthop objects on carrier loss too */
+		if (!(ifi->ifi_flags & IFF_UP) ||
+		    !(ifi->ifi_flags & (IFF_RUNNING | IFF_LOWER_UP)))
+			knexthop_obj_flush(kif->ifindex);
 
-	rtlabel_unref(krm->labelid);
-	free(krm);
-	return (multipath);
+		kif_revalidate(kif);
+		break;
+	case RTM_DELLINK:
+		knexthop_obj_flush(ifi->ifi_index);
+		kif = kif_find(ifi->ifi_index);
+		if (kif != NULL)
+			kif_remove(kif);
+		break;
+	}
 }
 
-static int
-kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any)
+int
+get_mpe_config(const char *name, u_int *rdomain, u_int *label)
 {
-	struct kroute6	*kr, *krm;
-	struct knexthop	*n;
-	int multipath = 1;
-
-	if ((kr = kroute6_find(kt, &kf->prefix, kf->prefixlen,
-	    kf->priority)) == NULL)
-		return (-1);
+	return (-1);
+}
 
-	if ((kr->flags & F_BGPD) != (kf->flags & F_BGPD)) {
-		log_warnx("%s: wrong type for %s/%u", __func__,
-		    log_addr(&kf->prefix), kf->prefixlen);
-		if (!(kf->flags & F_BGPD))
-			kr->flags &= ~F_BGPD_INSERTED;
-		return (-1);
-	}
+/*
+ * rtsock related functions
+ */
+static struct kr_inflight *
+kr_inflight_get(u_int i)
+{
+	return (&kr_state.inflight[(kr_state.inflight_head + i) %
+	    KR_MAX_INFLIGHT]);
+}
 
-	/* get the correct route to remove */
-	krm = kr;
-	if (!any) {
-		if ((krm = kroute6_matchgw(kr, kf)) == NULL) {
-			log_warnx("delete %s/%u: route not found",
-			    log_addr(&kf->prefix), kf->prefixlen);
-			return (-2);
-		}
-	}
+static void
+kr_inflight_error(u_int idx, int error)
+{
+	struct kr_inflight	*ki, *nki;
+	struct knexthop_obj	 s, *nho;
+	struct ktable		*kt;
+	struct kroute		*kr;
+	struct kroute6		*kr6;
+	u_int			 i;
 
-	if (krm == kr) {
-		/* head element */
-		RB_REMOVE(kroute6_tree, &kt->krt6, krm);
-		if (krm->next != NULL) {
-			kr = krm->next;
-			if (RB_INSERT(kroute6_tree, &kt->krt6, kr) != NULL) {
-				log_warnx("%s: failed to add %s/%u", __func__,
-				    log_in6addr(&kr->prefix), kr->prefixlen);
-				return (-2);
-			}
-		} else {
-			multipath = 0;
-		}
-	} else {
-		/* somewhere in the list */
-		while (kr->next != krm && kr->next != NULL)
-			kr = kr->next;
-		if (kr->next == NULL) {
-			log_warnx("%s: multipath list corrupted for %s/%u",
-			    __func__, log_in6addr(&kr->prefix), kr->prefixlen);
-			return (-2);
+	ki = kr_inflight_get(idx);
+	switch (ki->action) {
+	case RTM_NH_CHANGE:
+		errno = error;
+		log_warn("nexthop object %u via %s", ki->nhid,
+		    log_addr(&ki->prefix));
+		s.id = ki->nhid;
+		if ((nho = RB_FIND(knexthop_obj_tree, &knhot, &s)) != NULL)
+			knexthop_obj_fallback(nho);
+		return;
+	case RTM_NH_DELETE:
+		/* already flushed by the kernel */
+		if (error != ENOENT) {
+			errno = error;
+			log_warn("%s: delete nexthop object %u", __func__,
+			    ki->nhid);
 		}
-		kr->next = krm->next;
+		return;
 	}
 
-	/* check whether a nexthop depends on this kroute */
-	if (krm->flags & F_NEXTHOP) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt)) {
-			if (n->kroute == krm)
-				knexthop_validate(kt, n);
-		}
+	if (ki->action == RTM_DELETE && error == ESRCH) {
+		log_info("route %s/%u vanished before delete",
+		    log_addr(&ki->prefix), ki->prefixlen);
+		return;
 	}
+	errno = error;
+	log_warn("%s: action %u, prefix %s/%u", __func__, ki->action,
+	    log_addr(&ki->prefix), ki->prefixlen);
 
-	*kf = *kr6_tofull(krm);
-
-	rtlabel_unref(krm->labelid);
-	free(krm);
-	return (multipath);
-}
-
+	if (ki->action == RTM_DELETE)
+		return;
 
-int
-kroute_remove(struct ktable *kt, struct kroute_full *kf, int any)
-{
-	int multipath;
+	/*
+	 * A later message for the same prefix decides the final state,
+	 * be it in flight or still queued.
+	 */
+	for (i = idx + 1; i < kr_state.inflight_cnt; i++) {
+		nki = kr_inflight_get(i);
+		if (nki->action < RTM_NH_CHANGE &&
+		    nki->rtableid == ki->rtableid &&
+		    nki->prefixlen == ki->prefixlen &&
+		    prefix_compare(&nki->prefix, &ki->prefix,
+		    ki->prefixlen) == 0)
+			return;
+	}
+	if (kr_queue_find(ki->rtableid, &ki->prefix, ki->prefixlen) != NULL)
+		return;
 
-	switch (kf->prefix.aid) {
+	if ((kt = ktable_get(ki->rtableid)) == NULL)
+		return;
+	switch (ki->prefix.aid) {
 	case AID_INET:
-		multipath = kroute4_remove(kt, kf, any);
+		kr = kroute_find(kt, &ki->prefix, ki->prefixlen, RTP_MINE);
+		if (kr != NULL)
+			kr->flags &= ~F_BGPD_INSERTED;
 		break;
 	case AID_INET6:
-		multipath = kroute6_remove(kt, kf, any);
+		kr6 = kroute6_find(kt, &ki->prefix, ki->prefixlen, RTP_MINE);
+		if (kr6 != NULL)
+			kr6->flags &= ~F_BGPD_INSERTED;
 		break;
-	default:
-		log_warnx("%s: not handled AID", __func__);
-		return (-1);
 	}
+}
 
-	if (multipath < 0)
-		return (multipath + 1);
-
-	if (kf->flags & F_BGPD_INSERTED)
-		send_rtmsg(RTM_DELETE, kt, kf);
-
-	/* remove only once all multipath routes are gone */
-	if (!(kf->flags & F_BGPD) && !multipath)
-		kr_redistribute(IMSG_NETWORK_REMOVE, kt, kf);
+/*
+ * Retire all messages up to and including seq. Netlink processes the
+ * messages of a socket in order so everything before seq without an
+ * error report was successful, unless the whole batch failed.
+ */
+static int
+kr_inflight_ack(uint32_t seq, int error, int batch)
+{
+	struct kr_inflight	*ki;
+	int			 found = 0;
 
-	return (0);
+	while (kr_state.inflight_cnt > kr_state.batchcnt) {
+		ki = kr_inflight_get(0);
+		if ((int32_t)(ki->seq - seq) > 0)
+			break;
+		if (ki->seq == seq)
+			found = 1;
+		if ((found || batch) && error != 0)
+			kr_inflight_error(0, error);
+		kr_state.inflight_head =
+		    (kr_state.inflight_head + 1) % KR_MAX_INFLIGHT;
+		kr_state.inflight_cnt--;
+		if (found)
+			break;
+	}
+	return (found);
 }
 
+/*
+ * Hand all queued route messages to the writer. Only the last message
+ * requests an ACK which acknowledges the full batch.
+ */
 void
-kroute_clear(struct ktable *kt)
+kr_batch_flush(void)
 {
-	struct kroute	*kr;
+	struct nlmsghdr		*nlh;
+	struct kr_wbatch	*b;
+	size_t			 head;
+	char			*buf;
+	uint64_t		 one = 1;
 
-	while ((kr = RB_MIN(kroute_tree, &kt->krt)) != NULL)
-		kroute_remove(kt, kr_tofull(kr), 1);
+	if (kr_state.batchlen == 0)
+		return;
+
+	nlh = (struct nlmsghdr *)(kr_state.batch + kr_state.batchlast);
+	nlh->nlmsg_flags |= NLM_F_ACK;
+
+	/* all slots busy, the writer frees one with every batch sent */
+	head = atomic_load_explicit(&krw.head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&krw.tail,
+	    memory_order_acquire) >= KR_WRITER_RING)
+		kr_writer_wait(-1);
+
+	/* swap buffers with the slot, it holds an already sent batch */
+	b = &krw.ring[head % KR_WRITER_RING];
+	buf = b->buf;
+	b->buf = kr_state.batch;
+	b->len = kr_state.batchlen;
+	b->lastseq = nlh->nlmsg_seq;
+	kr_state.batch = buf;
+	atomic_store_explicit(&krw.head, head + 1, memory_order_release);
+	if (write(krw.wakefd, &one, sizeof(one)) == -1)
+		log_warn("%s: write", __func__);
+
+	kr_state.batchlen = 0;
+	kr_state.batchlast = 0;
+	kr_state.batchcnt = 0;
 }
 
-struct kroute6 *
-kroute6_find(struct ktable *kt, const struct bgpd_addr *prefix,
-    uint8_t prefixlen, uint8_t prio)
+/*
+ * Flush the batch and process replies until at most max messages are
+ * outstanding. Used for backpressure and on shutdown.
+ */
+void
+kr_inflight_wait(u_int max)
 {
-	struct kroute6	s;
-	struct kroute6	*kn6, *tmp;
-
-	s.prefix = prefix->v6;
-	s.prefix_scope_id = prefix->scope_id;
-	s.prefixlen = prefixlen;
-	s.priority = prio;
-
-	kn6 = RB_FIND(kroute6_tree, &kt->krt6, &s);
-	if (kn6 && prio == RTP_ANY) {
-		tmp = RB_PREV(kroute6_tree, &kt->krt6, kn6);
-		while (tmp) {
-			if (kroute6_compare(&s, tmp) == 0)
-				kn6 = tmp;
-			else
-				break;
-			tmp = RB_PREV(kroute6_tree, &kt->krt6, kn6);
+	kr_batch_flush();
+
+	while (kr_state.inflight_cnt > max) {
+		if (kr_writer_wait(KR_INFLIGHT_TIMEOUT) == -1) {
+			/* their fate is unknown, ask the kernel */
+			log_warnx("%s: giving up on %u outstanding messages",
+			    __func__, kr_state.inflight_cnt);
+			kr_state.inflight_head = 0;
+			kr_state.inflight_cnt = 0;
+			kr_state.resync = 1;
+			break;
 		}
+		kr_batch_flush();
 	}
-	return (kn6);
 }
 
-struct kroute6 *
-kroute6_matchgw(struct kroute6 *kr, struct kroute_full *kf)
+/*
+ * Wait up to timeout ms for the writer to report back and process what
+ * it did. The writer also reports every ring slot it frees.
+ */
+int
+kr_writer_wait(int timeout)
 {
-	struct in6_addr	nexthop;
-
-	if (kf->flags & F_CONNECTED) {
-		do {
-			if (kr->ifindex == kf->ifindex)
-				return (kr);
-			kr = kr->next;
-		} while (kr);
-		return (NULL);
-	}
-
-	nexthop = kf->nexthop.v6;
-	do {
-		if (memcmp(&kr->nexthop, &nexthop, sizeof(nexthop)) == 0 &&
-		    kr->nexthop_scope_id == kf->nexthop.scope_id)
-			return (kr);
-		kr = kr->next;
-	} while (kr);
-
-	return (NULL);
+	struct pollfd	pfd;
+	int		nfds;
+
+	pfd.fd = krw.donefd;
+	pfd.events = POLLIN;
+	while ((nfds = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+		;	/* nothing */
+	if (nfds == -1)
+		log_warn("%s: poll", __func__);
+	if (nfds <= 0)
+		return (-1);
+	kr_writer_reap();
+	return (0);
 }
 
-void
-kroute6_clear(struct ktable *kt)
+static void
+kr_writer_post(uint32_t seq, int error, int batch, int lost)
 {
-	struct kroute6	*kr;
+	struct kr_wdone	*d;
+	size_t		 dhead;
+	uint64_t	 one = 1;
 
-	while ((kr = RB_MIN(kroute6_tree, &kt->krt6)) != NULL)
-		kroute_remove(kt, kr6_tofull(kr), 1);
+	/*
+	 * Cannot overflow, there is room for an error per message and for
+	 * an ACK and a lost report per batch.
+	 */
+	dhead = atomic_load_explicit(&krw.dhead, memory_order_relaxed);
+	d = &krw.done[dhead % KR_WRITER_DONE];
+	d->seq = seq;
+	d->error = error;
+	d->batch = batch;
+	d->lost = lost;
+	atomic_store_explicit(&krw.dhead, dhead + 1, memory_order_release);
+	(void)write(krw.donefd, &one, sizeof(one));
 }
 
-struct knexthop *
-knexthop_find(struct ktable *kt, struct bgpd_addr *addr)
+/*
+ * Send a batch and wait for its ACK, passing errors on to the parent.
+ * Runs in the writer thread, so no logging and no shared state.
+ */
+static void
+kr_writer_send(struct kr_wbatch *b)
 {
-	struct knexthop	s;
-
-	memset(&s, 0, sizeof(s));
-	memcpy(&s.nexthop, addr, sizeof(s.nexthop));
+	char		 buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr	*nlh;
+	struct nlmsgerr	*err;
+	int		 n;
+
+	if (mnl_socket_sendto(krw.nl, b->buf, b->len) < 0) {
+		kr_writer_post(b->lastseq, errno, 1, 0);
+		krw.lastseq = b->lastseq;
+		return;
+	}
 
-	return (RB_FIND(knexthop_tree, KT2KNT(kt), &s));
+	for (;;) {
+		if ((n = mnl_socket_recvfrom(krw.nl, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/* error reports got lost */
+				kr_writer_post(0, ENOBUFS, 0, 1);
+				continue;
+			}
+			/*
+			 * No ACK within KR_INFLIGHT_TIMEOUT. The kernel most
+			 * likely applied the batch, so do not fail it. Retire
+			 * it like a lost reply and let a resync fix the rest.
+			 */
+			kr_writer_post(0, errno, 0, 1);
+			kr_writer_post(b->lastseq, 0, 0, 0);
+			krw.lastseq = b->lastseq;
+			return;
+		}
+		for (nlh = (struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, n);
+		    nlh = mnl_nlmsg_next(nlh, &n)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			/* late reply to a batch that timed out */
+			if ((int32_t)(nlh->nlmsg_seq - krw.lastseq) <= 0)
+				continue;
+			err = mnl_nlmsg_get_payload(nlh);
+			if (err->error != 0 || nlh->nlmsg_seq == b->lastseq)
+				kr_writer_post(nlh->nlmsg_seq, -err->error,
+				    0, 0);
+			if (nlh->nlmsg_seq == b->lastseq) {
+				krw.lastseq = b->lastseq;
+				return;
+			}
+		}
+	}
 }
 
-int
-knexthop_insert(struct ktable *kt, struct knexthop *kn)
+static void *
+kr_writer_main(void *arg)
 {
-	if (RB_INSERT(knexthop_tree, KT2KNT(kt), kn) != NULL) {
-		log_warnx("%s: failed for %s", __func__,
-		    log_addr(&kn->nexthop));
-		free(kn);
-		return (-1);
+	struct kr_wbatch	*b;
+	size_t			 tail;
+	uint64_t		 cnt, one = 1;
+
+	tail = atomic_load_explicit(&krw.tail, memory_order_relaxed);
+	for (;;) {
+		while (tail == atomic_load_explicit(&krw.head,
+		    memory_order_acquire))
+			if (read(krw.wakefd, &cnt, sizeof(cnt)) == -1 &&
+			    errno != EINTR)
+				return (NULL);
+
+		b = &krw.ring[tail % KR_WRITER_RING];
+		if (b->len == 0)
+			return (NULL);
+		kr_writer_send(b);
+		atomic_store_explicit(&krw.tail, ++tail, memory_order_release);
+		/* the parent may wait for the slot */
+		(void)write(krw.donefd, &one, sizeof(one));
 	}
+}
 
-	knexthop_validate(kt, kn);
+void
+kr_writer_start(void)
+{
+	struct timeval	tv;
+	sigset_t	all, old;
+	int		i, opt = 1;
 
-	return (0);
+	if ((krw.nl = mnl_socket_open2(NETLINK_ROUTE, SOCK_CLOEXEC)) == NULL)
+		fatal("mnl_socket_open");
+	if (mnl_socket_bind(krw.nl, 0, MNL_SOCKET_AUTOPID) < 0)
+		fatal("mnl_socket_bind");
+	krw.pid = mnl_socket_get_portid(krw.nl);
+
+	/* a batch with many failing messages, errors need little space */
+	if (setsockopt(mnl_socket_get_fd(krw.nl), SOL_NETLINK,
+	    NETLINK_CAP_ACK, &opt, sizeof(opt)) == -1)
+		log_warn("%s: setsockopt NETLINK_CAP_ACK", __func__);
+	tv.tv_sec = KR_INFLIGHT_TIMEOUT / 1000;
+	tv.tv_usec = (KR_INFLIGHT_TIMEOUT % 1000) * 1000;
+	if (setsockopt(mnl_socket_get_fd(krw.nl), SOL_SOCKET, SO_RCVTIMEO,
+	    &tv, sizeof(tv)) == -1)
+		fatal("%s: setsockopt SO_RCVTIMEO", __func__);
+
+	for (i = 0; i < KR_WRITER_RING; i++)
+		if ((krw.ring[i].buf = malloc(KR_BATCH_SIZE +
+		    MNL_SOCKET_BUFFER_SIZE)) == NULL)
+			fatal("%s", __func__);
+	if ((krw.done = calloc(KR_WRITER_DONE, sizeof(*krw.done))) == NULL)
+		fatal("%s", __func__);
+	if ((krw.wakefd = eventfd(0, EFD_CLOEXEC)) == -1 ||
+	    (krw.donefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		fatal("eventfd");
+
+	/* signals are for the parent */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if ((errno = pthread_create(&krw.thread, NULL, kr_writer_main,
+	    NULL)) != 0)
+		fatal("pthread_create");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
 void
-knexthop_remove(struct ktable *kt, struct knexthop *kn)
+kr_writer_stop(void)
 {
-	kroute_detach_nexthop(kt, kn);
-	RB_REMOVE(knexthop_tree, KT2KNT(kt), kn);
-	free(kn);
+	size_t		head;
+	uint64_t	one = 1;
+	int		i;
+
+	head = atomic_load_explicit(&krw.head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&krw.tail,
+	    memory_order_acquire) >= KR_WRITER_RING)
+		kr_writer_wait(-1);
+	krw.ring[head % KR_WRITER_RING].len = 0;
+	atomic_store_explicit(&krw.head, head + 1, memory_order_release);
+	if (write(krw.wakefd, &one, sizeof(one)) == -1)
+		log_warn("%s: write", __func__);
+	if ((errno = pthread_join(krw.thread, NULL)) != 0)
+		log_warn("%s: pthread_join", __func__);
+
+	for (i = 0; i < KR_WRITER_RING; i++)
+		free(krw.ring[i].buf);
+	free(krw.done);
+	close(krw.wakefd);
+	close(krw.donefd);
+	mnl_socket_close(krw.nl);
 }
 
+/*
+ * Process ACKs and errors reported by the writer.
+ */
 void
-knexthop_clear(struct ktable *kt)
+kr_writer_done(void)
 {
-	struct knexthop	*kn;
-
-	if (kt == NULL)
-		return;
+	kr_writer_reap();
 
-	while ((kn = RB_MIN(knexthop_tree, KT2KNT(kt))) != NULL)
-		knexthop_remove(kt, kn);
+	/* everything sent got acknowledged, push out the next batch */
+	if (kr_state.inflight_cnt == kr_state.batchcnt)
+		kr_batch_flush();
 }
 
-struct kif *
-kif_find(int ifindex)
+void
+kr_writer_reap(void)
 {
-	struct kif	s;
-
-	memset(&s, 0, sizeof(s));
-	s.ifindex = ifindex;
-
-	return (RB_FIND(kif_tree, &kit, &s));
+	struct kr_wdone	*d;
+	uint64_t	 cnt;
+
+	(void)read(krw.donefd, &cnt, sizeof(cnt));
+	while (krw.dtail != atomic_load_explicit(&krw.dhead,
+	    memory_order_acquire)) {
+		d = &krw.done[krw.dtail++ % KR_WRITER_DONE];
+		if (d->lost) {
+			log_warnx("%s: route message errors lost", __func__);
+			kr_state.resync = 1;
+			continue;
+		}
+		if (d->batch)
+			log_warnx("%s: batch up to seq %u failed", __func__,
+			    d->seq);
+		kr_inflight_ack(d->seq, d->error, d->batch);
+	}
 }
 
-int
-kif_insert(struct kif *kif)
+/*
+ * Start a new message at the end of the batch.
+ */
+static struct nlmsghdr *
+kr_batch_put(void)
 {
-	if (RB_INSERT(kif_tree, &kit, kif) != NULL) {
-		log_warnx("RB_INSERT(kif_tree, &kit, kif)");
-		free(kif);
-		return (-1);
-	}
+	struct nlmsghdr *nlh;
 
-	return (0);
-}
+	if (kr_state.inflight_cnt >= KR_MAX_INFLIGHT)
+		kr_inflight_wait(KR_MAX_INFLIGHT - 1);
 
-int
-kif_remove(struct kif *kif)
+	nlh = mnl_nlmsg_put_header(kr_state.batch + kr_state.batchlen);
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	nlh->nlmsg_seq = kr_next_seq();
+	return (nlh);
+}
+
+/*
+ * Add the finished message to the batch and remember it until the
+ * kernel acknowledged it.
+ */
+static void
+kr_batch_commit(struct nlmsghdr *nlh, const struct kr_inflight *req)
 {
-	struct ktable	*kt;
+	struct kr_inflight *ki;
 
-	kif->flags &= ~IFF_UP;
+	ki = kr_inflight_get(kr_state.inflight_cnt++);
+	*ki = *req;
+	ki->seq = nlh->nlmsg_seq;
+
+	kr_state.batchlast = kr_state.batchlen;
+	kr_state.batchlen += nlh->nlmsg_len;
+	kr_state.batchcnt++;
 
 	/*
-	 * TODO, remove all kroutes using this interface,
-	 * the kernel does this for us but better to do it
-	 * here as well.
+	 * Send right away if nothing else is in flight, else collect more
+	 * messages until the outstanding ones are acknowledged or the
+	 * batch is full.
 	 */
-
-	if ((kt = ktable_get(kif->rdomain)) != NULL)
-		knexthop_track(kt, kif->ifindex);
-
-	RB_REMOVE(kif_tree, &kit, kif);
-	free(kif);
-	return (0);
+	if (kr_state.inflight_cnt == kr_state.batchcnt ||
+	    kr_state.batchlen >= KR_BATCH_SIZE)
+		kr_batch_flush();
 }
 
-void
-kif_clear(void)
+static void
+kr_put_addr(struct nlmsghdr *nlh, uint16_t type, const struct bgpd_addr *addr)
 {
-	struct kif	*kif;
-
-	while ((kif = RB_MIN(kif_tree, &kit)) != NULL)
-		kif_remove(kif);
+	switch (addr->aid) {
+	case AID_INET:
+		mnl_attr_put_u32(nlh, type, addr->v4.s_addr);
+		break;
+	case AID_INET6:
+		mnl_attr_put(nlh, type, sizeof(struct in6_addr), &addr->v6);
+		break;
+	}
 }
 
 /*
- * nexthop validation
+ * Add the paths of a nexthop group inline, as plain gateway or as
+ * RTA_MULTIPATH for ECMP routes.
  */
+static void
+kr_put_gateways(struct nlmsghdr *nlh, struct knexthop_obj *nho)
+{
+	struct knexthop_obj	*m = nho->members;
+	struct rtnexthop	*rtnh;
+	struct nlattr		*nest;
 
-static int
-kif_validate(struct kif *kif)
+	if (m->next == NULL) {
+		kr_put_addr(nlh, RTA_GATEWAY, &m->gateway);
+		mnl_attr_put_u32(nlh, RTA_OIF, m->ifindex);
+		return;
+	}
+
+	nest = mnl_attr_nest_start(nlh, RTA_MULTIPATH);
+	for (; m != NULL; m = m->next) {
+		rtnh = mnl_nlmsg_get_payload_tail(nlh);
+		nlh->nlmsg_len += MNL_ALIGN(sizeof(*rtnh));
+		memset(rtnh, 0, sizeof(*rtnh));
+		rtnh->rtnh_ifindex = m->ifindex;
+		kr_put_addr(nlh, RTA_GATEWAY, &m->gateway);
+		rtnh->rtnh_len = (char *)mnl_nlmsg_get_payload_tail(nlh) -
+		    (char *)rtnh;
+	}
+	mnl_attr_nest_end(nlh, nest);
+}
+
+int
+send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf,
+    uint32_t nhid)
 {
-	if (!(kif->flags & IFF_UP))
+	struct kr_walk	*w;
+
+	if (!kt->fib_sync)
 		return (0);
 
-	/*
-	 * we treat link_state == LINK_STATE_UNKNOWN as valid,
-	 * not all interfaces have a concept of "link state" and/or
-	 * do not report up
-	 */
+	switch (kf->prefix.aid) {
+	case AID_INET:
+	case AID_INET6:
+		break;
+	default:
+		log_warnx("%s: unsupported address family %s", __func__,
+		    aid2str(kf->prefix.aid));
+		return (-1);
+	}
 
-	if (kif->link_state == LINK_STATE_DOWN)
+	/* routes not in the FIB yet wait for kr_fib_hold_end() */
+	if (action == RTM_ADD && kr_state.fib_hold) {
+		kr_state.hold_routes++;
+		return (0);
+	}
+
+	/* the table is being decoupled, only deletes may pass */
+	if (action != RTM_DELETE && (w = kr_walk_find(kt->rtableid)) != NULL &&
+	    w->type != KR_WALK_COUPLE)
 		return (0);
 
+	kr_audit_dirty(kt->rtableid, &kf->prefix, kf->prefixlen);
+	kr_queue_put(action, kt, kf, nhid);
 	return (1);
 }
 
-#ifdef NOTYET
-/*
- * return 1 when the interface is up and the link state is up or unknwown
- * except when this is a carp interface, then return 1 only when link state
- * is up
- */
-static int
-kif_depend_state(struct kif *kif)
+struct kr_pending *
+kr_queue_find(u_int rtableid, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	if (!(kif->flags & IFF_UP))
-		return (0);
+	struct kr_pending	 s;
 
-	if (kif->if_type == IFT_CARP &&
-	    kif->link_state == LINK_STATE_UNKNOWN)
-		return (0);
-	return LINK_STATE_IS_UP(kif->link_state);
+	if (kr_state.queue_len == 0)
+		return (NULL);
+	s.rtableid = rtableid;
+	s.kf.prefix = *prefix;
+	s.kf.prefixlen = prefixlen;
+	return (RB_FIND(kr_pending_tree, &krpending, &s));
 }
-#endif
 
-int
-kroute_validate(struct kroute *kr)
+/*
+ * Queue a route change, replacing an older change of the same prefix.
+ * An add followed by a delete cancels out.
+ */
+void
+kr_queue_put(int action, struct ktable *kt, struct kroute_full *kf,
+    uint32_t nhid)
 {
-	struct kif	*kif;
+	struct kr_pending	 s, *p;
 
-	if (kr->flags & (F_REJECT | F_BLACKHOLE))
-		return (0);
+	kr_state.queue_puts++;
 
-	if ((kif = kif_find(kr->ifindex)) == NULL) {
-		if (kr->ifindex)
-			log_warnx("%s: interface with index %d not found, "
-			    "referenced from route for %s/%u", __func__,
-			    kr->ifindex, inet_ntoa(kr->prefix),
-			    kr->prefixlen);
-		return (1);
+	s.rtableid = kt->rtableid;
+	s.kf.prefix = kf->prefix;
+	s.kf.prefixlen = kf->prefixlen;
+	if ((p = RB_FIND(kr_pending_tree, &krpending, &s)) == NULL) {
+		if ((p = kr_pool_get(&kr_pending_pool)) == NULL) {
+			log_warn("%s", __func__);
+			send_rtmsg_now(action, kt, kf, nhid);
+			return;
+		}
+		p->rtableid = kt->rtableid;
+		p->inkernel = action != RTM_ADD;
+		p->kf = *kf;	/* key for the insert */
+		RB_INSERT(kr_pending_tree, &krpending, p);
+		kr_state.queue_len++;
+	} else
+		kr_state.queue_coalesced++;
+
+	p->kf = *kf;
+	p->action = action;
+	knexthop_obj_ref(nhid);
+	knexthop_obj_unref(p->nhid);
+	p->nhid = nhid;
+
+	if (action == RTM_DELETE && !p->inkernel) {
+		/* never made it to the kernel */
+		kr_state.queue_cancelled++;
+		RB_REMOVE(kr_pending_tree, &krpending, p);
+		kr_state.queue_len--;
+		kr_pool_put(&kr_pending_pool, p);
 	}
 
-	return (kif->nh_reachable);
+	if (kr_state.queue_len >= KR_QUEUE_MAX)
+		kr_queue_flush();
+	else if (kr_state.queue_len > 0 &&
+	    !kr_state.timer_armed[KR_TIMER_QUEUE])
+		kr_timer_set(KR_TIMER_QUEUE, KR_QUEUE_DELAY);
 }
 
-int
-kroute6_validate(struct kroute6 *kr)
+/*
+ * Send all pending route changes, then drop the nexthop groups no
+ * longer used by them.
+ */
+void
+kr_queue_flush(void)
 {
-	struct kif	*kif;
+	struct kr_pending	*p;
+	struct knexthop_obj	*nho;
+	struct ktable		*kt;
 
-	if (kr->flags & (F_REJECT | F_BLACKHOLE))
-		return (0);
+	kr_timer_stop(KR_TIMER_QUEUE);
 
-	if ((kif = kif_find(kr->ifindex)) == NULL) {
-		if (kr->ifindex)
-			log_warnx("%s: interface with index %d not found, "
-			    "referenced from route for %s/%u", __func__,
-			    kr->ifindex, log_in6addr(&kr->prefix),
-			    kr->prefixlen);
-		return (1);
+	while ((p = RB_MIN(kr_pending_tree, &krpending)) != NULL) {
+		RB_REMOVE(kr_pending_tree, &krpending, p);
+		if ((kt = ktable_get(p->rtableid)) != NULL)
+			send_rtmsg_now(p->action, kt, &p->kf, p->nhid);
+		kr_state.queue_len--;
+		/* the route message is queued, the group may go after it */
+		knexthop_obj_unref(p->nhid);
+		kr_pool_put(&kr_pending_pool, p);
 	}
 
-	return (kif->nh_reachable);
+	while ((nho = kr_state.nhdead) != NULL) {
+		kr_state.nhdead = nho->dead;
+		knexthop_obj_destroy(nho);
+	}
+
+	kr_batch_flush();
+}
+
+void
+kr_queue_log(void)
+{
+	log_debug("fib queue: %zu pending, %llu changes, %llu coalesced, "
+	    "%llu cancelled, %llu kernel writes, %llu no-op changes "
+	    "suppressed", kr_state.queue_len,
+	    (unsigned long long)kr_state.queue_puts,
+	    (unsigned long long)kr_state.queue_coalesced,
+	    (unsigned long long)kr_state.queue_cancelled,
+	    (unsigned long long)kr_state.fib_writes,
+	    (unsigned long long)kr_state.fib_suppressed);
+	log_debug("nexthop updates: %llu queued, %llu coalesced, %llu sent",
+	    (unsigned long long)kr_state.nh_updates,
+	    (unsigned long long)kr_state.nh_coalesced,
+	    (unsigned long long)kr_state.nh_sent);
 }
 
 int
-knexthop_true_nexthop(struct ktable *kt, struct kroute_full *kf)
+send_rtmsg_now(int action, struct ktable *kt, struct kroute_full *kf,
+    uint32_t nhid)
 {
-	struct bgpd_addr gateway = { 0 };
-	struct knexthop *kn;
-	struct kroute	*kr;
-	struct kroute6	*kr6;
+	struct nlmsghdr *nlh;
+	struct rtmsg *rtm;
+	struct kr_inflight ki;
+	struct knexthop_obj s, *nho = NULL;
+
+	if (!kt->fib_sync)
+		return (0);
 
-	/*
-	 * Ignore the nexthop for VPN routes. The gateway is forced
-	 * to an mpe(4) interface route using an MPLS label.
-	 */
 	switch (kf->prefix.aid) {
-	case AID_VPN_IPv4:
-	case AID_VPN_IPv6:
-		return 1;
+	case AID_INET:
+	case AID_INET6:
+		break;
+	default:
+		log_warnx("%s: unsupported address family %s", __func__,
+		    aid2str(kf->prefix.aid));
+		return (-1);
 	}
 
-	kn = knexthop_find(kt, &kf->nexthop);
-	if (kn == NULL) {
-		log_warnx("%s: nexthop %s not found", __func__,
-		    log_addr(&kf->nexthop));
-		return 0;
+	if (action != RTM_DELETE && nhid != 0) {
+		s.id = nhid;
+		if ((nho = RB_FIND(knexthop_obj_tree, &knhot, &s)) == NULL)
+			fatalx("%s: unknown nexthop object %u", __func__, nhid);
+		/* the group needs to exist before the route uses it */
+		if (kr_state.nhobj && !nho->noobj && !nho->installed)
+			knexthop_obj_install(nho);
 	}
-	if (kn->kroute == NULL)
-		return 0;
 
-	switch (kn->nexthop.aid) {
+	nlh = kr_batch_put();
+	switch (action) {
+	case RTM_CHANGE:
+	case RTM_ADD:
+		nlh->nlmsg_type = RTM_NEWROUTE;
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+		break;
+	case RTM_DELETE:
+		nlh->nlmsg_type = RTM_DELROUTE;
+		break;
+	}
+
+	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+	rtm->rtm_family = aid2af(kf->prefix.aid);
+	rtm->rtm_dst_len = kf->prefixlen;
+	rtm->rtm_src_len = 0;
+	rtm->rtm_tos = 0;
+	rtm->rtm_protocol = kr_state.fib_prio;
+	rtm->rtm_table = kt->rtableid == 0 ? RT_TABLE_MAIN : kt->rtableid;
+	rtm->rtm_type = RTN_UNICAST;
+	if (kf->flags & F_BLACKHOLE)
+		rtm->rtm_type = RTN_BLACKHOLE;
+	if (kf->flags & F_REJECT)
+		rtm->rtm_type = RTN_PROHIBIT;
+	rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+	rtm->rtm_flags = 0;
+
+	switch (kf->prefix.aid) {
 	case AID_INET:
-		kr = kn->kroute;
-		if (kr->flags & F_CONNECTED)
-			return 1;
-		gateway.aid = AID_INET;
-		gateway.v4.s_addr = kr->nexthop.s_addr;
+		mnl_attr_put_u32(nlh, RTA_DST, kf->prefix.v4.s_addr);
+		if (nho == NULL && kf->nexthop.aid != AID_UNSPEC)
+			mnl_attr_put_u32(nlh, RTA_GATEWAY,
+			    kf->nexthop.v4.s_addr);
 		break;
 	case AID_INET6:
-		kr6 = kn->kroute;
-		if (kr6->flags & F_CONNECTED)
-			return 1;
-		gateway.aid = AID_INET6;
-		gateway.v6 = kr6->nexthop;
-		gateway.scope_id = kr6->nexthop_scope_id;
+		mnl_attr_put(nlh, RTA_DST, sizeof(struct in6_addr),
+		    &kf->prefix.v6);
+		if (nho == NULL && kf->nexthop.aid != AID_UNSPEC)
+			mnl_attr_put(nlh, RTA_GATEWAY, sizeof(struct in6_addr),
+			    &kf->nexthop.v6);
 		break;
 	}
+	if (nho != NULL) {
+#ifdef HAVE_LINUX_NEXTHOP_H
+		if (kr_state.nhobj && !nho->noobj)
+			mnl_attr_put_u32(nlh, RTA_NH_ID, nho->id);
+		else
+#endif
+			kr_put_gateways(nlh, nho);
+	}
 
-	kf->nexthop = gateway;
-	return 1;
+	memset(&ki, 0, sizeof(ki));
+	ki.prefix = kf->prefix;
+	ki.prefixlen = kf->prefixlen;
+	ki.rtableid = kt->rtableid;
+	ki.action = action;
+	kr_batch_commit(nlh, &ki);
+	kr_state.fib_writes++;
+
+	return (1);
 }
 
 void
-knexthop_validate(struct ktable *kt, struct knexthop *kn)
+send_nhmsg(int action, struct knexthop_obj *nho)
 {
-	void		*oldk;
-	struct kroute	*kr;
-	struct kroute6	*kr6;
-
-	oldk = kn->kroute;
-	kroute_detach_nexthop(kt, kn);
-
-	if ((kt = ktable_get(kt->nhtableid)) == NULL)
-		fatalx("%s: lost nexthop routing table", __func__);
-
-	switch (kn->nexthop.aid) {
-	case AID_INET:
-		kr = kroute_match(kt, &kn->nexthop, 0);
-
-		if (kr != NULL) {
-			kn->kroute = kr;
-			kn->ifindex = kr->ifindex;
-			kr->flags |= F_NEXTHOP;
-		}
+#ifdef HAVE_LINUX_NEXTHOP_H
+	struct nexthop_grp grp[KR_MAX_MPATH];
+	struct nlmsghdr *nlh;
+	struct nhmsg *nhm;
+	struct knexthop_obj *m;
+	struct kr_inflight ki;
+	int n = 0;
 
-		/*
-		 * Send update if nexthop route changed under us if
-		 * the route remains the same then the NH state has not
-		 * changed.
-		 */
-		if (kr != oldk)
-			knexthop_send_update(kn);
+	nlh = kr_batch_put();
+	nhm = mnl_nlmsg_put_extra_header(nlh, sizeof(*nhm));
+	switch (action) {
+	case RTM_NH_CHANGE:
+		nlh->nlmsg_type = RTM_NEWNEXTHOP;
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+		if (nho->members == NULL)
+			nhm->nh_family = aid2af(nho->gateway.aid);
+		else
+			nhm->nh_family = AF_UNSPEC;
+		nhm->nh_protocol = kr_state.fib_prio;
 		break;
-	case AID_INET6:
-		kr6 = kroute6_match(kt, &kn->nexthop, 0);
-
-		if (kr6 != NULL) {
-			kn->kroute = kr6;
-			kn->ifindex = kr6->ifindex;
-			kr6->flags |= F_NEXTHOP;
-		}
-
-		if (kr6 != oldk)
-			knexthop_send_update(kn);
+	case RTM_NH_DELETE:
+		nlh->nlmsg_type = RTM_DELNEXTHOP;
+		nhm->nh_family = AF_UNSPEC;
 		break;
 	}
+	mnl_attr_put_u32(nlh, NHA_ID, nho->id);
+
+	if (action == RTM_NH_CHANGE && nho->members != NULL) {
+		memset(grp, 0, sizeof(grp));
+		for (m = nho->members; m != NULL && n < KR_MAX_MPATH;
+		    m = m->next)
+			grp[n++].id = m->id;
+		mnl_attr_put(nlh, NHA_GROUP, n * sizeof(grp[0]), grp);
+	} else if (action == RTM_NH_CHANGE) {
+		mnl_attr_put_u32(nlh, NHA_OIF, nho->ifindex);
+		kr_put_addr(nlh, NHA_GATEWAY, &nho->gateway);
+	}
+
+	memset(&ki, 0, sizeof(ki));
+	ki.prefix = nho->gateway;
+	ki.nhid = nho->id;
+	ki.action = action;
+	kr_batch_commit(nlh, &ki);
+
+	nho->installed = (action == RTM_NH_CHANGE);
+#endif
 }
 
+#define KR_BPF_ACCEPT	0xffffffff
+#define KR_BPF_DROP	0
+
 /*
- * Called on interface state change.
+ * Attach a socket filter so that route events for tables we don't track
+ * and the echo of our own changes are dropped by the kernel, without
+ * waking us up. Dump replies and everything else pass. It only drops
+ * what mnl_callback() ignores anyway, so bgpd works the same without.
  */
 void
-knexthop_track(struct ktable *kt, u_short ifindex)
+kr_filter_update(void)
 {
-	struct knexthop	*kn;
+	struct sock_filter	 insn[18 + 2 * KR_FILTER_MAXTABLES];
+	struct sock_fprog	 prog;
+	u_int			 i, n = 0, ntables = 0;
+	int			 zero = 0;
+
+	if (!KR_FILTER)
+		return;
+
+	for (i = 0; i < krt_size; i++)
+		if (ktable_get(i) != NULL)
+			ntables++;
+
+	/* netlink headers are host order, BPF loads are network order */
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+	    offsetof(struct nlmsghdr, nlmsg_type));
+	insn[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+	    htons(RTM_NEWROUTE), 2, 0);
+	insn[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+	    htons(RTM_DELROUTE), 1, 0);
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+	    KR_BPF_ACCEPT);
+
+	/* dump replies */
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+	    offsetof(struct nlmsghdr, nlmsg_flags));
+	insn[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,
+	    htons(NLM_F_MULTI), 0, 1);
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+	    KR_BPF_ACCEPT);
+
+	/* changes done by us, the writer sends them */
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+	    offsetof(struct nlmsghdr, nlmsg_pid));
+	insn[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+	    htonl(krw.pid), 0, 1);
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+	    KR_BPF_DROP);
+
+	if (ntables > KR_FILTER_MAXTABLES) {
+		/* too many tables, only drop our own changes */
+		insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+		    KR_BPF_ACCEPT);
+		goto attach;
+	}
+
+	/* find RTA_TABLE, the kernel always adds it to route events */
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_W | BPF_IMM,
+	    NLMSG_SPACE(sizeof(struct rtmsg)));
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IMM,
+	    RTA_TABLE);
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+	    SKF_AD_OFF + SKF_AD_NLATTR);
+	insn[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+	    0, 0, 1);
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+	    KR_BPF_ACCEPT);
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND,
+	    sizeof(struct nlattr));
+	for (i = 0; i < krt_size; i++) {
+		if (ktable_get(i) == NULL)
+			continue;
+		insn[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ |
+		    BPF_K, htonl(i == 0 ? RT_TABLE_MAIN : i), 0, 1);
+		insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+		    KR_BPF_ACCEPT);
+	}
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+	    KR_BPF_DROP);
+
+ attach:
+	prog.len = n;
+	prog.filter = insn;
+	if (setsockopt(mnl_socket_get_fd(kr_state.nl), SOL_SOCKET,
+	    SO_ATTACH_FILTER, &prog, sizeof(prog)) == 0)
+		return;
+	log_warn("%s: setsockopt SO_ATTACH_FILTER", __func__);
 
-	RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
-		if (kn->ifindex == ifindex)
-			knexthop_validate(kt, kn);
+	/* an older filter would drop the events of a new table */
+	if (setsockopt(mnl_socket_get_fd(kr_state.nl), SOL_SOCKET,
+	    SO_DETACH_FILTER, &zero, sizeof(zero)) == -1 && errno != ENOENT)
+		log_warn("%s: setsockopt SO_DETACH_FILTER", __func__);
 }
 
 /*
- * Called on route change.
+ * Dump the routes of a table, limited to one protocol if not 0. With
+ * strict checking the kernel does the filtering, else all tables are
+ * dumped and mnl_callback() throws away what is not needed.
  */
-void
-knexthop_update(struct ktable *kt, struct kroute_full *kf)
+int
+fetchtable(struct ktable *kt, uint8_t protocol)
 {
-	struct knexthop	*kn;
-
-	RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
-		if (prefix_compare(&kf->prefix, &kn->nexthop,
-		    kf->prefixlen) == 0)
-			knexthop_send_update(kn);
+	struct timespec	start, end;
+	int		rv;
+
+	kr_state.dump_msgs = 0;
+	kr_state.dump_skipped = 0;
+	kr_state.dump_proto = protocol;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (kr_state.strict) {
+		/* a per family dump keeps other route families out */
+		if ((rv = fetchtable_af(kt, AF_INET, protocol)) == 0)
+			rv = fetchtable_af(kt, AF_INET6, protocol);
+	} else
+		rv = fetchtable_af(kt, AF_UNSPEC, protocol);
+
+	kr_state.dump_proto = 0;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespecsub(&end, &start, &end);
+	log_debug("%s: rtable %u: %u messages, %u skipped, %lld.%03ld sec",
+	    __func__, kt->rtableid, kr_state.dump_msgs,
+	    kr_state.dump_skipped, (long long)end.tv_sec,
+	    end.tv_nsec / 1000000);
+
+	return (rv);
 }
 
-void
-knexthop_send_update(struct knexthop *kn)
+int
+fetchtable_af(struct ktable *kt, int af, uint8_t protocol)
 {
-	struct kroute_nexthop	 n;
-	struct kroute		*kr;
-	struct kroute6		*kr6;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct rtmsg    *rtm;
+	u_int		 table;
 
-	memset(&n, 0, sizeof(n));
-	n.nexthop = kn->nexthop;
+	table = kt->rtableid == 0 ? RT_TABLE_MAIN : kt->rtableid;
 
-	if (kn->kroute == NULL) {
-		n.valid = 0;	/* NH is not valid */
-		send_nexthop_update(&n);
-		return;
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_type = RTM_GETROUTE;
+	nlh->nlmsg_seq = kr_state.query_seq = kr_next_seq();
+	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+	rtm->rtm_family = af;
+	rtm->rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+	if (kr_state.strict) {
+		rtm->rtm_protocol = protocol;
+		mnl_attr_put_u32(nlh, RTA_TABLE, table);
 	}
 
-	switch (kn->nexthop.aid) {
-	case AID_INET:
-		kr = kn->kroute;
-		n.valid = kroute_validate(kr);
-		n.connected = kr->flags & F_CONNECTED;
-		if (!n.connected) {
-			n.gateway.aid = AID_INET;
-			n.gateway.v4.s_addr = kr->nexthop.s_addr;
-		} else {
-			n.gateway = n.nexthop;
-			n.net.aid = AID_INET;
-			n.net.v4.s_addr = kr->prefix.s_addr;
-			n.netlen = kr->prefixlen;
-		}
-		break;
-	case AID_INET6:
-		kr6 = kn->kroute;
-		n.valid = kroute6_validate(kr6);
-		n.connected = kr6->flags & F_CONNECTED;
-		if (!n.connected) {
-			n.gateway.aid = AID_INET6;
-			n.gateway.v6 = kr6->nexthop;
-			n.gateway.scope_id = kr6->nexthop_scope_id;
-		} else {
-			n.gateway = n.nexthop;
-			n.net.aid = AID_INET6;
-			n.net.v6 = kr6->prefix;
-			n.net.scope_id = kr6->prefix_scope_id;
-			n.netlen = kr6->prefixlen;
-		}
-		break;
-	}
-	send_nexthop_update(&n);
+	if (mnl_socket_sendto(kr_state.nl, nlh, nlh->nlmsg_len) < 0)
+		log_warn("%s: action %u", __func__, nlh->nlmsg_type);
+
+	return dispatch_rtmsg();
 }
 
-struct kroute *
-kroute_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
+int
+fetchifs(int ifindex)
 {
-	int			 i;
-	struct kroute		*kr;
-	struct bgpd_addr	 masked;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifi;
 
-	for (i = 32; i >= 0; i--) {
-		applymask(&masked, key, i);
-		if ((kr = kroute_find(kt, &masked, i, RTP_ANY)) != NULL)
-			if (matchany || bgpd_oknexthop(kr_tofull(kr)))
-				return (kr);
-	}
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_type = RTM_GETLINK;
+	nlh->nlmsg_seq = kr_state.query_seq = kr_next_seq();
+	ifi = mnl_nlmsg_put_extra_header(nlh, sizeof *ifi);
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = ifindex;
 
-	return (NULL);
+	if (mnl_socket_sendto(kr_state.nl, nlh, nlh->nlmsg_len) < 0)
+		log_warn("%s: action %u", __func__, nlh->nlmsg_type);
+
+	return dispatch_rtmsg();
 }
 
-struct kroute6 *
-kroute6_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
+/*
+ * Probe for nexthop object support. Existing objects are skipped when
+ * allocating ids, ours of a previous run are adopted.
+ */
+int
+fetchnexthops(void)
 {
-	int			 i;
-	struct kroute6		*kr6;
-	struct bgpd_addr	 masked;
+#ifdef HAVE_LINUX_NEXTHOP_H
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct nhmsg *nhm;
+	int rv;
 
-	for (i = 128; i >= 0; i--) {
-		applymask(&masked, key, i);
-		if ((kr6 = kroute6_find(kt, &masked, i, RTP_ANY)) != NULL)
-			if (matchany || bgpd_oknexthop(kr6_tofull(kr6)))
-				return (kr6);
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_type = RTM_GETNEXTHOP;
+	nlh->nlmsg_seq = kr_state.query_seq = kr_next_seq();
+	nhm = mnl_nlmsg_put_extra_header(nlh, sizeof *nhm);
+	nhm->nh_family = AF_UNSPEC;
+
+	if (mnl_socket_sendto(kr_state.nl, nlh, nlh->nlmsg_len) < 0) {
+		log_warn("%s: action %u", __func__, nlh->nlmsg_type);
+		return (-1);
 	}
 
-	return (NULL);
+	kr_state.nhdump = 1;
+	rv = dispatch_rtmsg();
+	kr_state.nhdump = 0;
+	knexthop_obj_adopt_link();
+	return (rv);
+#else
+	return (-1);
+#endif
 }
 
+/*
+ * Messages from the kernel got lost, most likely during a burst of route
+ * changes. Dump everything again and only apply the differences.
+ */
 void
-kroute_detach_nexthop(struct ktable *kt, struct knexthop *kn)
+kr_resync(void)
 {
-	struct knexthop	*s;
-	struct kroute	*k;
-	struct kroute6	*k6;
-
-	if (kn->kroute == NULL)
-		return;
+	struct ktable	*kt;
+	u_int		 rid;
 
 	/*
-	 * check whether there's another nexthop depending on this kroute
-	 * if not remove the flag
+	 * The dump has to show our pending route messages. Send them and
+	 * come back once the kernel acknowledged all of them.
 	 */
-	RB_FOREACH(s, knexthop_tree, KT2KNT(kt))
-		if (s->kroute == kn->kroute && s != kn)
-			break;
+	kr_queue_flush();
+	if (kr_state.inflight_cnt != 0)
+		return;
 
-	if (s == NULL) {
-		switch (kn->nexthop.aid) {
-		case AID_INET:
-			k = kn->kroute;
-			k->flags &= ~F_NEXTHOP;
-			break;
-		case AID_INET6:
-			k6 = kn->kroute;
-			k6->flags &= ~F_NEXTHOP;
-			break;
-		}
-	}
+	kr_state.resync = 0;
+	log_info("resyncing with the kernel");
 
-	kn->kroute = NULL;
-	kn->ifindex = 0;
+	if (fetchifs(0) == -1)
+		kr_state.resync = 1;
+	for (rid = 0; rid < krt_size; rid++) {
+		if ((kt = ktable_get(rid)) == NULL)
+			continue;
+		if (kr_resync_table(kt) == -1)
+			kr_state.resync = 1;
+	}
 }
 
-/*
- * misc helpers
- */
-
-uint8_t
-prefixlen_classful(in_addr_t ina)
+static void
+kr_shadow_norm(struct kroute_full *kf)
 {
-	/* it hurt to write this. */
-
-	if (ina >= 0xf0000000U)		/* class E */
-		return (32);
-	else if (ina >= 0xe0000000U)	/* class D */
-		return (4);
-	else if (ina >= 0xc0000000U)	/* class C */
-		return (24);
-	else if (ina >= 0x80000000U)	/* class B */
-		return (16);
-	else				/* class A */
-		return (8);
+	/* connected routes are only known by their interface */
+	if (kf->flags & F_CONNECTED)
+		memset(&kf->nexthop, 0, sizeof(kf->nexthop));
 }
 
-static uint8_t
-mask2prefixlen4(struct sockaddr_in *sa_in)
+static int
+kr_shadow_samepfx(const struct kroute_full *a, const struct kroute_full *b)
 {
-	in_addr_t ina;
-
-	ina = sa_in->sin_addr.s_addr;
-	if (ina == 0)
-		return (0);
-	else
-		return (33 - ffs(ntohl(ina)));
+	return (kr_addr_compare(&a->prefix, &b->prefix) == 0 &&
+	    a->prefixlen == b->prefixlen && a->priority == b->priority);
 }
 
-static uint8_t
-mask2prefixlen6(struct sockaddr_in6 *sa_in6)
+int
+kr_resync_table(struct ktable *kt)
 {
-	uint8_t	*ap, *ep;
-	u_int	 l = 0;
+	struct kroute_full	 paths[KR_MAX_MPATH], kf;
+	struct kr_shadow	*ks, key;
+	struct kroute		*kr, *krn, *krtmp;
+	struct kroute6		*kr6, *kr6n, *kr6tmp;
+	u_int			 ngone = 0, nchanged = 0, nresent = 0;
+	int			 n, rv;
+
+	kr_state.shadow = kt;
+	rv = fetchtable(kt, 0);
+	kr_state.shadow = NULL;
+	if (rv == -1) {
+		kr_shadow_clear();
+		return (-1);
+	}
 
 	/*
-	 * sin6_len is the size of the sockaddr so substract the offset of
-	 * the possibly truncated sin6_addr struct.
+	 * Drop what is no longer in the kernel and reinstall our own
+	 * routes that went missing.
 	 */
-	ap = (uint8_t *)&sa_in6->sin6_addr;
-	ep = (uint8_t *)sa_in6 + sizeof(struct in6_addr);
-	for (; ap < ep; ap++) {
-		/* this "beauty" is adopted from sbin/route/show.c ... */
-		switch (*ap) {
-		case 0xff:
-			l += 8;
-			break;
-		case 0xfe:
-			l += 7;
-			goto done;
-		case 0xfc:
-			l += 6;
-			goto done;
-		case 0xf8:
-			l += 5;
-			goto done;
-		case 0xf0:
-			l += 4;
-			goto done;
-		case 0xe0:
-			l += 3;
-			goto done;
-		case 0xc0:
-			l += 2;
-			goto done;
-		case 0x80:
-			l += 1;
-			goto done;
-		case 0x00:
-			goto done;
-		default:
-			fatalx("non contiguous inet6 netmask");
+	memset(&key, 0, sizeof(key));
+	RB_FOREACH_SAFE(kr, kroute_tree, &kt->krt, krtmp) {
+		for (; kr != NULL; kr = krn) {
+			krn = kr->next;
+			kf = *kr_tofull(kr);
+			if (kr->priority == RTP_MINE) {
+				if (!(kr->flags & F_BGPD_INSERTED))
+					continue;
+				key.kf = kf;
+				key.kf.priority = kr_state.fib_prio;
+				memset(&key.kf.nexthop, 0,
+				    sizeof(key.kf.nexthop));
+				key.kf.ifindex = 0;
+				ks = RB_NFIND(kr_shadow_tree, &krshadow, &key);
+				if (ks == NULL || !kr_shadow_samepfx(&ks->kf,
+				    &key.kf)) {
+					send_rtmsg(RTM_ADD, kt, &kf, kr->nhid);
+					nresent++;
+				}
+				continue;
+			}
+			key.kf = kf;
+			kr_shadow_norm(&key.kf);
+			if (RB_FIND(kr_shadow_tree, &krshadow, &key) == NULL) {
+				kr_fib_delete(kt, &kf, 1);
+				ngone++;
+			}
+		}
+	}
+	RB_FOREACH_SAFE(kr6, kroute6_tree, &kt->krt6, kr6tmp) {
+		for (; kr6 != NULL; kr6 = kr6n) {
+			kr6n = kr6->next;
+			kf = *kr6_tofull(kr6);
+			if (kr6->priority == RTP_MINE) {
+				if (!(kr6->flags & F_BGPD_INSERTED))
+					continue;
+				key.kf = kf;
+				key.kf.priority = kr_state.fib_prio;
+				memset(&key.kf.nexthop, 0,
+				    sizeof(key.kf.nexthop));
+				key.kf.ifindex = 0;
+				ks = RB_NFIND(kr_shadow_tree, &krshadow, &key);
+				if (ks == NULL || !kr_shadow_samepfx(&ks->kf,
+				    &key.kf)) {
+					send_rtmsg(RTM_ADD, kt, &kf, kr6->nhid);
+					nresent++;
+				}
+				continue;
+			}
+			key.kf = kf;
+			kr_shadow_norm(&key.kf);
+			if (RB_FIND(kr_shadow_tree, &krshadow, &key) == NULL) {
+				kr_fib_delete(kt, &kf, 1);
+				ngone++;
+			}
 		}
 	}
 
- done:
-	if (l > sizeof(struct in6_addr) * 8)
-		fatalx("%s: prefixlen %d out of bound", __func__, l);
-	return (l);
+	/* add or update the routes that differ, one prefix at a time */
+	ks = RB_MIN(kr_shadow_tree, &krshadow);
+	while (ks != NULL) {
+		n = 0;
+		do {
+			if (n < KR_MAX_MPATH)
+				paths[n++] = ks->kf;
+			ks = RB_NEXT(kr_shadow_tree, &krshadow, ks);
+		} while (ks != NULL && kr_shadow_samepfx(&ks->kf, &paths[0]));
+
+		if (kr_resync_samepaths(kt, paths, n))
+			continue;
+		if (kr_fib_mpath(kt, paths, n, RTM_CHANGE) == -1) {
+			kr_shadow_clear();
+			return (-1);
+		}
+		nchanged++;
+	}
+	kr_shadow_clear();
+
+	if (ngone != 0 || nchanged != 0 || nresent != 0)
+		log_info("resync of rtable %u: %u routes removed, %u changed, "
+		    "%u reinstalled", kt->rtableid, ngone, nchanged, nresent);
+	return (0);
 }
 
-uint8_t
-mask2prefixlen(sa_family_t af, struct sockaddr *mask)
+#define	KR_AUDIT_BASIS	0xcbf29ce484222325ULL	/* FNV-1a */
+#define	KR_AUDIT_PRIME	0x100000001b3ULL
+
+uint64_t
+kr_audit_mix(uint64_t h, const void *p, size_t len)
 {
-	switch (af) {
-	case AF_INET:
-		return mask2prefixlen4((struct sockaddr_in *)mask);
-	case AF_INET6:
-		return mask2prefixlen6((struct sockaddr_in6 *)mask);
-	default:
-		fatalx("%s: unsupported af", __func__);
+	const uint8_t	*b = p;
+
+	while (len-- > 0) {
+		h ^= *b++;
+		h *= KR_AUDIT_PRIME;
 	}
+	return (h);
+}
+
+/*
+ * The slice only depends on the prefix, so both sides put a route into
+ * the same one.
+ */
+uint64_t
+kr_audit_prefix(const struct bgpd_addr *prefix, uint8_t prefixlen,
+    u_int *slice)
+{
+	uint64_t	h;
+
+	h = kr_audit_mix(KR_AUDIT_BASIS, &prefix->aid, sizeof(prefix->aid));
+	h = kr_audit_mix(h, &prefixlen, sizeof(prefixlen));
+	if (prefix->aid == AID_INET)
+		h = kr_audit_mix(h, &prefix->v4, sizeof(prefix->v4));
+	else
+		h = kr_audit_mix(h, &prefix->v6, sizeof(prefix->v6));
+	*slice = (h ^ (h >> 32)) % KR_AUDIT_SLICES;
+	return (h);
 }
 
-#ifdef NOTYET
-const struct if_status_description
-		if_status_descriptions[] = LINK_STATE_DESCRIPTIONS;
-const struct ifmedia_description
-		ifm_type_descriptions[] = IFM_TYPE_DESCRIPTIONS;
+/*
+ * Hash a route of ours given the hash of its nexthops.
+ */
+uint64_t
+kr_audit_hash(const struct kroute_full *kf, uint64_t nh, u_int *slice)
+{
+	uint64_t	h;
+	uint16_t	flags;
+
+	h = kr_audit_prefix(&kf->prefix, kf->prefixlen, slice);
+	flags = kf->flags & (F_BLACKHOLE|F_REJECT);
+	h = kr_audit_mix(h, &flags, sizeof(flags));
+	return (kr_audit_mix(h, &nh, sizeof(nh)));
+}
 
+/*
+ * Nexthops are hashed as the kernel reports them. Routes using a nexthop
+ * object only show its id, else the sum over the gateway hashes does not
+ * depend on their order.
+ */
 uint64_t
-ift2ifm(uint8_t if_type)
+kr_audit_gateway(const struct bgpd_addr *gw)
 {
-	switch (if_type) {
-	case IFT_ETHER:
-		return (IFM_ETHER);
-	case IFT_FDDI:
-		return (IFM_FDDI);
-	case IFT_CARP:
-		return (IFM_CARP);
-	case IFT_IEEE80211:
-		return (IFM_IEEE80211);
-	default:
-		return (0);
+	switch (gw->aid) {
+	case AID_INET:
+		return (kr_audit_mix(KR_AUDIT_BASIS, &gw->v4,
+		    sizeof(gw->v4)));
+	case AID_INET6:
+		return (kr_audit_mix(KR_AUDIT_BASIS, &gw->v6,
+		    sizeof(gw->v6)));
 	}
+	return (0);
 }
 
-const char *
-get_media_descr(uint64_t media_type)
+/*
+ * A route of ours from the kernel dump of the audited table.
+ */
+void
+kr_audit_kernel(struct kroute_full *paths, int npaths, uint32_t nhid)
 {
-	const struct ifmedia_description	*p;
+	struct kr_audit_route	*ar;
+	uint64_t		 h, nh = 0;
+	u_int			 slice;
+	int			 i;
 
-	for (p = ifm_type_descriptions; p->ifmt_string != NULL; p++)
-		if (media_type == p->ifmt_word)
-			return (p->ifmt_string);
+	if (paths[0].flags & (F_BLACKHOLE|F_REJECT))
+		nh = 0;
+	else if (nhid != 0)
+		nh = kr_audit_mix(KR_AUDIT_BASIS, &nhid, sizeof(nhid));
+	else
+		for (i = 0; i < npaths; i++)
+			nh += kr_audit_gateway(&paths[i].nexthop);
+	h = kr_audit_hash(&paths[0], nh, &slice);
 
-	return ("unknown media");
+	if (!kraudit.collect) {
+		kraudit.kern[slice] += h;
+		return;
+	}
+	if (kraudit.kern[slice] == kraudit.rib[slice] || kraudit.dirty[slice])
+		return;
+	if ((ar = calloc(1, sizeof(*ar))) == NULL) {
+		log_warn("%s", __func__);
+		return;
+	}
+	ar->prefix = paths[0].prefix;
+	ar->prefixlen = paths[0].prefixlen;
+	ar->hash = h;
+	if (RB_INSERT(kr_audit_tree, &kraudittree, ar) != NULL)
+		free(ar);
 }
-#endif
 
-const char *
-get_linkstate(uint8_t if_type, int link_state)
+/*
+ * A route of ours the RIB believes to be in the kernel. The nexthop
+ * object is only seen by the kernel if it supports them, else its
+ * gateways are.
+ */
+void
+kr_audit_rib(struct ktable *kt, struct kroute_full *kf, uint32_t nhid)
 {
-	static char buf[8];
+	struct knexthop_obj	 s, *nho, *m;
+	struct kr_audit_route	*ar, key;
+	uint64_t		 h, nh = 0;
+	u_int			 slice;
 
-	switch (link_state) {
-	case LINK_STATE_UP:
-		return "active";
-	case LINK_STATE_DOWN:
-		return "down";
-	case LINK_STATE_UNKNOWN:
-		return "unknown";
-	default:
-		snprintf(buf, sizeof(buf), "[#%d]", link_state);
-		return (buf);
+	if (kf->flags & (F_BLACKHOLE|F_REJECT))
+		nh = 0;
+	else if (nhid != 0) {
+		s.id = nhid;
+		nho = RB_FIND(knexthop_obj_tree, &knhot, &s);
+		if (kr_state.nhobj && (nho == NULL || !nho->noobj))
+			nh = kr_audit_mix(KR_AUDIT_BASIS, &nhid, sizeof(nhid));
+		else if (nho != NULL) {
+			m = nho->members != NULL ? nho->members : nho;
+			for (; m != NULL; m = m->next)
+				nh += kr_audit_gateway(&m->gateway);
+		}
+	} else
+		nh = kr_audit_gateway(&kf->nexthop);
+	h = kr_audit_hash(kf, nh, &slice);
+
+	if (!kraudit.collect) {
+		kraudit.rib[slice] += h;
+		return;
+	}
+	if (kraudit.kern[slice] == kraudit.rib[slice] || kraudit.dirty[slice])
+		return;
+
+	key.prefix = kf->prefix;
+	key.prefixlen = kf->prefixlen;
+	if ((ar = RB_FIND(kr_audit_tree, &kraudittree, &key)) != NULL) {
+		RB_REMOVE(kr_audit_tree, &kraudittree, ar);
+		h ^= ar->hash;
+		free(ar);
+		if (h == 0)
+			return;
 	}
+	/* missing or different, install it again */
+	kraudit.repair = 1;
+	if (send_rtmsg(RTM_CHANGE, kt, kf, nhid))
+		kraudit.repaired++;
+	kraudit.repair = 0;
 }
 
-#ifdef NOTYET
+/*
+ * A change of the audited table is on the way to the kernel, the dump
+ * may or may not show it. Leave its slice alone this time.
+ */
 void
-if_change(u_short ifindex, int flags, struct if_data *ifd)
+kr_audit_dirty(u_int rtableid, const struct bgpd_addr *prefix,
+    uint8_t prefixlen)
 {
-	struct ktable		*kt;
-	struct kif		*kif;
-	uint8_t			 reachable;
+	u_int	slice;
 
-	if ((kif = kif_find(ifindex)) == NULL) {
-		log_warnx("%s: interface with index %u not found",
-		    __func__, ifindex);
+	if (kraudit.state == KR_AUDIT_IDLE || kraudit.repair ||
+	    rtableid != kraudit.rtableid)
 		return;
-	}
+	kr_audit_prefix(prefix, prefixlen, &slice);
+	kraudit.dirty[slice] = 1;
+}
 
-	log_info("%s: %s: rdomain %u %s, %s, %s, %s",
-	    __func__, kif->ifname, ifd->ifi_rdomain,
-	    flags & IFF_UP ? "UP" : "DOWN",
-	    get_media_descr(ift2ifm(ifd->ifi_type)),
-	    get_linkstate(ifd->ifi_type, ifd->ifi_link_state),
-	    get_baudrate(ifd->ifi_baudrate, "bps"));
+/*
+ * Audit the next coupled table, round robin.
+ */
+void
+kr_audit(void)
+{
+	struct ktable	*kt;
+	u_int		 i, rid;
 
-	kif->flags = flags;
-	kif->link_state = ifd->ifi_link_state;
-	kif->if_type = ifd->ifi_type;
-	kif->rdomain = ifd->ifi_rdomain;
-	kif->baudrate = ifd->ifi_baudrate;
-	kif->depend_state = kif_depend_state(kif);
+	/* the kernel is behind on purpose */
+	if (kr_state.fib_hold || kraudit.state != KR_AUDIT_IDLE)
+		return;
 
-	kr_send_dependon(kif);
+	for (i = 0; i < krt_size; i++) {
+		rid = (kraudit.next + i) % krt_size;
+		if ((kt = ktable_get(rid)) == NULL || !kt->fib_sync ||
+		    kr_walk_find(rid) != NULL)
+			continue;
+		kraudit.next = rid + 1;
+		kr_audit_start(kt);
+		return;
+	}
+}
 
-	if ((reachable = kif_validate(kif)) == kif->nh_reachable)
-		return;		/* nothing changed wrt nexthop validity */
+/*
+ * Compare the routes of ours in the kernel with the ones the RIB holds
+ * as installed. The first dump only builds the slice digests, a second
+ * one is needed only if some slices differ. Routes of those slices are
+ * reinstalled if they are missing or different, the ones the RIB does
+ * not know about are removed. Nothing waits for the route queue, the
+ * slices of queued and unacknowledged changes are skipped instead.
+ */
+void
+kr_audit_start(struct ktable *kt)
+{
+	struct kr_pending	*p;
+	struct kr_inflight	*ki;
+	u_int			 i;
 
-	kif->nh_reachable = reachable;
+	memset(kraudit.kern, 0, sizeof(kraudit.kern));
+	memset(kraudit.rib, 0, sizeof(kraudit.rib));
+	memset(kraudit.dirty, 0, sizeof(kraudit.dirty));
+	kraudit.rtableid = kt->rtableid;
+	kraudit.state = KR_AUDIT_DUMP;
+	kraudit.collect = 0;
+	kraudit.nslices = 0;
+	kraudit.orepaired = kraudit.repaired;
+	kraudit.ounknown = kraudit.unknown;
+	kraudit.runs++;
+
+	RB_FOREACH(p, kr_pending_tree, &krpending)
+		kr_audit_dirty(p->rtableid, &p->kf.prefix, p->kf.prefixlen);
+	for (i = 0; i < kr_state.inflight_cnt; i++) {
+		ki = kr_inflight_get(i);
+		kr_audit_dirty(ki->rtableid, &ki->prefix, ki->prefixlen);
+	}
 
-	kt = ktable_get(kif->rdomain);
-	if (kt == NULL)
-		return;
+	kraudit.af = kr_state.strict ? AF_INET : AF_UNSPEC;
+	if (kr_audit_request() == -1)
+		kr_audit_end(0);
+}
 
-	knexthop_track(kt, ifindex);
+/*
+ * The audited table if it is still around and coupled, else the audit
+ * is given up.
+ */
+struct ktable *
+kr_audit_table(void)
+{
+	struct ktable	*kt;
+
+	if ((kt = ktable_get(kraudit.rtableid)) == NULL || !kt->fib_sync ||
+	    kr_walk_find(kraudit.rtableid) != NULL) {
+		kr_audit_end(0);
+		return (NULL);
+	}
+	return (kt);
 }
-#endif
 
-static void
-if_announce(const struct nlmsghdr *nlh, const char *name)
+/*
+ * The dump is complete, the second family is dumped on its own if the
+ * kernel filters. Then the RIB side follows.
+ */
+void
+kr_audit_dumped(void)
 {
+	if (kraudit.intr) {
+		/* entries may be missing, try again next time */
+		log_debug("%s: dump of rtable %u interrupted", __func__,
+		    kraudit.rtableid);
+		kr_audit_end(0);
+		return;
+	}
+	if (kraudit.af == AF_INET) {
+		kraudit.af = AF_INET6;
+		if (kr_audit_request() == -1)
+			kr_audit_end(0);
+		return;
+	}
+	kraudit.state = KR_AUDIT_RIB;
+	kraudit.aid = AID_INET;
+	kraudit.resume = 0;
+	kr_timer_set(KR_TIMER_AUDIT_WALK, 0);
+}
 
-	struct ifinfomsg *ifi;
-	struct ktable *kt;
-	struct kif *kif;
-	uint8_t	reachable;
+/*
+ * Walk the RIB side for KR_WALK_BUDGET ms, resuming where the last pass
+ * stopped like kr_walk_run() does.
+ */
+void
+kr_audit_walk(void)
+{
+	struct ktable	*kt;
+	struct kroute	*kr, *krn;
+	struct kroute6	*kr6, *kr6n;
+	struct timespec	 now, deadline, budget;
+	u_int		 i, n = 0;
 
-	ifi = mnl_nlmsg_get_payload(nlh);
+	if (kraudit.state != KR_AUDIT_RIB || (kt = kr_audit_table()) == NULL)
+		return;
 
-	switch (nlh->nlmsg_type) {
-	case RTM_NEWLINK:
-		kif = kif_find(ifi->ifi_index);
-		if (kif == NULL) {
-			if ((kif = calloc(1, sizeof(*kif))) == NULL) {
-				log_warn("%s", __func__);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	budget.tv_sec = KR_WALK_BUDGET / 1000;
+	budget.tv_nsec = (KR_WALK_BUDGET % 1000) * 1000000;
+	timespecadd(&deadline, &budget, &deadline);
+
+	while (kraudit.aid == AID_INET) {
+		if (++n % KR_WALK_CHECK == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespeccmp(&now, &deadline, >=)) {
+				/* more to do, come back after other events */
+				kr_timer_set(KR_TIMER_AUDIT_WALK, 0);
 				return;
 			}
-			kif->ifindex = ifi->ifi_index;
-			kif_insert(kif);
 		}
+		if (kraudit.resume)
+			kr = RB_NFIND(kroute_tree, &kt->krt, &kraudit.cur);
+		else
+			kr = RB_MIN(kroute_tree, &kt->krt);
+		if (kr == NULL) {
+			kraudit.aid = AID_INET6;
+			kraudit.resume = 0;
+			break;
+		}
+		if ((krn = RB_NEXT(kroute_tree, &kt->krt, kr)) == NULL)
+			kraudit.aid = AID_INET6;
+		else
+			kraudit.cur = *krn;
+		kraudit.resume = krn != NULL;
 
-		if (name)
-			strlcpy(kif->ifname, name, sizeof(kif->ifname));
-		kif->flags = ifi->ifi_flags;
-		kif->if_type = ifi->ifi_type;
+		if (kr->priority == RTP_MINE && kr->flags & F_BGPD_INSERTED)
+			kr_audit_rib(kt, kr_tofull(kr), kr->nhid);
+	}
 
-		if (ifi->ifi_flags & IFF_LOWER_UP)
-			kif->link_state = LINK_STATE_UP;
+	while (kraudit.aid == AID_INET6) {
+		if (++n % KR_WALK_CHECK == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespeccmp(&now, &deadline, >=)) {
+				/* more to do, come back after other events */
+				kr_timer_set(KR_TIMER_AUDIT_WALK, 0);
+				return;
+			}
+		}
+		if (kraudit.resume)
+			kr6 = RB_NFIND(kroute6_tree, &kt->krt6, &kraudit.cur6);
 		else
-			kif->link_state = LINK_STATE_DOWN;
+			kr6 = RB_MIN(kroute6_tree, &kt->krt6);
+		if (kr6 == NULL) {
+			kraudit.aid = AID_UNSPEC;
+			break;
+		}
+		if ((kr6n = RB_NEXT(kroute6_tree, &kt->krt6, kr6)) == NULL)
+			kraudit.aid = AID_UNSPEC;
+		else
+			kraudit.cur6 = *kr6n;
+		kraudit.resume = kr6n != NULL;
 
-		if ((reachable = kif_validate(kif)) == kif->nh_reachable)
-			return;	/* nothing changed wrt nexthop validity */
+		if (kr6->priority == RTP_MINE &&
+		    kr6->flags & F_BGPD_INSERTED)
+			kr_audit_rib(kt, kr6_tofull(kr6), kr6->nhid);
+	}
 
-		kif->nh_reachable = reachable;
+	if (kraudit.collect) {
+		kr_audit_end(1);
+		return;
+	}
+	for (i = 0; i < KR_AUDIT_SLICES; i++)
+		if (kraudit.kern[i] != kraudit.rib[i] && !kraudit.dirty[i])
+			kraudit.nslices++;
+	if (kraudit.nslices == 0) {
+		kr_audit_end(1);
+		return;
+	}
+	kraudit.slices += kraudit.nslices;
+
+	/* dump again, this time collecting the routes of those slices */
+	kraudit.collect = 1;
+	kraudit.state = KR_AUDIT_DUMP;
+	kraudit.af = kr_state.strict ? AF_INET : AF_UNSPEC;
+	if (kr_audit_request() == -1)
+		kr_audit_end(0);
+}
 
-		kt = ktable_get(kif->rdomain);
-		if (kt == NULL)
-			return;
+/*
+ * Finish the audit. If it went through, the collected routes left over
+ * are the ones the RIB does not have.
+ */
+void
+kr_audit_end(int done)
+{
+	struct kr_audit_route	*ar;
+	struct ktable		*kt;
+	struct kroute_full	 kf;
+	u_int			 slice;
 
-		knexthop_track(kt, kif->ifindex);
-			break;
-	case RTM_DELLINK:
-		kif = kif_find(ifi->ifi_index);
-		if (kif != NULL)
-			kif_remove(kif);
-		break;
+	if (kraudit.state == KR_AUDIT_IDLE)
+		return;
+	kt = ktable_get(kraudit.rtableid);
+
+	while ((ar = RB_MIN(kr_audit_tree, &kraudittree)) != NULL) {
+		RB_REMOVE(kr_audit_tree, &kraudittree, ar);
+		kr_audit_prefix(&ar->prefix, ar->prefixlen, &slice);
+		if (done && kt != NULL && !kraudit.dirty[slice]) {
+			kraudit.unknown++;
+			log_debug("%s: rtable %u: unknown route %s/%u",
+			    __func__, kraudit.rtableid,
+			    log_addr(&ar->prefix), ar->prefixlen);
+			if (KR_AUDIT_REMOVE) {
+				memset(&kf, 0, sizeof(kf));
+				kf.prefix = ar->prefix;
+				kf.prefixlen = ar->prefixlen;
+				kf.flags = F_BGPD;
+				kraudit.repair = 1;
+				send_rtmsg(RTM_DELETE, kt, &kf, 0);
+				kraudit.repair = 0;
+			}
+		}
+		free(ar);
 	}
+	kraudit.state = KR_AUDIT_IDLE;
+	kraudit.collect = 0;
+	kraudit.intr = 0;
+	kr_timer_stop(KR_TIMER_AUDIT_WALK);
+
+	if (done && kraudit.nslices != 0)
+		log_info("audit of rtable %u: %u slices diverged, %llu routes "
+		    "reinstalled, %llu unknown%s", kraudit.rtableid,
+		    kraudit.nslices,
+		    (unsigned long long)(kraudit.repaired - kraudit.orepaired),
+		    (unsigned long long)(kraudit.unknown - kraudit.ounknown),
+		    KR_AUDIT_REMOVE ? " removed" : "");
 }
 
-int
-get_mpe_config(const char *name, u_int *rdomain, u_int *label)
+void
+kr_audit_log(void)
 {
-	return (-1);
+	log_debug("fib audit: %llu runs, %llu slices diverged, %llu routes "
+	    "reinstalled, %llu unknown", (unsigned long long)kraudit.runs,
+	    (unsigned long long)kraudit.slices,
+	    (unsigned long long)kraudit.repaired,
+	    (unsigned long long)kraudit.unknown);
 }
 
 /*
- * rtsock related functions
+ * Check if the table has exactly the paths of a dumped route.
  */
 int
-send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf)
+kr_resync_samepaths(struct ktable *kt, struct kroute_full *paths, int npaths)
 {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	struct nlmsghdr *nlh;
-	struct rtmsg *rtm;
-
-	if (!kt->fib_sync)
-		return (0);
-
-	nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	switch (action) {
-	case RTM_CHANGE:
-	case RTM_ADD:
-		nlh->nlmsg_type = RTM_NEWROUTE;
-		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
-		break;
-	case RTM_DELETE:
-		nlh->nlmsg_type = RTM_DELROUTE;
-		break;
-	}
-	nlh->nlmsg_seq = kr_next_seq();
-
-	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
-	rtm->rtm_family = aid2af(kf->prefix.aid);
-	rtm->rtm_dst_len = kf->prefixlen;
-	rtm->rtm_src_len = 0;
-	rtm->rtm_tos = 0;
-	rtm->rtm_protocol = kr_state.fib_prio;
-	rtm->rtm_table = kt->rtableid == 0 ? RT_TABLE_MAIN : kt->rtableid;
-	rtm->rtm_type = RTN_UNICAST;
-	if (kf->flags & F_BLACKHOLE)
-		rtm->rtm_type = RTN_BLACKHOLE;
-	if (kf->flags & F_REJECT)
-		rtm->rtm_type = RTN_PROHIBIT;
-	rtm->rtm_scope = RT_SCOPE_UNIVERSE;
-	rtm->rtm_flags = 0;
+	struct kroute_full	 kf;
+	struct kroute		*kr;
+	struct kroute6		*kr6;
+	int			 i, n = 0;
 
-	switch (kf->prefix.aid) {
+	switch (paths[0].prefix.aid) {
 	case AID_INET:
-		mnl_attr_put_u32(nlh, RTA_DST, kf->prefix.v4.s_addr);
-		if (kf->nexthop.aid != AID_UNSPEC)
-			mnl_attr_put_u32(nlh, RTA_GATEWAY,
-			    kf->nexthop.v4.s_addr);
+		/* our own routes show up with the fib priority */
+		if (paths[0].priority == kr_state.fib_prio &&
+		    kroute_find(kt, &paths[0].prefix,
+		    paths[0].prefixlen, RTP_MINE) != NULL)
+			return (1);
+		kr = kroute_find(kt, &paths[0].prefix,
+		    paths[0].prefixlen, paths[0].priority);
+		for (; kr != NULL; kr = kr->next, n++) {
+			kf = *kr_tofull(kr);
+			kr_shadow_norm(&kf);
+			for (i = 0; i < npaths; i++)
+				if (KR_SAMEPATH(&kf, &paths[i]))
+					break;
+			if (i == npaths)
+				return (0);
+		}
 		break;
 	case AID_INET6:
-		mnl_attr_put(nlh, RTA_DST, sizeof(struct in6_addr),
-		    &kf->prefix.v6);
-		if (kf->nexthop.aid != AID_UNSPEC)
-			mnl_attr_put(nlh, RTA_GATEWAY, sizeof(struct in6_addr),
-			    &kf->nexthop.v6);
-		break;
-	default:
-		log_warn("%s: unsupported address family %s", __func__,
-		    aid2str(kf->prefix.aid));
-		return (-1);
-	}
-
-	if (mnl_socket_sendto(kr_state.nl, nlh, nlh->nlmsg_len) < 0) {
-		log_warn("%s: action %u, prefix %s/%u", __func__,
-		    nlh->nlmsg_type, log_addr(&kf->prefix),
-		    kf->prefixlen);
-		return (0);
+		if (paths[0].priority == kr_state.fib_prio &&
+		    kroute6_find(kt, &paths[0].prefix,
+		    paths[0].prefixlen, RTP_MINE) != NULL)
+			return (1);
+		kr6 = kroute6_find(kt, &paths[0].prefix,
+		    paths[0].prefixlen, paths[0].priority);
+		for (; kr6 != NULL; kr6 = kr6->next, n++) {
+			kf = *kr6_tofull(kr6);
+			kr_shadow_norm(&kf);
+			for (i = 0; i < npaths; i++)
+				if (KR_SAMEPATH(&kf, &paths[i]))
+					break;
+			if (i == npaths)
+				return (0);
+		}
+		break;
 	}
-	if (dispatch_rtmsg() == -1)
-		return (0);
-
-	return (1);
+	return (n == npaths);
 }
 
-int
-fetchtable(struct ktable *kt)
+/*
+ * Mirror a route message into the shadow table. Events arriving during
+ * the dump are applied as well so the diff does not revert them.
+ */
+void
+kr_shadow_update(int type, struct kroute_full *paths, int npaths)
 {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	struct nlmsghdr *nlh;
-	struct rtmsg    *rtm;
-
-	nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	nlh->nlmsg_type = RTM_GETROUTE;
-	nlh->nlmsg_seq = kr_state.query_seq = kr_next_seq();
-	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
-	rtm->rtm_family = AF_UNSPEC;
-	rtm->rtm_table = kt->rtableid == 0 ? RT_TABLE_MAIN : kt->rtableid;
+	struct kr_shadow	*ks, *next, key;
+	int			 i;
 
-	if (mnl_socket_sendto(kr_state.nl, nlh, nlh->nlmsg_len) < 0)
-		log_warn("%s: action %u", __func__, nlh->nlmsg_type);
+	memset(&key, 0, sizeof(key));
+	if (type == RTM_NEWROUTE) {
+		/* a new route replaces all paths of the prefix */
+		key.kf.prefix = paths[0].prefix;
+		key.kf.prefixlen = paths[0].prefixlen;
+		key.kf.priority = paths[0].priority;
+		for (ks = RB_NFIND(kr_shadow_tree, &krshadow, &key);
+		    ks != NULL && kr_shadow_samepfx(&ks->kf, &key.kf);
+		    ks = next) {
+			next = RB_NEXT(kr_shadow_tree, &krshadow, ks);
+			RB_REMOVE(kr_shadow_tree, &krshadow, ks);
+			free(ks);
+		}
+	}
 
-	return dispatch_rtmsg();
+	for (i = 0; i < npaths; i++) {
+		key.kf = paths[i];
+		kr_shadow_norm(&key.kf);
+		if (type == RTM_DELROUTE) {
+			if ((ks = RB_FIND(kr_shadow_tree, &krshadow,
+			    &key)) != NULL) {
+				RB_REMOVE(kr_shadow_tree, &krshadow, ks);
+				free(ks);
+			}
+			continue;
+		}
+		if ((ks = malloc(sizeof(*ks))) == NULL) {
+			log_warn("%s", __func__);
+			kr_state.resync = 1;
+			continue;
+		}
+		ks->kf = key.kf;
+		if (RB_INSERT(kr_shadow_tree, &krshadow, ks) != NULL)
+			free(ks);
+	}
 }
 
-int
-fetchifs(int ifindex)
+void
+kr_shadow_clear(void)
 {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	struct nlmsghdr *nlh;
-	struct ifinfomsg *ifi;
-
-	nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	nlh->nlmsg_type = RTM_GETLINK;
-	nlh->nlmsg_seq = kr_state.query_seq = kr_next_seq();
-	ifi = mnl_nlmsg_put_extra_header(nlh, sizeof *ifi);
-	ifi->ifi_family = AF_UNSPEC;
-	ifi->ifi_index = ifindex;
+	struct kr_shadow	*ks;
 
-	if (mnl_socket_sendto(kr_state.nl, nlh, nlh->nlmsg_len) < 0)
-		log_warn("%s: action %u", __func__, nlh->nlmsg_type);
-
-	return dispatch_rtmsg();
+	while ((ks = RB_MIN(kr_shadow_tree, &krshadow)) != NULL) {
+		RB_REMOVE(kr_shadow_tree, &krshadow, ks);
+		free(ks);
+	}
 }
 
 struct cb_attr {
@@ -2782,6 +7722,8 @@ log_mnltype(int type, int islink)
 			return "RTA_PREFSRC";
 		case RTA_GATEWAY:
 			return "RTA_GATEWAY";
+		case RTA_MULTIPATH:
+			return "RTA_MULTIPATH";
 		default:
 			snprintf(buf, sizeof(buf), "#%d", type);
 			return buf;
@@ -2848,6 +7790,13 @@ rtmsg_attr_cb(const struct nlattr *attr, void *data)
 			return MNL_CB_ERROR;
 		}
 		break;
+	case RTA_MULTIPATH:	/* list of rtnexthop, see dispatch_rtmsg_mpath */
+		if (mnl_attr_get_payload_len(attr) < sizeof(struct rtnexthop)) {
+			log_warnx("mnl_attr_validate for %s failed.",
+			   log_mnltype(type, 0));
+			return MNL_CB_ERROR;
+		}
+		break;
 	case RTA_METRICS:	/* ignored, also size is not fixed */
 	default:
 		attr = NULL;
@@ -2891,6 +7840,44 @@ link_attr_cb(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
+#ifdef HAVE_LINUX_NEXTHOP_H
+static int
+nh_attr_cb(const struct nlattr *attr, void *data)
+{
+	struct cb_attr *my = data;
+	int type = mnl_attr_get_type(attr);
+
+	/* skip unsupported attribute in user-space */
+	if (mnl_attr_type_valid(attr, NHA_MAX) < 0)
+		return MNL_CB_OK;
+
+	switch(type) {
+	case NHA_ID:
+	case NHA_OIF:
+		if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0) {
+			log_warnx("mnl_attr_validate for NHA_ID failed.");
+			return MNL_CB_ERROR;
+		}
+		break;
+	case NHA_GATEWAY:
+		if (mnl_attr_get_payload_len(attr) !=
+		    (my->family == AF_INET6 ? sizeof(struct in6_addr) :
+		    sizeof(struct in_addr))) {
+			log_warnx("mnl_attr_validate for NHA_GATEWAY failed.");
+			return MNL_CB_ERROR;
+		}
+		break;
+	case NHA_GROUP:
+		break;
+	default:
+		attr = NULL;
+		break;
+	}
+	my->tb[type] = attr;
+	return MNL_CB_OK;
+}
+#endif
+
 static int
 mnl_callback(const struct nlmsghdr *nlh, void *data)
 {
@@ -2898,21 +7885,39 @@ mnl_callback(const struct nlmsghdr *nlh, void *data)
 	struct rtmsg *rm;
 	struct ktable *kt;
 	struct cb_attr my = { .tb = tb };
-	struct kroute_full kf;
+	struct kroute_full kf, paths[KR_MAX_MPATH];
+#ifdef HAVE_LINUX_NEXTHOP_H
+	struct nhmsg *nhm;
+#endif
 	unsigned int table;
 	const char *name = NULL;
-	int rv;
-
+	uint32_t nhid;
+	int rv, npaths, i;
 
 	/* ignore routes form us unless we queried for them */
-	if (nlh->nlmsg_pid == kr_state.pid &&
-	    nlh->nlmsg_seq != kr_state.query_seq)
+	if ((nlh->nlmsg_pid == kr_state.pid &&
+	    nlh->nlmsg_seq != kr_state.query_seq) ||
+	    nlh->nlmsg_pid == krw.pid)
 		return MNL_CB_OK;
 
+	/* the table changed while being dumped, entries may be missing */
+	if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+		kr_state.resync = 1;
+
 	switch (nlh->nlmsg_type) {
 	case RTM_NEWROUTE:
 	case RTM_DELROUTE:
 		rm = mnl_nlmsg_get_payload(nlh);
+		/* dump replies, see fetchtable() */
+		if (nlh->nlmsg_pid == kr_state.pid) {
+			kr_state.dump_msgs++;
+			if (kr_state.dump_proto != 0 &&
+			    rm->rtm_protocol != kr_state.dump_proto) {
+				kr_state.dump_skipped++;
+				return MNL_CB_OK;
+			}
+		}
+
 		my.family = rm->rtm_family;
 		rv = mnl_attr_parse(nlh, sizeof(*rm), rtmsg_attr_cb, &my);
 		if (rv != MNL_CB_OK)
@@ -2924,22 +7929,57 @@ mnl_callback(const struct nlmsghdr *nlh, void *data)
 		if (table == RT_TABLE_MAIN)
 			table = 0;
 		else if (table == RT_TABLE_LOCAL)
-			return MNL_CB_OK;
+			goto skip;
 
 		if ((kt = ktable_get(table)) == NULL)
-			return MNL_CB_OK;
+			goto skip;
 
 		if (dispatch_rtmsg_addr(nlh, rm, tb, &kf) == -1)
 			return MNL_CB_OK;
 
+		if (tb[RTA_MULTIPATH] != NULL) {
+			npaths = dispatch_rtmsg_mpath(rm, tb[RTA_MULTIPATH],
+			    &kf, paths);
+			if (npaths <= 0)
+				return MNL_CB_OK;
+		} else {
+			paths[0] = kf;
+			npaths = 1;
+		}
+
+		if (kr_state.shadow != NULL) {
+			if (kt == kr_state.shadow)
+				kr_shadow_update(nlh->nlmsg_type, paths,
+				    npaths);
+			/* dump replies are only compared, see kr_resync() */
+			if (nlh->nlmsg_pid == kr_state.pid)
+				return MNL_CB_OK;
+		}
+
 		switch (nlh->nlmsg_type) {
 		case RTM_NEWROUTE:
-			if (kr_fib_change(kt, &kf, rm->rtm_type, 0) == -1)
+			/* our routes from a previous run, see ktable_new() */
+			if (kr_state.adopt && nlh->nlmsg_pid == kr_state.pid &&
+			    rm->rtm_protocol == kr_state.fib_prio) {
+				nhid = 0;
+#ifdef HAVE_LINUX_NEXTHOP_H
+				if (tb[RTA_NH_ID] != NULL)
+					nhid = mnl_attr_get_u32(tb[RTA_NH_ID]);
+#endif
+				if (kr_stale_adopt(kt, paths, npaths,
+				    nhid) == -1)
+					return MNL_CB_ERROR;
+				break;
+			}
+			if (kr_fib_mpath(kt, paths, npaths,
+			    rm->rtm_type) == -1)
 				return MNL_CB_ERROR;
 			break;
 		case RTM_DELROUTE:
-			if (kr_fib_delete(kt, &kf, 0) == -1)
-				return MNL_CB_ERROR;
+			for (i = 0; i < npaths; i++)
+				if (kr_fib_delete(kt, &paths[i],
+				    npaths > 1) == -1)
+					return MNL_CB_ERROR;
 			break;
 		}
 		break;
@@ -2953,6 +7993,36 @@ mnl_callback(const struct nlmsghdr *nlh, void *data)
 			name = mnl_attr_get_str(tb[IFLA_IFNAME]);
 		if_announce(nlh, name);
 		break;
+#ifdef HAVE_LINUX_NEXTHOP_H
+	case RTM_NEWNEXTHOP:
+		nhm = mnl_nlmsg_get_payload(nlh);
+		my.family = nhm->nh_family;
+		rv = mnl_attr_parse(nlh, sizeof(*nhm), nh_attr_cb, &my);
+		if (rv != MNL_CB_OK)
+			return rv;
+		if (tb[NHA_ID] == NULL)
+			break;
+		/* allocate ids above the ones already in use */
+		if (mnl_attr_get_u32(tb[NHA_ID]) >= kr_state.nhid_next)
+			kr_state.nhid_next = mnl_attr_get_u32(tb[NHA_ID]) + 1;
+		if (kr_state.nhid_next == 0)
+			kr_state.nhid_next = 1;
+		/* ours from a previous run, see fetchnexthops() */
+		if (kr_state.nhdump && nlh->nlmsg_pid == kr_state.pid &&
+		    nhm->nh_protocol == kr_state.fib_prio &&
+		    knexthop_obj_adopt(nhm, tb) == -1)
+			return MNL_CB_ERROR;
+		break;
+	case RTM_DELNEXTHOP:
+		nhm = mnl_nlmsg_get_payload(nlh);
+		my.family = nhm->nh_family;
+		rv = mnl_attr_parse(nlh, sizeof(*nhm), nh_attr_cb, &my);
+		if (rv != MNL_CB_OK)
+			return rv;
+		if (tb[NHA_ID] != NULL)
+			knexthop_obj_lost(mnl_attr_get_u32(tb[NHA_ID]));
+		break;
+#endif
 	default:
 		log_warnx("%s: unhandled routing message %d", __func__,
 		    nlh->nlmsg_type);
@@ -2960,35 +8030,222 @@ mnl_callback(const struct nlmsghdr *nlh, void *data)
 	}
 
 	return MNL_CB_OK;
+
+ skip:
+	if (nlh->nlmsg_pid == kr_state.pid)
+		kr_state.dump_skipped++;
+	return MNL_CB_OK;
+}
+
+static int
+mnl_error_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(*err))) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+
+	/* route messages are acknowledged to the writer, this is a query */
+	if (err->error == 0)
+		return MNL_CB_STOP;
+	errno = -err->error;
+	return MNL_CB_ERROR;
 }
 
+static const mnl_cb_t mnl_ctl_cb[NLMSG_ERROR + 1] = {
+	[NLMSG_ERROR] = mnl_error_cb,
+};
+
 int
 dispatch_rtmsg(void)
 {
 	char buf[MNL_SOCKET_BUFFER_SIZE];
-	int ret;
+	int ret, rv = 0;
 
-	ret = mnl_socket_recvfrom(kr_state.nl, buf, sizeof buf);
-	while (ret > 0) {
-		switch (mnl_cb_run(buf, ret, 0, 0, mnl_callback, NULL)) {
+	for (;;) {
+		ret = mnl_socket_recvfrom(kr_state.nl, buf, sizeof buf);
+		if (ret == -1 && errno == ENOBUFS) {
+			/* socket overrun, resync once everything is read */
+			log_warnx("%s: kernel messages lost", __func__);
+			kr_state.resync = 1;
+			continue;
+		}
+		if (ret <= 0)
+			break;
+		switch (mnl_cb_run2(buf, ret, 0, 0, mnl_callback, NULL,
+		    mnl_ctl_cb, NLMSG_ERROR + 1)) {
 		case MNL_CB_STOP:
-			return (0);
+			goto done;
 		case MNL_CB_ERROR:
 			log_warnx("mnl_cb_run error");
-			return (-1);
+			rv = -1;
+			goto done;
 		}
-		ret = mnl_socket_recvfrom(kr_state.nl, buf, sizeof buf);
 	}
 	if (ret == -1) {
-		if (errno == EAGAIN || errno == EINTR)
-			return (0);
-		log_warn("%s: read error", __func__);
-		return (-1);
+		if (errno != EAGAIN && errno != EINTR) {
+			log_warn("%s: read error", __func__);
+			rv = -1;
+		}
+	}
+
+ done:
+	/* everything sent got acknowledged, push out the next batch */
+	if (kr_state.inflight_cnt == kr_state.batchcnt)
+		kr_batch_flush();
+	return (rv);
+}
+
+/*
+ * Ask for a dump of our routes in the audited table on the audit socket.
+ */
+int
+kr_audit_request(void)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct rtmsg    *rtm;
+	u_int		 table;
+
+	table = kraudit.rtableid == 0 ? RT_TABLE_MAIN : kraudit.rtableid;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_type = RTM_GETROUTE;
+	nlh->nlmsg_seq = kraudit.seq = kr_next_seq();
+	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+	rtm->rtm_family = kraudit.af;
+	rtm->rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+	if (kr_state.strict) {
+		rtm->rtm_protocol = kr_state.fib_prio;
+		mnl_attr_put_u32(nlh, RTA_TABLE, table);
 	}
 
+	if (mnl_socket_sendto(kraudit.nl, nlh, nlh->nlmsg_len) < 0) {
+		log_warn("%s: rtable %u", __func__, kraudit.rtableid);
+		return (-1);
+	}
 	return (0);
 }
 
+static int
+kr_audit_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlattr *tb[RTA_MAX+1] = {};
+	struct rtmsg *rm;
+	struct cb_attr my = { .tb = tb };
+	struct kroute_full kf, paths[KR_MAX_MPATH];
+	unsigned int table;
+	uint32_t nhid = 0;
+	int rv, npaths;
+
+	/* left over of an audit given up */
+	if (kraudit.state != KR_AUDIT_DUMP || nlh->nlmsg_seq != kraudit.seq)
+		return MNL_CB_OK;
+	if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+		kraudit.intr = 1;
+	if (nlh->nlmsg_type != RTM_NEWROUTE)
+		return MNL_CB_OK;
+
+	rm = mnl_nlmsg_get_payload(nlh);
+	if (rm->rtm_protocol != kr_state.fib_prio)
+		return MNL_CB_OK;
+	my.family = rm->rtm_family;
+	rv = mnl_attr_parse(nlh, sizeof(*rm), rtmsg_attr_cb, &my);
+	if (rv != MNL_CB_OK)
+		return rv;
+
+	table = rm->rtm_table;
+	if (tb[RTA_TABLE])
+		table = mnl_attr_get_u32(tb[RTA_TABLE]);
+	if (table == RT_TABLE_MAIN)
+		table = 0;
+	if (table != kraudit.rtableid)
+		return MNL_CB_OK;
+
+	if (dispatch_rtmsg_addr(nlh, rm, tb, &kf) == -1)
+		return MNL_CB_OK;
+	if (tb[RTA_MULTIPATH] != NULL) {
+		npaths = dispatch_rtmsg_mpath(rm, tb[RTA_MULTIPATH], &kf,
+		    paths);
+		if (npaths <= 0)
+			return MNL_CB_OK;
+	} else {
+		paths[0] = kf;
+		npaths = 1;
+	}
+#ifdef HAVE_LINUX_NEXTHOP_H
+	if (tb[RTA_NH_ID] != NULL)
+		nhid = mnl_attr_get_u32(tb[RTA_NH_ID]);
+#endif
+	kr_audit_kernel(paths, npaths, nhid);
+	return MNL_CB_OK;
+}
+
+static int
+kr_audit_ctl_cb(const struct nlmsghdr *nlh, void *data)
+{
+	if (kraudit.state != KR_AUDIT_DUMP || nlh->nlmsg_seq != kraudit.seq)
+		return MNL_CB_OK;
+	if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+		kraudit.intr = 1;
+	if (nlh->nlmsg_type == NLMSG_ERROR)
+		return mnl_error_cb(nlh, data);
+	return MNL_CB_STOP;
+}
+
+static const mnl_cb_t kr_audit_ctl[NLMSG_DONE + 1] = {
+	[NLMSG_ERROR] = kr_audit_ctl_cb,
+	[NLMSG_DONE] = kr_audit_ctl_cb,
+};
+
+/*
+ * Read the audit dump for KR_WALK_BUDGET ms, the rest is left for the
+ * next pass of the event loop.
+ */
+void
+kr_audit_dispatch(void)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct timespec now, deadline, budget;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	budget.tv_sec = KR_WALK_BUDGET / 1000;
+	budget.tv_nsec = (KR_WALK_BUDGET % 1000) * 1000000;
+	timespecadd(&deadline, &budget, &deadline);
+
+	for (;;) {
+		if ((ret = mnl_socket_recvfrom(kraudit.nl, buf,
+		    sizeof buf)) <= 0) {
+			if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+				log_warn("%s: read error", __func__);
+				kr_audit_end(0);
+			}
+			return;
+		}
+		/* if the table went away the rest is thrown away */
+		if (kraudit.state == KR_AUDIT_DUMP)
+			(void)kr_audit_table();
+		switch (mnl_cb_run2(buf, ret, 0, 0, kr_audit_cb, NULL,
+		    kr_audit_ctl, NLMSG_DONE + 1)) {
+		case MNL_CB_STOP:
+			kr_audit_dumped();
+			return;
+		case MNL_CB_ERROR:
+			log_warn("%s: dump of rtable %u", __func__,
+			    kraudit.rtableid);
+			kr_audit_end(0);
+			return;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespeccmp(&now, &deadline, >=))
+			return;
+	}
+}
+
 int
 dispatch_rtmsg_addr(const struct nlmsghdr *nlh, const struct rtmsg *rm,
     const struct nlattr **tb, struct kroute_full *kf)
@@ -3055,12 +8312,137 @@ dispatch_rtmsg_addr(const struct nlmsghdr *nlh, const struct rtmsg *rm,
 	return (0);
 }
 
+/*
+ * Split a multipath route into one kroute_full per path, like the
+ * routing socket reports them. Returns the number of paths.
+ */
+int
+dispatch_rtmsg_mpath(const struct rtmsg *rm, const struct nlattr *mp,
+    const struct kroute_full *kf, struct kroute_full *paths)
+{
+	const struct nlattr *tb[RTA_MAX+1];
+	struct cb_attr my = { .tb = tb, .family = rm->rtm_family };
+	struct rtnexthop *rtnh;
+	int len, n = 0;
+
+	rtnh = mnl_attr_get_payload(mp);
+	len = mnl_attr_get_payload_len(mp);
+	for (; RTNH_OK(rtnh, len) && n < KR_MAX_MPATH;
+	    len -= RTNH_ALIGN(rtnh->rtnh_len), rtnh = RTNH_NEXT(rtnh)) {
+		memset(tb, 0, sizeof(tb));
+		if (mnl_attr_parse_payload(RTNH_DATA(rtnh),
+		    rtnh->rtnh_len - sizeof(*rtnh), rtmsg_attr_cb, &my) !=
+		    MNL_CB_OK)
+			return (-1);
+
+		paths[n] = *kf;
+		paths[n].ifindex = rtnh->rtnh_ifindex;
+		if (tb[RTA_GATEWAY] != NULL) {
+			paths[n].flags &= ~F_CONNECTED;
+			switch (rm->rtm_family) {
+			case AF_INET:
+				paths[n].nexthop.aid = AID_INET;
+				paths[n].nexthop.v4.s_addr =
+				    mnl_attr_get_u32(tb[RTA_GATEWAY]);
+				break;
+			case AF_INET6:
+				paths[n].nexthop.aid = AID_INET6;
+				memcpy(&paths[n].nexthop.v6,
+				    mnl_attr_get_payload(tb[RTA_GATEWAY]),
+				    sizeof(paths[n].nexthop.v6));
+				break;
+			}
+		}
+		n++;
+	}
+
+	return (n);
+}
+
 int
 kr_fib_delete(struct ktable *kt, struct kroute_full *kf, int mpath)
 {
 	return kroute_remove(kt, kf, !mpath);
 }
 
+/*
+ * The kernel reports all paths of a multipath route at once. Remove the
+ * kroutes of the paths that are gone, then add or update the others.
+ */
+int
+kr_fib_mpath(struct ktable *kt, struct kroute_full *paths, int npaths,
+    int type)
+{
+	struct kroute_full	 stale[KR_MAX_MPATH];
+	struct kroute		*kr, *krh;
+	struct kroute6		*kr6, *kr6h;
+	int			 i, nstale = 0, mpath = 0;
+
+	switch (paths[0].prefix.aid) {
+	case AID_INET:
+		krh = kroute_find(kt, &paths[0].prefix, paths[0].prefixlen,
+		    paths[0].priority);
+		for (kr = krh; kr != NULL && nstale < KR_MAX_MPATH;
+		    kr = kr->next) {
+			for (i = 0; i < npaths; i++)
+				if (kroute_matchgw(kr, &paths[i]) == kr)
+					break;
+			if (i == npaths)
+				stale[nstale++] = *kr_tofull(kr);
+		}
+		mpath = krh != NULL && krh->next != NULL;
+		break;
+	case AID_INET6:
+		kr6h = kroute6_find(kt, &paths[0].prefix, paths[0].prefixlen,
+		    paths[0].priority);
+		for (kr6 = kr6h; kr6 != NULL && nstale < KR_MAX_MPATH;
+		    kr6 = kr6->next) {
+			for (i = 0; i < npaths; i++)
+				if (kroute6_matchgw(kr6, &paths[i]) == kr6)
+					break;
+			if (i == npaths)
+				stale[nstale++] = *kr6_tofull(kr6);
+		}
+		mpath = kr6h != NULL && kr6h->next != NULL;
+		break;
+	}
+
+	/* a plain route replacing a plain route is changed in place */
+	if (npaths == 1 && !mpath)
+		return (kr_fib_change(kt, &paths[0], type, 0));
+
+	for (i = 0; i < nstale; i++)
+		if (kr_fib_delete(kt, &stale[i], 1) == -1)
+			return (-1);
+	for (i = 0; i < npaths; i++)
+		if (kr_fib_change(kt, &paths[i], kr_fib_haspath(kt, &paths[i]) ?
+		    RTM_CHANGE : RTM_ADD, 1) == -1)
+			return (-1);
+
+	return (0);
+}
+
+int
+kr_fib_haspath(struct ktable *kt, struct kroute_full *kf)
+{
+	struct kroute	*kr;
+	struct kroute6	*kr6;
+
+	switch (kf->prefix.aid) {
+	case AID_INET:
+		if ((kr = kroute_find(kt, &kf->prefix, kf->prefixlen,
+		    kf->priority)) == NULL)
+			return (0);
+		return (kroute_matchgw(kr, kf) != NULL);
+	case AID_INET6:
+		if ((kr6 = kroute6_find(kt, &kf->prefix, kf->prefixlen,
+		    kf->priority)) == NULL)
+			return (0);
+		return (kroute6_matchgw(kr6, kf) != NULL);
+	}
+	return (0);
+}
+
 int
 kr_fib_change(struct ktable *kt, struct kroute_full *kf, int type, int mpath)
 {
@@ -3102,12 +8484,13 @@ kr_fib_change(struct ktable *kt, struct kroute_full *kf, int type, int mpath)
 				if (kr->flags & F_NEXTHOP)
 					flags |= F_NEXTHOP;
 
-				new_labelid = rtlabel_name2id(kf->label);
+				new_labelid = kr_label_ref(kf->label);
 				if (kr->labelid != new_labelid) {
-					rtlabel_unref(kr->labelid);
+					kr_label_unref(kr->labelid);
 					kr->labelid = new_labelid;
 					rtlabel_changed = 1;
-				}
+				} else
+					kr_label_unref(new_labelid);
 
 				oflags = kr->flags;
 				if (flags != oflags)
@@ -3134,7 +8517,7 @@ kr_fib_change(struct ktable *kt, struct kroute_full *kf, int type, int mpath)
 			}
 		} else {
 add4:
-			kroute_insert(kt, kf);
+			kroute_insert(kt, kf, 0);
 		}
 		break;
 	case AID_INET6:
@@ -3174,12 +8557,13 @@ add4:
 				if (kr6->flags & F_NEXTHOP)
 					flags |= F_NEXTHOP;
 
-				new_labelid = rtlabel_name2id(kf->label);
+				new_labelid = kr_label_ref(kf->label);
 				if (kr6->labelid != new_labelid) {
-					rtlabel_unref(kr6->labelid);
+					kr_label_unref(kr6->labelid);
 					kr6->labelid = new_labelid;
 					rtlabel_changed = 1;
-				}
+				} else
+					kr_label_unref(new_labelid);
 
 				oflags = kr6->flags;
 				if (flags != oflags)
@@ -3206,7 +8590,7 @@ add4:
 			}
 		} else {
 add6:
-			kroute_insert(kt, kf);
+			kroute_insert(kt, kf, 0);
 		}
 		break;
 	}